@@ -0,0 +1,101 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief A fixed capacity queue between threads
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <cstddef>
+#include <condition_variable>
+
+/**
+ * @brief FIFO queue that holds at most a fixed number of items. A producer that gets ahead blocks in push
+ * until a consumer catches up, so a slow stage slows down the stages feeding it instead of piling up memory
+*/
+template <typename T>
+class BoundedQueue {
+private:
+
+  std::deque<T> items;
+
+  /**
+   * most items held at once
+  */
+  std::size_t capacity;
+
+  /**
+   * set by close, push fails and pop fails once the queue is empty
+  */
+  bool closed;
+
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+
+public:
+
+  explicit BoundedQueue(std::size_t capacity): items{}, capacity{capacity > 0 ? capacity : 1}, closed{false}, mutex{}, notEmpty{}, notFull{} {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+
+  /**
+   * @brief add an item to the back, waiting while the queue is full
+   * @return false if the queue was closed, the item is dropped then
+  */
+  bool push(T item) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      notFull.wait(lock, [this]() {
+        return closed || items.size() < capacity;
+      });
+      if (closed) {
+        return false;
+      }
+      items.push_back(std::move(item));
+    }
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief take the item at the front, waiting while the queue is empty
+   * @return false once the queue is closed and empty
+  */
+  bool pop(T &item) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      notEmpty.wait(lock, [this]() {
+        return closed || !items.empty();
+      });
+      if (items.empty()) {
+        return false;
+      }
+      item = std::move(items.front());
+      items.pop_front();
+    }
+    notFull.notify_one();
+    return true;
+  }
+
+  /**
+   * @brief wake everyone waiting, items already queued can still be popped
+  */
+  void close() {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      closed = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+  /**
+   * @return number of items waiting
+  */
+  std::size_t size() {
+    std::unique_lock<std::mutex> lock{mutex};
+    return items.size();
+  }
+};
@@ -0,0 +1,78 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief A fixed set of equally sized buffers shared between threads
+ */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <cstddef>
+#include <condition_variable>
+
+/**
+ * @brief Hands out buffers from one allocation made up front. A thread that wants a buffer while all of them
+ * are in use waits until one is given back, so whatever uses the pool never holds more than its size
+*/
+class BufferPool {
+private:
+
+  std::vector<std::byte> storage;
+
+  /**
+   * buffers not in use
+  */
+  std::vector<std::byte *> available;
+
+  std::size_t bufferSize;
+
+  std::mutex mutex;
+  std::condition_variable released;
+
+public:
+
+  /**
+   * @param buffers number of buffers
+   * @param bufferSize bytes in each
+  */
+  BufferPool(std::size_t buffers, std::size_t bufferSize):
+    storage{}, available{}, bufferSize{bufferSize}, mutex{}, released{} {
+    buffers = buffers > 0 ? buffers : 1;
+    storage.resize(buffers * bufferSize);
+    available.reserve(buffers);
+    for (std::size_t i = 0; i < buffers; ++i) {
+      available.push_back(storage.data() + i * bufferSize);
+    }
+  }
+
+  BufferPool(const BufferPool &) = delete;
+
+  /**
+   * @brief take a buffer, waiting while all of them are in use
+   * @return a buffer of BufferPool::getBufferSize bytes
+  */
+  std::byte *acquire() {
+    std::unique_lock<std::mutex> lock{mutex};
+    released.wait(lock, [this]() {
+      return !available.empty();
+    });
+    std::byte *buffer = available.back();
+    available.pop_back();
+    return buffer;
+  }
+
+  /**
+   * @brief give back a buffer from BufferPool::acquire
+  */
+  void release(std::byte *buffer) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      available.push_back(buffer);
+    }
+    released.notify_one();
+  }
+
+  [[nodiscard]] std::size_t getBufferSize() const {
+    return bufferSize;
+  }
+};
@@ -66,3 +66,14 @@ void getMP3FilePath(Music &m) {
     return;
   }
 }
+
+void getBatchPath(std::string &input) {
+  while (true) { // loop until some input
+    std::cout << "Enter a directory or an M3U playlist (-1 to cancel):\n >> ";
+    std::getline(std::cin, input);
+    if (!input.empty()) {
+      return;
+    }
+    std::cout << "Error: not a valid path\n";
+  }
+}
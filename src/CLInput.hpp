@@ -39,3 +39,10 @@ void getHost(std::string &input);
  * @brief Get mp3 file path
  */
 void getMP3FilePath(Music &m);
+
+/**
+ * @brief Get the path of a directory or an M3U playlist of songs
+ *
+ * @param input The path string to store the result in, -1 if cancelled
+ */
+void getBatchPath(std::string &input);
@@ -0,0 +1,29 @@
+/**
+ * @author Justin Nicolas Allard
+ * Wall clock helpers shared by the room and client
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief Get the wall clock time. Room and clients compare these, so this must be system time, not steady time
+ * @return milliseconds since the unix epoch
+*/
+inline int64_t wallClockMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()
+  ).count();
+}
+
+/**
+ * @brief Get a monotonic time for measuring how long something took, only meaningful within this process
+ * @return microseconds since some fixed point
+*/
+inline int64_t steadyClockUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
@@ -0,0 +1,26 @@
+/**
+ * @author Justin Nicolas Allard
+ * FNV-1a, the 64 bit hash songs are told apart by, shared by the room, its journal and the client
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/**
+ * @brief Hash some bytes, or carry on hashing from where an earlier call left off
+ * @param seed FNV_OFFSET_BASIS to start a hash, or what the call for the bytes before these returned
+ * @param data bytes to hash
+ * @param size number of bytes
+ * @return the hash of everything up to and including these bytes
+*/
+inline uint64_t fnv1a(uint64_t seed, const unsigned char *data, std::size_t size) {
+  for (std::size_t i = 0; i < size; ++i) {
+    seed = (seed ^ data[i]) * FNV_PRIME;
+  }
+  return seed;
+}
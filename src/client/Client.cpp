@@ -8,14 +8,27 @@
 using namespace clnt;
 
 Client::Client():
-  shouldRemoveFirstOnNext{false}, fdMax{}, threadPipe{}, clientName{},
-  queue{}, audioPlayer{}, master{}, clientSocket{} {}
+  shouldRemoveFirstOnNext{false}, streamingEntry{}, preloadedEntry{}, playPending{false}, pendingRoomTime{0},
+  pendingSinceMs{0}, lastLateMs{0}, fdMax{}, threadPipe{}, clientName{},
+  queue{}, audioPlayer{}, master{}, clientSocket{}, roomHost{}, receiver{}, replies{}, dataConnections{}, batch{},
+  batchMutex{} {}
 
 Client::Client(std::string name):
-  shouldRemoveFirstOnNext{false}, fdMax{}, threadPipe{}, clientName{std::move(name)},
-  queue{}, audioPlayer{}, master{}, clientSocket{} {}
+  shouldRemoveFirstOnNext{false}, streamingEntry{}, preloadedEntry{}, playPending{false}, pendingRoomTime{0},
+  pendingSinceMs{0}, lastLateMs{0}, fdMax{}, threadPipe{}, clientName{std::move(name)},
+  queue{}, audioPlayer{}, master{}, clientSocket{}, roomHost{}, receiver{}, replies{}, dataConnections{}, batch{},
+  batchMutex{} {}
 
 Client::~Client() {
+  // the data connections read into the receiver, stopping it first lets go of any waiting on it
+  if (receiver != nullptr) {
+    receiver->stop();
+  }
+  dataConnections.reset();
+  // after the data connections, they send replies too
+  replies.reset();
+  // the receiver writes to threadPipe
+  receiver.reset();
   if (threadPipe[0] != 0) {
     close(threadPipe[0]);
   }
@@ -28,6 +41,7 @@ bool Client::initializeClient(uint16_t port, const std::string &host) {
   if (!clientSocket.connect(host, port)) {
     return false;
   }
+  roomHost = host;
 
   if (::pipe(threadPipe) == -1) {
     fprintf(stderr, "pipe: %s (%d)\n", strerror(errno), errno);
@@ -41,6 +55,11 @@ bool Client::initializeClient(uint16_t port, const std::string &host) {
   FD_SET(clientSocket.getSocketFD(), &master);
   FD_SET(threadPipe[0], &master);
 
+  receiver = std::make_unique<SongReceiver>(queue, threadPipe[1], clientSocket.getSocketFD());
+  receiver->start();
+  replies = std::make_unique<ReplyWriter>(clientSocket);
+  replies->start();
+
   std::cout << "Successfully joined the room\n";
   return true;
 }
@@ -92,6 +111,9 @@ bool Client::processThreadFinished() {
   }
   DEBUG_P(std::cout << "adding fileDes back to master: " << t.fileDes << "\n");
   FD_SET(t.fileDes, &master);
+  // a song may have finished arriving, which might be the one waiting to play or the one to preload
+  startPending();
+  preloadNext();
   return true;
 }
 
@@ -101,8 +123,15 @@ enum class ClientCommand {
   EXIT,
   QUIT,
   ADD_SONG,
+  ADD_SONGS,
   MUTE,
-  UNMUTE
+  UNMUTE,
+  VOLUME_UP,
+  VOLUME_DOWN,
+  CROSSFADE_ON,
+  CROSSFADE_OFF,
+  STATS,
+  QUEUE
 };
 
 const std::unordered_map<std::string, ClientCommand> clientCommandMap = {
@@ -111,8 +140,15 @@ const std::unordered_map<std::string, ClientCommand> clientCommandMap = {
   {"exit", ClientCommand::EXIT},
   {"quit", ClientCommand::QUIT},
   {"add song", ClientCommand::ADD_SONG},
+  {"add songs", ClientCommand::ADD_SONGS},
   {"mute", ClientCommand::MUTE},
   {"unmute", ClientCommand::UNMUTE},
+  {"volume up", ClientCommand::VOLUME_UP},
+  {"volume down", ClientCommand::VOLUME_DOWN},
+  {"crossfade on", ClientCommand::CROSSFADE_ON},
+  {"crossfade off", ClientCommand::CROSSFADE_OFF},
+  {"stats", ClientCommand::STATS},
+  {"queue", ClientCommand::QUEUE},
 };
 
 // TODO:
@@ -124,8 +160,15 @@ void clientShowHelp() {
   "'exit'      | Exit the room.\n\n"
   "'quit'      | Quit the program.\n\n"
   "'add song'  | Add a song to the queue.\n\n"
+  "'add songs' | Add every song in a directory or an M3U playlist to the queue.\n\n"
   "'mute'      | Mute the audio player.\n\n"
-  "'unmute'    | Unmute the audio player.\n\n";
+  "'unmute'    | Unmute the audio player.\n\n"
+  "'volume up' / 'volume down'\n"
+  "            | Change the volume of the audio player by 10%.\n\n"
+  "'crossfade on' / 'crossfade off'\n"
+  "            | Fade between songs rather than going straight from one to the next.\n\n"
+  "'stats'     | Show playback statistics, such as how far off from the room the audio is.\n\n"
+  "'queue'     | List the songs in the queue with their lengths and when they start.\n\n";
   ;
 }
 
@@ -167,6 +210,15 @@ int Client::handleStdinCommand() {
       reqSendMusicFile();
       return 1;
 
+    case ClientCommand::ADD_SONGS: {
+      DEBUG_P(std::cout << "add songs command\n");
+      // the thread asks for the path, stdin is listened to again once the batch is sent or given up on
+      FD_CLR(0, &master);
+      std::thread thread = std::thread(&Client::reqSendBatch_threaded, this);
+      thread.detach();
+      return 1;
+    }
+
     case ClientCommand::MUTE:
       audioPlayer.mute();
       break;
@@ -175,6 +227,32 @@ int Client::handleStdinCommand() {
       audioPlayer.unmute();
       break;
 
+    case ClientCommand::VOLUME_UP:
+      audioPlayer.setVolume(std::min(audioPlayer.getVolume() + 0.1f, 1.0f));
+      std::cout << "Volume: " << static_cast<int>(audioPlayer.getVolume() * 100 + 0.5f) << "%\n";
+      break;
+
+    case ClientCommand::VOLUME_DOWN:
+      audioPlayer.setVolume(std::max(audioPlayer.getVolume() - 0.1f, 0.0f));
+      std::cout << "Volume: " << static_cast<int>(audioPlayer.getVolume() * 100 + 0.5f) << "%\n";
+      break;
+
+    case ClientCommand::CROSSFADE_ON:
+      audioPlayer.setCrossfadeMs(DEFAULT_CROSSFADE_MS);
+      break;
+
+    case ClientCommand::CROSSFADE_OFF:
+      audioPlayer.setCrossfadeMs(0);
+      break;
+
+    case ClientCommand::STATS:
+      printStats();
+      break;
+
+    case ClientCommand::QUEUE:
+      printQueue();
+      break;
+
     default:
       // this section of code should never be reached
       std::cerr << "Error: Reached default case in Client::handleStdinCommand\nCommand " << input << " not handled but is in clientMapCommand\n";
@@ -185,53 +263,152 @@ int Client::handleStdinCommand() {
   return 1;
 }
 
-void Client::handleServerSongData_threaded(Message mes) {
-  DEBUG_P(std::cout << "song data message from server of size" << mes.getBodySize() << "\n");
-  auto musicEntry = queue.addAtIndexAndLock(static_cast<uint8_t>(mes.getOptions()));
-  PipeData_t t = { clientSocket.getSocketFD() };
-  auto process = [this, &musicEntry, &t](uint32_t bodySize) {
-    Music music;
-    music.getVector().resize(bodySize);
-    if (!MusicStorage::makeTemp(musicEntry)) {
-      std::cerr << "Error: makeTemp\n";
-      t.fileDes *= -1;
-      return;
-    }
-    if (clientSocket.readAll(music.getVector().data(), bodySize) <= 0) {
-      std::cerr << "lost connection to room\n";
-      t.fileDes *= -1;
-      return;
-    }
+bool Client::handleServerSongBegin(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  uint32_t begin[2]{};
+  if (bodySize < sizeof begin) {
+    DEBUG_P(std::cout << "bad song begin\n");
+    return true;
+  }
+  std::copy(body.data(), body.data() + sizeof begin, reinterpret_cast<std::byte *>(begin));
+  DEBUG_P(std::cout << "song " << begin[0] << " of size " << begin[1] << " from server\n");
+  auto musicEntry = queue.addAtIndexAndPin(static_cast<uint8_t>(mes.getOptions()));
+  if (musicEntry == nullptr) {
+    // chunks for an unknown stream are skipped
+    receiver->skip(begin[0]);
+    return true;
+  }
+  if (!MusicStorage::makeTemp(musicEntry)) {
+    std::cerr << "Error: makeTemp\n";
+    queue.unpin(musicEntry);
+    receiver->skip(begin[0]);
+    return true;
+  }
+  receiver->begin(begin[0], musicEntry, begin[1]);
+  return true;
+}
+
+bool Client::handleServerSongChunk(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  uint32_t prefix[2]{};
+  if (bodySize < sizeof prefix || clientSocket.readAll(reinterpret_cast<std::byte *>(prefix), sizeof prefix) <= 0) {
+    return false;
+  }
+  bool complete = false;
+  if (!receiver->receive(clientSocket, prefix[0], prefix[1], bodySize - static_cast<uint32_t>(sizeof prefix), complete)) {
+    return false;
+  }
+  if (complete) {
     DEBUG_P(std::cout << "got song data\n");
+    // send received ok response to server, the song is still being written
+    Message response;
+    response.setCommand((std::byte)Commands::Command::RECV_OK);
+    replies->send(response);
+    DEBUG_P(std::cout << "sent back ok\n");
+  }
+  return true;
+}
+
+bool Client::handleServerSessionToken(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (bodySize > 0 && clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  uint64_t token{};
+  uint16_t dataPort{};
+  if (bodySize < sizeof token + sizeof dataPort || dataConnections != nullptr) {
+    DEBUG_P(std::cout << "bad session token\n");
+    return true;
+  }
+  std::copy(body.data(), body.data() + sizeof token, reinterpret_cast<std::byte *>(&token));
+  std::copy(body.data() + sizeof token, body.data() + sizeof token + sizeof dataPort, reinterpret_cast<std::byte *>(&dataPort));
+  // none are opened until songs are arriving slower than more connections could carry them
+  dataConnections = std::make_unique<DataConnections>(*receiver, *replies, roomHost, dataPort, token);
+  dataConnections->start();
+  return true;
+}
 
-    { // send received ok response to server
-      Message response;
-      response.setCommand((std::byte)Commands::Command::RECV_OK);
-      clientSocket.write(response.data(), response.size());
+bool Client::startStreaming(MusicStorageEntry *p_entry) {
+  std::unique_lock<std::mutex> lock{p_entry->streamMutex};
+  if (!p_entry->receiving) {
+    return false;
+  }
+  audioPlayer.feedStream();
+  // catch the player up on what is already in the file, the receiver pushes the rest
+  std::vector<std::byte> buffer{};
+  buffer.resize(SONG_RECEIVE_BUFFER_BYTES);
+  for (size_t offset = 0; offset < p_entry->bytesReceived; offset += buffer.size()) {
+    const size_t length = std::min(buffer.size(), p_entry->bytesReceived - offset);
+    if (!MusicStorage::readChunk(p_entry, offset, buffer.data(), length)) {
+      break;
     }
-    DEBUG_P(std::cout << "sent back ok\n");
-    // write the data to dis
-    music.setPath(musicEntry->path);
-    music.writeToPath();
-  };
+    audioPlayer.pushStream(buffer.data(), length);
+  }
+  p_entry->streamPlayer = &audioPlayer;
+  streamingEntry = p_entry->handle;
+  return true;
+}
 
-  if (musicEntry != nullptr) {
-    process(mes.getBodySize());
-    musicEntry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked entry mutex\n");
-  } else {
-    t.fileDes *= -1;
+void Client::stopStreaming() {
+  auto p_entry = queue.get(streamingEntry);
+  streamingEntry = {};
+  if (p_entry == nullptr) {
+    return;
   }
+  std::unique_lock<std::mutex> lock{p_entry->streamMutex};
+  if (p_entry->streamPlayer == &audioPlayer) {
+    p_entry->streamPlayer = nullptr;
+  }
+}
 
-  ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+void Client::preloadNext() {
+  if (!preloadedEntry.isNull() || !audioPlayer.isPlaying()) {
+    return;
+  }
+  auto p_entry = queue.getByPosition(1);
+  if (p_entry == nullptr || p_entry->getState() != EntryState::READY) {
+    // still being received, this is tried again once it has been
+    return;
+  }
+  if (audioPlayer.preload(p_entry->openSource())) {
+    DEBUG_P(std::cout << "preloaded next song\n");
+    preloadedEntry = p_entry->handle;
+  }
 }
 
 bool Client::handleServerPlayNext(Message &mes) {
   DEBUG_P(std::cout << "play next message from server\n");
+  // a newer PLAY_NEXT replaces whatever was waiting
+  playPending = false;
+  if (audioPlayer.isPlaying() && audioPlayer.takeTrackAdvance()) {
+    // the player already went into the preloaded song without a gap, keep playing it.
+    // Any difference from the room is fixed by the position beacons
+    DEBUG_P(std::cout << "already playing next\n");
+    std::vector<std::byte> body{mes.getBodySize()};
+    if (clientSocket.readAll(body.data(), body.size()) <= 0) {
+      return false;
+    }
+    if (shouldRemoveFirstOnNext) {
+      queue.removeFront();
+    }
+    shouldRemoveFirstOnNext = true;
+    preloadedEntry = {};
+    if (auto p_front = queue.getFront(); p_front != nullptr) {
+      p_front->transition(EntryState::READY, EntryState::PLAYING);
+    }
+    preloadNext();
+    return true;
+  }
   if (audioPlayer.isPlaying()) {
     audioPlayer.pause();
     audioPlayer.wait();
   }
+  stopStreaming();
   if (shouldRemoveFirstOnNext) {
     DEBUG_P(std::cout << "remove front first\n");
     queue.removeFront();
@@ -241,44 +418,211 @@ bool Client::handleServerPlayNext(Message &mes) {
   if (clientSocket.readAll(tempServerTime.data(), timeSize) <= 0) {
     return false;
   }
+  // calculate how far off we are from server time and seek to that point
+  int64_t roomTime{};
+  std::copy(
+    tempServerTime.data(),
+    tempServerTime.data() + sizeof roomTime,
+    reinterpret_cast<std::byte *>(&roomTime)
+  );
   auto nextSongEntry = queue.getFront();
   if (nextSongEntry == nullptr) {
     DEBUG_P(std::cout << "nothing to feed\n");
     shouldRemoveFirstOnNext = false;
     return true;
   }
-  if (nextSongEntry->path.empty()) {
-    DEBUG_P(std::cout << "song not received yet\n");
+  if (!startPlaying(nextSongEntry, roomTime)) {
+    DEBUG_P(std::cout << "song not received yet, starting it once it is\n");
     shouldRemoveFirstOnNext = false;
-    return true;
-  }
-  if (!nextSongEntry->entryMutex.try_lock()) {
-    DEBUG_P(std::cout << "could not get entry mutex, song is being received\n");
-    shouldRemoveFirstOnNext = false;
-    return true;
+    playPending = true;
+    pendingRoomTime = roomTime;
+    pendingSinceMs = wallClockMs();
   }
+  return true;
+}
 
-  DEBUG_P(std::cout << "feeding next\n");
-  audioPlayer.feed(nextSongEntry->path.c_str());
-  
-  // calculate how far off we are from server time and seek to that point
-  int64_t roomTime{};
-  std::copy(
-    tempServerTime.data(),
-    tempServerTime.data() + sizeof roomTime,
-    reinterpret_cast<std::byte *>(&roomTime)
-  );
-  const int64_t diff = (int64_t)std::time(nullptr) - roomTime;
+bool Client::startPlaying(MusicStorageEntry *p_entry, int64_t roomTime) {
+  if (p_entry->transition(EntryState::READY, EntryState::PLAYING)) {
+    DEBUG_P(std::cout << "feeding next\n");
+    audioPlayer.feed(p_entry->openSource());
+  } else if (p_entry->getState() == EntryState::RECEIVING && startStreaming(p_entry)) {
+    DEBUG_P(std::cout << "song is being received, streaming it\n");
+  } else {
+    return false;
+  }
+  const double diff = static_cast<double>(wallClockMs() - roomTime) / 1000.0;
   if (diff > 0 && diff < 86400) {
-    audioPlayer.seek(static_cast<double>(diff));
+    audioPlayer.seek(diff);
   }
   shouldRemoveFirstOnNext = true;
   DEBUG_P(std::cout << "playing next\n");
+  preloadedEntry = {};
   audioPlayer.play();
-  nextSongEntry->entryMutex.unlock();
+  preloadNext();
   return true;
 }
 
+void Client::startPending() {
+  if (!playPending) {
+    return;
+  }
+  auto p_front = queue.getFront();
+  if (p_front == nullptr || !startPlaying(p_front, pendingRoomTime)) {
+    return;
+  }
+  playPending = false;
+  lastLateMs = wallClockMs() - pendingSinceMs;
+  DEBUG_P(std::cout << "started " << lastLateMs << " ms late\n");
+  // let the room know, so it can see how well songs are getting to listeners ahead of time
+  std::vector<std::byte> bytes{};
+  bytes.resize(sizeof lastLateMs);
+  std::copy(
+    reinterpret_cast<const std::byte*>(&lastLateMs),
+    reinterpret_cast<const std::byte*>(&lastLateMs) + sizeof lastLateMs,
+    bytes.data()
+  );
+  Message message;
+  message.setCommand(static_cast<std::byte>(Commands::Command::PLAYBACK_LATE));
+  message.setBodySize(sizeof lastLateMs);
+  message.setBody(bytes);
+  replies->send(message);
+}
+
+bool Client::handleServerPositionBeacon(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  int64_t beacon[2]{};
+  if (bodySize < sizeof beacon) {
+    return true;
+  }
+  std::copy(body.data(), body.data() + sizeof beacon, reinterpret_cast<std::byte *>(beacon));
+  if (!audioPlayer.isPlaying()) {
+    return true;
+  }
+  // the room was at beacon[1] when it sent the beacon at beacon[0], account for the time since then
+  const int64_t expectedMs = beacon[1] + (wallClockMs() - beacon[0]);
+  audioPlayer.correctDrift(expectedMs);
+  return true;
+}
+
+bool Client::handleServerFrameIndex(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  auto index = FrameIndex::deserialize(body.data(), bodySize);
+  if (index == nullptr) {
+    DEBUG_P(std::cout << "bad frame index, the song will be indexed when it arrives\n");
+    return true;
+  }
+  // SONG_BEGIN for the same position comes next and pins the entry again
+  MusicStorageEntry *p_entry = queue.addAtIndexAndPin(static_cast<uint8_t>(mes.getOptions()));
+  if (p_entry == nullptr) {
+    return true;
+  }
+  p_entry->frameIndex = std::move(index);
+  queue.unpin(p_entry);
+  return true;
+}
+
+bool Client::handleServerQueueMetadata(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  auto metadata = std::make_shared<SongMetadata>();
+  if (!SongMetadata::deserialize(body.data(), bodySize, *metadata)) {
+    DEBUG_P(std::cout << "bad queue metadata\n");
+    return true;
+  }
+  // like FRAME_INDEX, this comes right before the song's SONG_BEGIN
+  MusicStorageEntry *p_entry = queue.addAtIndexAndPin(static_cast<uint8_t>(mes.getOptions()));
+  if (p_entry == nullptr) {
+    return true;
+  }
+  p_entry->metadata = std::move(metadata);
+  queue.unpin(p_entry);
+  return true;
+}
+
+bool Client::handleServerEntryGain(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> body{bodySize};
+  if (clientSocket.readAll(body.data(), bodySize) <= 0) {
+    return false;
+  }
+  float gainDb;
+  if (bodySize != sizeof gainDb) {
+    DEBUG_P(std::cout << "bad entry gain\n");
+    return true;
+  }
+  std::copy(body.data(), body.data() + sizeof gainDb, reinterpret_cast<std::byte *>(&gainDb));
+  const auto position = static_cast<uint8_t>(mes.getOptions());
+  // the gain usually comes after the song, unless the room measured it before sending it
+  MusicStorageEntry *p_entry = queue.getByPosition(position);
+  if (p_entry == nullptr) {
+    p_entry = queue.addAtIndexAndPin(position);
+    if (p_entry == nullptr) {
+      return true;
+    }
+    p_entry->gainDb = gainDb;
+    queue.unpin(p_entry);
+    return true;
+  }
+  p_entry->gainDb = gainDb;
+  const float linear = std::pow(10.0f, gainDb / 20.0f);
+  // a song the player already has was opened without its gain
+  if (position == 0 && (p_entry->getState() == EntryState::PLAYING || p_entry->handle == streamingEntry)) {
+    audioPlayer.setTrackGain(linear);
+  } else if (p_entry->handle == preloadedEntry) {
+    audioPlayer.setNextTrackGain(linear);
+  }
+  return true;
+}
+
+void Client::printQueue() {
+  int64_t frontLeftMs = 0;
+  auto p_front = queue.getFront();
+  if (
+    audioPlayer.isPlaying() && p_front != nullptr && p_front->getState() == EntryState::PLAYING &&
+    p_front->metadata != nullptr && p_front->metadata->durationMs > 0
+  ) {
+    frontLeftMs = p_front->metadata->durationMs - audioPlayer.getPositionMs();
+  }
+  queue.printQueue(frontLeftMs);
+}
+
+void Client::printStats() {
+  const PlayerStats stats = audioPlayer.getStats();
+  std::cout <<
+    "position:        " << audioPlayer.getPositionMs() << " ms\n"
+    "skew:            " << stats.lastSkewMs << " ms (max " << stats.maxSkewMs << " ms this song)\n"
+    "frames inserted: " << stats.framesInserted << '\n' <<
+    "frames dropped:  " << stats.framesDropped << '\n' <<
+    "drift seeks:     " << stats.driftSeeks << '\n' <<
+    "underruns:       " << stats.underruns << '\n' <<
+    "seek time:       " << stats.lastSeekUs << " us (max " << stats.maxSeekUs << " us)\n"
+    "buffered:        " << stats.ringFill << " / " << stats.ringCapacity << " bytes\n"
+    "last late start: " << lastLateMs << " ms\n";
+  if (dataConnections != nullptr) {
+    const DataConnectionStats_t &dataStats = dataConnections->getStats();
+    std::cout <<
+      "data connections: " << dataStats.lanes << " (" << dataStats.rejected << " closed for not helping), " <<
+      dataStats.lastRate << " B/s last second\n";
+  }
+  std::cout <<
+    "output:          " << stats.output;
+  if (stats.hasTimestamp) {
+    std::cout << ", " << stats.timestamp.frames << " frames played by " << stats.timestamp.wallMs << " ms";
+  }
+  std::cout << '\n';
+}
+
 bool Client::handleServerMessage() {
   std::byte responseHeader[SIZE_OF_HEADER];
   if (clientSocket.readAll(responseHeader, SIZE_OF_HEADER) <= 0){
@@ -290,14 +634,20 @@ bool Client::handleServerMessage() {
   const auto command = static_cast<Commands::Command>(mes.getCommand());
   switch (command) {
     // always take the next queue entry, if there are none available, add one
-    case Commands::Command::SONG_DATA: {
-      DEBUG_P(std::cout << "song data\n");
-      FD_CLR(clientSocket.getSocketFD(), &master);
-      std::thread thread = std::thread(&Client::handleServerSongData_threaded, this, mes);
-      thread.detach();
+    case Commands::Command::SONG_BEGIN: {
+      if (!handleServerSongBegin(mes)) {
+        return false;
+      }
+      break;
+    }
+
+    case Commands::Command::SONG_CHUNK: {
+      if (!handleServerSongChunk(mes)) {
+        return false;
+      }
       break;
     }
-    
+
     case Commands::Command::PLAY_NEXT: {
       if (!handleServerPlayNext(mes)) {
         return false;
@@ -305,6 +655,41 @@ bool Client::handleServerMessage() {
       break;
     }
 
+    case Commands::Command::SESSION_TOKEN: {
+      if (!handleServerSessionToken(mes)) {
+        return false;
+      }
+      break;
+    }
+
+    case Commands::Command::POSITION_BEACON: {
+      if (!handleServerPositionBeacon(mes)) {
+        return false;
+      }
+      break;
+    }
+
+    case Commands::Command::FRAME_INDEX: {
+      if (!handleServerFrameIndex(mes)) {
+        return false;
+      }
+      break;
+    }
+
+    case Commands::Command::QUEUE_METADATA: {
+      if (!handleServerQueueMetadata(mes)) {
+        return false;
+      }
+      break;
+    }
+
+    case Commands::Command::ENTRY_GAIN: {
+      if (!handleServerEntryGain(mes)) {
+        return false;
+      }
+      break;
+    }
+
     case Commands::Command::RES_ADD_TO_QUEUE_OK: {
       DEBUG_P(std::cout << "got ok\n");
       FD_CLR(0, &master);
@@ -317,13 +702,41 @@ bool Client::handleServerMessage() {
       break;
     }
 
+    case Commands::Command::RES_ADD_BATCH_TO_QUEUE: {
+      if (!handleServerBatchReserved(mes)) {
+        return false;
+      }
+      break;
+    }
+
     case Commands::Command::RES_ADD_TO_QUEUE_NOT_OK:
       std::cout << "The room is not allowing you to upload, try again later\n";
       break;
 
+    case Commands::Command::BAD_VALUES:
+      // the room also sends REMOVE_QUEUE_ENTRY for the song
+      std::cout << "The room rejected your song, it is not a valid MP3 file\n";
+      break;
+
     case Commands::Command::REMOVE_QUEUE_ENTRY: {
       DEBUG_P(std::cout << "remove by position " << (int)mes.getOptions() << '\n');
+      if (!streamingEntry.isNull() && queue.getPositionInQueue(streamingEntry) == static_cast<int>(mes.getOptions())) {
+        audioPlayer.pause();
+        audioPlayer.wait();
+        stopStreaming();
+      }
+      if (static_cast<int>(mes.getOptions()) <= 1) {
+        // the song after the current one is changing, forget what was preloaded
+        audioPlayer.cancelPreload();
+        preloadedEntry = {};
+      }
+      if (static_cast<int>(mes.getOptions()) == 0) {
+        // the song that was waiting to start is gone
+        playPending = false;
+      }
+      receiver->drop(queue.getByPosition(static_cast<uint8_t>(mes.getOptions())));
       queue.removeByPosition(static_cast<uint8_t>(mes.getOptions()));
+      preloadNext();
       break;
     }
 
@@ -343,17 +756,15 @@ void Client::reqSendMusicFile() {
   DEBUG_P(std::cout << "sending req add to queue to server\n");
   Message request;
   request.setCommand((std::byte)Commands::Command::REQ_ADD_TO_QUEUE);
-  if (!clientSocket.write(request.data(), request.size())) {
-    return; // writing to the socket failed
-  }
+  // a batch may be uploading, do not wait for it
+  replies->send(request);
 }
 
 void Client::sendMusicFile_threaded(uint8_t position) {
   DEBUG_P(std::cout << "sendMusicFile\n");
   PipeData_t t = { 0 };
-  auto process = [this, &t, position]() {
+  auto process = [this, &t](MusicStorageEntry *p_entry) {
     Music m;
-    MusicStorageEntry *p_entry = queue.addAtIndexAndLock(position);
     getMP3FilePath(m);
     if (clientSocket.getSocketFD() == 0) {
       std::cerr << "Leaving room\n >> ";
@@ -371,28 +782,191 @@ void Client::sendMusicFile_threaded(uint8_t position) {
       return;
     }
 
-    m.readFileAtPath();
+    size_t fileSize = 0;
+    const int fd = m.openFileAtPath(fileSize);
+    if (fd == -1) {
+      // the room is waiting for a song, tell it none is coming
+      Message header;
+      header.setCommand((std::byte)Commands::Command::CANCEL_REQ_ADD_TO_QUEUE);
+      if (!clientSocket.write(header.data(), header.size())) {
+        t.fileDes = -1;
+      }
+      std::cerr << "Error: could not open the file\n >> ";
+      return;
+    }
     p_entry->path = m.getPath();
-    p_entry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked entry mutex\n");
 
-    Message header;
-    header.setCommand(static_cast<std::byte>(Commands::Command::SONG_DATA));
-    header.setBodySize(static_cast<uint32_t>(m.getVector().size()));
     DEBUG_P(std::cout << "sending data \n");
-    if (!clientSocket.writeHeaderAndData(header.data(), m.getVector().data(), m.getVector().size())) {
+    if (!sendSongData(fd, fileSize, "Uploading... ")) {
       DEBUG_P(std::cout << "couldn't send \n");
       t.fileDes = -1;
       return;
-    } 
+    }
+
+    // the file was just read to send it, so indexing it reads from the cache
+    p_entry->frameIndex = FrameIndex::fromFile(p_entry->path);
+    // the room does not send our own song back, so read its metadata here
+    p_entry->metadata = std::make_shared<const SongMetadata>(
+      SongMetadata::fromFile(p_entry->path, p_entry->frameIndex.get())
+    );
+    p_entry->transition(EntryState::RESERVED, EntryState::READY);
     DEBUG_P(std::cout << "sent data \n");
     std::cout << "Added song to queue\n";
-    p_entry->entryMutex.unlock();
     std::cout << " >> ";
     std::cout.flush();
   };
 
-  process();
+  MusicStorageEntry *p_entry = queue.addAtIndexAndPin(position);
+  if (p_entry != nullptr) {
+    process(p_entry);
+    queue.unpin(p_entry);
+  } else {
+    std::cerr << "Could not add the song to the queue\n >> ";
+  }
+
+  ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+}
+
+bool Client::sendSongData(int fd, size_t fileSize, const std::string &label) {
+  Message header;
+  header.setCommand(static_cast<std::byte>(Commands::Command::SONG_DATA));
+  header.setBodySize(static_cast<uint32_t>(fileSize));
+  // sent straight from the file as it is read, it is never all in memory
+  size_t shownPercent = 0;
+  auto showProgress = [fileSize, &label, &shownPercent](size_t sent) {
+    const size_t percent = sent * 100 / fileSize;
+    if (percent != shownPercent) {
+      shownPercent = percent;
+      std::cout << '\r' << label << percent << '%';
+      std::cout.flush();
+    }
+  };
+  const bool sent = clientSocket.writeHeaderAndFile(header.data(), fd, fileSize, showProgress);
+  ::close(fd);
+  std::cout << '\n';
+  return sent;
+}
+
+void Client::reqSendBatch_threaded() {
+  PipeData_t t = { 0 };
+  std::string path;
+  getBatchPath(path);
+  if (path == "-1") {
+    std::cout << "Cancelled\n >> ";
+    std::cout.flush();
+    ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+    return;
+  }
+  const std::vector<std::string> paths = SongBatch::list(path);
+  size_t skipped = 0;
+  std::vector<BatchSong_t> songs = SongBatch::prepare(paths, skipped);
+  if (songs.size() > MAX_SONGS) {
+    std::cout << "Only the first " << MAX_SONGS << " songs fit in the queue\n";
+    songs.resize(MAX_SONGS);
+  }
+  if (songs.empty()) {
+    std::cerr << "Error: no songs to add\n >> ";
+    ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+    return;
+  }
+  if (clientSocket.getSocketFD() == 0) {
+    std::cerr << "Leaving room\n >> ";
+    return;
+  }
+  DEBUG_P(std::cout << "asking for " << songs.size() << " slots, " << skipped << " songs skipped\n");
+  Message request;
+  request.setCommand(Commands::Command::REQ_ADD_BATCH_TO_QUEUE);
+  request.setOptions(static_cast<std::byte>(songs.size()));
+  {
+    // taken by the main thread once the room answers
+    std::unique_lock<std::mutex> lock{batchMutex};
+    batch = std::move(songs);
+  }
+  if (!clientSocket.write(request.data(), request.size())) {
+    t.fileDes = -1;
+    ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+  }
+}
+
+bool Client::handleServerBatchReserved(Message &mes) {
+  const uint32_t bodySize = mes.getBodySize();
+  std::vector<std::byte> positions{bodySize};
+  if (bodySize != 0 && clientSocket.readAll(positions.data(), bodySize) <= 0) {
+    return false;
+  }
+  std::vector<BatchSong_t> songs;
+  {
+    std::unique_lock<std::mutex> lock{batchMutex};
+    songs = std::move(batch);
+    batch.clear();
+  }
+  if (positions.empty()) {
+    std::cout << "The room is not allowing you to upload, try again later\n >> ";
+    std::cout.flush();
+    FD_SET(0, &master);
+    return true;
+  }
+  if (positions.size() < songs.size()) {
+    std::cout << "The queue only has room for " << positions.size() << " of the " << songs.size() << " songs\n";
+  }
+  std::vector<std::pair<MusicStorageEntry *, BatchSong_t>> uploads{};
+  for (size_t i = 0; i < positions.size() && i < songs.size(); ++i) {
+    // added now, before anything else from the room moves the queue
+    MusicStorageEntry *p_entry = queue.addAtIndexAndPin(static_cast<uint8_t>(positions[i]));
+    uploads.emplace_back(p_entry, std::move(songs[i]));
+  }
+  std::thread thread = std::thread(&Client::sendBatch_threaded, this, std::move(uploads));
+  thread.detach();
+  return true;
+}
 
+void Client::sendBatch_threaded(std::vector<std::pair<MusicStorageEntry *, BatchSong_t>> uploads) {
+  PipeData_t t = { 0 };
+  size_t added = 0;
+  for (size_t i = 0; i < uploads.size(); ++i) {
+    MusicStorageEntry *p_entry = uploads[i].first;
+    const BatchSong_t &song = uploads[i].second;
+    if (t.fileDes == -1 || clientSocket.getSocketFD() == 0) {
+      if (p_entry != nullptr) {
+        queue.unpin(p_entry);
+      }
+      continue;
+    }
+    Music m;
+    m.setPath(song.path);
+    size_t fileSize = 0;
+    const int fd = p_entry == nullptr ? -1 : m.openFileAtPath(fileSize);
+    if (fd == -1 || fileSize != song.size) {
+      // the file changed since it was checked, or there is no entry for it here. The room gives up the slot
+      if (fd != -1) {
+        ::close(fd);
+      }
+      std::cerr << "Error: could not add " << song.path << '\n';
+      Message header;
+      header.setCommand(static_cast<std::byte>(Commands::Command::CANCEL_REQ_ADD_TO_QUEUE));
+      if (!clientSocket.write(header.data(), header.size())) {
+        t.fileDes = -1;
+      }
+    } else if (!sendSongData(fd, fileSize, "Uploading " + std::to_string(i + 1) + " of " + std::to_string(uploads.size()) + "... ")) {
+      DEBUG_P(std::cout << "couldn't send \n");
+      t.fileDes = -1;
+    } else {
+      p_entry->path = song.path;
+      // worked out while the batch was checked, the room does not send our own songs back
+      p_entry->frameIndex = song.frameIndex;
+      p_entry->metadata = song.metadata;
+      p_entry->transition(EntryState::RESERVED, EntryState::READY);
+      ++added;
+    }
+    if (p_entry != nullptr) {
+      queue.unpin(p_entry);
+    }
+  }
+  if (clientSocket.getSocketFD() == 0) {
+    std::cerr << "Leaving room\n >> ";
+  } else {
+    std::cout << "Added " << added << (added == 1 ? " song" : " songs") << " to queue\n >> ";
+  }
+  std::cout.flush();
   ::write(threadPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
 }
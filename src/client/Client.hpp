@@ -13,8 +13,11 @@
 
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
+#include <utility>
 #include <cstdlib>
 #include <unordered_map>
 #if _WIN32
@@ -35,7 +38,12 @@
 #include "../messaging/Commands.hpp"
 #include "../music/Player.hpp"
 #include "../music/Music.hpp"
+#include "SongReceiver.hpp"
+#include "DataConnections.hpp"
+#include "ReplyWriter.hpp"
+#include "SongBatch.hpp"
 #include "../CLInput.hpp"
+#include "../Clock.hpp"
 #include "../debug.hpp"
 
 
@@ -57,6 +65,36 @@ typedef struct {
 class Client {
 private:
   bool shouldRemoveFirstOnNext;
+
+  /**
+   * entry the audio player is streaming from while it is still being received, null if none
+  */
+  EntryHandle_t streamingEntry;
+
+  /**
+   * entry the audio player has preloaded to play right after the current one, null if none
+  */
+  EntryHandle_t preloadedEntry;
+
+  /**
+   * true when PLAY_NEXT arrived before the front of the queue did, playback starts once it has been received
+  */
+  bool playPending;
+
+  /**
+   * room start time, in ms, of the song waiting on Client::playPending
+  */
+  int64_t pendingRoomTime;
+
+  /**
+   * wall clock time in milliseconds at which the pending PLAY_NEXT arrived
+  */
+  int64_t pendingSinceMs;
+
+  /**
+   * how late the last deferred start was, in milliseconds
+  */
+  int64_t lastLateMs;
   int fdMax;
   int threadPipe[2];
 
@@ -74,6 +112,32 @@ private:
    */
   ThreadSafeSocket clientSocket;
 
+  /**
+   * host the room was joined at, data connections go there too
+  */
+  std::string roomHost;
+
+  /**
+   * writes the songs the room sends to their entries' files, made once connected
+  */
+  std::unique_ptr<SongReceiver> receiver;
+
+  /**
+   * writes the main loop's replies to the room, made once connected
+  */
+  std::unique_ptr<ReplyWriter> replies;
+
+  /**
+   * extra connections songs arrive over, made once the room sends its SESSION_TOKEN
+  */
+  std::unique_ptr<DataConnections> dataConnections;
+
+  /**
+   * songs of an 'add songs' batch, waiting for the room to reserve their slots
+  */
+  std::vector<BatchSong_t> batch;
+  std::mutex batchMutex;
+
   bool processThreadFinished();
 
   /**
@@ -82,12 +146,120 @@ private:
 
   void sendMusicFile_threaded(uint8_t);
 
+  /**
+   * @brief Sends a song as SONG_DATA straight from its file, showing how much has been sent
+   * @param fd the song's file, closed once sent
+   * @param label shown in front of the percentage
+   * @returns false if writing to the socket failed
+  */
+  bool sendSongData(int fd, size_t fileSize, const std::string &label);
+
+  /**
+   * @brief Asks for a directory or an M3U playlist, checks its songs in parallel, and asks the room for
+   * a slot for each of them in one REQ_ADD_BATCH_TO_QUEUE
+  */
+  void reqSendBatch_threaded();
+
+  /**
+   * @brief Reads a RES_ADD_BATCH_TO_QUEUE body, adds an entry at each position, and starts sending the batch
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerBatchReserved(Message &mes);
+
+  /**
+   * @brief Sends the songs of a batch back to back, each into its pinned entry. A song whose entry is nullptr,
+   * or whose file can no longer be read, gives up its slot with a CANCEL_REQ_ADD_TO_QUEUE
+  */
+  void sendBatch_threaded(std::vector<std::pair<MusicStorageEntry *, BatchSong_t>> uploads);
+
   int handleStdinCommand();
 
-  void handleServerSongData_threaded(Message mes);
+  /**
+   * @brief Reads a SONG_BEGIN body and gets the song's entry ready to receive it
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerSongBegin(Message &mes);
+
+  /**
+   * @brief Reads a SONG_CHUNK through Client::receiver into the song it is for. Once the whole song is in, tells the room
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerSongChunk(Message &mes);
+
+  /**
+   * @brief Reads a SESSION_TOKEN body and starts opening data connections to the room with it
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerSessionToken(Message &mes);
 
   bool handleServerPlayNext(Message &mes);
 
+  /**
+   * @brief Feeds or streams an entry and starts playing it at the room's position
+   * @param p_entry the front of the queue
+   * @param roomTime wall clock time the room started the song at, in ms
+   * @returns false if the entry has not started arriving yet
+  */
+  bool startPlaying(MusicStorageEntry *p_entry, int64_t roomTime);
+
+  /**
+   * @brief Starts a song that PLAY_NEXT was received for before the song itself, if it is here now,
+   * and tells the room how late it started
+  */
+  void startPending();
+
+  /**
+   * @brief Starts the audio player on an entry that is still being received
+   * @returns false if the entry is not being received
+  */
+  bool startStreaming(MusicStorageEntry *);
+
+  /**
+   * @brief Stops the receiving thread from pushing to the audio player
+  */
+  void stopStreaming();
+
+  /**
+   * @brief Preloads the song after the current one into the player, if it has been received
+  */
+  void preloadNext();
+
+  /**
+   * @brief Reads a POSITION_BEACON body and corrects the player's drift against the room
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerPositionBeacon(Message &mes);
+
+  /**
+   * @brief Reads a FRAME_INDEX body and attaches the index to the queue entry it is for, so the
+   * song does not have to be indexed again once it arrives
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerFrameIndex(Message &mes);
+
+  /**
+   * @brief Reads a QUEUE_METADATA body and attaches it to the queue entry it is for
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerQueueMetadata(Message &mes);
+
+  /**
+   * @brief Reads an ENTRY_GAIN body, attaches the gain to the queue entry it is for, and gives it to the
+   * audio player if the player already has that song
+   * @returns false if the connection to the room was lost
+  */
+  bool handleServerEntryGain(Message &mes);
+
+  /**
+   * @brief Prints the queue for the 'queue' command
+  */
+  void printQueue();
+
+  /**
+   * @brief Prints player statistics for the 'stats' command
+  */
+  void printStats();
+
   bool handleServerMessage();
 
 public:
@@ -0,0 +1,170 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for a client's data connections
+*/
+
+#include <chrono>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <sys/socket.h>
+#endif
+
+#include "DataConnections.hpp"
+#include "../debug.hpp"
+#include "../messaging/Commands.hpp"
+
+using namespace clnt;
+
+DataConnections::DataConnections(SongReceiver &receiver, ReplyWriter &replies, std::string host, uint16_t port, uint64_t token):
+  receiver{receiver}, replies{replies}, host{std::move(host)}, port{port}, token{token}, lanes{}, mutex{},
+  cond{}, stopping{false}, stats{}, thread{} {}
+
+DataConnections::~DataConnections() {
+  stop();
+}
+
+void DataConnections::start() {
+  if (!thread.joinable()) {
+    thread = std::thread(&DataConnections::_run, this);
+  }
+}
+
+void DataConnections::stop() {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  cond.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+  }
+  for (DataLane_t &lane : lanes) {
+#if defined(__APPLE__) || defined(__unix__)
+    shutdown(lane.socket->getSocketFD(), SHUT_RDWR);
+#endif
+    if (lane.thread.joinable()) {
+      lane.thread.join();
+    }
+  }
+  lanes.clear();
+  stats.lanes = 0;
+}
+
+const DataConnectionStats_t &DataConnections::getStats() const {
+  return stats;
+}
+
+void DataConnections::_run() {
+  uint64_t lastBytes = receiver.getBytesRead();
+  bool wasReceiving = receiver.isReceiving();
+  // bytes per second with the connections kept so far
+  double keptRate = 0;
+  bool trying = false;
+  int hold = 0;
+  std::unique_lock<std::mutex> lock{mutex};
+  while (!cond.wait_for(lock, std::chrono::milliseconds(STRIPE_WINDOW_MS), [this]() { return stopping; })) {
+    lock.unlock();
+    _reap();
+    const uint64_t bytes = receiver.getBytesRead();
+    const bool receiving = receiver.isReceiving();
+    const double rate = static_cast<double>(bytes - lastBytes) * 1000.0 / STRIPE_WINDOW_MS;
+    stats.lastRate = static_cast<uint64_t>(rate);
+    lastBytes = bytes;
+    // a window songs were not arriving for all of says nothing about how fast they can
+    const bool measured = wasReceiving && receiving;
+    wasReceiving = receiving;
+    if (!measured) {
+      trying = false;
+    } else if (trying && rate < keptRate * STRIPE_KEEP_GAIN) {
+      DEBUG_P(std::cout << "data connection did not help, " << rate << " B/s against " << keptRate << " B/s\n");
+      trying = false;
+      ++stats.rejected;
+      _close();
+      hold = STRIPE_HOLD_WINDOWS;
+    } else {
+      trying = false;
+      keptRate = rate;
+      if (hold > 0) {
+        --hold;
+      } else if (lanes.size() < MAX_DATA_CONNECTIONS && _open()) {
+        trying = true;
+      }
+    }
+    lock.lock();
+  }
+}
+
+bool DataConnections::_open() {
+  auto socket = std::make_unique<ThreadSafeSocket>();
+  if (!socket->connect(host, port)) {
+    return false;
+  }
+  Message hello;
+  hello.setCommand(Commands::Command::DATA_CONNECTION);
+  hello.setBodySize(sizeof token);
+  if (!socket->writeHeaderAndData(hello.data(), reinterpret_cast<const std::byte *>(&token), sizeof token)) {
+    return false;
+  }
+  DataLane_t &lane = lanes.emplace_back();
+  lane.socket = std::move(socket);
+  lane.closing = false;
+  lane.finished = false;
+  lane.thread = std::thread(&DataConnections::_read, this, std::ref(lane));
+  ++stats.lanes;
+  return true;
+}
+
+void DataConnections::_close() {
+  for (auto lane = lanes.rbegin(); lane != lanes.rend(); ++lane) {
+    if (!lane->closing && !lane->finished) {
+      lane->closing = true;
+#if defined(__APPLE__) || defined(__unix__)
+      // the room sees this before its next chunk and closes its side, the thread reads up to there
+      shutdown(lane->socket->getSocketFD(), SHUT_WR);
+#endif
+      return;
+    }
+  }
+}
+
+void DataConnections::_reap() {
+  auto lane = lanes.begin();
+  while (lane != lanes.end()) {
+    if (lane->finished) {
+      lane->thread.join();
+      lane = lanes.erase(lane);
+      --stats.lanes;
+    } else {
+      ++lane;
+    }
+  }
+}
+
+void DataConnections::_read(DataLane_t &lane) {
+  ThreadSafeSocket &socket = *lane.socket;
+  std::byte header[SIZE_OF_HEADER];
+  while (socket.readAll(header, SIZE_OF_HEADER) != 0) {
+    Message message(header);
+    const uint32_t bodySize = message.getBodySize();
+    uint32_t prefix[2]{};
+    if (
+      message.getCommand() != Commands::Command::SONG_CHUNK || bodySize < sizeof prefix ||
+      socket.readAll(reinterpret_cast<std::byte *>(prefix), sizeof prefix) == 0
+    ) {
+      // only song chunks come this way
+      break;
+    }
+    bool complete = false;
+    if (!receiver.receive(socket, prefix[0], prefix[1], bodySize - static_cast<uint32_t>(sizeof prefix), complete)) {
+      break;
+    }
+    if (complete) {
+      // the last of the song came this way, tell the room as the main connection would have
+      Message response;
+      response.setCommand(Commands::Command::RECV_OK);
+      replies.send(response);
+    }
+  }
+  lane.finished = true;
+}
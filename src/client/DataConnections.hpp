@@ -0,0 +1,152 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Extra connections to a room that songs are striped across, as many as make them arrive faster
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+#include "SongReceiver.hpp"
+#include "ReplyWriter.hpp"
+#include "../socket/ThreadSafeSocket.hpp"
+
+// how long throughput is measured for before the number of connections is changed
+#define STRIPE_WINDOW_MS 1000
+// a connection added is kept if songs arrive at least this much faster with it
+#define STRIPE_KEEP_GAIN 1.15
+// windows to wait after a connection did not help before trying another
+#define STRIPE_HOLD_WINDOWS 30
+
+namespace clnt {
+
+/**
+ * @brief A data connection and the thread reading it
+*/
+typedef struct {
+  std::unique_ptr<ThreadSafeSocket> socket;
+  std::thread thread;
+  /**
+   * set once this side was shut down, the room is closing the connection
+  */
+  bool closing;
+  /**
+   * set once the room closed the connection or it was lost, it is then joined and dropped
+  */
+  std::atomic<bool> finished;
+} DataLane_t;
+
+typedef struct {
+  /**
+   * data connections open now
+  */
+  std::atomic<uint64_t> lanes;
+  /**
+   * bytes per second songs arrived at over the last window, over every connection
+  */
+  std::atomic<uint64_t> lastRate;
+  /**
+   * connections opened and closed again because they did not make songs arrive faster
+  */
+  std::atomic<uint64_t> rejected;
+} DataConnectionStats_t;
+
+/**
+ * @brief Opens data connections to the room with the token from its SESSION_TOKEN. The room sends the next chunk
+ * of a song over whichever connection is free, so a song is striped across the main connection and these, and
+ * SongReceiver puts the chunks back in order. On a link with a long round trip one TCP connection cannot carry
+ * much, more of them carry more.
+ * While songs are arriving, a thread measures how fast every STRIPE_WINDOW_MS. It opens one more connection, and
+ * keeps it if the next window is at least STRIPE_KEEP_GAIN times faster. If not, it closes it and waits
+ * STRIPE_HOLD_WINDOWS before trying again. Near the room, the extra connections do not help and are closed again
+*/
+class DataConnections {
+private:
+
+  SongReceiver &receiver;
+
+  /**
+   * writes to the main connection to the room, RECV_OK is sent over it when a song's last chunk came over a
+   * data connection
+  */
+  ReplyWriter &replies;
+
+  std::string host;
+  uint16_t port;
+  uint64_t token;
+
+  /**
+   * only the tuning thread adds and drops lanes
+  */
+  std::list<DataLane_t> lanes;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stopping;
+
+  DataConnectionStats_t stats;
+
+  std::thread thread;
+
+  /**
+   * @brief loop of the tuning thread
+  */
+  void _run();
+
+  /**
+   * @brief open a data connection and start reading it
+   * @returns false if it could not be opened
+  */
+  bool _open();
+
+  /**
+   * @brief close the data connection opened last. The room stops sending over it, and what it already sent is read
+  */
+  void _close();
+
+  /**
+   * @brief join and drop lanes whose connection is done with
+  */
+  void _reap();
+
+  /**
+   * @brief loop of a data connection's thread, reads the SONG_CHUNKs the room sends over it
+  */
+  void _read(DataLane_t &lane);
+
+public:
+
+  /**
+   * @param receiver receives the chunks
+   * @param replies writer of the main connection to the room
+   * @param host host of the room
+   * @param port data port from the SESSION_TOKEN
+   * @param token token from the SESSION_TOKEN
+  */
+  DataConnections(SongReceiver &receiver, ReplyWriter &replies, std::string host, uint16_t port, uint64_t token);
+
+  DataConnections(const DataConnections &) = delete;
+
+  ~DataConnections();
+
+  /**
+   * @brief start the tuning thread
+  */
+  void start();
+
+  /**
+   * @brief close every data connection and stop the threads
+  */
+  void stop();
+
+  [[nodiscard]] const DataConnectionStats_t &getStats() const;
+};
+
+}
@@ -0,0 +1,80 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for a client's reply writer
+*/
+
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <sys/socket.h>
+#endif
+
+#include "ReplyWriter.hpp"
+#include "../debug.hpp"
+
+using namespace clnt;
+
+ReplyWriter::ReplyWriter(ThreadSafeSocket &socket): socket{socket}, mutex{}, cond{}, replies{}, stopping{false}, thread{} {}
+
+ReplyWriter::~ReplyWriter() {
+  stop();
+}
+
+void ReplyWriter::start() {
+  if (!thread.joinable()) {
+    thread = std::thread(&ReplyWriter::_run, this);
+  }
+}
+
+void ReplyWriter::stop() {
+  bool writing = false;
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    stopping = true;
+    writing = !replies.empty();
+  }
+  cond.notify_all();
+  if (thread.joinable()) {
+#if defined(__APPLE__) || defined(__unix__)
+    if (writing) {
+      // the client is leaving, do not wait for an upload to let go of the socket
+      shutdown(socket.getSocketFD(), SHUT_RDWR);
+    }
+#endif
+    thread.join();
+  }
+}
+
+void ReplyWriter::send(Message &message) {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (stopping) {
+      return;
+    }
+    replies.emplace_back(message.data(), message.data() + message.size());
+  }
+  cond.notify_one();
+}
+
+void ReplyWriter::_run() {
+  std::unique_lock<std::mutex> lock{mutex};
+  while (true) {
+    cond.wait(lock, [this]() { return stopping || !replies.empty(); });
+    if (stopping) {
+      return;
+    }
+    const std::vector<std::byte> reply = std::move(replies.front());
+    lock.unlock();
+    // blocks while an upload has the socket
+    const bool written = socket.write(reply.data(), reply.size());
+    lock.lock();
+    // the front is only popped here, send only adds to the back
+    replies.pop_front();
+    if (!written) {
+      // the room is gone, the main loop finds out when it next reads
+      DEBUG_P(std::cout << "could not write a reply to the room\n");
+      stopping = true;
+      return;
+    }
+  }
+}
@@ -0,0 +1,75 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Short messages a client sends the room, written off the main loop
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <condition_variable>
+
+#include "../socket/ThreadSafeSocket.hpp"
+#include "../messaging/Message.hpp"
+
+namespace clnt {
+
+/**
+ * @brief Writes RECV_OK, PLAYBACK_LATE and other short messages to the room from a thread of its own.
+ * An upload holds the room socket for as long as the song takes to send, so a reply written straight from the
+ * main loop would stop playback, beacons and stdin until it was done. Replies wait here instead and are written
+ * in the order they were queued in once the socket is free
+*/
+class ReplyWriter {
+private:
+
+  ThreadSafeSocket &socket;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  std::deque<std::vector<std::byte>> replies;
+
+  /**
+   * set to stop the thread, replies not written by then are dropped
+  */
+  bool stopping;
+
+  std::thread thread;
+
+  /**
+   * @brief loop of the writing thread
+  */
+  void _run();
+
+public:
+
+  /**
+   * @param socket main connection to the room
+  */
+  explicit ReplyWriter(ThreadSafeSocket &socket);
+
+  ReplyWriter(const ReplyWriter &) = delete;
+
+  ~ReplyWriter();
+
+  /**
+   * @brief start the writing thread
+  */
+  void start();
+
+  /**
+   * @brief stop the writing thread, waiting for the reply being written if any
+  */
+  void stop();
+
+  /**
+   * @brief queue a copy of a message, it is written after every message queued before it
+  */
+  void send(Message &message);
+};
+
+}
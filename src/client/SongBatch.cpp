@@ -0,0 +1,177 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for batches of songs to upload
+*/
+
+#include <set>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <utility>
+#include <iostream>
+#include <iterator>
+#include <algorithm>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "SongBatch.hpp"
+#include "../debug.hpp"
+#include "../Fnv1a.hpp"
+#include "../music/Music.hpp"
+#include "../music/Mp3Validator.hpp"
+
+using namespace clnt;
+
+static bool hasExtension(const std::string &path, const std::string &extension) {
+  if (path.length() <= extension.length()) {
+    return false;
+  }
+  std::string end = path.substr(path.length() - extension.length());
+  std::transform(end.begin(), end.end(), end.begin(), [](unsigned char c) {
+    return std::tolower(c);
+  });
+  return end == extension;
+}
+
+/**
+ * check, hash and index a song that is in memory
+*/
+static void inspect(BatchSong_t &song, const unsigned char *data, std::size_t size) {
+  Mp3Validator validator;
+  if (validator.feed(data, size) == Mp3Verdict::INVALID || validator.finish() != Mp3Verdict::VALID) {
+    return;
+  }
+  song.hash = fnv1a(FNV_OFFSET_BASIS, data, size);
+  song.frameIndex = FrameIndex::build(data, size);
+  song.metadata = std::make_shared<const SongMetadata>(SongMetadata::extract(data, size, song.frameIndex.get()));
+  song.valid = true;
+}
+
+std::vector<std::string> SongBatch::list(const std::string &path) {
+  std::vector<std::string> paths{};
+  if (hasExtension(path, ".m3u") || hasExtension(path, ".m3u8")) {
+    std::ifstream playlist{path};
+    if (!playlist) {
+      std::cerr << "Error: Unable to open playlist\n";
+      return paths;
+    }
+    const std::size_t slash = path.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::string line;
+    while (std::getline(playlist, line)) {
+      // written on windows as often as not
+      while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+        line.pop_back();
+      }
+      if (line.rfind("file://", 0) == 0) {
+        line.erase(0, 7);
+      }
+      // blank lines and #EXTINF and other directives
+      if (line.empty() || line.front() == '#') {
+        continue;
+      }
+      paths.push_back(line.front() == '/' ? line : dir + line);
+    }
+    return paths;
+  }
+#if defined(__APPLE__) || defined(__unix__)
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    std::cerr << "Error: not a directory or an M3U playlist\n";
+    return paths;
+  }
+  while (dirent *file = readdir(dir)) {
+    const std::string name = file->d_name;
+    const std::string songPath = path + (path.back() == '/' ? "" : "/") + name;
+    struct stat info{};
+    if (hasExtension(name, ".mp3") && stat(songPath.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+      paths.push_back(songPath);
+    }
+  }
+  closedir(dir);
+  std::sort(paths.begin(), paths.end());
+#else
+  std::cerr << "Error: not an M3U playlist\n";
+#endif
+  return paths;
+}
+
+std::vector<BatchSong_t> SongBatch::prepare(const std::vector<std::string> &paths, std::size_t &skipped) {
+  std::vector<BatchSong_t> loaded(paths.size());
+  std::atomic<std::size_t> next{0};
+  auto work = [&paths, &loaded, &next]() {
+    for (std::size_t i = next++; i < paths.size(); i = next++) {
+      loaded[i] = load(paths[i]);
+    }
+  };
+  const std::size_t workers = std::min<std::size_t>(std::max(std::thread::hardware_concurrency(), 1U), paths.size());
+  std::vector<std::thread> threads{};
+  for (std::size_t i = 1; i < workers; ++i) {
+    threads.emplace_back(work);
+  }
+  // this thread is one of them
+  work();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<BatchSong_t> songs{};
+  std::set<std::pair<uint64_t, std::size_t>> seen{};
+  skipped = 0;
+  for (BatchSong_t &song : loaded) {
+    if (!song.valid) {
+      std::cerr << "Error: skipping " << song.path << ", not a valid mp3 file\n";
+      ++skipped;
+    } else if (!seen.insert({song.hash, song.size}).second) {
+      std::cout << "Skipping " << song.path << ", it is already in the batch\n";
+      ++skipped;
+    } else {
+      songs.push_back(std::move(song));
+    }
+  }
+  return songs;
+}
+
+BatchSong_t SongBatch::load(const std::string &path) {
+  BatchSong_t song{path, 0, 0, nullptr, nullptr, false};
+#if defined(__APPLE__) || defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return song;
+  }
+  struct stat info{};
+  if (fstat(fd, &info) == -1 || info.st_size <= 0 || info.st_size > MAX_FILE_SIZE_BYTES) {
+    close(fd);
+    return song;
+  }
+  song.size = static_cast<std::size_t>(info.st_size);
+  void *address = mmap(nullptr, song.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return song;
+  }
+  inspect(song, static_cast<const unsigned char *>(address), song.size);
+  munmap(address, song.size);
+#else
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return song;
+  }
+  const std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  song.size = bytes.size();
+  if (song.size == 0 || song.size > MAX_FILE_SIZE_BYTES) {
+    return song;
+  }
+  inspect(song, bytes.data(), song.size);
+#endif
+  DEBUG_P(std::cout << "checked " << path << (song.valid ? ", valid\n" : ", not valid\n"));
+  return song;
+}
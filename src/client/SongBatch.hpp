@@ -0,0 +1,66 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Songs from a directory or an M3U playlist, checked and indexed before they are uploaded together
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "../music/FrameIndex.hpp"
+#include "../music/SongMetadata.hpp"
+
+namespace clnt {
+
+/**
+ * @brief A song of a batch, with everything the queue needs about it worked out before it is sent
+*/
+typedef struct {
+  std::string path;
+  std::size_t size;
+  /**
+   * FNV-1a hash of the song, the same song listed twice is only sent once
+  */
+  uint64_t hash;
+  std::shared_ptr<const FrameIndex> frameIndex;
+  std::shared_ptr<const SongMetadata> metadata;
+  /**
+   * false if the file could not be read, is too big or empty, or is not an MP3
+  */
+  bool valid;
+} BatchSong_t;
+
+/**
+ * @brief Turns a directory or a playlist into songs ready to upload. Every file is mapped once, on one of as many
+ * threads as there are cores, and checked with Mp3Validator, hashed, indexed and has its tags read from the mapping.
+ * The uploads that follow then read the files from the cache
+*/
+class SongBatch {
+public:
+
+  /**
+   * @brief list the songs to add
+   * @param path a directory, whose MP3 files are taken in name order, or an M3U playlist, whose entries are taken
+   * in order. Relative entries are relative to the playlist
+   * @returns paths of the songs, empty if there are none or path could not be read
+  */
+  static std::vector<std::string> list(const std::string &path);
+
+  /**
+   * @brief check and index songs in parallel
+   * @param paths from SongBatch::list
+   * @param skipped set to the number of songs dropped, invalid ones and repeats
+   * @returns the valid songs, in the order they were listed
+  */
+  static std::vector<BatchSong_t> prepare(const std::vector<std::string> &paths, std::size_t &skipped);
+
+  /**
+   * @brief check and index one song
+  */
+  static BatchSong_t load(const std::string &path);
+};
+
+}
@@ -0,0 +1,295 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for receiving songs from a room
+*/
+
+#include <algorithm>
+
+#include "SongReceiver.hpp"
+#include "Client.hpp"
+
+using namespace clnt;
+
+SongReceiver::SongReceiver(MusicStorage &queue, int notifyFd, int socketFD):
+  queue{queue}, notifyFd{notifyFd}, socketFD{socketFD}, pool{SONG_RECEIVE_BUFFERS, SONG_RECEIVE_BUFFER_BYTES},
+  pieces{SONG_RECEIVE_BUFFERS * 2}, mutex{}, begun{}, songs{}, nextId{0}, stopping{false}, bytesRead{0},
+  readBack{}, thread{} {}
+
+SongReceiver::~SongReceiver() {
+  stop();
+}
+
+void SongReceiver::start() {
+  if (!thread.joinable()) {
+    thread = std::thread(&SongReceiver::_run, this);
+  }
+}
+
+void SongReceiver::stop() {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  begun.notify_all();
+  pieces.close();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+bool SongReceiver::begin(uint32_t id, MusicStorageEntry *p_entry, uint32_t size) {
+  // decided up front, the song goes to a file in memory or on disk as it arrives
+  if (!queue.reserveStore(p_entry, size)) {
+    std::cerr << "Error: could not store song\n";
+    queue.unpin(p_entry);
+    skip(id);
+    return false;
+  }
+  p_entry->transition(EntryState::RESERVED, EntryState::RECEIVING);
+  {
+    // a player can start on the song before all of it has arrived
+    std::unique_lock<std::mutex> lock{p_entry->streamMutex};
+    p_entry->receiving = true;
+    p_entry->bytesReceived = 0;
+  }
+  auto song = std::make_shared<IncomingSong_t>();
+  song->p_entry = p_entry;
+  song->size = size;
+  song->mapped = MusicStorage::mapStore(p_entry);
+  song->received = 0;
+  song->readers = 0;
+  song->dropped = false;
+  song->failed = false;
+  song->contiguous = 0;
+  song->closed = false;
+  if (size == 0) {
+    // nothing will follow
+    skip(id);
+    return pieces.push({std::move(song), nullptr, 0, 0});
+  }
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    songs[id] = std::move(song);
+    nextId = std::max(nextId, id + 1);
+  }
+  begun.notify_all();
+  return true;
+}
+
+void SongReceiver::skip(uint32_t id) {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    nextId = std::max(nextId, id + 1);
+  }
+  begun.notify_all();
+}
+
+bool SongReceiver::receive(ThreadSafeSocket &socket, uint32_t id, uint32_t offset, uint32_t length, bool &complete) {
+  complete = false;
+  std::shared_ptr<IncomingSong_t> song;
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    begun.wait(lock, [this, id]() {
+      return stopping || id < nextId;
+    });
+    auto entry = songs.find(id);
+    if (entry != songs.end() && offset <= entry->second->size && length <= entry->second->size - offset) {
+      song = entry->second;
+      // counted while the song is in songs, a dropped song is taken out first
+      ++song->readers;
+    }
+  }
+  if (song == nullptr) {
+    // the rest of a song that was removed
+    return _discard(socket, length);
+  }
+  bool read = true;
+  uint32_t done = 0;
+  while (done < length) {
+    // waits here if the writing thread is behind
+    std::byte *buffer = song->mapped != nullptr ? song->mapped + offset + done : pool.acquire();
+    const auto pieceLength = static_cast<uint32_t>(std::min<std::size_t>(length - done, pool.getBufferSize()));
+    if (socket.readAll(buffer, pieceLength) == 0 || !pieces.push({song, buffer, offset + done, pieceLength})) {
+      if (song->mapped == nullptr) {
+        pool.release(buffer);
+      }
+      read = false;
+      break;
+    }
+    done += pieceLength;
+  }
+  if (read) {
+    // a chunk cut short on a lost connection is sent again whole, only whole chunks count
+    bytesRead += length;
+    complete = song->received.fetch_add(length) + length == song->size;
+    if (complete) {
+      std::unique_lock<std::mutex> lock{mutex};
+      songs.erase(id);
+    }
+  }
+  if (--song->readers == 0 && song->dropped) {
+    // the writing thread lets go of the entry once it gets here
+    pieces.push({song, nullptr, 0, 0});
+  }
+  return read;
+}
+
+void SongReceiver::drop(const MusicStorageEntry *p_entry) {
+  std::shared_ptr<IncomingSong_t> song;
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    for (auto entry = songs.begin(); entry != songs.end(); ++entry) {
+      if (entry->second->p_entry == p_entry) {
+        song = entry->second;
+        song->dropped = true;
+        songs.erase(entry);
+        break;
+      }
+    }
+  }
+  if (song == nullptr) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock{song->p_entry->streamMutex};
+    song->p_entry->receiving = false;
+  }
+  if (song->readers == 0) {
+    // otherwise the last connection reading it does this
+    pieces.push({song, nullptr, 0, 0});
+  }
+}
+
+uint64_t SongReceiver::getBytesRead() const {
+  return bytesRead;
+}
+
+bool SongReceiver::isReceiving() {
+  std::unique_lock<std::mutex> lock{mutex};
+  return !songs.empty();
+}
+
+bool SongReceiver::_discard(ThreadSafeSocket &socket, std::size_t length) {
+  std::byte *buffer = pool.acquire();
+  bool read = true;
+  while (read && length > 0) {
+    const std::size_t pieceLength = std::min(length, pool.getBufferSize());
+    read = socket.readAll(buffer, pieceLength) != 0;
+    length -= pieceLength;
+  }
+  pool.release(buffer);
+  return read;
+}
+
+void SongReceiver::_run() {
+  SongPiece_t piece;
+  while (pieces.pop(piece)) {
+    _write(piece);
+    piece = {};
+  }
+}
+
+void SongReceiver::_write(SongPiece_t &piece) {
+  IncomingSong_t &song = *piece.song;
+  MusicStorageEntry *p_entry = song.p_entry;
+  if (piece.buffer != nullptr) {
+    if (!song.closed && !song.dropped) {
+      _store(song, piece);
+    }
+    if (song.mapped == nullptr) {
+      pool.release(piece.buffer);
+    }
+  }
+  if (song.closed) {
+    return;
+  }
+  if (song.dropped) {
+    if (song.readers > 0) {
+      // a connection is still reading into it
+      return;
+    }
+    song.closed = true;
+    if (song.mapped != nullptr) {
+      MusicStorage::unmapStore(p_entry, song.mapped);
+    }
+    queue.unpin(p_entry);
+    return;
+  }
+  if (song.contiguous < song.size) {
+    return;
+  }
+  song.closed = true;
+  if (song.mapped != nullptr) {
+    // a memory file cannot be sealed against writes while it is mapped for writing
+    MusicStorage::unmapStore(p_entry, song.mapped);
+  }
+  {
+    std::unique_lock<std::mutex> lock{p_entry->streamMutex};
+    if (p_entry->streamPlayer != nullptr) {
+      p_entry->streamPlayer->endStream();
+      p_entry->streamPlayer = nullptr;
+    }
+    p_entry->receiving = false;
+  }
+  if (song.failed || !MusicStorage::sealStore(p_entry)) {
+    p_entry->transition(EntryState::RECEIVING, EntryState::RESERVED);
+    std::cerr << "Error: could not store song\n";
+  } else {
+    p_entry->transition(EntryState::RECEIVING, EntryState::READY);
+  }
+  queue.unpin(p_entry);
+  PipeData_t t = { socketFD };
+  ::write(notifyFd, reinterpret_cast<const void *>(&t), sizeof t);
+}
+
+void SongReceiver::_store(IncomingSong_t &song, const SongPiece_t &piece) {
+  MusicStorageEntry *p_entry = song.p_entry;
+  if (song.mapped == nullptr && !song.failed && !MusicStorage::storeChunkAt(p_entry, piece.offset, piece.buffer, piece.length)) {
+    song.failed = true;
+  }
+  const auto end = static_cast<uint32_t>(piece.offset + piece.length);
+  if (piece.offset > song.contiguous) {
+    // waits for the pieces before it
+    uint32_t &aheadEnd = song.ahead[piece.offset];
+    aheadEnd = std::max(aheadEnd, end);
+    return;
+  }
+  const uint32_t from = song.contiguous;
+  song.contiguous = std::max(song.contiguous, end);
+  auto next = song.ahead.begin();
+  while (next != song.ahead.end() && next->first <= song.contiguous) {
+    song.contiguous = std::max(song.contiguous, next->second);
+    next = song.ahead.erase(next);
+  }
+  if (song.contiguous == from) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock{p_entry->streamMutex};
+  // the player gets it even if it could not be written, the song plays on while it is here
+  if (p_entry->streamPlayer != nullptr) {
+    _feed(song, piece, from, song.contiguous);
+  }
+  p_entry->bytesReceived = song.contiguous;
+}
+
+void SongReceiver::_feed(IncomingSong_t &song, const SongPiece_t &piece, uint32_t from, uint32_t to) {
+  Player *player = song.p_entry->streamPlayer;
+  if (song.mapped != nullptr) {
+    player->pushStream(song.mapped + from, to - from);
+    return;
+  }
+  if (piece.offset == from && piece.offset + piece.length == to) {
+    // arrived in order, the usual case
+    player->pushStream(piece.buffer, piece.length);
+    return;
+  }
+  // pieces that were waiting for this one are only in the file now
+  readBack.resize(pool.getBufferSize());
+  for (uint32_t offset = from; offset < to; offset += static_cast<uint32_t>(readBack.size())) {
+    const std::size_t length = std::min<std::size_t>(readBack.size(), to - offset);
+    if (!MusicStorage::readChunk(song.p_entry, offset, readBack.data(), length)) {
+      break;
+    }
+    player->pushStream(readBack.data(), length);
+  }
+}
@@ -0,0 +1,244 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Receives the songs a room sends straight into their queue entries' files
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "../BufferPool.hpp"
+#include "../BoundedQueue.hpp"
+#include "../music/MusicStorage.hpp"
+#include "../socket/ThreadSafeSocket.hpp"
+
+// buffers songs are read into on their way to their files, shared by every song being received
+#define SONG_RECEIVE_BUFFERS 16
+#define SONG_RECEIVE_BUFFER_BYTES 16384
+
+namespace clnt {
+
+/**
+ * @brief A song the room is sending in SONG_CHUNKs
+*/
+typedef struct {
+  /**
+   * the song's entry, pinned until the last piece has been written
+  */
+  MusicStorageEntry *p_entry;
+  uint32_t size;
+  /**
+   * the entry's file mapped by MusicStorage::mapStore, the song is read straight into it. nullptr if it could not
+   * be mapped, the song then goes through the pool and is written to the file
+  */
+  std::byte *mapped;
+  /**
+   * bytes read from the room so far, over any of its connections
+  */
+  std::atomic<uint32_t> received;
+  /**
+   * connections reading a chunk of the song now. A dropped song is let go of once none are
+  */
+  std::atomic<int> readers;
+  /**
+   * set by the main thread when the entry is removed, the rest of the song is not written
+  */
+  std::atomic<bool> dropped;
+  /**
+   * the rest is only used by the writing thread. failed is set when the song could not be written
+  */
+  bool failed;
+  /**
+   * bytes from the start of the song that are in the file, the player has been given these
+  */
+  uint32_t contiguous;
+  /**
+   * pieces in the file past contiguous, offset to end. Pieces from different connections arrive out of order
+  */
+  std::map<uint32_t, uint32_t> ahead;
+  /**
+   * set once the entry has been let go of, pieces still arriving are thrown away
+  */
+  bool closed;
+} IncomingSong_t;
+
+/**
+ * @brief A piece of a song waiting to be written
+*/
+typedef struct {
+  std::shared_ptr<IncomingSong_t> song;
+  /**
+   * buffer from the pool or place in the mapped file holding the piece. nullptr when a dropped song may have
+   * no connections reading it anymore, or for an empty song
+  */
+  std::byte *buffer;
+  /**
+   * where the piece goes in the song
+  */
+  uint32_t offset;
+  std::size_t length;
+} SongPiece_t;
+
+/**
+ * @brief Reads each SONG_CHUNK straight into the song's file where the file can be mapped. Otherwise the chunk
+ * goes into a buffer from a small pool, and a writing thread writes it to its place in the file. Either way the
+ * writing thread passes the song on to a player streaming it, in order, as far as it has arrived without gaps.
+ * A song is never held in memory apart from its file, however large it is or however many arrive at once, the
+ * pool is all the memory used on the way. If the writes fall behind, reading waits for a buffer, which slows the
+ * room down rather than using more memory.
+ * Chunks can be read from the main connection and from any number of data connections at once
+*/
+class SongReceiver {
+private:
+
+  MusicStorage &queue;
+
+  /**
+   * write end of the pipe a clnt::PipeData_t is sent to once each song is in its file
+  */
+  int notifyFd;
+
+  /**
+   * socket of the room, sent through the pipe
+  */
+  int socketFD;
+
+  BufferPool pool;
+
+  BoundedQueue<SongPiece_t> pieces;
+
+  /**
+   * guards songs, nextId and stopping
+  */
+  std::mutex mutex;
+
+  /**
+   * notified when a SONG_BEGIN has been handled or the receiver stops
+  */
+  std::condition_variable begun;
+
+  /**
+   * songs being received, by the stream id from their SONG_BEGIN
+  */
+  std::unordered_map<uint32_t, std::shared_ptr<IncomingSong_t>> songs;
+
+  /**
+   * one past the highest stream id a SONG_BEGIN has been handled for. The room numbers streams in order,
+   * so a chunk with a lower id that is not in songs is for a song no longer being received
+  */
+  uint32_t nextId;
+
+  bool stopping;
+
+  /**
+   * bytes of songs read over every connection, for measuring how fast they arrive
+  */
+  std::atomic<uint64_t> bytesRead;
+
+  /**
+   * read back from a file to give a player pieces that arrived out of order, only used by the writing thread
+  */
+  std::vector<std::byte> readBack;
+
+  std::thread thread;
+
+  /**
+   * @brief loop of the writing thread
+  */
+  void _run();
+
+  /**
+   * @brief write a piece, and once the song is complete seal its file and tell the main thread
+  */
+  void _write(SongPiece_t &piece);
+
+  /**
+   * @brief write a piece to its place in the file and give a player what is now there without gaps
+  */
+  void _store(IncomingSong_t &song, const SongPiece_t &piece);
+
+  /**
+   * @brief give a streaming player bytes of a song that are in its file, with the entry's streamMutex held
+  */
+  void _feed(IncomingSong_t &song, const SongPiece_t &piece, uint32_t from, uint32_t to);
+
+  /**
+   * @brief read and throw away bytes of a song that is not being received
+   * @returns false if the connection was lost
+  */
+  bool _discard(ThreadSafeSocket &socket, std::size_t length);
+
+public:
+
+  /**
+   * @param queue queue the songs' entries are in
+   * @param notifyFd write end of the pipe told about each song stored
+   * @param socketFD socket of the room
+  */
+  SongReceiver(MusicStorage &queue, int notifyFd, int socketFD);
+
+  SongReceiver(const SongReceiver &) = delete;
+
+  ~SongReceiver();
+
+  /**
+   * @brief start the writing thread
+  */
+  void start();
+
+  /**
+   * @brief stop the writing thread once the pieces already read have been written. Connections reading
+   * chunks stop waiting for songs to begin, their chunks can no longer be received
+  */
+  void stop();
+
+  /**
+   * @brief get ready to receive a song into an entry
+   * @param id stream id from the SONG_BEGIN
+   * @param p_entry the song's entry, pinned, with a temp file. The receiver unpins it
+   * @param size size of the song
+   * @returns false if the entry cannot be written to, its chunks are then skipped
+  */
+  bool begin(uint32_t id, MusicStorageEntry *p_entry, uint32_t size);
+
+  /**
+   * @brief note a SONG_BEGIN whose song will not be received, its chunks are then skipped
+  */
+  void skip(uint32_t id);
+
+  /**
+   * @brief read a SONG_CHUNK's data from the room and queue it to be written. A chunk that came over a data
+   * connection before its song's SONG_BEGIN came over the main connection waits for it
+   * @param socket connection the chunk is on
+   * @param offset where the data goes in the song
+   * @param length bytes of data
+   * @param complete set to true if this was the last of the song to arrive
+   * @returns false if the connection was lost
+  */
+  bool receive(ThreadSafeSocket &socket, uint32_t id, uint32_t offset, uint32_t length, bool &complete);
+
+  /**
+   * @brief bytes of songs read so far over every connection
+  */
+  [[nodiscard]] uint64_t getBytesRead() const;
+
+  /**
+   * @brief whether any song is still arriving
+  */
+  [[nodiscard]] bool isReceiving();
+
+  /**
+   * @brief stop receiving the song for an entry that was removed, if it is still arriving
+  */
+  void drop(const MusicStorageEntry *p_entry);
+};
+
+}
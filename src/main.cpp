@@ -6,6 +6,7 @@
 
 #include <iostream>
 #include <unordered_map>
+#include <csignal>
 
 #include "./room/Room.hpp"
 #include "./client/Client.hpp"
@@ -82,8 +83,48 @@ const std::unordered_map<std::string, Command> commandMap = {
   {"join room", Command::JOIN_ROOM},
 };
 
-int main() {
+/**
+ * Run a room without prompts, for `main room [--setting value]...`
+ * @param argc number of arguments after "room"
+ * @param argv the arguments after "room"
+ * @return exit code of the program
+*/
+int runHeadlessRoom(int argc, char **argv) {
+  const int64_t begin = steadyClockUs();
+  RoomConfig_t config;
+  if (argc == 1 && std::string{argv[0]} == "--help") {
+    showRoomConfigHelp();
+    return 0;
+  }
+  if (!parseRoomConfig(argc, argv, config)) {
+    std::cerr << "Try 'main room --help' for the settings\n";
+    return 1;
+  }
+#if defined(__APPLE__) || defined(__unix__)
+  // a listener or control connection hanging up mid write is handled where the write fails
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  room::Room room{config};
+  if (!room.initializeRoom()) {
+    return 1;
+  }
+  std::cout << "Listening on " << config.host << ':' << config.port << ", control socket " << config.controlPath <<
+    ", ready in " << static_cast<double>(steadyClockUs() - begin) / 1000 << " ms\n";
+  std::cout.flush();
+  return room.launchRoom() ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
   winSocketInitialize();
+  if (argc > 1 && std::string{argv[1]} == "room") {
+    const int code = runHeadlessRoom(argc - 2, argv + 2);
+    closeWinSocket();
+    return code;
+  }
+  if (argc > 1) {
+    std::cerr << "Usage: main, or main room [--setting value]... to run a room without prompts\n";
+    return 1;
+  }
   std::string input;
   while (true) {
     std::cout << " >> ";
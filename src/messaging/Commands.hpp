@@ -39,12 +39,13 @@ enum class Command : std::underlying_type_t<std::byte> {
     /* message contains song data
      * should only be sent if received an ok after REQ_ADD_TO_QUEUE
      * example: SONG_DATA <option byte> <4 bytes size of body> <body>
-     * can also be sent by room to a client at anytime
+     * the room sends songs to clients as SONG_BEGIN and SONG_CHUNK instead
     */
     SONG_DATA,
 
     /**
      * play the next song in queue, sent from server to clients
+     * example: PLAY_NEXT <option byte> <4 bytes size of body> <8 bytes wall clock time the song started at in ms>
     */
     PLAY_NEXT,
 
@@ -61,7 +62,80 @@ enum class Command : std::underlying_type_t<std::byte> {
 
     GOOD_MSG, /* Says the return was good */
     BAD_FORMAT, /* Says the format was bad */
-    BAD_VALUES /* Values given to the recipient were bad or did not make sense */
+    BAD_VALUES, /* Values given to the recipient were bad or did not make sense */
+
+    /**
+     * sent periodically by the room while a song plays so clients can correct drift
+     * example: POSITION_BEACON <option byte> <4 bytes size of body> <8 bytes room time in ms> <8 bytes position in ms>
+    */
+    POSITION_BEACON,
+
+    /**
+     * sent by a client that got PLAY_NEXT before the song and started it once the song arrived
+     * example: PLAYBACK_LATE <option byte> <4 bytes size of body> <8 bytes how late the start was in ms>
+    */
+    PLAYBACK_LATE,
+
+    /**
+     * offsets of a song's MP3 frames, sent by the room right before the song's SONG_BEGIN
+     * example: FRAME_INDEX <queue position> <4 bytes size of body> <4 bytes step> <4 bytes sample rate>
+     *          <4 bytes samples per frame> <8 bytes frames> <8 bytes per offset>
+    */
+    FRAME_INDEX,
+
+    /**
+     * title, artist, album and length of a song, sent by the room right before the song's SONG_BEGIN
+     * example: QUEUE_METADATA <queue position> <4 bytes size of body> <8 bytes length in ms>
+     *          <1 byte title length> <title> <1 byte artist length> <artist> <1 byte album length> <album>
+    */
+    QUEUE_METADATA,
+
+    /**
+     * gain that brings a song to the loudness target, sent by the room once it has measured the song,
+     * or right before the song's SONG_BEGIN if it already has
+     * example: ENTRY_GAIN <queue position> <4 bytes size of body> <4 bytes float gain in dB>
+    */
+    ENTRY_GAIN,
+
+    /**
+     * a song the room is about to send to a client in SONG_CHUNKs, ties a stream id to the queue entry.
+     * Other messages, and chunks of other songs, can come between its chunks
+     * example: SONG_BEGIN <queue position> <4 bytes size of body> <4 bytes stream id> <4 bytes size of the song>
+    */
+    SONG_BEGIN,
+
+    /**
+     * a piece of a song started with SONG_BEGIN. The pieces of one song come in order on one connection,
+     * but pieces sent over a client's data connections can arrive in any order
+     * example: SONG_CHUNK <option byte> <4 bytes size of body> <4 bytes stream id> <4 bytes offset in the song> <data>
+    */
+    SONG_CHUNK,
+
+    /**
+     * sent by the room to a client that joins, lets the client open data connections to the room's data port
+     * example: SESSION_TOKEN <option byte> <4 bytes size of body> <8 bytes token> <2 bytes data port>
+    */
+    SESSION_TOKEN,
+
+    /**
+     * the first message on a client's data connection, the room then sends it SONG_CHUNKs alongside the main connection
+     * example: DATA_CONNECTION <option byte> <4 bytes size of body> <8 bytes token from SESSION_TOKEN>
+    */
+    DATA_CONNECTION,
+
+    /**
+     * client asks the room for a queue slot for each of several songs at once. The songs are then sent one after
+     * another as SONG_DATA without waiting in between
+     * example: REQ_ADD_BATCH_TO_QUEUE <number of songs> <4 bytes size of body>
+    */
+    REQ_ADD_BATCH_TO_QUEUE,
+
+    /**
+     * the slots the room reserved for a REQ_ADD_BATCH_TO_QUEUE, fewer than asked for if the queue filled up and none
+     * if the room is not allowing uploads. Each SONG_DATA fills the next slot, a CANCEL_REQ_ADD_TO_QUEUE gives it up
+     * example: RES_ADD_BATCH_TO_QUEUE <option byte> <4 bytes size of body> <1 byte queue position per slot>
+    */
+    RES_ADD_BATCH_TO_QUEUE
 };
 
 
@@ -69,4 +143,7 @@ enum class Command : std::underlying_type_t<std::byte> {
 /* They will start with the command name then the option */
 #define JOIN_NAME (std::byte)1 /* With this option, a name should be in the body as a null terminated string */
 
+/* data connections a client can have to the room on top of its main connection */
+#define MAX_DATA_CONNECTIONS 7
+
 }
@@ -0,0 +1,220 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for audio sinks
+*/
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <mpg123.h>
+
+#include "AudioSink.hpp"
+#include "../Clock.hpp"
+
+// size of a WAV header for PCM, the data follows it
+#define WAV_HEADER_BYTES 44
+
+std::unique_ptr<AudioSink> AudioSink::create(const std::string &driver, const std::string &device) {
+  if (driver == "none") {
+    return std::make_unique<NullSink>();
+  }
+  if (driver == "wav") {
+    return std::make_unique<WavSink>(device);
+  }
+  return std::make_unique<Out123Sink>(driver, device);
+}
+
+NullSink::NullSink(): rate{0}, frameSize{0}, nextUs{0}, frames{0}, lastWallMs{0} {}
+
+bool NullSink::start(long newRate, int channels, int encoding) {
+  if (newRate <= 0 || channels <= 0) {
+    return false;
+  }
+  rate = newRate;
+  frameSize = static_cast<std::size_t>(channels * mpg123_encsize(encoding));
+  return frameSize > 0;
+}
+
+std::size_t NullSink::play(const void *, std::size_t bytes) {
+  if (frameSize == 0) {
+    return 0;
+  }
+  const std::size_t count = bytes / frameSize;
+  const int64_t now = steadyClockUs();
+  // nothing was playing, start from now rather than catching up on the silence
+  if (nextUs < now) {
+    nextUs = now;
+  }
+  nextUs += static_cast<int64_t>(count) * 1000000 / rate;
+  frames += count;
+  lastWallMs = wallClockMs() + (nextUs - now) / 1000;
+  // a device takes audio as fast as it plays it
+  std::this_thread::sleep_for(std::chrono::microseconds(nextUs - now));
+  return count * frameSize;
+}
+
+void NullSink::setMuted(bool) {}
+
+bool NullSink::getTimestamp(SinkTimestamp_t &timestamp) const {
+  timestamp = {frames, lastWallMs};
+  return true;
+}
+
+const char *NullSink::name() const {
+  return "none";
+}
+
+WavSink::WavSink(std::string path):
+  clock{}, path{std::move(path)}, file{nullptr}, files{0}, rate{0}, channels{0}, dataBytes{0}, muted{false} {}
+
+WavSink::~WavSink() {
+  _finish();
+}
+
+/**
+ * @brief write a little endian number of some bytes into a buffer
+*/
+static void putLittleEndian(unsigned char *p_out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    p_out[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+}
+
+void WavSink::_finish() {
+  if (file == nullptr) {
+    return;
+  }
+  const uint32_t bytesPerSample = 2;
+  unsigned char header[WAV_HEADER_BYTES];
+  std::memcpy(header, "RIFF", 4);
+  putLittleEndian(header + 4, WAV_HEADER_BYTES - 8 + dataBytes, 4);
+  std::memcpy(header + 8, "WAVEfmt ", 8);
+  putLittleEndian(header + 16, 16, 4);
+  // 1 is integer PCM
+  putLittleEndian(header + 20, 1, 2);
+  putLittleEndian(header + 22, static_cast<uint32_t>(channels), 2);
+  putLittleEndian(header + 24, static_cast<uint32_t>(rate), 4);
+  putLittleEndian(header + 28, static_cast<uint32_t>(rate) * static_cast<uint32_t>(channels) * bytesPerSample, 4);
+  putLittleEndian(header + 32, static_cast<uint32_t>(channels) * bytesPerSample, 2);
+  putLittleEndian(header + 34, bytesPerSample * 8, 2);
+  std::memcpy(header + 36, "data", 4);
+  putLittleEndian(header + 40, dataBytes, 4);
+  fseek(file, 0, SEEK_SET);
+  fwrite(header, 1, sizeof header, file);
+  fclose(file);
+  file = nullptr;
+}
+
+bool WavSink::start(long newRate, int newChannels, int encoding) {
+  // the player always decodes to signed 16 bit, that is all the header is written for
+  if (encoding != MPG123_ENC_SIGNED_16 || !clock.start(newRate, newChannels, encoding)) {
+    return false;
+  }
+  if (file != nullptr && newRate == rate && newChannels == channels) {
+    return true;
+  }
+  _finish();
+  std::string name = path;
+  if (files > 0) {
+    const std::size_t extension = name.size() >= 4 && name.compare(name.size() - 4, 4, ".wav") == 0 ? name.size() - 4 : name.size();
+    name = name.substr(0, extension) + '-' + std::to_string(files) + ".wav";
+  }
+  file = fopen(name.c_str(), "wb");
+  if (file == nullptr) {
+    fprintf(stderr, "fopen: %s (%d)\n", strerror(errno), errno);
+    return false;
+  }
+  ++files;
+  rate = newRate;
+  channels = newChannels;
+  dataBytes = 0;
+  // room for the header, written once the size is known
+  const unsigned char blank[WAV_HEADER_BYTES] = {};
+  fwrite(blank, 1, sizeof blank, file);
+  return true;
+}
+
+std::size_t WavSink::play(const void *data, std::size_t bytes) {
+  if (file == nullptr) {
+    return 0;
+  }
+  if (muted) {
+    const std::vector<unsigned char> silence(bytes);
+    fwrite(silence.data(), 1, bytes, file);
+  } else {
+    fwrite(data, 1, bytes, file);
+  }
+  dataBytes += static_cast<uint32_t>(bytes);
+  return clock.play(data, bytes);
+}
+
+void WavSink::setMuted(bool mute) {
+  muted = mute;
+}
+
+bool WavSink::getTimestamp(SinkTimestamp_t &timestamp) const {
+  return clock.getTimestamp(timestamp);
+}
+
+const char *WavSink::name() const {
+  return "wav";
+}
+
+Out123Sink::Out123Sink(std::string driver, std::string device):
+  driver{std::move(driver)}, device{std::move(device)}, ao{out123_new()}, opened{false}, failed{false}, fallback{} {
+  if (ao == nullptr) {
+    std::cerr << "Error: out123 library failed, playing without audio output\n";
+    failed = true;
+  }
+}
+
+Out123Sink::~Out123Sink() {
+  if (ao != nullptr) {
+    out123_del(ao);
+  }
+}
+
+bool Out123Sink::start(long rate, int channels, int encoding) {
+  if (!failed && !opened) {
+    // opened here rather than when the player is made, so a room or listener that never plays needs no sound card
+    if (out123_open(ao, driver.empty() ? nullptr : driver.c_str(), device.empty() ? nullptr : device.c_str()) != OUT123_OK) {
+      std::cout << "err: " << out123_strerror(ao) << ", playing without audio output\n";
+      failed = true;
+    }
+    opened = !failed;
+  }
+  if (failed) {
+    return fallback.start(rate, channels, encoding);
+  }
+  if (out123_start(ao, rate, channels, encoding) != OUT123_OK) {
+    std::cout << "err: " << out123_strerror(ao) << '\n';
+    return false;
+  }
+  return true;
+}
+
+std::size_t Out123Sink::play(const void *data, std::size_t bytes) {
+  if (failed) {
+    return fallback.play(data, bytes);
+  }
+  return out123_play(ao, const_cast<void *>(data), bytes);
+}
+
+void Out123Sink::setMuted(bool muted) {
+  if (ao != nullptr) {
+    out123_param(ao, muted ? OUT123_ADD_FLAGS : OUT123_REMOVE_FLAGS, OUT123_MUTE, 0, nullptr);
+  }
+}
+
+bool Out123Sink::getTimestamp(SinkTimestamp_t &timestamp) const {
+  // out123 does not say when the device plays what it was given
+  return failed && fallback.getTimestamp(timestamp);
+}
+
+const char *Out123Sink::name() const {
+  return failed ? "none (out123 could not be opened)" : "out123";
+}
@@ -0,0 +1,180 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Where the player's decoded audio goes: a sound card, nowhere, or a WAV file
+ */
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+
+#include <out123.h>
+
+/**
+ * @brief When audio handed to a sink plays
+*/
+typedef struct {
+  /**
+   * sample frames handed to the sink since it was made
+  */
+  uint64_t frames;
+  /**
+   * wall clock time in ms at which the last of those frames finishes playing
+  */
+  int64_t wallMs;
+} SinkTimestamp_t;
+
+/**
+ * @brief An output for decoded audio. The player's output thread is the only one to call AudioSink::start and
+ * AudioSink::play, the rest can be called from any thread
+*/
+class AudioSink {
+public:
+
+  virtual ~AudioSink() = default;
+
+  /**
+   * @brief get ready to play audio in a format. Called before the first AudioSink::play and whenever the format
+   * changes, a sink that needs a device opens it the first time
+   * @param rate sample rate
+   * @param channels number of channels
+   * @param encoding mpg123 encoding of the samples
+   * @return false if the audio cannot be played
+  */
+  virtual bool start(long rate, int channels, int encoding) = 0;
+
+  /**
+   * @brief play whole sample frames, blocks until the sink has taken them
+   * @return bytes played
+  */
+  virtual std::size_t play(const void *data, std::size_t bytes) = 0;
+
+  virtual void setMuted(bool muted) = 0;
+
+  /**
+   * @brief find out when the audio handed to the sink so far finishes playing
+   * @return false if the sink does not know
+  */
+  virtual bool getTimestamp(SinkTimestamp_t &timestamp) const = 0;
+
+  /**
+   * @return name of the sink for printing
+  */
+  [[nodiscard]] virtual const char *name() const = 0;
+
+  /**
+   * @brief make a sink, nothing is opened until the first AudioSink::start
+   * @param driver "none" for a NullSink, "wav" for a WavSink writing to device, otherwise an out123 driver,
+   * empty for out123's default
+   * @param device device for the out123 driver, or the WAV file's path
+  */
+  static std::unique_ptr<AudioSink> create(const std::string &driver, const std::string &device);
+};
+
+/**
+ * @brief Throws audio away at the pace it would have played at, keeping track of when each frame would have played.
+ * Lets a room run without a sound card and many simulated listeners run on one machine
+*/
+class NullSink : public AudioSink {
+private:
+
+  long rate;
+  std::size_t frameSize;
+
+  /**
+   * steady clock time in us at which the audio taken so far finishes playing
+  */
+  int64_t nextUs;
+
+  std::atomic<uint64_t> frames;
+  std::atomic<int64_t> lastWallMs;
+
+public:
+
+  NullSink();
+
+  bool start(long rate, int channels, int encoding) override;
+  std::size_t play(const void *data, std::size_t bytes) override;
+  void setMuted(bool muted) override;
+  bool getTimestamp(SinkTimestamp_t &timestamp) const override;
+  [[nodiscard]] const char *name() const override;
+};
+
+/**
+ * @brief Writes audio to a 16 bit PCM WAV file at the pace it would have played at, so the file holds what a
+ * listener would have heard, drift corrections included. A format change starts a new file, path-1.wav, path-2.wav...
+*/
+class WavSink : public AudioSink {
+private:
+
+  /**
+   * paces the writes and keeps the timestamps
+  */
+  NullSink clock;
+
+  std::string path;
+  FILE *file;
+  /**
+   * files started so far
+  */
+  int files;
+  long rate;
+  int channels;
+  uint32_t dataBytes;
+  std::atomic<bool> muted;
+
+  /**
+   * @brief write the sizes into the header of the current file and close it
+  */
+  void _finish();
+
+public:
+
+  explicit WavSink(std::string path);
+
+  WavSink(const WavSink &) = delete;
+
+  ~WavSink() override;
+
+  bool start(long rate, int channels, int encoding) override;
+  std::size_t play(const void *data, std::size_t bytes) override;
+  void setMuted(bool muted) override;
+  bool getTimestamp(SinkTimestamp_t &timestamp) const override;
+  [[nodiscard]] const char *name() const override;
+};
+
+/**
+ * @brief Plays through out123. The device is opened on the first AudioSink::start rather than when the sink is made,
+ * and if it cannot be opened the audio goes to a NullSink instead so playback and its timing carry on
+*/
+class Out123Sink : public AudioSink {
+private:
+
+  std::string driver;
+  std::string device;
+  out123_handle *ao;
+  bool opened;
+  /**
+   * set if the device could not be opened, fallback plays from then on
+  */
+  std::atomic<bool> failed;
+  NullSink fallback;
+
+public:
+
+  Out123Sink(std::string driver, std::string device);
+
+  Out123Sink(const Out123Sink &) = delete;
+
+  ~Out123Sink() override;
+
+  bool start(long rate, int channels, int encoding) override;
+  std::size_t play(const void *data, std::size_t bytes) override;
+  void setMuted(bool muted) override;
+  bool getTimestamp(SinkTimestamp_t &timestamp) const override;
+  [[nodiscard]] const char *name() const override;
+};
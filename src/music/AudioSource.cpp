@@ -0,0 +1,131 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for audio source class
+*/
+
+#include <cstdio>
+#include <cstring>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "AudioSource.hpp"
+
+AudioSource::AudioSource(): path{}, music{}, data{nullptr}, size{0}, position{0}, mapped{false}, frameIndex{}, gain{1} {}
+
+AudioSource::~AudioSource() {
+#if defined(__APPLE__) || defined(__unix__)
+  if (mapped) {
+    munmap(const_cast<unsigned char *>(data), size);
+  }
+#endif
+}
+
+std::unique_ptr<AudioSource> AudioSource::fromPath(const std::string &path) {
+  std::unique_ptr<AudioSource> source{new AudioSource()};
+  source->path = path;
+  return source;
+}
+
+std::unique_ptr<AudioSource> AudioSource::fromMemory(std::shared_ptr<const Music> music) {
+  std::unique_ptr<AudioSource> source{new AudioSource()};
+  source->data = reinterpret_cast<const unsigned char *>(music->getVector().data());
+  source->size = music->getVector().size();
+  source->music = std::move(music);
+  return source;
+}
+
+std::unique_ptr<AudioSource> AudioSource::fromMappedFile(const std::string &path) {
+#if defined(__APPLE__) || defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return fromPath(path);
+  }
+  struct stat info{};
+  if (fstat(fd, &info) == -1 || info.st_size <= 0) {
+    close(fd);
+    return fromPath(path);
+  }
+  void *address = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the file descriptor is closed
+  close(fd);
+  if (address == MAP_FAILED) {
+    return fromPath(path);
+  }
+  std::unique_ptr<AudioSource> source{new AudioSource()};
+  source->path = path;
+  source->data = static_cast<const unsigned char *>(address);
+  source->size = static_cast<std::size_t>(info.st_size);
+  source->mapped = true;
+  return source;
+#else
+  return fromPath(path);
+#endif
+}
+
+void AudioSource::installReader(mpg123_handle *handle) {
+  mpg123_replace_reader_handle(handle, &AudioSource::readCallback, &AudioSource::seekCallback, nullptr);
+}
+
+bool AudioSource::open(mpg123_handle *handle) {
+  position = 0;
+  const int err = data == nullptr ? mpg123_open(handle, path.c_str()) : mpg123_open_handle(handle, this);
+  if (err != MPG123_OK) {
+    std::cout << "err: " << mpg123_strerror(handle) << '\n';
+    return false;
+  }
+  if (frameIndex != nullptr) {
+    // without a table mpg123 has to scan up to the seek target, or guess from the bitrate for VBR files
+    frameIndex->apply(handle);
+  }
+  return true;
+}
+
+void AudioSource::setFrameIndex(std::shared_ptr<const FrameIndex> index) {
+  frameIndex = std::move(index);
+}
+
+void AudioSource::setGain(float linear) {
+  gain = linear;
+}
+
+float AudioSource::getGain() const {
+  return gain;
+}
+
+ssize_t AudioSource::readCallback(void *handle, void *buffer, std::size_t count) {
+  auto *source = static_cast<AudioSource *>(handle);
+  const std::size_t left = source->size - source->position;
+  const std::size_t n = count < left ? count : left;
+  memcpy(buffer, source->data + source->position, n);
+  source->position += n;
+  return static_cast<ssize_t>(n);
+}
+
+off_t AudioSource::seekCallback(void *handle, off_t offset, int whence) {
+  auto *source = static_cast<AudioSource *>(handle);
+  off_t target;
+  switch (whence) {
+    case SEEK_SET:
+      target = offset;
+      break;
+    case SEEK_CUR:
+      target = static_cast<off_t>(source->position) + offset;
+      break;
+    case SEEK_END:
+      target = static_cast<off_t>(source->size) + offset;
+      break;
+    default:
+      return -1;
+  }
+  if (target < 0 || static_cast<std::size_t>(target) > source->size) {
+    return -1;
+  }
+  source->position = static_cast<std::size_t>(target);
+  return target;
+}
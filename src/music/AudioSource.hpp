@@ -0,0 +1,118 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Where the player reads a song from: a file path, a buffer in memory, or a memory mapped file
+ */
+
+#pragma once
+
+#include <mpg123.h>
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <sys/types.h>
+
+#include "Music.hpp"
+#include "FrameIndex.hpp"
+
+/**
+ * @brief A song for mpg123 to decode. Buffers are decoded in place through mpg123_open_handle,
+ * so a song that is already in memory is never written to disk and read back
+*/
+class AudioSource {
+private:
+
+  /**
+   * file path, used when the song is neither in memory nor mapped
+  */
+  std::string path;
+
+  /**
+   * keeps an in memory song alive while it is being decoded
+  */
+  std::shared_ptr<const Music> music;
+
+  /**
+   * start of the bytes to decode, nullptr for a path
+  */
+  const unsigned char *data;
+
+  /**
+   * number of bytes at data
+  */
+  std::size_t size;
+
+  /**
+   * read position in data
+  */
+  std::size_t position;
+
+  /**
+   * true if data was mapped by this object and has to be unmapped
+  */
+  bool mapped;
+
+  /**
+   * frame offsets given to mpg123 when the source is opened, nullptr to let mpg123 build its own
+  */
+  std::shared_ptr<const FrameIndex> frameIndex;
+
+  /**
+   * linear gain that brings the song to the loudness target, 1 if it has not been measured
+  */
+  float gain;
+
+  AudioSource();
+
+  /**
+   * reader callbacks given to mpg123_replace_reader_handle, the handle is the AudioSource
+  */
+  static ssize_t readCallback(void *handle, void *buffer, std::size_t count);
+  static off_t seekCallback(void *handle, off_t offset, int whence);
+
+public:
+
+  AudioSource(const AudioSource &) = delete;
+
+  ~AudioSource();
+
+  /**
+   * @brief decode a file by path, mpg123 reads it itself
+  */
+  static std::unique_ptr<AudioSource> fromPath(const std::string &path);
+
+  /**
+   * @brief decode a song that is in memory
+  */
+  static std::unique_ptr<AudioSource> fromMemory(std::shared_ptr<const Music> music);
+
+  /**
+   * @brief map a file into memory and decode it from there, falls back to fromPath if it cannot be mapped
+  */
+  static std::unique_ptr<AudioSource> fromMappedFile(const std::string &path);
+
+  /**
+   * @brief point a mpg123 handle's reader at AudioSource objects, call once per handle
+  */
+  static void installReader(mpg123_handle *handle);
+
+  /**
+   * @brief give mpg123 a prebuilt frame index when the source is opened
+  */
+  void setFrameIndex(std::shared_ptr<const FrameIndex> index);
+
+  /**
+   * @brief set the linear gain the player applies to this song
+  */
+  void setGain(float linear);
+
+  /**
+   * @return linear gain the player applies to this song
+  */
+  [[nodiscard]] float getGain() const;
+
+  /**
+   * @brief open this source on a mpg123 handle. The source must outlive its use by the handle
+   * @return true on success
+  */
+  bool open(mpg123_handle *handle);
+};
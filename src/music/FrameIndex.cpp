@@ -0,0 +1,381 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the MP3 frame index
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "../debug.hpp"
+#include "FrameIndex.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_INDEX_X86 1
+#else
+#define FRAME_INDEX_X86 0
+#endif
+
+// bytes in front of the offsets in a serialized index
+#define FRAME_INDEX_HEADER_BYTES 20
+
+// kbps by [MPEG 1, MPEG 2/2.5][layer - 1][bitrate index]
+static const uint16_t BITRATES[2][3][16] = {
+  {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0}
+  },
+  {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}
+  }
+};
+
+// Hz by [version bits][sample rate index], version bits 1 is reserved
+static const uint32_t SAMPLE_RATES[4][3] = {
+  {11025, 12000, 8000},
+  {0, 0, 0},
+  {22050, 24000, 16000},
+  {44100, 48000, 32000}
+};
+
+/**
+ * sync scan: a byte of 0xFF followed by a byte with its top 3 bits set
+*/
+
+static std::size_t findSyncScalar(const unsigned char *data, std::size_t size, std::size_t from) {
+  for (std::size_t i = from; i + 1 < size; ++i) {
+    if (data[i] == 0xFF && (data[i + 1] & 0xE0) == 0xE0) {
+      return i;
+    }
+  }
+  return size;
+}
+
+#if FRAME_INDEX_X86
+
+/**
+ * SSE2 version, checks 16 positions at a time by comparing the bytes and the bytes one over
+*/
+__attribute__((target("sse2")))
+static std::size_t findSyncSse2(const unsigned char *data, std::size_t size, std::size_t from) {
+  const __m128i ones = _mm_set1_epi8(static_cast<char>(0xFF));
+  const __m128i top = _mm_set1_epi8(static_cast<char>(0xE0));
+  std::size_t i = from;
+  for (; i + 17 <= size; i += 16) {
+    const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 1));
+    const __m128i hits = _mm_and_si128(
+      _mm_cmpeq_epi8(first, ones),
+      _mm_cmpeq_epi8(_mm_and_si128(second, top), top)
+    );
+    const unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(hits));
+    if (bits != 0) {
+      return i + static_cast<std::size_t>(__builtin_ctz(bits));
+    }
+  }
+  return findSyncScalar(data, size, i);
+}
+
+/**
+ * AVX2 version, 32 positions at a time
+*/
+__attribute__((target("avx2")))
+static std::size_t findSyncAvx2(const unsigned char *data, std::size_t size, std::size_t from) {
+  const __m256i ones = _mm256_set1_epi8(static_cast<char>(0xFF));
+  const __m256i top = _mm256_set1_epi8(static_cast<char>(0xE0));
+  std::size_t i = from;
+  for (; i + 33 <= size; i += 32) {
+    const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    const __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1));
+    const __m256i hits = _mm256_and_si256(
+      _mm256_cmpeq_epi8(first, ones),
+      _mm256_cmpeq_epi8(_mm256_and_si256(second, top), top)
+    );
+    const unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+    if (bits != 0) {
+      return i + static_cast<std::size_t>(__builtin_ctz(bits));
+    }
+  }
+  return findSyncScalar(data, size, i);
+}
+
+#endif
+
+/**
+ * the sync scan picked for this CPU
+*/
+typedef struct {
+  std::size_t (*findSync)(const unsigned char *, std::size_t, std::size_t);
+  const char *name;
+} SyncKernel_t;
+
+static SyncKernel_t pickKernel() {
+#if FRAME_INDEX_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return {&findSyncAvx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {&findSyncSse2, "sse2"};
+  }
+#endif
+  return {&findSyncScalar, "scalar"};
+}
+
+static const SyncKernel_t &kernel() {
+  static const SyncKernel_t picked = pickKernel();
+  return picked;
+}
+
+/**
+ * @return true if the frame holds a Xing, Info or VBRI header instead of audio
+*/
+static bool isInfoFrame(const unsigned char *frame, const Mp3Header_t &header) {
+  // the tag follows the side information, whose size depends on the version and channel count
+  std::size_t offset = 4 + (header.crc ? 2 : 0);
+  if (header.mpeg1) {
+    offset += header.channels == 1 ? 17 : 32;
+  } else {
+    offset += header.channels == 1 ? 9 : 17;
+  }
+  if (offset + 4 <= header.frameBytes) {
+    const unsigned char *tag = frame + offset;
+    if (std::equal(tag, tag + 4, "Xing") || std::equal(tag, tag + 4, "Info")) {
+      return true;
+    }
+  }
+  return 40 <= header.frameBytes && std::equal(frame + 36, frame + 40, "VBRI");
+}
+
+FrameIndex::FrameIndex(): offsets{}, step{1}, frames{0}, sampleRate{0}, samplesPerFrame{0} {}
+
+bool FrameIndex::parseHeader(const unsigned char *p, Mp3Header_t &header) {
+  if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) {
+    return false;
+  }
+  const unsigned version = (p[1] >> 3) & 3;
+  const unsigned layerBits = (p[1] >> 1) & 3;
+  const unsigned bitrateIndex = p[2] >> 4;
+  const unsigned rateIndex = (p[2] >> 2) & 3;
+  // bitrate index 0 is free format, the frame length cannot be worked out from the header
+  if (version == 1 || layerBits == 0 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3) {
+    return false;
+  }
+  const unsigned layer = 4 - layerBits;
+  header.mpeg1 = version == 3;
+  header.layer = layer;
+  header.sampleRate = SAMPLE_RATES[version][rateIndex];
+  header.channels = (p[3] >> 6) == 3 ? 1 : 2;
+  header.crc = (p[1] & 1) == 0;
+  const uint32_t bitrate = BITRATES[header.mpeg1 ? 0 : 1][layer - 1][bitrateIndex] * 1000u;
+  const uint32_t padding = (p[2] >> 1) & 1u;
+  if (layer == 1) {
+    header.samples = 384;
+    header.frameBytes = (12 * bitrate / header.sampleRate + padding) * 4;
+  } else {
+    header.samples = layer == 3 && !header.mpeg1 ? 576 : 1152;
+    header.frameBytes = header.samples / 8 * bitrate / header.sampleRate + padding;
+  }
+  return header.frameBytes > 4;
+}
+
+std::size_t FrameIndex::findSync(const unsigned char *data, std::size_t size, std::size_t from) {
+  return kernel().findSync(data, size, from);
+}
+
+std::size_t FrameIndex::id3v2Size(const unsigned char *data, std::size_t size) {
+  if (size < 10 || data[0] != 'I' || data[1] != 'D' || data[2] != '3') {
+    return 0;
+  }
+  // the size is stored in 4 bytes of 7 bits each
+  std::size_t tagSize = 0;
+  for (std::size_t i = 6; i < 10; ++i) {
+    if (data[i] & 0x80) {
+      return 0;
+    }
+    tagSize = (tagSize << 7) | data[i];
+  }
+  // header, and a footer if the flag for one is set
+  tagSize += 10 + ((data[5] & 0x10) ? 10 : 0);
+  return tagSize < size ? tagSize : size;
+}
+
+std::shared_ptr<const FrameIndex> FrameIndex::build(const unsigned char *data, std::size_t size) {
+  std::shared_ptr<FrameIndex> index{new FrameIndex()};
+  std::size_t position = 0;
+  // some files have more than one tag in front
+  for (std::size_t tag = id3v2Size(data, size); tag != 0; tag = id3v2Size(data + position, size - position)) {
+    position += tag;
+  }
+  bool haveFirst = false;
+  while (true) {
+    position = findSync(data, size, position);
+    Mp3Header_t header{};
+    if (position + 4 > size) {
+      break;
+    }
+    if (!parseHeader(data + position, header) || position + header.frameBytes > size) {
+      ++position;
+      continue;
+    }
+    if (!haveFirst) {
+      // 0xFF 0xE0 can show up in a tag or junk before the audio, so the first frame has to be followed by another
+      const std::size_t next = position + header.frameBytes;
+      Mp3Header_t nextHeader{};
+      if (next + 4 <= size && (!parseHeader(data + next, nextHeader) || nextHeader.sampleRate != header.sampleRate)) {
+        ++position;
+        continue;
+      }
+      haveFirst = true;
+      index->sampleRate = header.sampleRate;
+      index->samplesPerFrame = header.samples;
+      if (isInfoFrame(data + position, header)) {
+        // mpg123 does not count this frame either
+        position = next;
+        continue;
+      }
+    } else if (header.sampleRate != index->sampleRate) {
+      ++position;
+      continue;
+    }
+    if (index->frames % index->step == 0) {
+      if (index->offsets.size() == FRAME_INDEX_MAX_ENTRIES) {
+        // full, keep every other entry and index half as often
+        for (std::size_t i = 0; i < FRAME_INDEX_MAX_ENTRIES / 2; ++i) {
+          index->offsets[i] = index->offsets[i * 2];
+        }
+        index->offsets.resize(FRAME_INDEX_MAX_ENTRIES / 2);
+        index->step *= 2;
+      }
+      if (index->frames % index->step == 0) {
+        index->offsets.push_back(static_cast<int64_t>(position));
+      }
+    }
+    ++index->frames;
+    position += header.frameBytes;
+  }
+  if (index->frames == 0) {
+    return nullptr;
+  }
+  index->offsets.shrink_to_fit();
+  return index;
+}
+
+std::shared_ptr<const FrameIndex> FrameIndex::fromFile(const std::string &path) {
+#if defined(__APPLE__) || defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat info{};
+  if (fstat(fd, &info) == -1 || info.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+  const std::size_t size = static_cast<std::size_t>(info.st_size);
+  void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+  auto index = build(static_cast<const unsigned char *>(address), size);
+  munmap(address, size);
+  return index;
+#else
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return nullptr;
+  }
+  const std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  return build(bytes.data(), bytes.size());
+#endif
+}
+
+std::shared_ptr<const FrameIndex> FrameIndex::deserialize(const std::byte *data, std::size_t size) {
+  if (size < FRAME_INDEX_HEADER_BYTES || (size - FRAME_INDEX_HEADER_BYTES) % sizeof(int64_t) != 0) {
+    return nullptr;
+  }
+  const std::size_t count = (size - FRAME_INDEX_HEADER_BYTES) / sizeof(int64_t);
+  if (count == 0 || count > FRAME_INDEX_MAX_ENTRIES) {
+    return nullptr;
+  }
+  std::shared_ptr<FrameIndex> index{new FrameIndex()};
+  std::copy(data, data + 4, reinterpret_cast<std::byte *>(&index->step));
+  std::copy(data + 4, data + 8, reinterpret_cast<std::byte *>(&index->sampleRate));
+  std::copy(data + 8, data + 12, reinterpret_cast<std::byte *>(&index->samplesPerFrame));
+  std::copy(data + 12, data + 20, reinterpret_cast<std::byte *>(&index->frames));
+  if (index->step == 0 || index->sampleRate == 0 || index->frames == 0) {
+    return nullptr;
+  }
+  index->offsets.resize(count);
+  std::copy(
+    data + FRAME_INDEX_HEADER_BYTES,
+    data + size,
+    reinterpret_cast<std::byte *>(index->offsets.data())
+  );
+  return index;
+}
+
+std::vector<std::byte> FrameIndex::serialize() const {
+  std::vector<std::byte> bytes{};
+  bytes.resize(FRAME_INDEX_HEADER_BYTES + offsets.size() * sizeof(int64_t));
+  std::copy(reinterpret_cast<const std::byte *>(&step), reinterpret_cast<const std::byte *>(&step) + 4, bytes.data());
+  std::copy(
+    reinterpret_cast<const std::byte *>(&sampleRate),
+    reinterpret_cast<const std::byte *>(&sampleRate) + 4,
+    bytes.data() + 4
+  );
+  std::copy(
+    reinterpret_cast<const std::byte *>(&samplesPerFrame),
+    reinterpret_cast<const std::byte *>(&samplesPerFrame) + 4,
+    bytes.data() + 8
+  );
+  std::copy(reinterpret_cast<const std::byte *>(&frames), reinterpret_cast<const std::byte *>(&frames) + 8, bytes.data() + 12);
+  std::copy(
+    reinterpret_cast<const std::byte *>(offsets.data()),
+    reinterpret_cast<const std::byte *>(offsets.data() + offsets.size()),
+    bytes.data() + FRAME_INDEX_HEADER_BYTES
+  );
+  return bytes;
+}
+
+bool FrameIndex::apply(mpg123_handle *handle) const {
+  // mpg123 copies the table
+  std::vector<off_t> table{};
+  table.reserve(offsets.size());
+  for (const int64_t offset : offsets) {
+    table.push_back(static_cast<off_t>(offset));
+  }
+  if (mpg123_set_index(handle, table.data(), static_cast<off_t>(step), table.size()) != MPG123_OK) {
+    DEBUG_P(std::cout << "set index: " << mpg123_strerror(handle) << '\n');
+    return false;
+  }
+  return true;
+}
+
+uint64_t FrameIndex::getFrames() const {
+  return frames;
+}
+
+int64_t FrameIndex::getDurationMs() const {
+  if (sampleRate == 0) {
+    return 0;
+  }
+  return static_cast<int64_t>(frames * samplesPerFrame * 1000 / sampleRate);
+}
+
+const char *FrameIndex::kernelName() {
+  return kernel().name;
+}
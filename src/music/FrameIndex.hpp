@@ -0,0 +1,150 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Table of MP3 frame offsets, built once when a song enters the queue
+ */
+
+#pragma once
+
+#include <mpg123.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// most entries kept in an index, long songs index every few frames instead of every frame
+#define FRAME_INDEX_MAX_ENTRIES 4096
+
+/**
+ * @brief Fields of an MP3 frame header needed to walk from frame to frame
+*/
+typedef struct {
+  /**
+   * sample rate in Hz
+  */
+  uint32_t sampleRate;
+  /**
+   * bytes in the frame, header included
+  */
+  uint32_t frameBytes;
+  /**
+   * samples per channel decoded from the frame
+  */
+  uint32_t samples;
+  /**
+   * number of channels, 1 or 2
+  */
+  uint32_t channels;
+  /**
+   * layer 1, 2 or 3
+  */
+  uint32_t layer;
+  /**
+   * true for MPEG 1, false for MPEG 2 and 2.5
+  */
+  bool mpeg1;
+  /**
+   * true if a 2 byte CRC follows the header
+  */
+  bool crc;
+} Mp3Header_t;
+
+/**
+ * @brief Byte offset of every step-th MP3 frame. Given to mpg123 through mpg123_set_index, so seeking
+ * goes straight to the right frame instead of scanning the file or guessing from the average bitrate
+*/
+class FrameIndex {
+private:
+
+  /**
+   * byte offset of frames 0, step, 2 * step, ... from the start of the file
+  */
+  std::vector<int64_t> offsets;
+
+  /**
+   * frames between entries in offsets
+  */
+  uint32_t step;
+
+  /**
+   * number of audio frames in the song, the Xing/Info frame is not counted
+  */
+  uint64_t frames;
+
+  /**
+   * sample rate of the first frame in Hz
+  */
+  uint32_t sampleRate;
+
+  /**
+   * samples per channel in each frame
+  */
+  uint32_t samplesPerFrame;
+
+  FrameIndex();
+
+public:
+
+  /**
+   * @brief read a frame header
+   * @param p at least 4 bytes
+   * @return false if the bytes are not a valid header, free format frames are not supported
+  */
+  static bool parseHeader(const unsigned char *p, Mp3Header_t &header);
+
+  /**
+   * @brief find the next possible frame sync, 11 set bits, with the best vector instructions the CPU has
+   * @return position of the first byte of the sync, size if there is none
+  */
+  static std::size_t findSync(const unsigned char *data, std::size_t size, std::size_t from);
+
+  /**
+   * @return size of the ID3v2 tag at the start of data, 0 if there is none
+  */
+  static std::size_t id3v2Size(const unsigned char *data, std::size_t size);
+
+  /**
+   * @brief index the frames of a song in memory
+   * @return the index, nullptr if no frames were found
+  */
+  static std::shared_ptr<const FrameIndex> build(const unsigned char *data, std::size_t size);
+
+  /**
+   * @brief map a file into memory and index its frames
+   * @return the index, nullptr if the file could not be read or no frames were found
+  */
+  static std::shared_ptr<const FrameIndex> fromFile(const std::string &path);
+
+  /**
+   * @brief parse an index sent by the room, the layout is the one made by serialize
+   * @return the index, nullptr if the bytes are malformed
+  */
+  static std::shared_ptr<const FrameIndex> deserialize(const std::byte *data, std::size_t size);
+
+  /**
+   * @brief body of a FRAME_INDEX message:
+   * <4 bytes step> <4 bytes sample rate> <4 bytes samples per frame> <8 bytes frames> <8 bytes per offset>
+  */
+  [[nodiscard]] std::vector<std::byte> serialize() const;
+
+  /**
+   * @brief hand the table to a mpg123 handle, call after the handle has been opened
+   * @return true on success
+  */
+  bool apply(mpg123_handle *handle) const;
+
+  /**
+   * @return number of audio frames in the song
+  */
+  [[nodiscard]] uint64_t getFrames() const;
+
+  /**
+   * @return length of the song in ms, 0 if unknown
+  */
+  [[nodiscard]] int64_t getDurationMs() const;
+
+  /**
+   * @return name of the sync scan kernel in use, "avx2", "sse2" or "scalar"
+  */
+  static const char *kernelName();
+};
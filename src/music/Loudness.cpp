@@ -0,0 +1,291 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the loudness meter
+*/
+
+#include <cmath>
+#include <algorithm>
+
+#include "Loudness.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOUDNESS_X86 1
+#else
+#define LOUDNESS_X86 0
+#endif
+
+// floats decoded at a time while analysing
+#define LOUDNESS_DECODE_FLOATS 16384
+// BS.1770 gates, the absolute one in LUFS and the relative one in LU below the ungated loudness
+#define LOUDNESS_ABSOLUTE_GATE -70.0
+#define LOUDNESS_RELATIVE_GATE -10.0
+
+static const long DECODE_RATES[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+
+static double energyToLufs(double energy) {
+  return -0.691 + 10.0 * std::log10(energy);
+}
+
+static double lufsToEnergy(double lufs) {
+  return std::pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+/**
+ * scalar version, one channel after the other
+*/
+static void kWeightScalar(KWeighting_t &f, const float *in, std::size_t count, int channels, double *sums, float &peak) {
+  for (int c = 0; c < channels; ++c) {
+    double s1 = f.shelfState[c][0], s2 = f.shelfState[c][1];
+    double h1 = f.highPassState[c][0], h2 = f.highPassState[c][1];
+    double sum = 0;
+    float channelPeak = peak;
+    for (std::size_t i = 0; i < count; ++i) {
+      const float sample = in[i * static_cast<std::size_t>(channels) + static_cast<std::size_t>(c)];
+      channelPeak = std::max(channelPeak, std::fabs(sample));
+      const double x = sample;
+      const double y = f.shelf[0] * x + s1;
+      s1 = f.shelf[1] * x - f.shelf[3] * y + s2;
+      s2 = f.shelf[2] * x - f.shelf[4] * y;
+      const double w = f.highPass[0] * y + h1;
+      h1 = f.highPass[1] * y - f.highPass[3] * w + h2;
+      h2 = f.highPass[2] * y - f.highPass[4] * w;
+      sum += w * w;
+    }
+    f.shelfState[c][0] = s1;
+    f.shelfState[c][1] = s2;
+    f.highPassState[c][0] = h1;
+    f.highPassState[c][1] = h2;
+    sums[c] += sum;
+    peak = channelPeak;
+  }
+}
+
+#if LOUDNESS_X86
+
+/**
+ * SSE2 version, left and right go through the filters together in the two lanes of a register.
+ * Mono falls back to the scalar version
+*/
+__attribute__((target("sse2")))
+static void kWeightSse2(KWeighting_t &f, const float *in, std::size_t count, int channels, double *sums, float &peak) {
+  if (channels != 2) {
+    kWeightScalar(f, in, count, channels, sums, peak);
+    return;
+  }
+  const __m128d sb0 = _mm_set1_pd(f.shelf[0]), sb1 = _mm_set1_pd(f.shelf[1]), sb2 = _mm_set1_pd(f.shelf[2]);
+  const __m128d sa1 = _mm_set1_pd(f.shelf[3]), sa2 = _mm_set1_pd(f.shelf[4]);
+  const __m128d hb0 = _mm_set1_pd(f.highPass[0]), hb1 = _mm_set1_pd(f.highPass[1]), hb2 = _mm_set1_pd(f.highPass[2]);
+  const __m128d ha1 = _mm_set1_pd(f.highPass[3]), ha2 = _mm_set1_pd(f.highPass[4]);
+  __m128d s1 = _mm_set_pd(f.shelfState[1][0], f.shelfState[0][0]);
+  __m128d s2 = _mm_set_pd(f.shelfState[1][1], f.shelfState[0][1]);
+  __m128d h1 = _mm_set_pd(f.highPassState[1][0], f.highPassState[0][0]);
+  __m128d h2 = _mm_set_pd(f.highPassState[1][1], f.highPassState[0][1]);
+  __m128d sum = _mm_setzero_pd();
+  __m128 maxAbs = _mm_setzero_ps();
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  for (std::size_t i = 0; i < count; ++i) {
+    // one left and right pair, the upper half of the register is zeroed
+    const __m128 pair = _mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(in + 2 * i)));
+    maxAbs = _mm_max_ps(maxAbs, _mm_and_ps(pair, absMask));
+    const __m128d x = _mm_cvtps_pd(pair);
+    const __m128d y = _mm_add_pd(_mm_mul_pd(sb0, x), s1);
+    s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(sb1, x), _mm_mul_pd(sa1, y)), s2);
+    s2 = _mm_sub_pd(_mm_mul_pd(sb2, x), _mm_mul_pd(sa2, y));
+    const __m128d w = _mm_add_pd(_mm_mul_pd(hb0, y), h1);
+    h1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(hb1, y), _mm_mul_pd(ha1, w)), h2);
+    h2 = _mm_sub_pd(_mm_mul_pd(hb2, y), _mm_mul_pd(ha2, w));
+    sum = _mm_add_pd(sum, _mm_mul_pd(w, w));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, s1);
+  f.shelfState[0][0] = lanes[0];
+  f.shelfState[1][0] = lanes[1];
+  _mm_storeu_pd(lanes, s2);
+  f.shelfState[0][1] = lanes[0];
+  f.shelfState[1][1] = lanes[1];
+  _mm_storeu_pd(lanes, h1);
+  f.highPassState[0][0] = lanes[0];
+  f.highPassState[1][0] = lanes[1];
+  _mm_storeu_pd(lanes, h2);
+  f.highPassState[0][1] = lanes[0];
+  f.highPassState[1][1] = lanes[1];
+  _mm_storeu_pd(lanes, sum);
+  sums[0] += lanes[0];
+  sums[1] += lanes[1];
+  float peaks[4];
+  _mm_storeu_ps(peaks, maxAbs);
+  peak = std::max(peak, std::max(peaks[0], peaks[1]));
+}
+
+#endif
+
+/**
+ * the filter kernel picked for this CPU
+*/
+typedef struct {
+  void (*kWeight)(KWeighting_t &, const float *, std::size_t, int, double *, float &);
+  const char *name;
+} FilterKernel_t;
+
+static FilterKernel_t pickKernel() {
+#if LOUDNESS_X86
+  if (__builtin_cpu_supports("sse2")) {
+    return {&kWeightSse2, "sse2"};
+  }
+#endif
+  return {&kWeightScalar, "scalar"};
+}
+
+static const FilterKernel_t &kernel() {
+  static const FilterKernel_t picked = pickKernel();
+  return picked;
+}
+
+LoudnessMeter::LoudnessMeter(long rate, int channels):
+  filter{}, rate{rate}, channels{channels}, stepFrames{static_cast<std::size_t>(rate / 10)}, stepSums{0, 0}, stepFill{0},
+  steps{}, peak{0}, frames{0} {
+  const double fs = static_cast<double>(rate);
+  // BS.1770 stage 1, a high shelf modelling the head, worked out for this sample rate
+  double K = std::tan(M_PI * 1681.974450955533 / fs);
+  const double Q = 0.7071752369554196;
+  const double Vh = std::pow(10.0, 3.999843853973347 / 20.0);
+  const double Vb = std::pow(Vh, 0.4996667741545416);
+  double a0 = 1.0 + K / Q + K * K;
+  filter.shelf[0] = (Vh + Vb * K / Q + K * K) / a0;
+  filter.shelf[1] = 2.0 * (K * K - Vh) / a0;
+  filter.shelf[2] = (Vh - Vb * K / Q + K * K) / a0;
+  filter.shelf[3] = 2.0 * (K * K - 1.0) / a0;
+  filter.shelf[4] = (1.0 - K / Q + K * K) / a0;
+  // stage 2, a high pass
+  K = std::tan(M_PI * 38.13547087602444 / fs);
+  const double highPassQ = 0.5003270373238773;
+  a0 = 1.0 + K / highPassQ + K * K;
+  filter.highPass[0] = 1.0;
+  filter.highPass[1] = -2.0;
+  filter.highPass[2] = 1.0;
+  filter.highPass[3] = 2.0 * (K * K - 1.0) / a0;
+  filter.highPass[4] = (1.0 - K / highPassQ + K * K) / a0;
+  if (stepFrames == 0) {
+    stepFrames = 1;
+  }
+}
+
+void LoudnessMeter::add(const float *samples, std::size_t count) {
+  const FilterKernel_t &k = kernel();
+  frames += count;
+  while (count > 0) {
+    const std::size_t n = std::min(count, stepFrames - stepFill);
+    k.kWeight(filter, samples, n, channels, stepSums, peak);
+    samples += n * static_cast<std::size_t>(channels);
+    count -= n;
+    stepFill += n;
+    if (stepFill == stepFrames) {
+      // channels are weighted 1.0 each, left and right in BS.1770
+      steps.push_back((stepSums[0] + stepSums[1]) / static_cast<double>(stepFrames));
+      stepSums[0] = 0;
+      stepSums[1] = 0;
+      stepFill = 0;
+    }
+  }
+}
+
+LoudnessResult_t LoudnessMeter::result() const {
+  LoudnessResult_t result{};
+  result.peak = peak;
+  result.seconds = rate > 0 ? static_cast<double>(frames) / static_cast<double>(rate) : 0;
+  // 400 ms blocks overlapping by 300 ms are 4 steps each, a song shorter than that is one block
+  std::vector<double> blocks{};
+  if (steps.size() < 4) {
+    double total = 0;
+    for (const double step : steps) {
+      total += step;
+    }
+    if (!steps.empty()) {
+      blocks.push_back(total / static_cast<double>(steps.size()));
+    }
+  } else {
+    for (std::size_t i = 3; i < steps.size(); ++i) {
+      blocks.push_back((steps[i - 3] + steps[i - 2] + steps[i - 1] + steps[i]) / 4.0);
+    }
+  }
+  const double absoluteGate = lufsToEnergy(LOUDNESS_ABSOLUTE_GATE);
+  double sum = 0;
+  std::size_t count = 0;
+  for (const double block : blocks) {
+    if (block > absoluteGate) {
+      sum += block;
+      ++count;
+    }
+  }
+  if (count == 0) {
+    // silence, leave it alone
+    result.integratedLufs = LOUDNESS_ABSOLUTE_GATE - 1;
+    result.gainDb = 0;
+    return result;
+  }
+  const double relativeGate = lufsToEnergy(energyToLufs(sum / static_cast<double>(count)) + LOUDNESS_RELATIVE_GATE);
+  double gatedSum = 0;
+  std::size_t gatedCount = 0;
+  for (const double block : blocks) {
+    if (block > absoluteGate && block > relativeGate) {
+      gatedSum += block;
+      ++gatedCount;
+    }
+  }
+  result.integratedLufs = energyToLufs(gatedSum / static_cast<double>(gatedCount));
+  float gain = static_cast<float>(LOUDNESS_TARGET_LUFS - result.integratedLufs);
+  gain = std::min(std::max(gain, LOUDNESS_MAX_CUT_DB), LOUDNESS_MAX_BOOST_DB);
+  if (peak > 0) {
+    // never boost the loudest sample past full scale
+    gain = std::min(gain, -20.0f * std::log10(peak));
+  }
+  result.gainDb = gain;
+  return result;
+}
+
+bool LoudnessMeter::analyse(AudioSource &source, LoudnessResult_t &result) {
+#if LOUDNESS_X86
+  // the filters ring down towards denormals in quiet passages, which are very slow, treat them as 0
+  _mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+  mpg123_handle *mh = mpg123_new(nullptr, nullptr);
+  if (mh == nullptr) {
+    return false;
+  }
+  AudioSource::installReader(mh);
+  mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_IGNORE_STREAMLENGTH, 0);
+  // have mpg123 output floats whatever the sample rate, so the filters need no conversion
+  mpg123_format_none(mh);
+  for (const long decodeRate : DECODE_RATES) {
+    mpg123_format(mh, decodeRate, MPG123_MONO | MPG123_STEREO, MPG123_ENC_FLOAT_32);
+  }
+  long rate = 0;
+  int channels = 0, encoding = 0;
+  if (
+    !source.open(mh) || mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK ||
+    encoding != MPG123_ENC_FLOAT_32 || channels < 1 || channels > 2 || rate <= 0
+  ) {
+    mpg123_close(mh);
+    mpg123_delete(mh);
+    return false;
+  }
+  LoudnessMeter meter{rate, channels};
+  std::vector<float> buffer(LOUDNESS_DECODE_FLOATS);
+  const std::size_t frameBytes = sizeof(float) * static_cast<std::size_t>(channels);
+  int err;
+  do {
+    std::size_t done = 0;
+    err = mpg123_read(mh, buffer.data(), buffer.size() * sizeof(float), &done);
+    meter.add(buffer.data(), done / frameBytes);
+  } while (err == MPG123_OK || err == MPG123_NEW_FORMAT);
+  mpg123_close(mh);
+  mpg123_delete(mh);
+  result = meter.result();
+  // a broken frame near the end still leaves a usable measurement
+  return err == MPG123_DONE || result.seconds > 0;
+}
+
+const char *LoudnessMeter::kernelName() {
+  return kernel().name;
+}
@@ -0,0 +1,134 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Measures how loud a song is, so every song can be played back at about the same loudness
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "AudioSource.hpp"
+
+// loudness songs are brought to, the ReplayGain 2.0 reference level
+#define LOUDNESS_TARGET_LUFS -18.0
+// largest cut and boost applied, in dB
+#define LOUDNESS_MAX_CUT_DB -20.0f
+#define LOUDNESS_MAX_BOOST_DB 12.0f
+
+/**
+ * @brief Result of measuring a song
+*/
+typedef struct {
+  /**
+   * integrated loudness in LUFS, below -70 for silence
+  */
+  double integratedLufs;
+  /**
+   * largest absolute sample value, 1.0 is full scale
+  */
+  float peak;
+  /**
+   * gain to apply to reach LOUDNESS_TARGET_LUFS without clipping the peak, in dB
+  */
+  float gainDb;
+  /**
+   * length of the decoded audio in seconds
+  */
+  double seconds;
+} LoudnessResult_t;
+
+/**
+ * @brief coefficients and state of the two K-weighting biquads, per channel
+*/
+typedef struct {
+  /**
+   * b0, b1, b2, a1, a2 of the high shelf and the high pass
+  */
+  double shelf[5];
+  double highPass[5];
+  /**
+   * z1 and z2 of each filter for up to 2 channels
+  */
+  double shelfState[2][2];
+  double highPassState[2][2];
+} KWeighting_t;
+
+/**
+ * @brief Integrated loudness as in ITU-R BS.1770: K-weighting, 400 ms blocks every 100 ms,
+ * an absolute gate at -70 LUFS and a relative gate 10 LU below the ungated loudness.
+ * The filters run on an SSE2 version where the CPU has it, both channels at once
+*/
+class LoudnessMeter {
+private:
+
+  KWeighting_t filter;
+
+  /**
+   * sample rate and channels of the audio being measured
+  */
+  long rate;
+  int channels;
+
+  /**
+   * sample frames in 100 ms
+  */
+  std::size_t stepFrames;
+
+  /**
+   * sum of squares of the filtered samples of the 100 ms step being filled, per channel
+  */
+  double stepSums[2];
+
+  /**
+   * sample frames in the step being filled
+  */
+  std::size_t stepFill;
+
+  /**
+   * mean square of each finished 100 ms step, summed over the channels
+  */
+  std::vector<double> steps;
+
+  /**
+   * largest absolute sample value so far
+  */
+  float peak;
+
+  /**
+   * sample frames measured
+  */
+  uint64_t frames;
+
+public:
+
+  /**
+   * @param rate sample rate in Hz
+   * @param channels 1 or 2
+  */
+  LoudnessMeter(long rate, int channels);
+
+  /**
+   * @brief measure more audio
+   * @param samples interleaved float samples
+   * @param count number of sample frames
+  */
+  void add(const float *samples, std::size_t count);
+
+  /**
+   * @return the measurement of everything added so far
+  */
+  [[nodiscard]] LoudnessResult_t result() const;
+
+  /**
+   * @brief decode a song with its own mpg123 handle and measure it
+   * @return false if the song could not be decoded
+  */
+  static bool analyse(AudioSource &source, LoudnessResult_t &result);
+
+  /**
+   * @return name of the filter kernel in use, "sse2" or "scalar"
+  */
+  static const char *kernelName();
+};
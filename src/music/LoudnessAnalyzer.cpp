@@ -0,0 +1,121 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the loudness analyzer
+*/
+
+#include <chrono>
+#include <iostream>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "LoudnessAnalyzer.hpp"
+#include "../debug.hpp"
+
+// nice value of the worker threads, lowest priority
+#define LOUDNESS_WORKER_NICE 19
+
+LoudnessAnalyzer::LoudnessAnalyzer(MusicStorage &queue):
+  queue{queue}, notifyFd{-1}, workers{}, jobs{}, jobsMutex{}, jobsCond{}, stopping{false}, stats{} {}
+
+LoudnessAnalyzer::~LoudnessAnalyzer() {
+  stop();
+}
+
+void LoudnessAnalyzer::start(int fd) {
+  if (!workers.empty()) {
+    return;
+  }
+  notifyFd = fd;
+  {
+    std::unique_lock<std::mutex> lock{jobsMutex};
+    stopping = false;
+  }
+  const unsigned cores = std::thread::hardware_concurrency();
+  const unsigned count = cores / LOUDNESS_CORES_PER_WORKER > 0 ? cores / LOUDNESS_CORES_PER_WORKER : 1;
+  for (unsigned i = 0; i < count; ++i) {
+    workers.emplace_back(&LoudnessAnalyzer::_work, this);
+  }
+}
+
+void LoudnessAnalyzer::stop() {
+  {
+    std::unique_lock<std::mutex> lock{jobsMutex};
+    stopping = true;
+    jobs.clear();
+  }
+  jobsCond.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+}
+
+void LoudnessAnalyzer::submit(EntryHandle_t handle) {
+  {
+    std::unique_lock<std::mutex> lock{jobsMutex};
+    jobs.push_back(handle);
+  }
+  jobsCond.notify_one();
+}
+
+std::size_t LoudnessAnalyzer::getWorkers() const {
+  return workers.size();
+}
+
+const LoudnessStats_t &LoudnessAnalyzer::getStats() const {
+  return stats;
+}
+
+void LoudnessAnalyzer::_work() {
+#if defined(__linux__)
+  // on linux the nice value belongs to the thread that sets it
+  setpriority(PRIO_PROCESS, 0, LOUDNESS_WORKER_NICE);
+#endif
+  while (true) {
+    EntryHandle_t handle;
+    {
+      std::unique_lock<std::mutex> lock{jobsMutex};
+      jobsCond.wait(lock, [this]() {
+        return stopping || !jobs.empty();
+      });
+      if (stopping) {
+        return;
+      }
+      handle = jobs.front();
+      jobs.pop_front();
+    }
+    _analyse(handle);
+  }
+}
+
+void LoudnessAnalyzer::_analyse(EntryHandle_t handle) {
+  MusicStorageEntry *p_entry = queue.pin(handle);
+  if (p_entry == nullptr) {
+    return;
+  }
+  const EntryState state = p_entry->getState();
+  if (state != EntryState::READY && state != EntryState::PLAYING) {
+    queue.unpin(p_entry);
+    return;
+  }
+  const auto begin = std::chrono::steady_clock::now();
+  LoudnessResult_t result{};
+  const bool measured = LoudnessMeter::analyse(*p_entry->openSource(), result);
+  const auto busy = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+  stats.busyUs += static_cast<uint64_t>(busy.count());
+  if (!measured) {
+    ++stats.failed;
+    queue.unpin(p_entry);
+    return;
+  }
+  ++stats.songs;
+  stats.audioMs += static_cast<uint64_t>(result.seconds * 1000);
+  p_entry->gainDb = result.gainDb;
+  queue.unpin(p_entry);
+  DEBUG_P(std::cout << "loudness " << result.integratedLufs << " LUFS, gain " << result.gainDb << " dB\n");
+  ::write(notifyFd, reinterpret_cast<const void *>(&handle), sizeof handle);
+}
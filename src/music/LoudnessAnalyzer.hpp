@@ -0,0 +1,111 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Measures the loudness of queue entries on worker threads, away from the room's event loop
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "MusicStorage.hpp"
+#include "Loudness.hpp"
+
+// share of the CPU cores given to loudness analysis, one worker per this many cores, at least one worker
+#define LOUDNESS_CORES_PER_WORKER 4
+
+/**
+ * @brief Running totals of the analysis, read by the room's stats command
+*/
+typedef struct {
+  /**
+   * songs measured, and songs that could not be decoded
+  */
+  std::atomic<uint64_t> songs;
+  std::atomic<uint64_t> failed;
+  /**
+   * milliseconds of audio measured, and microseconds of worker time it took
+  */
+  std::atomic<uint64_t> audioMs;
+  std::atomic<uint64_t> busyUs;
+} LoudnessStats_t;
+
+/**
+ * @brief A small pool of threads that decode stored entries and set their gainDb. Workers run at a low
+ * priority and there are a quarter as many as there are cores, so analysis never competes with playback or
+ * the network. Each measured entry's handle is written to a pipe for the event loop to pick up
+*/
+class LoudnessAnalyzer {
+private:
+
+  MusicStorage &queue;
+
+  /**
+   * write end of the pipe that finished entries are sent to
+  */
+  int notifyFd;
+
+  std::vector<std::thread> workers;
+
+  /**
+   * entries waiting to be measured
+  */
+  std::deque<EntryHandle_t> jobs;
+
+  /**
+   * guards jobs and stopping
+  */
+  std::mutex jobsMutex;
+  std::condition_variable jobsCond;
+  bool stopping;
+
+  LoudnessStats_t stats;
+
+  /**
+   * @brief loop of a worker thread
+  */
+  void _work();
+
+  /**
+   * @brief measure one entry and set its gain
+  */
+  void _analyse(EntryHandle_t handle);
+
+public:
+
+  /**
+   * @param queue storage the entries live in
+  */
+  explicit LoudnessAnalyzer(MusicStorage &queue);
+
+  LoudnessAnalyzer(const LoudnessAnalyzer &) = delete;
+
+  ~LoudnessAnalyzer();
+
+  /**
+   * @brief start the workers
+   * @param fd write end of a pipe, gets an EntryHandle_t for each entry whose gain has been set
+  */
+  void start(int fd);
+
+  /**
+   * @brief stop the workers once they finish the entries they are on, entries still waiting are dropped
+  */
+  void stop();
+
+  /**
+   * @brief queue an entry to be measured, it is skipped if it is removed or still receiving when its turn comes
+  */
+  void submit(EntryHandle_t handle);
+
+  /**
+   * @return number of worker threads
+  */
+  [[nodiscard]] std::size_t getWorkers() const;
+
+  [[nodiscard]] const LoudnessStats_t &getStats() const;
+};
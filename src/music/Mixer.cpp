@@ -0,0 +1,217 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the mixer kernels
+*/
+
+#include "Mixer.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIXER_X86 1
+#else
+#define MIXER_X86 0
+#endif
+
+// 16 bit samples are scaled by this to get floats in [-1, 1)
+#define S16_SCALE 32768.0f
+
+/**
+ * scalar versions, also used for the samples left over at the end by the vector versions
+*/
+
+static void s16ToFloatScalar(const int16_t *in, float *out, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    out[i] = static_cast<float>(in[i]) * (1.0f / S16_SCALE);
+  }
+}
+
+static void floatToS16Scalar(const float *in, int16_t *out, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    float sample = in[i] * S16_SCALE;
+    sample = sample > 32767.0f ? 32767.0f : sample;
+    sample = sample < -32768.0f ? -32768.0f : sample;
+    out[i] = static_cast<int16_t>(sample < 0 ? sample - 0.5f : sample + 0.5f);
+  }
+}
+
+static void gainRampScalar(float *samples, std::size_t count, float gain, float step) {
+  for (std::size_t i = 0; i < count; ++i) {
+    samples[i] *= gain + step * static_cast<float>(i);
+  }
+}
+
+static void mixAddScalar(float *dst, const float *src, std::size_t count) {
+  for (std::size_t i = 0; i < count; ++i) {
+    dst[i] += src[i];
+  }
+}
+
+#if MIXER_X86
+
+/**
+ * SSE2 versions, 4 floats or 8 samples at a time
+*/
+
+__attribute__((target("sse2")))
+static void s16ToFloatSse2(const int16_t *in, float *out, std::size_t count) {
+  const __m128 scale = _mm_set1_ps(1.0f / S16_SCALE);
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    // widen to 32 bits keeping the sign by putting each sample in the top half and shifting down
+    const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+    const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+  }
+  s16ToFloatScalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void floatToS16Sse2(const float *in, int16_t *out, std::size_t count) {
+  const __m128 scale = _mm_set1_ps(S16_SCALE);
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i low = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), scale));
+    const __m128i high = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), scale));
+    // packing saturates, which does the clipping
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(low, high));
+  }
+  floatToS16Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void gainRampSse2(float *samples, std::size_t count, float gain, float step) {
+  __m128 gains = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+  const __m128 stepVector = _mm_set1_ps(4 * step);
+  std::size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(samples + i, _mm_mul_ps(_mm_loadu_ps(samples + i), gains));
+    gains = _mm_add_ps(gains, stepVector);
+  }
+  gainRampScalar(samples + i, count - i, gain + step * static_cast<float>(i), step);
+}
+
+__attribute__((target("sse2")))
+static void mixAddSse2(float *dst, const float *src, std::size_t count) {
+  std::size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+  }
+  mixAddScalar(dst + i, src + i, count - i);
+}
+
+/**
+ * AVX2 versions, 8 floats or 16 samples at a time
+*/
+
+__attribute__((target("avx2")))
+static void s16ToFloatAvx2(const int16_t *in, float *out, std::size_t count) {
+  const __m256 scale = _mm256_set1_ps(1.0f / S16_SCALE);
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(samples)), scale));
+  }
+  s16ToFloatScalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void floatToS16Avx2(const float *in, int16_t *out, std::size_t count) {
+  const __m256 scale = _mm256_set1_ps(S16_SCALE);
+  std::size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m256i low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale));
+    const __m256i high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(in + i + 8), scale));
+    // packing works within each 128 bit lane, put the 64 bit pieces back in order afterwards
+    const __m256i packed = _mm256_packs_epi32(low, high);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  floatToS16Scalar(in + i, out + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void gainRampAvx2(float *samples, std::size_t count, float gain, float step) {
+  __m256 gains = _mm256_setr_ps(
+    gain, gain + step, gain + 2 * step, gain + 3 * step,
+    gain + 4 * step, gain + 5 * step, gain + 6 * step, gain + 7 * step
+  );
+  const __m256 stepVector = _mm256_set1_ps(8 * step);
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(samples + i, _mm256_mul_ps(_mm256_loadu_ps(samples + i), gains));
+    gains = _mm256_add_ps(gains, stepVector);
+  }
+  gainRampScalar(samples + i, count - i, gain + step * static_cast<float>(i), step);
+}
+
+__attribute__((target("avx2")))
+static void mixAddAvx2(float *dst, const float *src, std::size_t count) {
+  std::size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i)));
+  }
+  mixAddScalar(dst + i, src + i, count - i);
+}
+
+#endif
+
+/**
+ * the kernels picked for this CPU
+*/
+typedef struct {
+  void (*s16ToFloat)(const int16_t *, float *, std::size_t);
+  void (*floatToS16)(const float *, int16_t *, std::size_t);
+  void (*gainRamp)(float *, std::size_t, float, float);
+  void (*mixAdd)(float *, const float *, std::size_t);
+  const char *name;
+} Kernels_t;
+
+static Kernels_t pickKernels() {
+#if MIXER_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return {&s16ToFloatAvx2, &floatToS16Avx2, &gainRampAvx2, &mixAddAvx2, "avx2"};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {&s16ToFloatSse2, &floatToS16Sse2, &gainRampSse2, &mixAddSse2, "sse2"};
+  }
+#endif
+  return {&s16ToFloatScalar, &floatToS16Scalar, &gainRampScalar, &mixAddScalar, "scalar"};
+}
+
+static const Kernels_t &kernels() {
+  static const Kernels_t picked = pickKernels();
+  return picked;
+}
+
+void Mixer::s16ToFloat(const int16_t *in, float *out, std::size_t count) {
+  kernels().s16ToFloat(in, out, count);
+}
+
+void Mixer::floatToS16(const float *in, int16_t *out, std::size_t count) {
+  kernels().floatToS16(in, out, count);
+}
+
+void Mixer::gainRamp(float *samples, std::size_t count, float gain, float step) {
+  kernels().gainRamp(samples, count, gain, step);
+}
+
+void Mixer::mixAdd(float *dst, const float *src, std::size_t count) {
+  kernels().mixAdd(dst, src, count);
+}
+
+void Mixer::scaleS16(int16_t *samples, std::size_t count, float gain) {
+  // convert in pieces that fit on the stack
+  float buffer[1024];
+  const Kernels_t &k = kernels();
+  for (std::size_t i = 0; i < count; i += 1024) {
+    const std::size_t n = count - i < 1024 ? count - i : 1024;
+    k.s16ToFloat(samples + i, buffer, n);
+    k.gainRamp(buffer, n, gain, 0.0f);
+    k.floatToS16(buffer, samples + i, n);
+  }
+}
+
+const char *Mixer::kernelName() {
+  return kernels().name;
+}
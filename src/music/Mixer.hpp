@@ -0,0 +1,63 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Vectorized kernels for mixing and scaling decoded audio
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief Converts 16 bit PCM to float and back, applies gain ramps and mixes streams.
+ * Each kernel has an AVX2, an SSE2 and a scalar version, the best one the CPU supports is picked on first use
+*/
+class Mixer {
+public:
+
+  /**
+   * @brief convert signed 16 bit samples to floats in [-1, 1)
+   * @param in samples to convert
+   * @param out where to put the converted samples
+   * @param count number of samples
+  */
+  static void s16ToFloat(const int16_t *in, float *out, std::size_t count);
+
+  /**
+   * @brief convert floats to signed 16 bit samples, clipping anything outside [-1, 1)
+   * @param in samples to convert
+   * @param out where to put the converted samples
+   * @param count number of samples
+  */
+  static void floatToS16(const float *in, int16_t *out, std::size_t count);
+
+  /**
+   * @brief multiply samples by a gain that changes linearly from sample to sample
+   * @param samples samples to scale in place
+   * @param count number of samples
+   * @param gain gain of the first sample
+   * @param step amount the gain changes by per sample, 0 for a constant gain
+  */
+  static void gainRamp(float *samples, std::size_t count, float gain, float step);
+
+  /**
+   * @brief add one stream of samples into another
+   * @param dst samples to add to
+   * @param src samples to add
+   * @param count number of samples
+  */
+  static void mixAdd(float *dst, const float *src, std::size_t count);
+
+  /**
+   * @brief scale signed 16 bit samples by a constant gain, this is the software volume
+   * @param samples samples to scale in place
+   * @param count number of samples
+   * @param gain gain to apply
+  */
+  static void scaleS16(int16_t *samples, std::size_t count, float gain);
+
+  /**
+   * @return name of the instruction set the kernels use, "avx2", "sse2" or "scalar"
+  */
+  static const char *kernelName();
+};
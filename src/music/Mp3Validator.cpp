@@ -0,0 +1,90 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the streaming MP3 validator
+*/
+
+#include "Mp3Validator.hpp"
+
+Mp3Validator::Mp3Validator():
+  position{0}, audioStart{0}, skippedTags{false}, runStart{0}, frames{0}, first{}, verdict{Mp3Verdict::NEED_MORE} {}
+
+void Mp3Validator::restart() {
+  position = runStart + 1;
+  frames = 0;
+}
+
+Mp3Verdict Mp3Validator::feed(const unsigned char *data, std::size_t size) {
+  if (verdict != Mp3Verdict::NEED_MORE) {
+    return verdict;
+  }
+  while (!skippedTags) {
+    // the 10 byte tag header says how long the tag is
+    if (position + 10 > size) {
+      return verdict;
+    }
+    const std::size_t tag = FrameIndex::id3v2Size(data + position, size - position);
+    if (tag == 0) {
+      skippedTags = true;
+      audioStart = position;
+      break;
+    }
+    // id3v2Size stops at size when the rest of the tag has not arrived yet
+    if (position + tag >= size) {
+      return verdict;
+    }
+    position += tag;
+  }
+  while (true) {
+    if (frames == 0) {
+      position = FrameIndex::findSync(data, size, position);
+      if (position - audioStart > MP3_VALIDATOR_MAX_JUNK) {
+        verdict = Mp3Verdict::INVALID;
+        return verdict;
+      }
+      if (position == size) {
+        // the last byte could be the first half of a sync, look at it again once more arrives
+        position = size - 1 > audioStart ? size - 1 : audioStart;
+        return verdict;
+      }
+    }
+    if (position + 4 > size) {
+      return verdict;
+    }
+    Mp3Header_t header{};
+    if (!FrameIndex::parseHeader(data + position, header)) {
+      if (frames == 0) {
+        ++position;
+      } else {
+        restart();
+      }
+      continue;
+    }
+    if (frames == 0) {
+      first = header;
+      runStart = position;
+    } else if (
+      header.sampleRate != first.sampleRate || header.layer != first.layer ||
+      header.mpeg1 != first.mpeg1 || header.channels != first.channels
+    ) {
+      restart();
+      continue;
+    }
+    ++frames;
+    if (frames >= MP3_VALIDATOR_MIN_FRAMES) {
+      verdict = Mp3Verdict::VALID;
+      return verdict;
+    }
+    position += header.frameBytes;
+  }
+}
+
+Mp3Verdict Mp3Validator::finish() {
+  if (verdict == Mp3Verdict::NEED_MORE) {
+    verdict = Mp3Verdict::INVALID;
+  }
+  return verdict;
+}
+
+uint32_t Mp3Validator::getFrames() const {
+  return frames;
+}
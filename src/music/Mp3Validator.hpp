@@ -0,0 +1,101 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Checks that bytes arriving over a socket look like an MP3 before they are stored or sent on
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "FrameIndex.hpp"
+
+// frames in a row with matching headers needed before a song is accepted
+#define MP3_VALIDATOR_MIN_FRAMES 8
+// bytes after the ID3v2 tags searched for the first frame before giving up
+#define MP3_VALIDATOR_MAX_JUNK 65536
+
+/**
+ * @brief Result of checking the bytes so far
+*/
+enum class Mp3Verdict {
+  /** nothing wrong yet, more bytes are needed to decide */
+  NEED_MORE,
+  /** MP3_VALIDATOR_MIN_FRAMES frames were found back to back */
+  VALID,
+  /** not an MP3, or not one the player can decode */
+  INVALID
+};
+
+/**
+ * @brief Walks MP3 frame headers as a song is received. The ID3v2 tags are skipped, then the first frame
+ * has to turn up within MP3_VALIDATOR_MAX_JUNK bytes and be followed by MP3_VALIDATOR_MIN_FRAMES - 1 frames
+ * with the same version, layer, sample rate and channel count. Work done is remembered between calls,
+ * so each byte is looked at about once
+*/
+class Mp3Validator {
+private:
+
+  /**
+   * where the next header is expected, or where to keep searching from
+  */
+  std::size_t position;
+
+  /**
+   * where the audio starts, after the ID3v2 tags, 0 until they have been skipped
+  */
+  std::size_t audioStart;
+
+  /**
+   * true once the tags at the start have been skipped
+  */
+  bool skippedTags;
+
+  /**
+   * start of the run of frames being checked
+  */
+  std::size_t runStart;
+
+  /**
+   * frames in the current run
+  */
+  uint32_t frames;
+
+  /**
+   * header of the first frame in the run, the others have to match it
+  */
+  Mp3Header_t first;
+
+  /**
+   * result so far, once VALID or INVALID it does not change
+  */
+  Mp3Verdict verdict;
+
+  /**
+   * @brief drop the current run and search for a new first frame after it
+  */
+  void restart();
+
+public:
+
+  Mp3Validator();
+
+  /**
+   * @brief check newly arrived bytes
+   * @param data everything received so far, starting from the first byte of the song
+   * @param size number of bytes at data
+   * @return the verdict so far
+  */
+  Mp3Verdict feed(const unsigned char *data, std::size_t size);
+
+  /**
+   * @brief call once every byte has arrived, a song still waiting for more frames is too short to play
+   * @return VALID or INVALID
+  */
+  Mp3Verdict finish();
+
+  /**
+   * @return number of frames in a row checked so far
+  */
+  [[nodiscard]] uint32_t getFrames() const;
+};
@@ -3,6 +3,10 @@
  * Implementation file for music class
 */
 
+#if defined(__APPLE__) || defined(__unix__)
+#include <unistd.h>
+#endif
+
 #include "Music.hpp"
 
 size_t Music::validateFile(FILE *fp) {
@@ -61,6 +65,25 @@ bool Music::readFileAtPath(size_t (*validator)(FILE *)) {
   return true;
 }
 
+int Music::openFileAtPath(size_t &fileSize, size_t (*validator)(FILE *)) const {
+  FILE *fp = fopen(path.c_str(), "r");
+  fileSize = validator(fp);
+  if (fileSize == 0) {
+    if (fp != nullptr) {
+      fclose(fp);
+    }
+    return -1;
+  }
+#if defined(__APPLE__) || defined(__unix__)
+  // the descriptor outlives the FILE, which only buffers reads that are not made
+  const int fd = dup(fileno(fp));
+#else
+  const int fd = -1;
+#endif
+  fclose(fp);
+  return fd;
+}
+
 void Music::writeToPath() {
   FILE *fp = fopen(path.c_str(), "w");
   if (fp == nullptr) {
@@ -91,6 +114,10 @@ std::vector<std::byte> &Music::getVector() {
   return bytes;
 }
 
+const std::vector<std::byte> &Music::getVector() const {
+  return bytes;
+}
+
 void Music::setPath(const std::string &newPath) {
   path = newPath;
 }
@@ -70,6 +70,13 @@ public:
   */
   bool readFileAtPath(size_t (*)(FILE *) = &validateFile);
 
+  /**
+   * Opens the file at Music::path for reading without reading it into Music::bytes, for sending it as it is read
+   * @param fileSize set to the size of the file
+   * @returns file descriptor the caller closes, -1 if the file could not be opened or is not valid
+  */
+  int openFileAtPath(size_t &fileSize, size_t (*)(FILE *) = &validateFile) const;
+
   /**
    * Attemps to read the file at Music::path and store the contents in Music::bytes
    * @returns true on success, false otherwise
@@ -105,6 +112,13 @@ public:
    */
   [[nodiscard]] std::vector<std::byte> &getVector();
 
+  /**
+   * @brief Get the vector of this object
+   * 
+   * @return const std::vector<std::byte>& 
+   */
+  [[nodiscard]] const std::vector<std::byte> &getVector() const;
+
   /**
    * @brief Loads the file, at 'path', into memory and makes a shared pointer to it
    * 
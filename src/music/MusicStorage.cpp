@@ -4,50 +4,163 @@
 */
 
 #include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <iostream>
 #if _WIN32
 // windows includes
 #elif defined(__APPLE__) || defined(__unix__)
 #include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
 #endif
 
 #include "../debug.hpp"
 #include "MusicStorage.hpp"
 
 MusicStorageEntry::MusicStorageEntry():
-  sent{false}, fd{0}, path{},  entryMutex{} {}
+  handle{0, 0}, key{0}, sent{false}, fd{0}, path{}, inMemory{false}, size{0}, frameIndex{}, metadata{}, gainDb{NAN}, hash{0}, state{EntryState::RESERVED}, pins{0}, streamMutex{},
+  receiving{false}, bytesReceived{0}, streamPlayer{nullptr} {}
 
 MusicStorageEntry::MusicStorageEntry(int i, std::string s):
-  sent{false}, fd{i}, path{std::move(s)},  entryMutex{} {}
+  handle{0, 0}, key{0}, sent{false}, fd{i}, path{std::move(s)}, inMemory{false}, size{0}, frameIndex{}, metadata{}, gainDb{NAN}, hash{0}, state{EntryState::RESERVED}, pins{0}, streamMutex{},
+  receiving{false}, bytesReceived{0}, streamPlayer{nullptr} {}
+
+void MusicStorageEntry::reset(int i, std::string s) {
+  sent = 0;
+  fd = i;
+  path = std::move(s);
+  inMemory = false;
+  size = 0;
+  frameIndex.reset();
+  metadata.reset();
+  gainDb = NAN;
+  hash = 0;
+  state = EntryState::RESERVED;
+  receiving = false;
+  bytesReceived = 0;
+  streamPlayer = nullptr;
+}
+
+EntryState MusicStorageEntry::getState() const {
+  return state.load();
+}
 
-const std::regex MusicStorage::tempFileRegEx{"/tmp/musicBroadcaster_[-a-zA-Z0-9._]{6}"};
+bool MusicStorageEntry::transition(EntryState from, EntryState to) {
+  return state.compare_exchange_strong(from, to);
+}
 
-MusicStorage::MusicStorage(): songs{}, musicStorageMutex{} {}
+std::unique_ptr<AudioSource> MusicStorageEntry::openSource() const {
+  // a memfd is mapped straight from memory
+  auto source = AudioSource::fromMappedFile(path);
+  source->setFrameIndex(frameIndex);
+  const float db = gainDb.load();
+  if (!std::isnan(db)) {
+    source->setGain(std::pow(10.0f, db / 20.0f));
+  }
+  return source;
+}
+
+MusicStorage::MusicStorage():
+  slots{}, generations{}, freeSlots{}, keySlot{}, order{ORDER_KEY_SPACE}, nextKey{0}, musicStorageMutex{}, memoryBytes{0}, memoryBudget{MEMORY_BUDGET_BYTES} {
+  keySlot.fill(-1);
+  // taken from the back, so slot 0 is used first
+  for (uint32_t i = MAX_SONGS; i > 0; --i) {
+    freeSlots.push_back(i - 1);
+  }
+}
 
 MusicStorage::~MusicStorage() {
-  for (MusicStorageEntry &entry: songs) {
-    // double guard against deleting local files
-    if (entry.fd > 0 && std::regex_match(songs.front().path, tempFileRegEx)) {
-      remove(entry.path.c_str());
+  for (MusicStorageEntry &entry: slots) {
+    if (!entry.handle.isNull()) {
+      release(entry);
     }
   }
 }
 
+MusicStorageEntry *MusicStorage::_append(const std::string &path, int fd, bool pin) {
+  // a removed entry can still be pinned by the thread that was working on it, skip those slots
+  for (auto iter = freeSlots.rbegin(); iter != freeSlots.rend(); ++iter) {
+    MusicStorageEntry &entry = slots[*iter];
+    if (entry.pins != 0) {
+      continue;
+    }
+    if (pin) {
+      ++entry.pins;
+    }
+    const uint32_t slot = *iter;
+    freeSlots.erase(std::next(iter).base());
+    if (nextKey == ORDER_KEY_SPACE) {
+      _renumber();
+    }
+    if (++generations[slot] == 0) {
+      // 0 is the null handle
+      generations[slot] = 1;
+    }
+    entry.reset(fd, path);
+    entry.handle = {slot, generations[slot]};
+    entry.key = nextKey++;
+    keySlot[entry.key] = static_cast<int>(slot);
+    order.insert(entry.key);
+    return &entry;
+  }
+  return nullptr;
+}
+
+void MusicStorage::_erase(MusicStorageEntry &entry) {
+  entry.state = EntryState::RETIRED;
+  if (entry.pins == 0) {
+    release(entry);
+  }
+  order.erase(entry.key);
+  keySlot[entry.key] = -1;
+  freeSlots.push_back(entry.handle.slot);
+  entry.handle = {0, 0};
+}
+
+MusicStorageEntry *MusicStorage::_at(size_t position) {
+  if (position >= order.size()) {
+    return nullptr;
+  }
+  return &slots[static_cast<size_t>(keySlot[order.select(position)])];
+}
+
+MusicStorageEntry *MusicStorage::_get(EntryHandle_t handle) {
+  if (handle.isNull() || handle.slot >= MAX_SONGS || slots[handle.slot].handle != handle) {
+    return nullptr;
+  }
+  return &slots[handle.slot];
+}
+
+void MusicStorage::_renumber() {
+  DEBUG_P(std::cout << "renumbering queue order keys\n");
+  std::vector<int> inOrder;
+  for (size_t i = 0; i < order.size(); ++i) {
+    inOrder.push_back(keySlot[order.select(i)]);
+  }
+  order.clear();
+  keySlot.fill(-1);
+  nextKey = 0;
+  for (int slot : inOrder) {
+    slots[static_cast<size_t>(slot)].key = nextKey;
+    keySlot[nextKey] = slot;
+    order.insert(nextKey++);
+  }
+}
+
 MusicStorageEntry *MusicStorage::add(const std::string &path, int fd) {
   DEBUG_P(std::cout << "waiting for queue mutex\n");
   std::unique_lock<std::mutex> lock{musicStorageMutex};
   DEBUG_P(std::cout << "got queue mutex\n");
-  if (songs.size() >= MAX_SONGS) {
-    return nullptr;
-  }
-  auto &p_entry = songs.emplace_back(fd, path);
-  p_entry.entryMutex.lock();
-  DEBUG_P(std::cout << "got entry mutex\n");
+  auto p_entry = _append(path, fd, true);
   DEBUG_P(std::cout << "unlocked queue mutex\n");
-  return &p_entry;
+  return p_entry;
 }
 
-MusicStorageEntry *MusicStorage::addAtIndexAndLock(uint8_t index) {
+MusicStorageEntry *MusicStorage::addAtIndexAndPin(uint8_t index) {
   DEBUG_P(std::cout << "adding at index [" << (int)index << "]\n");
   if (index > MAX_SONGS - 1) {
     std::cerr << "Request to add song at index [" << (int)index <<  "] past max songs [" << MAX_SONGS << "]\n";
@@ -56,126 +169,373 @@ MusicStorageEntry *MusicStorage::addAtIndexAndLock(uint8_t index) {
   DEBUG_P(std::cout << "waiting for queue mutex\n");
   std::unique_lock<std::mutex> lock{musicStorageMutex};
   DEBUG_P(std::cout << "got queue mutex\n");
-  if (songs.empty() || songs.size() - 1 < index) {
+  if (order.size() <= index) {
     DEBUG_P(std::cout << "need to add entries to reach index \n");
-    do {
-      songs.emplace_back(0, "");
-    } while (songs.size() - 1 < index);
-    auto &back = songs.back();
-    back.entryMutex.lock();
-    DEBUG_P(std::cout << "got entry mutex\n");
+    while (order.size() < index) {
+      if (_append("", 0, false) == nullptr) {
+        return nullptr;
+      }
+    }
+    auto p_back = _append("", 0, true);
     DEBUG_P(std::cout << "unlocked queue mutex\n");
-    return &back;
+    return p_back;
   }
   DEBUG_P(std::cout << "no need to add entries\n");
-  auto iter = songs.begin();
-  for (int i = 0; i < index; ++i, ++iter);
-  if (!iter->entryMutex.try_lock()) {
-    std::cerr << "Could not get entry lock. Entry at position [" << index << "] is locked\n";
+  auto p_entry = _at(index);
+  if (p_entry->getState() != EntryState::RESERVED || p_entry->pins != 0) {
+    std::cerr << "Entry at position [" << (int)index << "] is already taken\n";
     return nullptr;
   }
-  DEBUG_P(std::cout << "got entry mutex\n");
+  ++p_entry->pins;
   DEBUG_P(std::cout << "unlocked queue mutex\n");
-  return &*iter;
+  return p_entry;
+}
+
+int MusicStorage::openDiskFile(std::string &path) {
+  char s[] = "/tmp/musicBroadcaster_XXXXXX";
+  int filedes = mkstemp(s);
+  if (filedes > 0) {
+    path = s;
+  }
+  return filedes;
+}
+
+int MusicStorage::openTempFile(std::string &path, bool &inMemory) {
+#ifdef __linux__
+  int filedes = memfd_create("musicBroadcaster", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (filedes > 0) {
+    // lets everything that takes a path open the file
+    path = "/proc/self/fd/" + std::to_string(filedes);
+    inMemory = true;
+    return filedes;
+  }
+  DEBUG_P(std::cout << "memfd_create failed, using a file in /tmp\n");
+#endif
+  inMemory = false;
+  return openDiskFile(path);
 }
 
 bool MusicStorage::makeTemp(MusicStorageEntry *p_entry) {
   if (p_entry == nullptr) {
     return false;
   }
-  char s[] = "/tmp/musicBroadcaster_XXXXXX";
-  int filedes = mkstemp(s);
+  std::string path;
+  bool inMemory;
+  int filedes = openTempFile(path, inMemory);
   if (filedes < 1) {
     return false;
   }
-  p_entry->path = s;
+  p_entry->path = std::move(path);
   p_entry->fd = filedes;
+  p_entry->inMemory = inMemory;
   return true;
 }
 
-MusicStorageEntry *MusicStorage::addLocalAndLockEntry() {
+MusicStorageEntry *MusicStorage::addLocalAndPinEntry() {
   return add("path", -1);
 }
 
-MusicStorageEntry *MusicStorage::addTempAndLockEntry() {
-  char s[] = "/tmp/musicBroadcaster_XXXXXX";
-  int filedes = mkstemp(s);
+MusicStorageEntry *MusicStorage::addTempAndPinEntry() {
+  std::string path;
+  bool inMemory;
+  int filedes = openTempFile(path, inMemory);
   if (filedes < 1) {
     return nullptr;
   }
-  return add(s, filedes);
+  auto p_entry = add(path, filedes);
+  if (p_entry == nullptr) {
+    close(filedes);
+    if (!inMemory) {
+      remove(path.c_str());
+    }
+    return nullptr;
+  }
+  p_entry->inMemory = inMemory;
+  return p_entry;
+}
+
+bool MusicStorage::store(MusicStorageEntry *p_entry, const Music &music) {
+  const std::vector<std::byte> &bytes = music.getVector();
+  return reserveStore(p_entry, bytes.size()) &&
+    storeChunk(p_entry, bytes.data(), bytes.size()) &&
+    sealStore(p_entry, bytes.data());
+}
+
+bool MusicStorage::reserveStore(MusicStorageEntry *p_entry, size_t size) {
+  if (p_entry == nullptr || p_entry->fd < 1) {
+    return false;
+  }
+  if (p_entry->inMemory && memoryBytes.fetch_add(size) + size > memoryBudget) {
+    memoryBytes -= size;
+    DEBUG_P(std::cout << "memory budget used up, spilling song to disk\n");
+    std::string path;
+    int filedes = openDiskFile(path);
+    if (filedes < 1) {
+      return false;
+    }
+    close(p_entry->fd);
+    p_entry->fd = filedes;
+    p_entry->path = std::move(path);
+    p_entry->inMemory = false;
+  }
+  // set now so that the budget is given back if the entry is removed before the song is sealed
+  p_entry->size = size;
+  return true;
+}
+
+bool MusicStorage::storeChunk(MusicStorageEntry *p_entry, const std::byte *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    const ssize_t res = ::write(p_entry->fd, data + written, size - written);
+    if (res <= 0) {
+      fprintf(stderr, "write: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    written += static_cast<size_t>(res);
+  }
+  return true;
+}
+
+bool MusicStorage::storeChunkAt(MusicStorageEntry *p_entry, size_t offset, const std::byte *data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    const ssize_t res = ::pwrite(p_entry->fd, data + written, size - written, static_cast<off_t>(offset + written));
+    if (res <= 0) {
+      fprintf(stderr, "pwrite: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    written += static_cast<size_t>(res);
+  }
+  return true;
+}
+
+std::byte *MusicStorage::mapStore(MusicStorageEntry *p_entry) {
+#ifdef __linux__
+  if (p_entry->size == 0) {
+    return nullptr;
+  }
+  const auto size = static_cast<off_t>(p_entry->size);
+  // blocks on disk are taken now, so writing through the map cannot run out of space half way
+  if (fallocate(p_entry->fd, 0, 0, size) == -1 && ftruncate(p_entry->fd, size) == -1) {
+    fprintf(stderr, "fallocate: %s (%d)\n", strerror(errno), errno);
+    return nullptr;
+  }
+  void *address = mmap(nullptr, p_entry->size, PROT_READ | PROT_WRITE, MAP_SHARED, p_entry->fd, 0);
+  if (address == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s (%d)\n", strerror(errno), errno);
+    // storeChunk appends, the file has to be empty again
+    ftruncate(p_entry->fd, 0);
+    return nullptr;
+  }
+  return static_cast<std::byte *>(address);
+#else
+  (void)p_entry;
+  return nullptr;
+#endif
+}
+
+void MusicStorage::unmapStore(MusicStorageEntry *p_entry, std::byte *data) {
+#ifdef __linux__
+  munmap(data, p_entry->size);
+#else
+  (void)p_entry;
+  (void)data;
+#endif
+}
+
+bool MusicStorage::sealStore(MusicStorageEntry *p_entry, const std::byte *data) {
+  if (p_entry->frameIndex == nullptr) {
+    // index while the bytes are still at hand, seeking in the song later does not have to scan it
+    p_entry->frameIndex = FrameIndex::build(reinterpret_cast<const unsigned char *>(data), p_entry->size);
+  }
+#ifdef __linux__
+  if (p_entry->inMemory) {
+    // the song never changes once received, sealing lets readers map it without worrying about that
+    fcntl(p_entry->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  }
+#endif
+  return true;
+}
+
+bool MusicStorage::sealStore(MusicStorageEntry *p_entry) {
+  if (p_entry->frameIndex == nullptr) {
+    // the song is only in the file, map it back to index it
+    p_entry->frameIndex = FrameIndex::fromFile(p_entry->path);
+  }
+#ifdef __linux__
+  if (p_entry->inMemory) {
+    fcntl(p_entry->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  }
+#endif
+  return true;
+}
+
+bool MusicStorage::readChunk(const MusicStorageEntry *p_entry, size_t offset, std::byte *data, size_t size) {
+  size_t read = 0;
+  while (read < size) {
+    const ssize_t res = ::pread(p_entry->fd, data + read, size - read, static_cast<off_t>(offset + read));
+    if (res <= 0) {
+      fprintf(stderr, "pread: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    read += static_cast<size_t>(res);
+  }
+  return true;
+}
+
+void MusicStorage::release(MusicStorageEntry &entry) {
+  if (entry.fd < 1) {
+    // local file or placeholder, not ours to delete
+    return;
+  }
+  if (entry.inMemory) {
+    // closing the last descriptor frees the memory
+    memoryBytes -= entry.size;
+  } else {
+    remove(entry.path.c_str());
+  }
+  close(entry.fd);
+  entry.fd = 0;
 }
 
 MusicStorageEntry *MusicStorage::getFront() {
   std::unique_lock<std::mutex> lock{musicStorageMutex};
-  if (songs.empty()) {
-    return nullptr;
+  return _at(0);
+}
+
+MusicStorageEntry *MusicStorage::getByPosition(uint8_t position) {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  return _at(position);
+}
+
+MusicStorageEntry *MusicStorage::get(EntryHandle_t handle) {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  return _get(handle);
+}
+
+MusicStorageEntry *MusicStorage::pin(EntryHandle_t handle) {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  auto p_entry = _get(handle);
+  if (p_entry != nullptr) {
+    ++p_entry->pins;
+  }
+  return p_entry;
+}
+
+void MusicStorage::unpin(MusicStorageEntry *p_entry) {
+  if (p_entry == nullptr) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  if (--p_entry->pins == 0 && p_entry->getState() == EntryState::RETIRED) {
+    // removed while a thread was working on it
+    release(*p_entry);
   }
-  return &songs.front();
 }
 
 void MusicStorage::removeFront() {
   DEBUG_P(std::cout << "waiting for queue mutex\n");
   std::unique_lock<std::mutex> lock{musicStorageMutex};
   DEBUG_P(std::cout << "got queue mutex\n");
-  // double guard against deleting local files
-  DEBUG_P(std::cout << "waiting for entry mutex\n");
-  songs.front().entryMutex.lock();
-  DEBUG_P(std::cout << "got entry mutex\n");
-  if (songs.front().fd > 0 && std::regex_match(songs.front().path, tempFileRegEx)) {
-    remove(songs.front().path.c_str());
-  }
-  songs.pop_front();
+  auto p_front = _at(0);
+  if (p_front == nullptr) {
+    return;
+  }
+  _erase(*p_front);
   DEBUG_P(std::cout << "deleted front entry\n");
   DEBUG_P(std::cout << "unlocked queue mutex\n");
 }
 
-const std::list<MusicStorageEntry> &MusicStorage::getSongs() const {
-  return songs;
+std::vector<EntryHandle_t> MusicStorage::getHandles() {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  std::vector<EntryHandle_t> handles;
+  handles.reserve(order.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    handles.push_back(_at(i)->handle);
+  }
+  return handles;
+}
+
+size_t MusicStorage::size() {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  return order.size();
 }
 
-void MusicStorage::removeByAddress(const MusicStorageEntry *musicAddress) {
-  if (musicAddress == nullptr) {
+void MusicStorage::printQueue(int64_t frontLeftMs, std::ostream &out) {
+  std::unique_lock<std::mutex> lock{musicStorageMutex};
+  if (order.size() == 0) {
+    out << "The queue is empty\n";
     return;
   }
+  // -1 once a length is unknown, the songs after it cannot be given a start time
+  int64_t startsIn = 0;
+  for (size_t position = 0; position < order.size(); ++position) {
+    const MusicStorageEntry &entry = *_at(position);
+    const EntryState state = entry.getState();
+    out << "  " << position << ". ";
+    if (state != EntryState::READY && state != EntryState::PLAYING) {
+      // the metadata is written along with the data, it can only be read once the entry is READY
+      out << "(receiving)\n";
+      startsIn = -1;
+      continue;
+    }
+    const int64_t duration = entry.metadata != nullptr ? entry.metadata->durationMs : 0;
+    out << (entry.metadata != nullptr ? entry.metadata->describe() : "unknown") <<
+      " [" << SongMetadata::formatDuration(duration) << "]";
+    if (state == EntryState::PLAYING) {
+      out << " playing";
+      if (frontLeftMs > 0) {
+        out << ", " << SongMetadata::formatDuration(frontLeftMs) << " left";
+      }
+      startsIn = frontLeftMs > 0 ? frontLeftMs : -1;
+    } else {
+      if (startsIn > 0) {
+        out << ", starts in " << SongMetadata::formatDuration(startsIn);
+      }
+      startsIn = startsIn >= 0 && duration > 0 ? startsIn + duration : -1;
+    }
+    out << '\n';
+  }
+}
+
+void MusicStorage::setMemoryBudget(size_t bytes) {
+  memoryBudget = bytes;
+}
+
+void MusicStorage::removeByHandle(EntryHandle_t handle) {
   DEBUG_P(std::cout << "waiting for queue mutex\n");
   std::unique_lock<std::mutex> lock(musicStorageMutex);
   DEBUG_P(std::cout << "got queue mutex\n");
-  songs.remove_if([musicAddress](const MusicStorageEntry &song){
-    return &song == musicAddress;
-  });
+  auto p_entry = _get(handle);
+  if (p_entry != nullptr) {
+    _erase(*p_entry);
+  }
   DEBUG_P(std::cout << "unlocked queue mutex\n");
 }
 
 void MusicStorage::removeByPosition(uint8_t position) {
-  if (position > MAX_SONGS - 1) {
-    return;
-  }
   DEBUG_P(std::cout << "waiting for queue mutex\n");
   std::unique_lock<std::mutex> lock(musicStorageMutex);
   DEBUG_P(std::cout << "got queue mutex\n");
-  uint8_t i = 0;
-  auto iter = songs.begin();
-  while (iter != songs.end()) {
-    if (i == position) {
-      songs.erase(iter);
-      DEBUG_P(std::cout << "unlocked queue mutex\n");
-      return;
-    }
-    ++i;
-    ++iter;
+  auto p_entry = _at(position);
+  if (p_entry != nullptr) {
+    _erase(*p_entry);
   }
   DEBUG_P(std::cout << "unlocked queue mutex\n");
 }
 
 int MusicStorage::getPositionInQueue(const MusicStorageEntry *p_find) {
-  uint8_t i = 0;
+  if (p_find == nullptr) {
+    return -1;
+  }
+  return getPositionInQueue(p_find->handle);
+}
+
+int MusicStorage::getPositionInQueue(EntryHandle_t handle) {
   std::unique_lock<std::mutex> lock(musicStorageMutex);
-  for (const MusicStorageEntry &entry : songs) {
-    if (&entry == p_find) {
-      return static_cast<int>(i);
-    }
-    ++i;
+  auto p_entry = _get(handle);
+  if (p_entry == nullptr) {
+    return -1;
   }
-  return -1;
+  return static_cast<int>(order.rank(p_entry->key));
 }
@@ -10,13 +10,14 @@
 
 #pragma once
 
-#include <list>
+#include <array>
+#include <vector>
 #include <memory>
 #include <atomic>
-#include <regex>
 #include <mutex>
 #include <string>
 #include <iostream>
+#include <cmath>
 #if _WIN32
 // windows includes
 #elif defined(__APPLE__) || defined(__unix__)
@@ -25,32 +26,166 @@
 
 #include "../debug.hpp"
 #include "Music.hpp"
+#include "AudioSource.hpp"
+#include "FrameIndex.hpp"
+#include "SongMetadata.hpp"
+#include "OrderIndex.hpp"
 
 // ABSOLUTE max is the max number representable by the size of 'option' in Message class, so currently 255 (1 byte)
 #define MAX_SONGS 50
 
+// songs are kept in memory until they add up to this many bytes, past that they are spilled to a file in /tmp.
+// A room can be given a different budget with MusicStorage::setMemoryBudget
+#define MEMORY_BUDGET_BYTES 200000000
+
+// number of order keys before they are renumbered, must be greater than MAX_SONGS
+#define ORDER_KEY_SPACE 256
+
+class Player;
+
+/**
+ * Refers to an entry in a MusicStorage. Unlike a pointer it is safe to hold on to after the entry is removed,
+ * looking it up then gives nullptr instead of whatever entry reuses the slot
+*/
+typedef struct EntryHandle {
+  /**
+   * index of the entry's slot
+  */
+  uint32_t slot;
+  /**
+   * which use of the slot this refers to, 0 for no entry
+  */
+  uint32_t generation;
+
+  [[nodiscard]] bool isNull() const { return generation == 0; }
+  bool operator==(const EntryHandle &rhs) const { return slot == rhs.slot && generation == rhs.generation; }
+  bool operator!=(const EntryHandle &rhs) const { return !(*this == rhs); }
+} EntryHandle_t;
+
 /**
- * Entry in the MusicStorage list
+ * Lifecycle of a queue entry. Each step is made with an atomic compare and swap, so whoever sees
+ * an entry READY knows its data is complete without taking a lock
+*/
+enum class EntryState : uint8_t {
+  /** has a place in the queue, no data yet */
+  RESERVED,
+  /** data is arriving */
+  RECEIVING,
+  /** all data is stored, it can be played and sent */
+  READY,
+  /** the audio player is on it */
+  PLAYING,
+  /** taken out of the queue */
+  RETIRED
+};
+
+/**
+ * Entry in the MusicStorage queue
 */
 class MusicStorageEntry {
 public:
+  /**
+   * handle to this entry, null while the slot is free
+  */
+  EntryHandle_t handle;
+
+  /**
+   * order key, entries are in the queue in increasing key order
+  */
+  size_t key;
+
   /**
    * If/how many times this entry has been sent
   */
   std::atomic<int> sent;
 
   /**
-   * File descriptor of the file which holds the music information
+   * File descriptor of the file which holds the music information, greater than 0 if the file belongs to the queue
   */
   int fd;
   /**
-   * Path to the file
+   * Path to the file, /proc/self/fd/N for a file held in memory
   */
   std::string path;
+
+  /**
+   * true if the file is a memfd, its size counts against MEMORY_BUDGET_BYTES
+  */
+  bool inMemory;
+
+  /**
+   * number of bytes stored in the file by MusicStorage::store
+  */
+  size_t size;
+
+  /**
+   * offsets of the song's frames, made by store or sent by the room, nullptr if there is none
+  */
+  std::shared_ptr<const FrameIndex> frameIndex;
+
+  /**
+   * title, artist, album and length, read by the room or sent by it, nullptr until known
+  */
+  std::shared_ptr<const SongMetadata> metadata;
+
+  /**
+   * gain that brings the song to LOUDNESS_TARGET_LUFS in dB, worked out by the room after the song
+   * is stored or sent by it. NAN until known
+  */
+  std::atomic<float> gainDb;
+
+  /**
+   * FNV-1a hash of the song's bytes, worked out by the room while receiving it. 0 if not known
+  */
+  uint64_t hash;
+
+  /**
+   * where the entry is in its lifecycle
+  */
+  std::atomic<EntryState> state;
+
+  /**
+   * number of threads working on the entry outside the queue mutex, its file and slot are not
+   * released until this is 0. Only changed with the queue mutex held
+  */
+  std::atomic<int> pins;
+
   /**
-   * mutex for the entry
+   * guards receiving, bytesReceived and streamPlayer, which let a Player start on the entry while it is still being received
   */
-  std::mutex entryMutex;
+  std::mutex streamMutex;
+
+  /**
+   * true while the song is being received straight into the entry's file
+  */
+  bool receiving;
+
+  /**
+   * number of bytes of the song in the entry's file so far
+  */
+  size_t bytesReceived;
+
+  /**
+   * player to push bytes to as they arrive, nullptr if no player is streaming this entry
+  */
+  Player *streamPlayer;
+
+  /**
+   * @return where the entry is in its lifecycle
+  */
+  [[nodiscard]] EntryState getState() const;
+
+  /**
+   * @brief move the entry from one state to another
+   * @return false if the entry was not in state from, nothing is changed then
+  */
+  bool transition(EntryState from, EntryState to);
+
+  /**
+   * @brief make a source for a Player to decode this entry from, the file at path mapped into memory,
+   * with the frame index and loudness gain attached if there are any
+  */
+  [[nodiscard]] std::unique_ptr<AudioSource> openSource() const;
 
   /**
    * Constructor
@@ -61,24 +196,106 @@ public:
    * Constructor
   */
   MusicStorageEntry(int, std::string);
+
+  /**
+   * @brief clear the entry for a new song in the RESERVED state, pins are left as they are
+  */
+  void reset(int, std::string);
 };
 
 class MusicStorage {
 private:
   /**
-   * Regular expression to match temp file paths
+   * entries live in fixed slots so that pointers and handles to them never move
+  */
+  std::array<MusicStorageEntry, MAX_SONGS> slots;
+
+  /**
+   * generation of the last use of each slot
+  */
+  std::array<uint32_t, MAX_SONGS> generations;
+
+  /**
+   * slots that are not in the queue
+  */
+  std::vector<uint32_t> freeSlots;
+
+  /**
+   * slot holding each order key, -1 if the key is not used
+  */
+  std::array<int, ORDER_KEY_SPACE> keySlot;
+
+  /**
+   * order keys of the entries in the queue, gives positions in O(log n)
   */
-  static const std::regex tempFileRegEx;
+  OrderIndex order;
+
   /**
-   * we dont need the music objects to be next to each other, so use a list
+   * order key given to the next entry added to the back of the queue
   */
-  std::list<MusicStorageEntry> songs;
+  size_t nextKey;
 
   /**
    * Mutex for the list
   */
   std::mutex musicStorageMutex;
 
+  /**
+   * bytes of the songs that are held in memory
+  */
+  std::atomic<size_t> memoryBytes;
+
+  /**
+   * bytes of songs that can be held in memory, MEMORY_BUDGET_BYTES unless changed
+  */
+  std::atomic<size_t> memoryBudget;
+
+  /**
+   * @brief close and delete an entry's file if it belongs to the queue, and give back its memory budget
+  */
+  void release(MusicStorageEntry &);
+
+  /**
+   * @brief take a free slot and put it at the back of the queue, musicStorageMutex must be held
+   * @param pin true to return the entry pinned
+   * @return the entry, nullptr if no room
+  */
+  MusicStorageEntry *_append(const std::string &path, int fd, bool pin);
+
+  /**
+   * @brief take an entry out of the queue and free its slot, musicStorageMutex must be held
+  */
+  void _erase(MusicStorageEntry &);
+
+  /**
+   * @return entry at a position, nullptr if there is none, musicStorageMutex must be held
+  */
+  MusicStorageEntry *_at(size_t position);
+
+  /**
+   * @return entry a handle refers to, nullptr if it has been removed, musicStorageMutex must be held
+  */
+  MusicStorageEntry *_get(EntryHandle_t handle);
+
+  /**
+   * @brief give the entries in the queue the keys 0 to n - 1, once nextKey runs out of key space
+  */
+  void _renumber();
+
+  /**
+   * @brief open an anonymous file in memory, falls back to a temp file in /tmp where memfd_create is not available
+   * @param path set to a path that opens the file
+   * @param inMemory set to true if the file is in memory
+   * @return file descriptor, less than 1 on error
+  */
+  static int openTempFile(std::string &path, bool &inMemory);
+
+  /**
+   * @brief open a temp file in /tmp
+   * @return file descriptor, less than 1 on error
+  */
+  static int openDiskFile(std::string &path);
+
   /**
    * @brief Add an unnamed Music object to the back of the list
    * @returns pointer to the new Music object, nullptr if no room
@@ -100,14 +317,15 @@ public:
   ~MusicStorage();
 
   /** 
-   * @brief Adds an entry at the the specified index in the queue and locks it's mutex
+   * @brief Adds an entry at the the specified index in the queue and pins it, or pins the entry
+   * already there if it is still RESERVED
    * 
-   * @return pointer to the entry
+   * @return pointer to the entry, nullptr if the position is past MAX_SONGS or already has data
    */
-  MusicStorageEntry *addAtIndexAndLock(uint8_t index);
+  MusicStorageEntry *addAtIndexAndPin(uint8_t index);
 
   /** 
-   * @brief Set an entry's path to a new temp file
+   * @brief Set an entry's path to a new temp file, held in memory when possible
    * 
    * @param pointer to the entry
    * @return true on success, false on error
@@ -116,28 +334,132 @@ public:
 
 
   /** 
-   * @brief Adds an entry at the end of the queue, sets it's path set to a new temp file, and locks it's mutex
+   * @brief Adds an entry at the end of the queue, sets it's path set to a new temp file, and pins it
    * 
    * @return pointer to the entry
    */
-  MusicStorageEntry *addTempAndLockEntry();
+  MusicStorageEntry *addTempAndPinEntry();
 
   /** 
-   * @brief Adds an entry at the end of the queue and locks it's mutex
+   * @brief Adds an entry at the end of the queue and pins it
    * 
    * @return pointer to the entry
    */
-  MusicStorageEntry *addLocalAndLockEntry();
+  MusicStorageEntry *addLocalAndPinEntry();
+
+  /**
+   * @brief Pin an entry so that its slot is not reused while a thread works on it, even if it is removed
+   * 
+   * @param handle handle to the entry
+   * @return pointer to the entry, nullptr if it has been removed
+   */
+  MusicStorageEntry *pin(EntryHandle_t handle);
+
+  /**
+   * @brief Let go of an entry pinned by MusicStorage::pin or one of the add functions.
+   * If the entry was removed meanwhile, its file is released once the last pin is gone
+   */
+  void unpin(MusicStorageEntry *);
+
+  /**
+   * @brief Write a received song to the entry's temp file and seal it. The file stays in memory while
+   * the memory budget allows, otherwise it is moved to disk. Builds the entry's frame index if it has none
+   * 
+   * @param p_entry pointer to the entry, must have a temp file from MusicStorage::makeTemp or MusicStorage::addTempAndPinEntry
+   * @param music the received song
+   * @return true on success, false on error
+   */
+  bool store(MusicStorageEntry *p_entry, const Music &music);
+
+  /**
+   * @brief First step of MusicStorage::store for a song written a piece at a time: decide whether the song
+   * stays in memory and count it against the budget
+   * 
+   * @param p_entry pointer to the entry, must have a temp file
+   * @param size size of the whole song
+   * @return true on success, false on error
+   */
+  bool reserveStore(MusicStorageEntry *p_entry, size_t size);
+
+  /**
+   * @brief Append the next piece of a song to the entry's file, after MusicStorage::reserveStore
+   * 
+   * @return true on success, false on error
+   */
+  static bool storeChunk(MusicStorageEntry *p_entry, const std::byte *data, size_t size);
+
+  /**
+   * @brief Write a piece of a song to its place in the entry's file, for pieces that arrive out of order
+   * 
+   * @param offset where in the song the piece goes
+   * @return true on success, false on error
+   */
+  static bool storeChunkAt(MusicStorageEntry *p_entry, size_t offset, const std::byte *data, size_t size);
+
+  /**
+   * @brief Instead of MusicStorage::storeChunk, give the entry's file its whole size up front and map it,
+   * so a song can be read from a socket straight into its file. After MusicStorage::reserveStore, Linux only
+   * 
+   * @return p_entry->size bytes of the file, nullptr if it could not be mapped, storeChunk is used then
+   */
+  static std::byte *mapStore(MusicStorageEntry *p_entry);
+
+  /**
+   * @brief Let go of the mapping from MusicStorage::mapStore, before the file is sealed
+   */
+  static void unmapStore(MusicStorageEntry *p_entry, std::byte *data);
+
+  /**
+   * @brief Last step of a song written a piece at a time: build the frame index if the entry has none and seal the file
+   * 
+   * @param p_entry pointer to the entry
+   * @param data the whole song, p_entry->size bytes
+   * @return true on success, false on error
+   */
+  static bool sealStore(MusicStorageEntry *p_entry, const std::byte *data);
+
+  /**
+   * @brief Last step of a song written a piece at a time when the whole song is not at hand: build the frame index
+   * from the file if the entry has none and seal the file
+   * 
+   * @param p_entry pointer to the entry
+   * @return true on success, false on error
+   */
+  static bool sealStore(MusicStorageEntry *p_entry);
+
+  /**
+   * @brief Read back part of what has been written to the entry's file
+   * 
+   * @param offset where in the song to start
+   * @return true on success, false on error
+   */
+  static bool readChunk(const MusicStorageEntry *p_entry, size_t offset, std::byte *data, size_t size);
 
 
   /**
    * @brief Get the position of an entry in the queue
    * 
    * @param entry pointer to the entry
-   * @return the position in the queue (0 being first)
+   * @return the position in the queue (0 being first), -1 if it is not in the queue
    */
   int getPositionInQueue(const MusicStorageEntry *);
 
+  /**
+   * @brief Get the position of an entry in the queue
+   * 
+   * @param handle handle to the entry
+   * @return the position in the queue (0 being first), -1 if it has been removed
+   */
+  int getPositionInQueue(EntryHandle_t handle);
+
+  /**
+   * @brief Look up an entry by handle
+   * 
+   * @param handle handle to the entry
+   * @return MusicStorageEntry* Pointer to the entry, nullptr if it has been removed
+   */
+  [[nodiscard]] MusicStorageEntry *get(EntryHandle_t handle);
+
   /**
    * @brief Gets the first song in the list
    * 
@@ -146,9 +468,36 @@ public:
   [[nodiscard]] MusicStorageEntry *getFront();
 
   /**
-   * @brief Get the list of songs
+   * @brief Gets the song at a position in the list
+   * 
+   * @param position The position (0 being first)
+   * @return MusicStorageEntry* Pointer to the song, nullptr if there is none at that position
+   */
+  [[nodiscard]] MusicStorageEntry *getByPosition(uint8_t position);
+
+  /**
+   * @brief Get handles to every entry, in queue order
    */
-  [[nodiscard]] const std::list<MusicStorageEntry> &getSongs() const;
+  [[nodiscard]] std::vector<EntryHandle_t> getHandles();
+
+  /**
+   * @brief Get the number of entries in the queue
+   */
+  [[nodiscard]] size_t size();
+
+  /**
+   * @brief Print the queue with each song's title, length and when it starts, for the 'queue' command
+   * 
+   * @param frontLeftMs ms left of the song at the front if it is playing, 0 or less if that is not known
+   * @param out where to print it
+   */
+  void printQueue(int64_t frontLeftMs, std::ostream &out = std::cout);
+
+  /**
+   * @brief Set how many bytes of songs can be held in memory, songs stored after that go to disk.
+   * Songs already in memory stay there
+   */
+  void setMemoryBudget(size_t bytes);
 
   /**
    * @brief Removes the first song in the list
@@ -156,12 +505,12 @@ public:
    */
   void removeFront();
 
-   /**
-   * @brief Removes a music object by its address
+  /**
+   * @brief Removes a music object by its handle, does nothing if it has already been removed
    * 
-   * @param musicAddress The address of the music/song 
+   * @param handle handle to the entry
    */
-  void removeByAddress(const MusicStorageEntry *);
+  void removeByHandle(EntryHandle_t handle);
   
   /**
    * @brief Removes a music object by its position in queue
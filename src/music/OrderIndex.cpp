@@ -0,0 +1,67 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for order index class
+*/
+
+#include <algorithm>
+
+#include "OrderIndex.hpp"
+
+OrderIndex::OrderIndex(std::size_t capacity): tree(capacity + 1, 0), topBit{1}, count{0} {
+  while (topBit * 2 <= capacity) {
+    topBit *= 2;
+  }
+}
+
+void OrderIndex::update(std::size_t key, int delta) {
+  for (std::size_t i = key + 1; i < tree.size(); i += i & (~i + 1)) {
+    tree[i] += delta;
+  }
+}
+
+void OrderIndex::insert(std::size_t key) {
+  update(key, 1);
+  ++count;
+}
+
+void OrderIndex::erase(std::size_t key) {
+  update(key, -1);
+  --count;
+}
+
+std::size_t OrderIndex::rank(std::size_t key) const {
+  int sum = 0;
+  // prefix sum over [0, key)
+  for (std::size_t i = key; i > 0; i -= i & (~i + 1)) {
+    sum += tree[i];
+  }
+  return static_cast<std::size_t>(sum);
+}
+
+std::size_t OrderIndex::select(std::size_t k) const {
+  // walk down the tree, skipping every subtree that holds no more than the keys still to pass
+  std::size_t position = 0;
+  int remaining = static_cast<int>(k);
+  for (std::size_t step = topBit; step > 0; step /= 2) {
+    const std::size_t next = position + step;
+    if (next < tree.size() && tree[next] <= remaining) {
+      position = next;
+      remaining -= tree[next];
+    }
+  }
+  // position is the number of 1 based slots passed, which is the 0 based key
+  return position;
+}
+
+std::size_t OrderIndex::size() const {
+  return count;
+}
+
+std::size_t OrderIndex::capacity() const {
+  return tree.size() - 1;
+}
+
+void OrderIndex::clear() {
+  std::fill(tree.begin(), tree.end(), 0);
+  count = 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Order statistics over a set of small integer keys
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Set of keys in [0, capacity) that answers "how many keys are smaller than this one" and
+ * "which key is the k-th smallest" in O(log capacity). Backed by a Fenwick tree of key counts.
+ * Not thread safe
+*/
+class OrderIndex {
+private:
+
+  /**
+   * Fenwick tree, tree[i] counts the keys in (i - lowbit(i), i], 1 based
+  */
+  std::vector<int> tree;
+
+  /**
+   * highest power of two not greater than the capacity, where OrderIndex::select starts its descent
+  */
+  std::size_t topBit;
+
+  /**
+   * number of keys in the set
+  */
+  std::size_t count;
+
+  /**
+   * @brief add delta to the count of key
+  */
+  void update(std::size_t key, int delta);
+
+public:
+
+  /**
+   * @param capacity keys must be less than this
+  */
+  explicit OrderIndex(std::size_t capacity);
+
+  /**
+   * @brief add a key, it must not already be in the set
+  */
+  void insert(std::size_t key);
+
+  /**
+   * @brief remove a key, it must be in the set
+  */
+  void erase(std::size_t key);
+
+  /**
+   * @return number of keys in the set that are less than key
+  */
+  [[nodiscard]] std::size_t rank(std::size_t key) const;
+
+  /**
+   * @param k 0 based, must be less than OrderIndex::size
+   * @return the k-th smallest key
+  */
+  [[nodiscard]] std::size_t select(std::size_t k) const;
+
+  /**
+   * @return number of keys in the set
+  */
+  [[nodiscard]] std::size_t size() const;
+
+  /**
+   * @return keys must be less than this
+  */
+  [[nodiscard]] std::size_t capacity() const;
+
+  /**
+   * @brief remove every key
+  */
+  void clear();
+};
@@ -0,0 +1,84 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the PCM ring buffer
+*/
+
+#include <cstring>
+
+#include "PcmRing.hpp"
+
+static std::size_t roundUpPowerOfTwo(std::size_t n) {
+  std::size_t power = 1;
+  while (power < n) {
+    power <<= 1;
+  }
+  return power;
+}
+
+PcmRing::PcmRing(std::size_t capacity):
+  buffer(roundUpPowerOfTwo(capacity)), mask{buffer.size() - 1}, readPos{0}, writePos{0} {}
+
+void PcmRing::resize(std::size_t capacity) {
+  buffer.assign(roundUpPowerOfTwo(capacity), 0);
+  mask = buffer.size() - 1;
+  reset();
+}
+
+void PcmRing::reset() {
+  readPos = 0;
+  writePos = 0;
+}
+
+std::size_t PcmRing::write(const void *data, std::size_t size) {
+  const uint64_t write = writePos.load(std::memory_order_relaxed);
+  const uint64_t read = readPos.load(std::memory_order_acquire);
+  const std::size_t space = buffer.size() - static_cast<std::size_t>(write - read);
+  const std::size_t count = size < space ? size : space;
+  const std::size_t start = static_cast<std::size_t>(write) & mask;
+  // copy in up to two pieces, the second one when wrapping around the end
+  const std::size_t first = count < buffer.size() - start ? count : buffer.size() - start;
+  memcpy(buffer.data() + start, data, first);
+  memcpy(buffer.data(), static_cast<const unsigned char *>(data) + first, count - first);
+  writePos.store(write + count, std::memory_order_release);
+  return count;
+}
+
+std::size_t PcmRing::read(void *data, std::size_t size) {
+  const uint64_t read = readPos.load(std::memory_order_relaxed);
+  const uint64_t write = writePos.load(std::memory_order_acquire);
+  const auto available = static_cast<std::size_t>(write - read);
+  const std::size_t count = size < available ? size : available;
+  const std::size_t start = static_cast<std::size_t>(read) & mask;
+  const std::size_t first = count < buffer.size() - start ? count : buffer.size() - start;
+  memcpy(data, buffer.data() + start, first);
+  memcpy(static_cast<unsigned char *>(data) + first, buffer.data(), count - first);
+  readPos.store(read + count, std::memory_order_release);
+  return count;
+}
+
+void PcmRing::discardUntil(uint64_t position) {
+  const uint64_t read = readPos.load(std::memory_order_relaxed);
+  const uint64_t write = writePos.load(std::memory_order_acquire);
+  if (position <= read) {
+    return;
+  }
+  readPos.store(position < write ? position : write, std::memory_order_release);
+}
+
+std::size_t PcmRing::fill() const {
+  // read first, the write position can only be ahead of it
+  const uint64_t read = readPos.load(std::memory_order_acquire);
+  return static_cast<std::size_t>(writePos.load(std::memory_order_acquire) - read);
+}
+
+uint64_t PcmRing::readPosition() const {
+  return readPos.load(std::memory_order_acquire);
+}
+
+uint64_t PcmRing::written() const {
+  return writePos.load(std::memory_order_acquire);
+}
+
+std::size_t PcmRing::capacity() const {
+  return buffer.size();
+}
@@ -0,0 +1,103 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Lock-free single producer single consumer ring buffer for decoded audio
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// default size of the decoded audio ring between the decoder and output threads (about 1.5 s of 44.1 kHz stereo)
+#define PCM_RING_BYTES 262144
+// largest ring a room can be configured with (about 6 minutes of 44.1 kHz stereo)
+#define PCM_RING_MAX_BYTES 67108864
+
+/**
+ * @brief Ring buffer of decoded PCM bytes between the decoder thread (producer) and the output thread (consumer).
+ * Positions only ever increase, the index into the buffer is the position modulo the capacity.
+ * Exactly one thread may write and exactly one thread may read at a time
+*/
+class PcmRing {
+private:
+
+  /**
+   * storage, size is a power of two
+  */
+  std::vector<unsigned char> buffer;
+
+  /**
+   * capacity - 1, used to wrap positions into the buffer
+  */
+  std::size_t mask;
+
+  /**
+   * total bytes read, only changed by the consumer
+  */
+  std::atomic<uint64_t> readPos;
+
+  /**
+   * total bytes written, only changed by the producer
+  */
+  std::atomic<uint64_t> writePos;
+
+public:
+
+  /**
+   * @brief Construct a new ring
+   * @param capacity size in bytes, rounded up to a power of two
+  */
+  explicit PcmRing(std::size_t capacity);
+
+  PcmRing(const PcmRing &) = delete;
+
+  /**
+   * @brief Change the size of the ring and empty it. Neither thread may be using the ring
+   * @param capacity size in bytes, rounded up to a power of two
+  */
+  void resize(std::size_t capacity);
+
+  /**
+   * @brief Empty the ring. Neither thread may be using the ring
+  */
+  void reset();
+
+  /**
+   * @brief Producer only. Copy as many bytes as fit into the ring
+   * @return number of bytes written
+  */
+  std::size_t write(const void *data, std::size_t size);
+
+  /**
+   * @brief Consumer only. Copy up to size bytes out of the ring
+   * @return number of bytes read
+  */
+  std::size_t read(void *data, std::size_t size);
+
+  /**
+   * @brief Consumer only. Throw away everything written before position
+  */
+  void discardUntil(uint64_t position);
+
+  /**
+   * @return number of bytes waiting to be read
+  */
+  [[nodiscard]] std::size_t fill() const;
+
+  /**
+   * @return total number of bytes ever read or discarded
+  */
+  [[nodiscard]] uint64_t readPosition() const;
+
+  /**
+   * @return total number of bytes ever written
+  */
+  [[nodiscard]] uint64_t written() const;
+
+  /**
+   * @return size of the ring in bytes
+  */
+  [[nodiscard]] std::size_t capacity() const;
+};
@@ -3,53 +3,392 @@
  * Implementation file for player class
 */
 
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+
 #include "Player.hpp"
 
-Player::Player(): shouldPlay{} {
+Player::Player(): Player{"", ""} {}
+
+Player::Player(const std::string &driver, const std::string &device): shouldPlay{}, decodeDone{false}, playBuffer{nullptr}, ring{PCM_RING_BYTES}, flushUntil{0}, outputMutex{},
+  nextMh{nullptr}, source{}, nextSource{}, nextReady{false}, preloadBuffer{nullptr}, preloadBytes{0}, preloadOffset{0}, preloadConsumedFrames{0},
+  crossfadeMs{0}, fading{false}, fadePos{0}, fadeLen{0}, fadeCurrent{}, fadeNext{}, fadeStage{}, volume{1.0f}, trackGain{1.0f}, nextTrackGain{1.0f}, preloadMutex{},
+  trackBoundary{0}, trackAdvanced{false}, trackMutex{}, trackCond{},
+  rate{0}, channels{0}, encoding{0}, frameSize{0}, framesPlayed{0}, pendingSeek{-1.0}, driftFrames{0},
+  lastSkewMs{0}, maxSkewMs{0}, framesInserted{0}, framesDropped{0}, driftSeeks{0}, underruns{0}, lastSeekUs{0}, maxSeekUs{0},
+  streaming{false}, skipFrames{0}, streamInput{}, streamBuffered{0}, streamEnded{false}, streamMutex{}, streamCond{} {
   mh = mpg123_new(nullptr, nullptr);
-  if (mh == nullptr) {
+  nextMh = mpg123_new(nullptr, nullptr);
+  if (mh == nullptr || nextMh == nullptr) {
     std::cerr << "Error: mpg123 library failed\n";
     exit(1);
   }
-  ao = out123_new();
-  if (ao == nullptr) {
-    std::cerr << "Error: out123 library failed\n";
-    exit(1);
-  }
+  sink = AudioSink::create(driver, device);
+  AudioSource::installReader(mh);
+  AudioSource::installReader(nextMh);
   mpg123_param(mh, MPG123_ADD_FLAGS, MPG123_IGNORE_STREAMLENGTH, 0); // removes warning message on 'Frankenstein'
+  mpg123_param(nextMh, MPG123_ADD_FLAGS, MPG123_IGNORE_STREAMLENGTH, 0);
+  _forceS16(mh);
+  _forceS16(nextMh);
   outBufferSize = mpg123_outblock(mh);
-  outBuffer = malloc(outBufferSize);
-  if(out123_open(ao, nullptr, nullptr) != OUT123_OK) {
-    std::cout << "err: " << out123_strerror(ao) << '\n';
-    exit(1);
-  }
+  // twice the size so that drift correction has room to insert sample frames
+  outBuffer = malloc(outBufferSize * 2);
+  playBuffer = malloc(outBufferSize);
+  preloadBuffer = malloc(outBufferSize);
+  fadeCurrent.resize(outBufferSize / sizeof (int16_t));
+  fadeNext.resize(outBufferSize / sizeof (int16_t));
+  fadeStage.resize(outBufferSize / sizeof (int16_t));
 }
 
 Player::~Player() {
   pause();
   wait();
-  out123_del(ao);
   mpg123_delete(mh);
+  mpg123_delete(nextMh);
   free(outBuffer);
+  free(playBuffer);
+  free(preloadBuffer);
 }
 
 void Player::feed(const char *fp) {
+  feed(AudioSource::fromMappedFile(fp));
+}
+
+void Player::feed(std::unique_ptr<AudioSource> newSource) {
   pause();
-  mpg123_open(mh, fp);
+  framesPlayed = 0;
+  pendingSeek = -1.0;
+  driftFrames = 0;
+  maxSkewMs = 0;
+  streaming = false;
+  ring.reset();
+  flushUntil = 0;
+  cancelPreload();
+  _endFade();
+  takeTrackAdvance();
+  // close before the old source goes away, mh may still be reading from it
+  mpg123_close(mh);
+  source = std::move(newSource);
+  trackGain = source->getGain();
+  source->open(mh);
   _newFormat();
 }
 
+void Player::feedStream() {
+  pause();
+  framesPlayed = 0;
+  pendingSeek = -1.0;
+  driftFrames = 0;
+  maxSkewMs = 0;
+  skipFrames = 0;
+  ring.reset();
+  flushUntil = 0;
+  cancelPreload();
+  _endFade();
+  takeTrackAdvance();
+  // the format is not known until enough of the stream has been decoded
+  rate = 0;
+  frameSize = 0;
+  {
+    std::unique_lock<std::mutex> lock{streamMutex};
+    streamInput.clear();
+    streamBuffered = 0;
+    streamEnded = false;
+  }
+  streaming = true;
+  trackGain = 1.0f;
+  mpg123_close(mh);
+  source.reset();
+  if (mpg123_open_feed(mh) != MPG123_OK) {
+    std::cout << "err: " << mpg123_strerror(mh) << '\n';
+  }
+}
+
+void Player::pushStream(const std::byte *data, std::size_t size) {
+  if (!streaming) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock{streamMutex};
+    const auto *bytes = reinterpret_cast<const unsigned char *>(data);
+    streamInput.insert(streamInput.end(), bytes, bytes + size);
+    streamBuffered += size;
+  }
+  streamCond.notify_one();
+}
+
+void Player::endStream() {
+  {
+    std::unique_lock<std::mutex> lock{streamMutex};
+    streamEnded = true;
+  }
+  streamCond.notify_one();
+}
+
+bool Player::_feedStreamInput(bool wait) {
+  std::vector<unsigned char> input;
+  {
+    std::unique_lock<std::mutex> lock{streamMutex};
+    if (wait) {
+      streamCond.wait(lock, [this]() {
+        return !streamInput.empty() || streamEnded || !shouldPlay;
+      });
+    }
+    if (streamInput.empty()) {
+      return !streamEnded;
+    }
+    input.swap(streamInput);
+  }
+  if (mpg123_feed(mh, input.data(), input.size()) != MPG123_OK) {
+    std::cout << "err: " << mpg123_strerror(mh) << '\n';
+  }
+  return true;
+}
+
+void Player::_applySkip(std::size_t &bytes) {
+  const std::size_t size = frameSize;
+  if (skipFrames <= 0 || size == 0) {
+    return;
+  }
+  const auto frames = static_cast<int64_t>(bytes / size);
+  const int64_t skip = skipFrames < frames ? skipFrames : frames;
+  const auto skipBytes = static_cast<std::size_t>(skip) * size;
+  auto *buffer = static_cast<unsigned char *>(outBuffer);
+  memmove(buffer, buffer + skipBytes, bytes - skipBytes);
+  bytes -= skipBytes;
+  skipFrames -= skip;
+  framesPlayed += skip;
+}
+
 void Player::_newFormat() {
   int channels, encoding;
-  long rate;
-  if (mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK) {
+  long newRate;
+  if (mpg123_getformat(mh, &newRate, &channels, &encoding) != MPG123_OK) {
     std::cout << "err: " << mpg123_strerror(mh) << '\n';
     exit(1);
   }
-  if (out123_start(ao, rate, channels, encoding) != OUT123_OK) {
-    std::cout << "err: " << out123_strerror(ao) << '\n';
+  // let the output thread play everything decoded in the old format first
+  while (ring.fill() > 0 && shouldPlay) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::unique_lock<std::mutex> lock{outputMutex};
+  if (!sink->start(newRate, channels, encoding)) {
+    std::cout << "err: audio output cannot play this song's format\n";
     exit(1);
   }
+  rate = newRate;
+  this->channels = channels;
+  this->encoding = encoding;
+  frameSize = static_cast<std::size_t>(channels * mpg123_encsize(encoding));
+}
+
+void Player::_forceS16(mpg123_handle *handle) {
+  static const long rates[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+  mpg123_format_none(handle);
+  for (const long r : rates) {
+    mpg123_format(handle, r, MPG123_MONO | MPG123_STEREO, MPG123_ENC_SIGNED_16);
+  }
+}
+
+void Player::setCrossfadeMs(int64_t ms) {
+  crossfadeMs = ms < 0 ? 0 : ms;
+}
+
+int64_t Player::getCrossfadeMs() const {
+  return crossfadeMs;
+}
+
+void Player::setVolume(float gain) {
+  volume = gain < 0 ? 0 : gain;
+}
+
+float Player::getVolume() const {
+  return volume;
+}
+
+void Player::setTrackGain(float linear) {
+  trackGain = linear < 0 ? 0 : linear;
+}
+
+void Player::setNextTrackGain(float linear) {
+  nextTrackGain = linear < 0 ? 0 : linear;
+}
+
+bool Player::preload(const char *fp) {
+  return preload(AudioSource::fromMappedFile(fp));
+}
+
+bool Player::preload(std::unique_ptr<AudioSource> newSource) {
+  std::unique_lock<std::mutex> lock{preloadMutex};
+  nextReady = _openPreload(std::move(newSource));
+  return nextReady;
+}
+
+bool Player::_openPreload(std::unique_ptr<AudioSource> newSource) {
+  mpg123_close(nextMh);
+  nextSource = std::move(newSource);
+  nextTrackGain = nextSource->getGain();
+  if (!nextSource->open(nextMh)) {
+    return false;
+  }
+  // decode the first block now so that the switch does not wait on the decoder
+  preloadOffset = 0;
+  preloadConsumedFrames = 0;
+  int err;
+  do {
+    err = mpg123_read(nextMh, preloadBuffer, outBufferSize, &preloadBytes);
+  } while (err == MPG123_NEW_FORMAT && preloadBytes == 0);
+  if (err != MPG123_OK && err != MPG123_NEW_FORMAT) {
+    std::cout << "err: " << mpg123_strerror(nextMh) << '\n';
+    return false;
+  }
+  return true;
+}
+
+void Player::cancelPreload() {
+  std::unique_lock<std::mutex> lock{preloadMutex};
+  nextReady = false;
+}
+
+void Player::_endFade() {
+  std::unique_lock<std::mutex> lock{preloadMutex};
+  fading = false;
+}
+
+bool Player::_switchToPreloaded() {
+  // what is left of the preloaded block, copied out so that preload() can use preloadBuffer again straight away
+  std::vector<unsigned char> left{};
+  {
+    std::unique_lock<std::mutex> lock{preloadMutex};
+    if (!nextReady) {
+      return false;
+    }
+    std::swap(mh, nextMh);
+    std::swap(source, nextSource);
+    nextReady = false;
+    streaming = false;
+    fading = false;
+    // if there was a crossfade, part of the preloaded song has been played already
+    framesPlayed = preloadConsumedFrames;
+    const auto *block = static_cast<const unsigned char *>(preloadBuffer);
+    left.assign(block + preloadOffset, block + preloadBytes);
+  }
+  skipFrames = 0;
+  driftFrames = 0;
+  maxSkewMs = 0;
+  long newRate;
+  int newChannels, newEncoding;
+  mpg123_getformat(mh, &newRate, &newChannels, &newEncoding);
+  if (newRate != rate || newChannels != channels || newEncoding != encoding) {
+    // only restart the output when it has to, this drains the ring first. Not holding preloadMutex,
+    // that takes as long as the ring is and preload() and cancelPreload() would wait all that time
+    _newFormat();
+  }
+  trackBoundary = ring.written();
+  const std::size_t size = frameSize;
+  _pushToRing(left.data(), left.size());
+  if (size != 0) {
+    framesPlayed += static_cast<int64_t>(left.size() / size);
+  }
+  DEBUG_P(std::cout << "switched to preloaded song\n");
+  return true;
+}
+
+std::size_t Player::_takePreloaded(unsigned char *data, std::size_t size) {
+  std::size_t taken = 0;
+  while (taken < size) {
+    if (preloadOffset == preloadBytes) {
+      preloadOffset = 0;
+      const int err = mpg123_read(nextMh, preloadBuffer, outBufferSize, &preloadBytes);
+      if (err != MPG123_OK && err != MPG123_NEW_FORMAT && preloadBytes == 0) {
+        break;
+      }
+    }
+    const std::size_t count = std::min(size - taken, preloadBytes - preloadOffset);
+    memcpy(data + taken, static_cast<const unsigned char *>(preloadBuffer) + preloadOffset, count);
+    preloadOffset += count;
+    taken += count;
+  }
+  return taken;
+}
+
+void Player::_crossfade(std::size_t bytes, bool &songEnded) {
+  const int64_t fadeMs = crossfadeMs;
+  const std::size_t size = frameSize;
+  if (fadeMs == 0 || encoding != MPG123_ENC_SIGNED_16 || size == 0 || bytes == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock{preloadMutex};
+  if (!fading) {
+    if (!nextReady) {
+      return;
+    }
+    const auto length = static_cast<int64_t>(mpg123_length(mh));
+    const int64_t remaining = length - framesPlayed;
+    if (length <= 0 || remaining > fadeMs * rate / 1000) {
+      return;
+    }
+    // only mix songs with the same format, otherwise they just play one after the other
+    long nextRate;
+    int nextChannels, nextEncoding;
+    mpg123_getformat(nextMh, &nextRate, &nextChannels, &nextEncoding);
+    if (nextRate != rate || nextChannels != channels || nextEncoding != encoding) {
+      return;
+    }
+    DEBUG_P(std::cout << "starting crossfade\n");
+    fading = true;
+    fadePos = 0;
+    fadeLen = remaining > 0 ? remaining : 1;
+  }
+  const std::size_t samples = bytes / sizeof (int16_t);
+  const std::size_t frames = bytes / size;
+  const auto length = static_cast<float>(fadeLen);
+  const float startGain = static_cast<float>(fadePos) / length;
+  const float endGain = std::min(static_cast<float>(fadePos + static_cast<int64_t>(frames)) / length, 1.0f);
+  const float step = (endGain - startGain) / static_cast<float>(samples);
+  auto *current = static_cast<int16_t *>(outBuffer);
+  Mixer::s16ToFloat(current, fadeCurrent.data(), samples);
+  Mixer::gainRamp(fadeCurrent.data(), samples, 1.0f - startGain, -step);
+  // if the next song was cancelled part way through, the current one still fades out, jumping back to full
+  // volume would pop. It ends when it is silent and the room moves on as though it had played out
+  if (nextReady) {
+    const std::size_t taken = _takePreloaded(reinterpret_cast<unsigned char *>(fadeStage.data()), bytes);
+    // the next song ran out during the fade, mix in silence
+    memset(reinterpret_cast<unsigned char *>(fadeStage.data()) + taken, 0, bytes - taken);
+    preloadConsumedFrames += static_cast<int64_t>(taken / size);
+    Mixer::s16ToFloat(fadeStage.data(), fadeNext.data(), samples);
+    // the output thread applies the current song's loudness gain to the mix, bring the next song to its own
+    const float currentGain = trackGain;
+    const float relative = currentGain > 0 ? nextTrackGain / currentGain : 1.0f;
+    Mixer::gainRamp(fadeNext.data(), samples, startGain * relative, step * relative);
+    Mixer::mixAdd(fadeCurrent.data(), fadeNext.data(), samples);
+  }
+  Mixer::floatToS16(fadeCurrent.data(), current, samples);
+
+  fadePos += static_cast<int64_t>(frames);
+  if (fadePos >= fadeLen) {
+    // the current song is silent now, the next one takes over if there still is one
+    songEnded = true;
+  }
+}
+
+bool Player::waitTrackEnd() {
+  std::unique_lock<std::mutex> lock{trackMutex};
+  trackCond.wait(lock, [this]() {
+    return trackAdvanced || !shouldPlay;
+  });
+  const bool advanced = trackAdvanced;
+  trackAdvanced = false;
+  return advanced;
+}
+
+bool Player::takeTrackAdvance() {
+  std::unique_lock<std::mutex> lock{trackMutex};
+  const bool advanced = trackAdvanced;
+  trackAdvanced = false;
+  return advanced;
 }
 
 void Player::play() {
@@ -58,25 +397,41 @@ void Player::play() {
   }
   wait();
   shouldPlay = true;
+  decodeDone = false;
   player = std::thread(&Player::_play, this);
+  output = std::thread(&Player::_output, this);
 }
 
 void Player::pause() {
   shouldPlay = false;
+  // wake the player thread if it is waiting on stream input
+  streamCond.notify_one();
+  trackCond.notify_all();
 }
 
 void Player::wait() {
   if (player.joinable()) {
     player.join();
   }
+  if (output.joinable()) {
+    output.join();
+  }
+}
+
+void Player::setRingSize(std::size_t bytes) {
+  if (shouldPlay) {
+    return;
+  }
+  wait();
+  ring.resize(bytes);
 }
 
 void Player::mute() {
-  out123_param(ao, OUT123_ADD_FLAGS, OUT123_MUTE, 0, nullptr);
+  sink->setMuted(true);
 }
 
 void Player::unmute() {
-  out123_param(ao, OUT123_REMOVE_FLAGS, OUT123_MUTE, 0, nullptr);
+  sink->setMuted(false);
 }
 
 bool Player::isPlaying() {
@@ -85,32 +440,250 @@ bool Player::isPlaying() {
 
 void Player::seek(double time) {
   DEBUG_P(std::cout << "seek to time: " << time << '\n');
+  pendingSeek = time;
+  if (!shouldPlay) {
+    _applySeek();
+  }
+}
+
+void Player::_applySeek() {
+  const double time = pendingSeek.exchange(-1.0);
+  if (time < 0) {
+    return;
+  }
+  if (streaming) {
+    // mpg123 cannot seek in data it has not been fed yet, so decode up to the target and throw it away
+    if (rate <= 0) {
+      // format not known yet, try again once it is
+      pendingSeek = time;
+      return;
+    }
+    const auto target = static_cast<int64_t>(time * static_cast<double>(rate));
+    skipFrames = target - framesPlayed;
+    if (skipFrames < 0) {
+      DEBUG_P(std::cout << "cannot seek backwards while streaming\n");
+      skipFrames = 0;
+    }
+    driftFrames = 0;
+    flushUntil = ring.written();
+    return;
+  }
+  const auto seekStart = std::chrono::steady_clock::now();
   if (mpg123_seek_frame(mh, mpg123_timeframe(mh, time), SEEK_SET) < 0) {
-    mpg123_strerror(mh);
+    std::cout << "err: " << mpg123_strerror(mh) << '\n';
+    return;
   }
+  const int64_t seekUs = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - seekStart
+  ).count();
+  lastSeekUs = seekUs;
+  if (seekUs > maxSeekUs) {
+    maxSeekUs = seekUs;
+  }
+  framesPlayed = static_cast<int64_t>(mpg123_tell(mh));
+  driftFrames = 0;
+  // audio from before the seek is still in the ring, the output thread skips it
+  flushUntil = ring.written();
+}
+
+int64_t Player::getPositionMs() const {
+  const long currentRate = rate;
+  const std::size_t size = frameSize;
+  if (currentRate <= 0 || size == 0) {
+    return 0;
+  }
+  // framesPlayed is where the decoder is, take off what is still waiting in the ring
+  const uint64_t written = ring.written();
+  const uint64_t readUpTo = std::max<uint64_t>(written - ring.fill(), flushUntil);
+  const uint64_t waiting = readUpTo < written ? written - readUpTo : 0;
+  const int64_t frames = framesPlayed - static_cast<int64_t>(waiting / size);
+  // right after switching to a preloaded song the end of the previous one is still waiting
+  return frames > 0 ? frames * 1000 / currentRate : 0;
+}
+
+void Player::correctDrift(int64_t expectedMs) {
+  const int64_t skew = getPositionMs() - expectedMs;
+  const int64_t absSkew = skew < 0 ? -skew : skew;
+  lastSkewMs = skew;
+  if (absSkew > maxSkewMs) {
+    maxSkewMs = absSkew;
+  }
+  DEBUG_P(std::cout << "skew: " << skew << "ms\n");
+  if (absSkew <= DRIFT_TOLERANCE_MS) {
+    driftFrames = 0;
+    return;
+  }
+  if (absSkew > DRIFT_RESEEK_MS) {
+    ++driftSeeks;
+    seek(static_cast<double>(expectedMs) / 1000.0);
+    return;
+  }
+  // ahead of the room means we insert frames to slow down, behind means we drop frames to catch up
+  driftFrames = skew * rate / 1000;
+}
+
+PlayerStats Player::getStats() const {
+  SinkTimestamp_t timestamp{};
+  const bool hasTimestamp = sink->getTimestamp(timestamp);
+  return {
+    lastSkewMs, maxSkewMs, framesInserted, framesDropped, driftSeeks, underruns, lastSeekUs, maxSeekUs,
+    sink->name(), hasTimestamp, timestamp, ring.fill(), ring.capacity()
+  };
+}
+
+int64_t Player::_applyDriftCorrection(std::size_t &bytes) {
+  const std::size_t size = frameSize;
+  if (size == 0) {
+    return 0;
+  }
+  auto *buffer = static_cast<unsigned char *>(outBuffer);
+  std::size_t frames = bytes / size;
+  const auto trackFrames = static_cast<int64_t>(frames);
+  const int64_t pending = driftFrames;
+  if (pending == 0 || frames < DRIFT_CORRECTION_RATIO) {
+    return trackFrames;
+  }
+  const std::size_t maxChange = frames / DRIFT_CORRECTION_RATIO;
+  const std::size_t change = static_cast<std::size_t>(pending < 0 ? -pending : pending) < maxChange ?
+    static_cast<std::size_t>(pending < 0 ? -pending : pending) : maxChange;
+  // spread the inserted/dropped frames evenly over the buffer
+  const std::size_t stride = frames / (change + 1);
+  if (pending > 0) {
+    // insert by duplicating frames, working backwards so earlier positions stay valid
+    for (std::size_t i = change; i > 0; --i) {
+      const std::size_t at = i * stride;
+      memmove(buffer + (at + 1) * size, buffer + at * size, (frames - at) * size);
+      ++frames;
+    }
+    driftFrames -= static_cast<int64_t>(change);
+    framesInserted += change;
+  } else {
+    for (std::size_t i = change; i > 0; --i) {
+      const std::size_t at = i * stride;
+      memmove(buffer + at * size, buffer + (at + 1) * size, (frames - at - 1) * size);
+      --frames;
+    }
+    driftFrames += static_cast<int64_t>(change);
+    framesDropped += change;
+  }
+  bytes = frames * size;
+  return trackFrames;
 }
 
 void Player::_play() {
   std::size_t done;
   int err;
-  while (shouldPlay) {
+  if (streaming) {
+    // fill the jitter buffer before starting so that a slow link does not stutter right away
+    std::unique_lock<std::mutex> lock{streamMutex};
+    streamCond.wait(lock, [this]() {
+      return streamBuffered >= STREAM_JITTER_BUFFER_BYTES || streamEnded || !shouldPlay;
+    });
+  }
+  while (shouldPlay && !decodeDone) {
+    bool songEnded = false;
+    _applySeek();
+    if (streaming) {
+      _feedStreamInput(false);
+    }
     // decode audio
     err = mpg123_read(mh, outBuffer, outBufferSize, &done);
-    if (err == MPG123_NEW_FORMAT) {
+    if (err == MPG123_NEED_MORE && streaming) {
+      // decoded everything fed so far, wait for more of the stream to arrive
+      if (!_feedStreamInput(true)) {
+        decodeDone = true;
+      }
+      if (done == 0) {
+        continue;
+      }
+    } else if (err == MPG123_NEW_FORMAT) {
       // new format as been detected, handle it
       _newFormat();
       continue;
     } else if (err == MPG123_DONE) {
-      shouldPlay = false;
+      songEnded = true;
     } else if (err != MPG123_OK) {
       std::cout << "err: " << mpg123_strerror(mh) << '\n';
       // some error
-      shouldPlay = false;
+      decodeDone = true;
+    }
+    _applySkip(done);
+    _crossfade(done, songEnded);
+    const int64_t trackFrames = _applyDriftCorrection(done);
+    _pushToRing(static_cast<const unsigned char *>(outBuffer), done);
+    framesPlayed += trackFrames;
+    // once the rest of this song is in the ring, keep going into the next song if one is preloaded
+    if (songEnded && !_switchToPreloaded()) {
+      decodeDone = true;
+    }
+  }
+  decodeDone = true;
+}
+
+void Player::_pushToRing(const unsigned char *data, std::size_t size) {
+  while (size > 0 && shouldPlay) {
+    const std::size_t written = ring.write(data, size);
+    data += written;
+    size -= written;
+    if (size > 0) {
+      // ring is full, the output thread is behind by a whole ring so there is plenty of time
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+}
+
+void Player::_output() {
+  bool started = false;
+  bool starved = false;
+  while (shouldPlay) {
+    ring.discardUntil(flushUntil);
+    const std::size_t size = frameSize;
+    // check if decoding is done before checking the fill, the decoder fills the ring before saying it is done
+    const bool done = decodeDone;
+    std::size_t available = ring.fill();
+    if (size == 0 || available < size) {
+      if (done) {
+        break;
+      }
+      if (started && !starved) {
+        ++underruns;
+        starved = true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+    started = true;
+    starved = false;
+    available = available < outBufferSize ? available : outBufferSize;
+    available -= available % size;
+    ring.read(playBuffer, available);
+    const uint64_t boundary = trackBoundary;
+    if (boundary != 0 && ring.readPosition() >= boundary) {
+      // the preloaded song has started playing
+      trackBoundary = 0;
+      trackGain = nextTrackGain.load();
+      {
+        std::unique_lock<std::mutex> lock{trackMutex};
+        trackAdvanced = true;
+      }
+      trackCond.notify_all();
+    }
+    std::unique_lock<std::mutex> lock{outputMutex};
+    const float gain = volume * trackGain;
+    if (gain != 1.0f && encoding == MPG123_ENC_SIGNED_16) {
+      Mixer::scaleS16(static_cast<int16_t *>(playBuffer), available / sizeof (int16_t), gain);
     }
     // play the audio
-    if (out123_play(ao, outBuffer, done) != done) {
+    if (sink->play(playBuffer, available) != available) {
       // try to finish playing
       // out123_play(ao, outBuffer + played, done - played);
     }
   }
+  {
+    std::unique_lock<std::mutex> lock{trackMutex};
+    shouldPlay = false;
+  }
+  // wake the decoder if it is waiting on stream input, and anyone waiting on the song to end
+  streamCond.notify_one();
+  trackCond.notify_all();
 }
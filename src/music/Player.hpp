@@ -11,24 +11,104 @@
 
 #pragma once
 
-#include <out123.h>
 #include <mpg123.h>
+#include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 #include <atomic>
+#include <memory>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 
 #include "Music.hpp"
+#include "PcmRing.hpp"
+#include "Mixer.hpp"
+#include "AudioSource.hpp"
+#include "AudioSink.hpp"
 #include "../debug.hpp"
 
+// skew below this is considered in sync, no correction is applied
+#define DRIFT_TOLERANCE_MS 5
+// skew above this is corrected by seeking rather than by inserting/dropping samples
+#define DRIFT_RESEEK_MS 150
+// at most one sample frame is inserted or dropped per this many frames played (0.2% speed change)
+#define DRIFT_CORRECTION_RATIO 500
+// when streaming, playback starts once this many bytes have arrived (about one second at 128 kbps)
+#define STREAM_JITTER_BUFFER_BYTES 16384
+// crossfade length used by the 'crossfade on' command
+#define DEFAULT_CROSSFADE_MS 4000
+
+/**
+ * @brief Statistics about the player, shown by the 'stats' command
+*/
+typedef struct {
+  /**
+   * last measured difference between local and room position, positive means ahead of the room
+  */
+  int64_t lastSkewMs;
+  /**
+   * largest absolute skew measured for the current track
+  */
+  int64_t maxSkewMs;
+  /**
+   * sample frames inserted to slow down
+  */
+  uint64_t framesInserted;
+  /**
+   * sample frames dropped to catch up
+  */
+  uint64_t framesDropped;
+  /**
+   * number of times skew was too large and a seek was done instead
+  */
+  uint64_t driftSeeks;
+  /**
+   * times the output thread found the decoded audio ring empty while the song was still decoding
+  */
+  uint64_t underruns;
+  /**
+   * time the last seek took in mpg123, in microseconds
+  */
+  int64_t lastSeekUs;
+  /**
+   * longest seek since the player was made, in microseconds
+  */
+  int64_t maxSeekUs;
+  /**
+   * name of the sink audio is played through
+  */
+  const char *output;
+  /**
+   * when the audio played so far finishes, if the sink knows
+  */
+  bool hasTimestamp;
+  SinkTimestamp_t timestamp;
+  /**
+   * bytes of decoded audio waiting in the ring
+  */
+  std::size_t ringFill;
+  /**
+   * size of the ring in bytes
+  */
+  std::size_t ringCapacity;
+} PlayerStats;
+
 class Player {
 private:
 
   /**
-   * atomic boolean to communicate with player thread
+   * atomic boolean to communicate with player threads
   */
   std::atomic<bool> shouldPlay; 
 
+  /**
+   * set by the decoder thread when the song has been fully decoded
+  */
+  std::atomic<bool> decodeDone;
+
   /**
    * size of decode buffer
   */
@@ -40,9 +120,29 @@ private:
   void *outBuffer;
 
   /**
-   * used by out123
+   * buffer the output thread reads from the ring into
   */
-  out123_handle *ao;
+  void *playBuffer;
+
+  /**
+   * decoded audio waiting to be played
+  */
+  PcmRing ring;
+
+  /**
+   * ring position up to which audio should be thrown away rather than played, set after a seek
+  */
+  std::atomic<uint64_t> flushUntil;
+
+  /**
+   * held by the output thread while it writes to the sink so that a format change does not happen mid write
+  */
+  std::mutex outputMutex;
+
+  /**
+   * where decoded audio is played, opened the first time a song starts
+  */
+  std::unique_ptr<AudioSink> sink;
 
   /**
    * used by mpg123
@@ -50,10 +150,193 @@ private:
   mpg123_handle *mh;
 
   /**
-   * thread in which audio plays
+   * mpg123 handle opened on the next song ahead of time, swapped with mh when the current song ends
+  */
+  mpg123_handle *nextMh;
+
+  /**
+   * what mh is decoding from, nullptr when streaming
+  */
+  std::unique_ptr<AudioSource> source;
+
+  /**
+   * what nextMh is decoding from, swapped with source along with the handles
+  */
+  std::unique_ptr<AudioSource> nextSource;
+
+  /**
+   * true when nextMh has a song opened and its first block decoded into preloadBuffer
+  */
+  bool nextReady;
+
+  /**
+   * first decoded block of the preloaded song
+  */
+  void *preloadBuffer;
+
+  /**
+   * number of bytes in preloadBuffer
+  */
+  std::size_t preloadBytes;
+
+  /**
+   * bytes at the start of preloadBuffer that have already been used by a crossfade
+  */
+  std::size_t preloadOffset;
+
+  /**
+   * sample frames of the preloaded song that have already been used by a crossfade
+  */
+  int64_t preloadConsumedFrames;
+
+  /**
+   * length of crossfades between songs in milliseconds, 0 to go straight from one to the next
+  */
+  std::atomic<int64_t> crossfadeMs;
+
+  /**
+   * true while the end of the current song is being mixed with the start of the preloaded one
+  */
+  bool fading;
+
+  /**
+   * how far into the crossfade the decoder is, and how long it is, in sample frames
+  */
+  int64_t fadePos;
+  int64_t fadeLen;
+
+  /**
+   * float samples of the current and next song while crossfading, and the next song's 16 bit samples
+  */
+  std::vector<float> fadeCurrent;
+  std::vector<float> fadeNext;
+  std::vector<int16_t> fadeStage;
+
+  /**
+   * software volume applied by the output thread, 1 is unchanged
+  */
+  std::atomic<float> volume;
+
+  /**
+   * loudness gain of the song being heard and of the preloaded one, applied along with volume.
+   * The output thread moves nextTrackGain to trackGain when it reaches trackBoundary
+  */
+  std::atomic<float> trackGain;
+  std::atomic<float> nextTrackGain;
+
+  /**
+   * guards nextMh, nextReady, preloadBuffer and preloadBytes
+  */
+  std::mutex preloadMutex;
+
+  /**
+   * ring position where the preloaded song starts, 0 if no switch is waiting to be played
+  */
+  std::atomic<uint64_t> trackBoundary;
+
+  /**
+   * set by the output thread when it starts playing a preloaded song
+  */
+  bool trackAdvanced;
+
+  /**
+   * guards trackAdvanced
+  */
+  std::mutex trackMutex;
+
+  /**
+   * notifies Player::waitTrackEnd that the song changed or playback stopped
+  */
+  std::condition_variable trackCond;
+
+  /**
+   * thread in which audio is decoded into the ring
   */
   std::thread player;
 
+  /**
+   * thread in which audio is taken from the ring and played
+  */
+  std::thread output;
+
+  /**
+   * sample rate of the current track
+  */
+  std::atomic<long> rate;
+
+  /**
+   * number of channels and encoding of the current track, used to tell if out123 needs restarting
+  */
+  int channels;
+  int encoding;
+
+  /**
+   * size in bytes of one sample frame (all channels) of the current track
+  */
+  std::atomic<std::size_t> frameSize;
+
+  /**
+   * position in the track, in sample frames, of the audio that has been decoded into the ring
+  */
+  std::atomic<int64_t> framesPlayed;
+
+  /**
+   * time in seconds to seek to, negative when no seek is pending. Applied by the player thread
+  */
+  std::atomic<double> pendingSeek;
+
+  /**
+   * sample frames still to insert (positive) or drop (negative) to correct drift
+  */
+  std::atomic<int64_t> driftFrames;
+
+  /**
+   * statistics, see PlayerStats
+  */
+  std::atomic<int64_t> lastSkewMs;
+  std::atomic<int64_t> maxSkewMs;
+  std::atomic<uint64_t> framesInserted;
+  std::atomic<uint64_t> framesDropped;
+  std::atomic<uint64_t> driftSeeks;
+  std::atomic<uint64_t> underruns;
+  std::atomic<int64_t> lastSeekUs;
+  std::atomic<int64_t> maxSeekUs;
+
+  /**
+   * true when fed with Player::feedStream, audio is decoded as it arrives rather than from a file
+  */
+  std::atomic<bool> streaming;
+
+  /**
+   * sample frames to decode and throw away, used to seek forward while streaming
+  */
+  int64_t skipFrames;
+
+  /**
+   * bytes pushed with Player::pushStream that have not been given to mpg123 yet
+  */
+  std::vector<unsigned char> streamInput;
+
+  /**
+   * total bytes pushed for the current stream
+  */
+  std::size_t streamBuffered;
+
+  /**
+   * set by Player::endStream, no more bytes will be pushed
+  */
+  bool streamEnded;
+
+  /**
+   * guards streamInput, streamBuffered and streamEnded
+  */
+  std::mutex streamMutex;
+
+  /**
+   * notifies the player thread that stream bytes arrived, the stream ended, or playback was paused
+  */
+  std::condition_variable streamCond;
+
 public:
   
   /**
@@ -62,6 +345,14 @@ public:
    */
   Player(); 
 
+  /**
+   * @brief Construct a new Player object that plays through a given output
+   * 
+   * @param driver out123 driver, empty for the default, "none" to play nothing or "wav" to write to a file, see AudioSink::create
+   * @param device device for the driver, empty for the default, or the path of the WAV file
+   */
+  Player(const std::string &driver, const std::string &device);
+
   /**
    * @brief Destroy the Player object
    * 
@@ -74,6 +365,95 @@ public:
   */
   void feed(const char *fp);
 
+  /**
+   * @brief feed audio data to mpg123 from a source, which the player keeps until the song is replaced
+   * @param newSource the song, from a path, memory, or a mapped file
+  */
+  void feed(std::unique_ptr<AudioSource> newSource);
+
+  /**
+   * @brief prepare to play audio that is still arriving. Bytes are given with Player::pushStream
+  */
+  void feedStream();
+
+  /**
+   * @brief give the player more bytes of the stream started with Player::feedStream
+   * @param data pointer to the bytes
+   * @param size number of bytes
+  */
+  void pushStream(const std::byte *data, std::size_t size);
+
+  /**
+   * @brief tell the player that the whole stream has been pushed
+  */
+  void endStream();
+
+  /**
+   * @brief open the song that plays after the current one, so it starts without a gap
+   * @param fp path to file, ex: /tmp/musicBroadcaster_XXXXX
+   * @return true if the song was opened and decoded from
+  */
+  bool preload(const char *fp);
+
+  /**
+   * @brief open the song that plays after the current one from a source
+   * @param newSource the song, from a path, memory, or a mapped file
+   * @return true if the song was opened and decoded from
+  */
+  bool preload(std::unique_ptr<AudioSource> newSource);
+
+  /**
+   * @brief forget the preloaded song. A crossfade into it that has already started keeps fading the current
+   * song out, and that song ends once it is silent
+  */
+  void cancelPreload();
+
+  /**
+   * @brief set the length of crossfades between songs
+   * @param ms length in milliseconds, 0 to turn crossfading off
+  */
+  void setCrossfadeMs(int64_t ms);
+
+  /**
+   * @return length of crossfades between songs in milliseconds, 0 if off
+  */
+  [[nodiscard]] int64_t getCrossfadeMs() const;
+
+  /**
+   * @brief set the software volume
+   * @param gain 1 for unchanged, 0 for silent
+  */
+  void setVolume(float gain);
+
+  /**
+   * @brief get the software volume
+  */
+  [[nodiscard]] float getVolume() const;
+
+  /**
+   * @brief set the loudness gain of the song being played, for a gain that was not known when it was fed
+   * @param linear 1 for unchanged
+  */
+  void setTrackGain(float linear);
+
+  /**
+   * @brief set the loudness gain of the preloaded song, for a gain that was not known when it was preloaded
+   * @param linear 1 for unchanged
+  */
+  void setNextTrackGain(float linear);
+
+  /**
+   * @brief waits until the current song ends
+   * @return true if the preloaded song is now playing, false if playback stopped
+  */
+  bool waitTrackEnd();
+
+  /**
+   * @brief check if the player moved on to the preloaded song, and clear that
+   * @return true if it did since the last call, Player::feed, or Player::waitTrackEnd
+  */
+  bool takeTrackAdvance();
+
   /**
    * @brief plays audio which as been fed to mpg123
   */
@@ -85,10 +465,16 @@ public:
   void pause();
 
   /**
-   * @brief waits for the player thread to finish execution (no more audio to play, or some error occurs)
+   * @brief waits for the player threads to finish execution (no more audio to play, or some error occurs)
   */
   void wait();
 
+  /**
+   * @brief set how much decoded audio can be buffered ahead of the output. Only takes effect while not playing
+   * @param bytes size of the ring in bytes, rounded up to a power of two
+  */
+  void setRingSize(std::size_t bytes);
+
   /**
    * @brief mute audio
   */
@@ -110,14 +496,101 @@ public:
   */
   bool isPlaying();
 
+  /**
+   * @brief get the position of the audio handed to the output device
+   * @return position in the track in milliseconds
+  */
+  int64_t getPositionMs() const;
+
+  /**
+   * @brief compares the local position to the position the room reported and corrects the difference.
+   * Small differences are corrected by inserting or dropping sample frames, large ones by seeking
+   * @param expectedMs where the room says this player should be right now, in milliseconds
+  */
+  void correctDrift(int64_t expectedMs);
+
+  /**
+   * @brief get a snapshot of the player statistics
+  */
+  PlayerStats getStats() const;
+
 private:
   /**
-   * @brief actually plays audio
+   * @brief decodes audio into the ring
   */
   void _play();
 
+  /**
+   * @brief plays audio from the ring
+  */
+  void _output();
+
+  /**
+   * @brief swaps in the preloaded song once the current one has been decoded
+   * @return false if nothing was preloaded
+  */
+  bool _switchToPreloaded();
+
+  /**
+   * @brief opens the preloaded song and decodes its first block into preloadBuffer, holding preloadMutex
+  */
+  bool _openPreload(std::unique_ptr<AudioSource> newSource);
+
+  /**
+   * @brief copies decoded bytes of the preloaded song, decoding more as needed, holding preloadMutex
+   * @return number of bytes copied, less than size if the preloaded song ended
+  */
+  std::size_t _takePreloaded(unsigned char *data, std::size_t size);
+
+  /**
+   * @brief mixes the start of the preloaded song into Player::outBuffer when the current song is near its end
+   * @param bytes number of decoded bytes in Player::outBuffer
+   * @param songEnded set to true once the crossfade is over and the current song should be switched out
+  */
+  void _crossfade(std::size_t bytes, bool &songEnded);
+
+  /**
+   * @brief stop a crossfade, for when a new song is fed in after one faded out with nothing to switch to
+  */
+  void _endFade();
+
+  /**
+   * @brief make mpg123 decode to signed 16 bit samples, which is what the mixer works on
+  */
+  static void _forceS16(mpg123_handle *handle);
+
+  /**
+   * @brief writes decoded bytes to the ring, waiting while it is full
+  */
+  void _pushToRing(const unsigned char *data, std::size_t size);
+
   /**
    * @brief handles a new mp3 format
   */
   void _newFormat();
+
+  /**
+   * @brief seeks mpg123 to Player::pendingSeek if a seek is pending. Only call from the player thread or when not playing
+  */
+  void _applySeek();
+
+  /**
+   * @brief inserts or drops sample frames in the decoded buffer according to Player::driftFrames
+   * @param bytes number of decoded bytes in Player::outBuffer, updated to the new number of bytes
+   * @return the number of sample frames of the track that the buffer covers
+  */
+  int64_t _applyDriftCorrection(std::size_t &bytes);
+
+  /**
+   * @brief gives pushed stream bytes to mpg123, waiting for some if there are none
+   * @param wait true to wait until bytes arrive, the stream ends, or playback is paused
+   * @return false if the stream has ended and everything has been given to mpg123
+  */
+  bool _feedStreamInput(bool wait);
+
+  /**
+   * @brief throws away decoded frames while Player::skipFrames is positive
+   * @param bytes number of decoded bytes in Player::outBuffer, updated to the number left
+  */
+  void _applySkip(std::size_t &bytes);
 };
@@ -0,0 +1,287 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for song metadata
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "SongMetadata.hpp"
+
+// size of an ID3v1 tag, found at the very end of the file
+#define ID3V1_BYTES 128
+
+static void appendUtf8(std::string &out, uint32_t codePoint) {
+  if (codePoint < 0x80) {
+    out.push_back(static_cast<char>(codePoint));
+  } else if (codePoint < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+    out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+  } else if (codePoint < 0x10000) {
+    out.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (codePoint >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+  }
+}
+
+/**
+ * @brief cut off trailing spaces and anything past METADATA_MAX_TEXT, without splitting a UTF-8 character
+*/
+static void tidy(std::string &text) {
+  if (text.size() > METADATA_MAX_TEXT) {
+    std::size_t end = METADATA_MAX_TEXT;
+    while (end > 0 && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80) {
+      --end;
+    }
+    text.resize(end);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\0')) {
+    text.pop_back();
+  }
+}
+
+/**
+ * @brief convert an ID3 text field to UTF-8, up to the first terminator
+ * @param encoding 0 ISO-8859-1, 1 UTF-16 with a byte order mark, 2 UTF-16BE, 3 UTF-8
+*/
+static std::string decodeText(const unsigned char *p, std::size_t n, unsigned encoding) {
+  std::string out;
+  if (encoding == 0) {
+    for (std::size_t i = 0; i < n && p[i] != 0; ++i) {
+      appendUtf8(out, p[i]);
+    }
+  } else if (encoding == 3) {
+    for (std::size_t i = 0; i < n && p[i] != 0; ++i) {
+      out.push_back(static_cast<char>(p[i]));
+    }
+  } else if (encoding == 1 || encoding == 2) {
+    bool bigEndian = encoding == 2;
+    std::size_t i = 0;
+    if (encoding == 1 && n >= 2 && ((p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF))) {
+      bigEndian = p[0] == 0xFE;
+      i = 2;
+    }
+    auto unit = [p, bigEndian](std::size_t at) {
+      return bigEndian ? static_cast<uint32_t>(p[at] << 8 | p[at + 1]) : static_cast<uint32_t>(p[at + 1] << 8 | p[at]);
+    };
+    for (; i + 1 < n; i += 2) {
+      uint32_t codePoint = unit(i);
+      if (codePoint == 0) {
+        break;
+      }
+      if (codePoint >= 0xD800 && codePoint < 0xE000) {
+        // surrogate pair, anything unpaired becomes the replacement character
+        const uint32_t low = i + 3 < n ? unit(i + 2) : 0;
+        if (codePoint < 0xDC00 && low >= 0xDC00 && low < 0xE000) {
+          codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+          i += 2;
+        } else {
+          codePoint = 0xFFFD;
+        }
+      }
+      appendUtf8(out, codePoint);
+    }
+  }
+  tidy(out);
+  return out;
+}
+
+static std::size_t bigEndian32(const unsigned char *p, bool syncSafe) {
+  const unsigned shift = syncSafe ? 7 : 8;
+  std::size_t value = 0;
+  for (std::size_t i = 0; i < 4; ++i) {
+    value = (value << shift) | p[i];
+  }
+  return value;
+}
+
+/**
+ * @brief fill in metadata from the ID3v2 tag at the start of data, if there is one
+*/
+static void readId3v2(const unsigned char *data, std::size_t size, SongMetadata &metadata) {
+  std::size_t end = FrameIndex::id3v2Size(data, size);
+  if (end == 0) {
+    return;
+  }
+  const unsigned major = data[3];
+  const unsigned flags = data[5];
+  // unsynchronised tags would have to be undone byte by byte first, leave those to the ID3v1 tag
+  if (major < 2 || major > 4 || (flags & 0x80)) {
+    return;
+  }
+  if ((flags & 0x10) && end >= 20) {
+    end -= 10;
+  }
+  std::size_t position = 10;
+  if ((flags & 0x40) && major >= 3 && position + 4 <= end) {
+    // extended header, version 3 does not count its own size field
+    position += bigEndian32(data + position, major == 4) + (major == 3 ? 4 : 0);
+  }
+  const std::size_t headerBytes = major == 2 ? 6 : 10;
+  while (position + headerBytes <= end && data[position] != 0) {
+    const unsigned char *frame = data + position;
+    std::size_t frameSize;
+    bool usable = true;
+    if (major == 2) {
+      frameSize = static_cast<std::size_t>(frame[3] << 16 | frame[4] << 8 | frame[5]);
+    } else {
+      frameSize = bigEndian32(frame + 4, major == 4);
+      // compressed, encrypted or unsynchronised frames are skipped
+      usable = (frame[9] & (major == 3 ? 0xC0 : 0x0F)) == 0;
+    }
+    if (frameSize > end - position - headerBytes) {
+      break;
+    }
+    const std::string id{reinterpret_cast<const char *>(frame), major == 2 ? 3u : 4u};
+    std::string *field = nullptr;
+    if (id == "TIT2" || id == "TT2") {
+      field = &metadata.title;
+    } else if (id == "TPE1" || id == "TP1") {
+      field = &metadata.artist;
+    } else if (id == "TALB" || id == "TAL") {
+      field = &metadata.album;
+    }
+    if (field != nullptr && usable && frameSize > 1) {
+      *field = decodeText(frame + headerBytes + 1, frameSize - 1, frame[headerBytes]);
+    }
+    position += headerBytes + frameSize;
+  }
+}
+
+/**
+ * @brief fill in whatever is still missing from the ID3v1 tag at the end of data, if there is one
+*/
+static void readId3v1(const unsigned char *data, std::size_t size, SongMetadata &metadata) {
+  if (size < ID3V1_BYTES) {
+    return;
+  }
+  const unsigned char *tag = data + size - ID3V1_BYTES;
+  if (tag[0] != 'T' || tag[1] != 'A' || tag[2] != 'G') {
+    return;
+  }
+  // fixed 30 byte fields
+  if (metadata.title.empty()) {
+    metadata.title = decodeText(tag + 3, 30, 0);
+  }
+  if (metadata.artist.empty()) {
+    metadata.artist = decodeText(tag + 33, 30, 0);
+  }
+  if (metadata.album.empty()) {
+    metadata.album = decodeText(tag + 63, 30, 0);
+  }
+}
+
+SongMetadata::SongMetadata(): title{}, artist{}, album{}, durationMs{0} {}
+
+SongMetadata SongMetadata::extract(const unsigned char *data, std::size_t size, const FrameIndex *index) {
+  SongMetadata metadata;
+  readId3v2(data, size, metadata);
+  readId3v1(data, size, metadata);
+  if (index != nullptr) {
+    metadata.durationMs = index->getDurationMs();
+  }
+  return metadata;
+}
+
+SongMetadata SongMetadata::fromFile(const std::string &path, const FrameIndex *index) {
+#if defined(__APPLE__) || defined(__unix__)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return {};
+  }
+  struct stat info{};
+  if (fstat(fd, &info) == -1 || info.st_size <= 0) {
+    close(fd);
+    return {};
+  }
+  const std::size_t size = static_cast<std::size_t>(info.st_size);
+  void *address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return {};
+  }
+  SongMetadata metadata = extract(static_cast<const unsigned char *>(address), size, index);
+  munmap(address, size);
+  return metadata;
+#else
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return {};
+  }
+  const std::vector<unsigned char> bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  return extract(bytes.data(), bytes.size(), index);
+#endif
+}
+
+std::vector<std::byte> SongMetadata::serialize() const {
+  std::vector<std::byte> bytes{};
+  bytes.resize(sizeof durationMs);
+  std::copy(
+    reinterpret_cast<const std::byte *>(&durationMs),
+    reinterpret_cast<const std::byte *>(&durationMs) + sizeof durationMs,
+    bytes.data()
+  );
+  for (const std::string *text : {&title, &artist, &album}) {
+    const std::size_t length = std::min<std::size_t>(text->size(), METADATA_MAX_TEXT);
+    bytes.push_back(static_cast<std::byte>(length));
+    const auto *start = reinterpret_cast<const std::byte *>(text->data());
+    bytes.insert(bytes.end(), start, start + length);
+  }
+  return bytes;
+}
+
+bool SongMetadata::deserialize(const std::byte *data, std::size_t size, SongMetadata &metadata) {
+  SongMetadata parsed;
+  if (size < sizeof parsed.durationMs) {
+    return false;
+  }
+  std::copy(data, data + sizeof parsed.durationMs, reinterpret_cast<std::byte *>(&parsed.durationMs));
+  std::size_t position = sizeof parsed.durationMs;
+  for (std::string *text : {&parsed.title, &parsed.artist, &parsed.album}) {
+    if (position >= size) {
+      return false;
+    }
+    const auto length = static_cast<std::size_t>(data[position++]);
+    if (length > size - position) {
+      return false;
+    }
+    text->assign(reinterpret_cast<const char *>(data + position), length);
+    position += length;
+  }
+  metadata = std::move(parsed);
+  return true;
+}
+
+std::string SongMetadata::describe() const {
+  if (!artist.empty() && !title.empty()) {
+    return artist + " - " + title;
+  }
+  if (!title.empty()) {
+    return title;
+  }
+  return artist.empty() ? "unknown" : artist;
+}
+
+std::string SongMetadata::formatDuration(int64_t ms) {
+  if (ms <= 0) {
+    return "?:??";
+  }
+  const int64_t seconds = ms / 1000;
+  const int64_t rest = seconds % 60;
+  return std::to_string(seconds / 60) + (rest < 10 ? ":0" : ":") + std::to_string(rest);
+}
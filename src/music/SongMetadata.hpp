@@ -0,0 +1,72 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Title, artist, album and length of a song, read once when it enters the queue
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "FrameIndex.hpp"
+
+// longest title, artist or album kept, in bytes of UTF-8. Each length is sent in 1 byte
+#define METADATA_MAX_TEXT 255
+
+/**
+ * @brief What listeners are shown about a queue entry. Read from the ID3v2 tag, with the
+ * ID3v1 tag filling in whatever the ID3v2 tag does not have. The length comes from the frame index
+*/
+class SongMetadata {
+public:
+
+  /**
+   * UTF-8, empty if the tags do not have it
+  */
+  std::string title;
+  std::string artist;
+  std::string album;
+
+  /**
+   * length of the song in ms, 0 if unknown
+  */
+  int64_t durationMs;
+
+  SongMetadata();
+
+  /**
+   * @brief read the tags of a song in memory
+   * @param index the song's frame index for the length, may be nullptr
+  */
+  static SongMetadata extract(const unsigned char *data, std::size_t size, const FrameIndex *index);
+
+  /**
+   * @brief map a file into memory and read its tags
+   * @param index the song's frame index for the length, may be nullptr
+  */
+  static SongMetadata fromFile(const std::string &path, const FrameIndex *index);
+
+  /**
+   * @brief body of a QUEUE_METADATA message:
+   * <8 bytes length in ms> <1 byte title length> <title> <1 byte artist length> <artist> <1 byte album length> <album>
+  */
+  [[nodiscard]] std::vector<std::byte> serialize() const;
+
+  /**
+   * @brief parse a QUEUE_METADATA body
+   * @return false if the bytes are malformed, metadata is left as it was then
+  */
+  static bool deserialize(const std::byte *data, std::size_t size, SongMetadata &metadata);
+
+  /**
+   * @return "artist - title", whichever of them are known, "unknown" if neither is
+  */
+  [[nodiscard]] std::string describe() const;
+
+  /**
+   * @return ms as m:ss, or ?:?? if ms is 0
+  */
+  static std::string formatDuration(int64_t ms);
+};
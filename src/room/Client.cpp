@@ -8,14 +8,19 @@
 */
 
 #include "Client.hpp"
+#include "Outbox.hpp"
 
-room::Client::Client(): entriesTillSynced{0}, p_entry{}, name{}, socket{} {}
+room::Client::Client(): entriesTillSynced{0}, entry{}, reserved{}, name{}, socket{} {}
 
 room::Client::Client(std::string name, ThreadSafeSocket &&socket):
-  entriesTillSynced{0}, p_entry{}, name{std::move(name)}, socket{std::move(socket)} {}
+  entriesTillSynced{0}, entry{}, reserved{}, name{std::move(name)}, socket{std::move(socket)} {}
 
 room::Client::Client(Client &&moved) noexcept:
-  entriesTillSynced{moved.entriesTillSynced}, name{std::move(moved.name)}, socket{std::move(moved.socket)} {}
+  entriesTillSynced{moved.entriesTillSynced}, entry{moved.entry}, reserved{std::move(moved.reserved)}, sessionToken{moved.sessionToken}, outbox{std::move(moved.outbox)}, name{std::move(moved.name)}, socket{std::move(moved.socket)} {}
+
+room::Client::~Client() {
+  outbox.reset();
+}
 
 bool room::Client::operator==(const room::Client &rhs) const {
   return rhs.socket.getSocketFD() == socket.getSocketFD();
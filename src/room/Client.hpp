@@ -5,20 +5,54 @@
 
 #pragma once
 
+#include <deque>
 #include <thread>
+#include <memory>
 #include <utility>
 #include "../music/MusicStorage.hpp"
 #include "../socket/ThreadSafeSocket.hpp"
 
 namespace room { 
 
+  class Outbox;
+
    /**
    * @brief Server side client class. Used as an entry into the Room's list of connected clients.
    */
   class Client {
   public:
     int entriesTillSynced;
-    MusicStorageEntry *p_entry{};
+    EntryHandle_t entry{};
+
+    /**
+     * slots reserved by a REQ_ADD_BATCH_TO_QUEUE that no SONG_DATA has filled yet, in the order the songs come in
+    */
+    std::deque<EntryHandle_t> reserved{};
+
+    /**
+     * number of songs this client started late because PLAY_NEXT got there before the song did
+    */
+    int lateStarts{};
+
+    /**
+     * how late the last late start was, in milliseconds
+    */
+    int64_t lastLateMs{};
+
+    /**
+     * the latest start so far, in milliseconds
+    */
+    int64_t maxLateMs{};
+
+    /**
+     * sent to the client when it joins, its data connections send it back
+    */
+    uint64_t sessionToken{};
+
+    /**
+     * everything sent to the client goes through here, made once the client is in the room's list
+    */
+    std::unique_ptr<Outbox> outbox;
 
   private:
 
@@ -57,6 +91,11 @@ namespace room {
      */
     Client(const Client &) = delete;
 
+    /**
+     * @brief Destructor, stops the outbox before the socket is closed
+     */
+    ~Client();
+
     /**
      * @brief the equality operator
      */
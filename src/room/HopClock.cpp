@@ -0,0 +1,34 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the relay clock offset
+*/
+
+#include <algorithm>
+
+#include "HopClock.hpp"
+
+HopClock::HopClock(): delays{}, count{0}, roundTripUs{-1}, offsetMs{0} {}
+
+void HopClock::sample(int64_t sentMs, int64_t receivedMs, int64_t newRoundTripUs) {
+  delays[count % HOP_CLOCK_SAMPLES] = receivedMs - sentMs;
+  ++count;
+  if (newRoundTripUs >= 0 && (roundTripUs < 0 || newRoundTripUs < roundTripUs)) {
+    roundTripUs = newRoundTripUs;
+  }
+  const auto end = delays.begin() + static_cast<std::ptrdiff_t>(std::min<std::size_t>(count, HOP_CLOCK_SAMPLES));
+  const int64_t leastDelay = *std::min_element(delays.begin(), end);
+  // the beacon spent about half a round trip on the wire
+  offsetMs = leastDelay - (roundTripUs > 0 ? roundTripUs / 2000 : 0);
+}
+
+int64_t HopClock::toLocal(int64_t upstreamMs) const {
+  return upstreamMs + offsetMs;
+}
+
+int64_t HopClock::getOffsetMs() const {
+  return offsetMs;
+}
+
+std::size_t HopClock::getSamples() const {
+  return count;
+}
@@ -0,0 +1,72 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief How far a relay's clock is from the clock of the room it relays
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// position beacons the offset is estimated over, the least delayed one is used
+#define HOP_CLOCK_SAMPLES 16
+
+/**
+ * @brief Estimates the offset between a relay's wall clock and its upstream room's from the position beacons the
+ * room sends, so the times in PLAY_NEXT and POSITION_BEACON can be passed on in the relay's own clock.
+ * A beacon's delay is its send time minus its receive time, the clock offset plus how long it took to arrive.
+ * The least delayed recent beacon waited the least behind other data, and half a round trip is taken off for the
+ * time it was on the wire. Every relay in a chain converts from the one above it, so the error does not add up
+ * over the hops beyond each hop's own. Not thread safe
+*/
+class HopClock {
+private:
+
+  /**
+   * receive time minus send time of the most recent beacons, in ms
+  */
+  std::array<int64_t, HOP_CLOCK_SAMPLES> delays;
+
+  /**
+   * beacons seen so far, the next one goes in delays[count % HOP_CLOCK_SAMPLES]
+  */
+  std::size_t count;
+
+  /**
+   * shortest round trip seen in us, -1 if not known. Longer ones are a slow ack rather than the network
+  */
+  int64_t roundTripUs;
+
+  /**
+   * relay clock minus upstream clock in ms
+  */
+  int64_t offsetMs;
+
+public:
+
+  HopClock();
+
+  /**
+   * @brief take a beacon into account
+   * @param sentMs upstream wall clock time the beacon was sent at
+   * @param receivedMs relay wall clock time it was received at
+   * @param newRoundTripUs round trip time of the connection in us, -1 if not known
+  */
+  void sample(int64_t sentMs, int64_t receivedMs, int64_t newRoundTripUs);
+
+  /**
+   * @brief convert an upstream wall clock time to the relay's clock. Left as is until the first beacon
+  */
+  [[nodiscard]] int64_t toLocal(int64_t upstreamMs) const;
+
+  /**
+   * @return relay clock minus upstream clock in ms
+  */
+  [[nodiscard]] int64_t getOffsetMs() const;
+
+  /**
+   * @return number of beacons the offset is from
+  */
+  [[nodiscard]] std::size_t getSamples() const;
+};
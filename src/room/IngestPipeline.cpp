@@ -0,0 +1,293 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the ingest pipeline
+*/
+
+#include <iostream>
+#include <algorithm>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <unistd.h>
+#endif
+
+#include "IngestPipeline.hpp"
+#include "../Clock.hpp"
+#include "../Fnv1a.hpp"
+#include "../debug.hpp"
+
+
+using namespace room;
+
+static const char *const STAGE_NAMES[INGEST_STAGES] = {"receive", "validate", "persist", "index", "publish"};
+
+IngestPipeline::IngestPipeline(MusicStorage &queue): queue{queue}, notifyFd{-1}, queues{}, threads{}, stats{} {
+  for (int stage = VALIDATE; stage < INGEST_STAGES; ++stage) {
+    queues[static_cast<std::size_t>(stage)] = std::make_unique<BoundedQueue<IngestChunk_t>>(INGEST_QUEUE_CHUNKS);
+  }
+}
+
+IngestPipeline::~IngestPipeline() {
+  stop();
+}
+
+void IngestPipeline::start(int fd) {
+  if (!threads.empty()) {
+    return;
+  }
+  notifyFd = fd;
+  for (int stage = VALIDATE; stage < INGEST_STAGES; ++stage) {
+    threads.emplace_back(&IngestPipeline::_run, this, static_cast<IngestStage>(stage));
+  }
+}
+
+void IngestPipeline::stop() {
+  for (int stage = VALIDATE; stage < INGEST_STAGES; ++stage) {
+    queues[static_cast<std::size_t>(stage)]->close();
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+}
+
+std::shared_ptr<IngestJob_t> IngestPipeline::begin(PipeData_t t, uint32_t size) {
+  // pinned so the slot is not reused if the entry is removed while receiving
+  MusicStorageEntry *p_entry = queue.pin(t.entry);
+  if (p_entry == nullptr) {
+    ::write(notifyFd, reinterpret_cast<const void *>(&t), sizeof t);
+    return nullptr;
+  }
+  if (!p_entry->transition(EntryState::RESERVED, EntryState::RECEIVING)) {
+    queue.unpin(p_entry);
+    t.socketFD *= -1;
+    ::write(notifyFd, reinterpret_cast<const void *>(&t), sizeof t);
+    return nullptr;
+  }
+  DEBUG_P(std::cout << "reading in file of size " << size << " bytes\n");
+  auto job = std::make_shared<IngestJob_t>();
+  job->t = t;
+  job->p_entry = p_entry;
+  job->hash = FNV_OFFSET_BASIS;
+  job->size = size;
+  // the entry's file stays in memory unless the memory budget is used up
+  if (!queue.reserveStore(p_entry, size)) {
+    job->failed = true;
+  } else {
+    job->data = MusicStorage::mapStore(p_entry);
+    job->mapped = job->data != nullptr;
+  }
+  if (!job->mapped) {
+    job->music.getVector().resize(size);
+    job->data = job->music.getVector().data();
+  }
+  return job;
+}
+
+bool IngestPipeline::push(const std::shared_ptr<IngestJob_t> &job, std::size_t length) {
+  const int64_t now = steadyClockUs();
+  if (job->received == 0) {
+    job->firstUs = now;
+  }
+  IngestChunk_t chunk{job, job->received, length, false, now};
+  job->received += length;
+  if (job->disconnected || job->cancelled || job->received == job->size) {
+    job->lastUs = now;
+    chunk.last = true;
+  }
+  if (!queues[VALIDATE]->push(std::move(chunk))) {
+    // shutting down
+    if (job->mapped) {
+      MusicStorage::unmapStore(job->p_entry, job->data);
+    }
+    queue.unpin(job->p_entry);
+    return false;
+  }
+  return true;
+}
+
+void IngestPipeline::cancel(const std::shared_ptr<IngestJob_t> &job) {
+  job->cancelled = true;
+  push(job, 0);
+}
+
+void IngestPipeline::receive(PipeData_t t, ThreadSafeSocket &socket, uint32_t size) {
+  std::shared_ptr<IngestJob_t> job = begin(t, size);
+  if (job == nullptr) {
+    return;
+  }
+  std::byte *data = job->data;
+  // where the rest of a song found not to be an MP3 goes, it still has to be read off the socket
+  std::vector<std::byte> scratch{};
+
+  bool last = false;
+  while (!last) {
+    const int64_t readStart = steadyClockUs();
+    const std::size_t chunkSize = std::min<std::size_t>(size - job->received, RECEIVE_CHUNK_BYTES);
+    std::size_t numBytesRead = 0;
+    if (chunkSize > 0) {
+      std::byte *into = data + job->received;
+      if (job->rejected) {
+        scratch.resize(RECEIVE_CHUNK_BYTES);
+        into = scratch.data();
+      }
+      numBytesRead = socket.read(into, chunkSize);
+      if (numBytesRead == 0) {
+        // either client disconnected half way through, or some other error. Scrap it
+        DEBUG_P(std::cout << "error reading song from socket, removing entry from queue\n");
+        job->disconnected = true;
+      }
+    }
+    const int64_t now = steadyClockUs();
+    last = job->disconnected || job->received + numBytesRead == size;
+    if (!push(job, numBytesRead)) {
+      return;
+    }
+    _record(RECEIVE, steadyClockUs() - now, now - readStart);
+  }
+}
+
+void IngestPipeline::_run(IngestStage stage) {
+  BoundedQueue<IngestChunk_t> &in = *queues[stage];
+  IngestChunk_t chunk{};
+  while (in.pop(chunk)) {
+    const int64_t start = steadyClockUs();
+    switch (stage) {
+      case VALIDATE:
+        _validate(chunk);
+        break;
+      case PERSIST:
+        _persist(chunk);
+        break;
+      case INDEX:
+        _index(chunk);
+        break;
+      case PUBLISH:
+        _publish(chunk);
+        break;
+      default:
+        break;
+    }
+    const int64_t end = steadyClockUs();
+    _record(stage, start - chunk.queuedUs, end - start);
+    if (stage + 1 < INGEST_STAGES) {
+      chunk.queuedUs = end;
+      if (!queues[stage + 1]->push(std::move(chunk))) {
+        return;
+      }
+    }
+    // let go of the job, the last stage to do so frees the song's buffer
+    chunk = {};
+  }
+}
+
+void IngestPipeline::_validate(IngestChunk_t &chunk) {
+  IngestJob_t &job = *chunk.job;
+  if (job.rejected) {
+    // the rest of the song was read into scratch, there is nothing here to look at
+    return;
+  }
+  const auto *data = reinterpret_cast<const unsigned char *>(job.data);
+  // the validator looks at everything received so far, it picks up where it left off
+  if (job.validator.feed(data, chunk.offset + chunk.length) == Mp3Verdict::INVALID) {
+    DEBUG_P(std::cout << "not an mp3 after " << chunk.offset + chunk.length << " bytes, dropping the rest\n");
+    job.rejected = true;
+    return;
+  }
+  job.hash = fnv1a(job.hash, data + chunk.offset, chunk.length);
+  if (chunk.last && !job.disconnected && !job.cancelled && job.validator.finish() == Mp3Verdict::INVALID) {
+    DEBUG_P(std::cout << "not an mp3 after " << chunk.offset + chunk.length << " bytes\n");
+    job.rejected = true;
+  }
+}
+
+void IngestPipeline::_persist(IngestChunk_t &chunk) {
+  IngestJob_t &job = *chunk.job;
+  // cancelled is only safe to read on the last piece, it is set before that piece is queued
+  if (job.failed || job.mapped || job.rejected || (chunk.last && job.cancelled)) {
+    return;
+  }
+  if (!MusicStorage::storeChunk(job.p_entry, job.data + chunk.offset, chunk.length)) {
+    job.failed = true;
+  }
+}
+
+void IngestPipeline::_index(IngestChunk_t &chunk) {
+  IngestJob_t &job = *chunk.job;
+  if (!chunk.last || job.disconnected || job.cancelled || job.failed || job.rejected) {
+    return;
+  }
+  const auto *bytes = reinterpret_cast<const unsigned char *>(job.data);
+  if (job.p_entry->frameIndex == nullptr) {
+    // index while the bytes are still at hand, seeking in the song later does not have to scan it
+    job.p_entry->frameIndex = FrameIndex::build(bytes, job.size);
+  }
+  // read here rather than on the main thread, it goes to every listener along with the song
+  job.p_entry->metadata = std::make_shared<const SongMetadata>(SongMetadata::extract(
+    bytes,
+    job.size,
+    job.p_entry->frameIndex.get()
+  ));
+  if (job.mapped) {
+    // a memory file cannot be sealed against writes while it is mapped for writing
+    MusicStorage::unmapStore(job.p_entry, job.data);
+    job.data = nullptr;
+  }
+  if (!MusicStorage::sealStore(job.p_entry)) {
+    job.failed = true;
+  }
+}
+
+void IngestPipeline::_publish(IngestChunk_t &chunk) {
+  if (!chunk.last) {
+    return;
+  }
+  IngestJob_t &job = *chunk.job;
+  if (job.mapped && job.data != nullptr) {
+    // not indexed, the upload is not going any further
+    MusicStorage::unmapStore(job.p_entry, job.data);
+    job.data = nullptr;
+  }
+  if (job.cancelled) {
+    // the entry was removed, there is nothing to publish
+    job.t.entry = {};
+  } else if (job.disconnected) {
+    // make FD negative to tell parent thread we need to remove the client
+    job.t.socketFD *= -1;
+  } else if (job.failed) {
+    std::cerr << "Error: could not store song\n";
+    job.t.socketFD *= -1;
+  } else if (job.rejected) {
+    job.t.rejected = true;
+  } else {
+    job.p_entry->hash = job.hash;
+    job.p_entry->transition(EntryState::RECEIVING, EntryState::READY);
+    DEBUG_P(std::cout << "queue entry ready\n");
+    const int64_t now = steadyClockUs();
+    ++stats.uploads;
+    stats.bytes += job.size;
+    stats.totalUs += static_cast<uint64_t>(now - job.firstUs);
+    stats.tailUs += static_cast<uint64_t>(now - job.lastUs);
+  }
+  queue.unpin(job.p_entry);
+  DEBUG_P(std::cout << "recv process done, writing to recv pipe: socketFD " << job.t.socketFD << "\n");
+  ::write(notifyFd, reinterpret_cast<const void *>(&job.t), sizeof job.t);
+}
+
+void IngestPipeline::_record(IngestStage stage, int64_t waitUs, int64_t busyUs) {
+  IngestStageStats_t &stageStats = stats.stages[stage];
+  const auto busy = static_cast<uint64_t>(std::max<int64_t>(busyUs, 0));
+  ++stageStats.chunks;
+  stageStats.waitUs += static_cast<uint64_t>(std::max<int64_t>(waitUs, 0));
+  stageStats.busyUs += busy;
+  uint64_t longest = stageStats.maxUs;
+  while (busy > longest && !stageStats.maxUs.compare_exchange_weak(longest, busy)) {}
+}
+
+const IngestStats_t &IngestPipeline::getStats() const {
+  return stats;
+}
+
+const char *IngestPipeline::stageName(IngestStage stage) {
+  return STAGE_NAMES[stage];
+}
@@ -0,0 +1,261 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Stages an uploaded song goes through between the socket and the queue
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+#include "Client.hpp"
+#include "../BoundedQueue.hpp"
+#include "../music/Music.hpp"
+#include "../music/MusicStorage.hpp"
+#include "../music/Mp3Validator.hpp"
+
+// songs are received this many bytes at a time, each piece goes through the stages on its own
+#define RECEIVE_CHUNK_BYTES 65536
+// pieces of a song that can wait between two stages, a stage that falls this far behind blocks the one before it
+#define INGEST_QUEUE_CHUNKS 16
+
+namespace room {
+
+typedef struct {
+  int socketFD;
+  room::Client *p_client;
+  EntryHandle_t entry;
+  // true if the song was not a valid MP3, its entry is removed but the client stays
+  bool rejected;
+} PipeData_t;
+
+/**
+ * Stages of an upload, in order. RECEIVE runs on the upload's own thread, the rest on one pipeline thread each
+*/
+enum IngestStage {
+  /** reading pieces off the socket */
+  RECEIVE,
+  /** checking the song is an MP3 and hashing it */
+  VALIDATE,
+  /** writing it to the entry's file, nothing to do when it was received straight into the file */
+  PERSIST,
+  /** building the frame index and reading the metadata */
+  INDEX,
+  /** marking the entry READY and telling the room */
+  PUBLISH,
+  INGEST_STAGES
+};
+
+/**
+ * @brief Timing of one stage, over every piece of every upload so far
+*/
+typedef struct {
+  /**
+   * pieces handled
+  */
+  std::atomic<uint64_t> chunks;
+  /**
+   * microseconds pieces spent queued before the stage. For RECEIVE, time spent blocked because VALIDATE was full
+  */
+  std::atomic<uint64_t> waitUs;
+  /**
+   * microseconds the stage spent working, and the longest it spent on one piece
+  */
+  std::atomic<uint64_t> busyUs;
+  std::atomic<uint64_t> maxUs;
+} IngestStageStats_t;
+
+/**
+ * @brief Totals over whole uploads
+*/
+typedef struct {
+  /**
+   * uploads published, and bytes in them
+  */
+  std::atomic<uint64_t> uploads;
+  std::atomic<uint64_t> bytes;
+  /**
+   * microseconds from the first piece arriving to the entry being READY, summed over the uploads
+  */
+  std::atomic<uint64_t> totalUs;
+  /**
+   * microseconds from the last piece arriving to the entry being READY, the time the pipeline adds to an upload
+  */
+  std::atomic<uint64_t> tailUs;
+  std::array<IngestStageStats_t, INGEST_STAGES> stages;
+} IngestStats_t;
+
+/**
+ * @brief One upload going through the pipeline. Each stage works on it in turn, the queues between them
+ * make whatever one stage wrote visible to the next
+*/
+typedef struct {
+  /**
+   * sent to the room once the upload is published
+  */
+  PipeData_t t;
+  /**
+   * pinned by the receiving thread, unpinned once published
+  */
+  MusicStorageEntry *p_entry;
+  /**
+   * the whole song, filled in piece by piece. Where the entry's file can be mapped this is the file,
+   * and pieces are read from the socket straight into it, otherwise it is music
+  */
+  std::byte *data;
+  std::size_t size;
+  bool mapped;
+  /**
+   * holds the song when the file could not be mapped
+  */
+  Music music;
+  Mp3Validator validator;
+  /**
+   * bytes received so far, only used by whoever is receiving the song
+  */
+  std::size_t received;
+  /**
+   * FNV-1a hash of the song
+  */
+  uint64_t hash;
+  /**
+   * the client disconnected, the upload was cancelled, or the song could not be stored.
+   * Each is set by one stage, or before the last piece is queued, and only read by later stages on the last piece
+  */
+  bool disconnected;
+  bool cancelled;
+  bool failed;
+  /**
+   * not an MP3, set by VALIDATE as soon as it is sure. From then on the song is not hashed or stored,
+   * and whoever is receiving it reads the rest of it into a scratch buffer instead of data
+  */
+  std::atomic<bool> rejected;
+  /**
+   * when the first and the last piece arrived
+  */
+  int64_t firstUs;
+  int64_t lastUs;
+} IngestJob_t;
+
+/**
+ * @brief A piece of an upload passed from stage to stage
+*/
+typedef struct {
+  std::shared_ptr<IngestJob_t> job;
+  /**
+   * where the piece is in the song and how long it is
+  */
+  std::size_t offset;
+  std::size_t length;
+  /**
+   * true for the piece that ends the upload, whether the song is complete or not
+  */
+  bool last;
+  /**
+   * when the piece was queued for the stage it is waiting on
+  */
+  int64_t queuedUs;
+} IngestChunk_t;
+
+/**
+ * @brief Receiving a song, validating it, writing it out, indexing it and publishing it run as separate
+ * stages on their own threads, with bounded queues between them. While one piece of a song is being written,
+ * the next is being validated and the one after is still arriving, and different uploads share the stages.
+ * Most of the work is done by the time the last byte arrives
+*/
+class IngestPipeline {
+private:
+
+  MusicStorage &queue;
+
+  /**
+   * write end of the pipe published uploads are sent to as PipeData_t
+  */
+  int notifyFd;
+
+  /**
+   * queue in front of each stage, RECEIVE has none
+  */
+  std::array<std::unique_ptr<BoundedQueue<IngestChunk_t>>, INGEST_STAGES> queues;
+
+  std::vector<std::thread> threads;
+
+  IngestStats_t stats;
+
+  /**
+   * @brief loop of a stage thread
+  */
+  void _run(IngestStage stage);
+
+  void _validate(IngestChunk_t &chunk);
+  void _persist(IngestChunk_t &chunk);
+  static void _index(IngestChunk_t &chunk);
+  void _publish(IngestChunk_t &chunk);
+
+  /**
+   * @brief add a piece's timings to a stage's stats
+  */
+  void _record(IngestStage stage, int64_t waitUs, int64_t busyUs);
+
+public:
+
+  explicit IngestPipeline(MusicStorage &queue);
+
+  IngestPipeline(const IngestPipeline &) = delete;
+
+  ~IngestPipeline();
+
+  /**
+   * @brief start the stage threads
+   * @param fd write end of a pipe, gets a PipeData_t for each upload once it is published
+  */
+  void start(int fd);
+
+  /**
+   * @brief stop the stage threads, pieces still queued are dropped
+  */
+  void stop();
+
+  /**
+   * @brief start an upload whose pieces are given to IngestPipeline::push as they arrive, read into job->data
+   * @param t room's record of the upload, t.entry is the entry the song is for
+   * @param size size of the song in bytes
+   * @return the upload, nullptr if the entry is gone, in which case the room has been told through the pipe
+  */
+  std::shared_ptr<IngestJob_t> begin(PipeData_t t, uint32_t size);
+
+  /**
+   * @brief send the next piece of an upload through the pipeline, blocking if the pipeline is behind.
+   * The piece must already be in job->data at job->received
+   * @param length bytes in the piece
+   * @return false if the pipeline is shutting down
+  */
+  bool push(const std::shared_ptr<IngestJob_t> &job, std::size_t length);
+
+  /**
+   * @brief give up on an upload whose entry was removed. The room is sent a PipeData_t with a null entry
+  */
+  void cancel(const std::shared_ptr<IngestJob_t> &job);
+
+  /**
+   * @brief receive a song from a client's socket and send it through the pipeline. Runs on the calling
+   * thread until the last piece is queued, blocking whenever the pipeline is behind
+   * @param t room's record of the upload, t.entry is the entry the song is for
+   * @param socket client's socket, positioned at the start of the song
+   * @param size size of the song in bytes
+  */
+  void receive(PipeData_t t, ThreadSafeSocket &socket, uint32_t size);
+
+  [[nodiscard]] const IngestStats_t &getStats() const;
+
+  /**
+   * @return name of a stage for printing
+  */
+  static const char *stageName(IngestStage stage);
+};
+
+}
@@ -0,0 +1,320 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for a client's outbox
+*/
+
+#include <climits>
+#include <algorithm>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <unistd.h>
+#include <sys/socket.h>
+#endif
+
+#include "Outbox.hpp"
+#include "../Clock.hpp"
+#include "../debug.hpp"
+#include "../messaging/Commands.hpp"
+
+using namespace room;
+
+Outbox::Outbox(room::Client &client, MusicStorage &queue, int notifyFd):
+  client{client}, queue{queue}, notifyFd{notifyFd}, mutex{}, cond{}, messages{}, streams{}, lanes{}, nextStreamId{0},
+  stopping{false}, failed{false}, stats{}, thread{} {}
+
+Outbox::~Outbox() {
+  stop();
+}
+
+void Outbox::start() {
+  if (thread.joinable()) {
+    return;
+  }
+  // a chunk written waits behind little more than the one before it
+  client.getSocket().limitUnsentBytes(OUTBOX_UNSENT_BYTES);
+  thread = std::thread(&Outbox::_run, this);
+}
+
+void Outbox::stop() {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    stopping = true;
+  }
+  cond.notify_all();
+  if (thread.joinable()) {
+#if defined(__APPLE__) || defined(__unix__)
+    // a client that stopped reading would keep the thread in write forever
+    shutdown(client.getSocket().getSocketFD(), SHUT_RDWR);
+#endif
+    thread.join();
+  }
+  // only this thread adds lanes, none are added while they are stopped
+  for (OutboxLane_t &lane : lanes) {
+#if defined(__APPLE__) || defined(__unix__)
+    shutdown(lane.socket->getSocketFD(), SHUT_RDWR);
+#endif
+    if (lane.thread.joinable()) {
+      lane.thread.join();
+    }
+  }
+  lanes.clear();
+}
+
+bool Outbox::addLane(ThreadSafeSocket &&socket) {
+  // lanes whose connection is done with are dropped first, they do not count
+  auto lane = lanes.begin();
+  while (lane != lanes.end()) {
+    if (lane->finished) {
+      lane->thread.join();
+      lane = lanes.erase(lane);
+    } else {
+      ++lane;
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (stopping || failed || lanes.size() >= MAX_DATA_CONNECTIONS) {
+      return false;
+    }
+  }
+  OutboxLane_t &added = lanes.emplace_back();
+  added.socket = std::make_unique<ThreadSafeSocket>(std::move(socket));
+  added.finished = false;
+  added.socket->limitUnsentBytes(OUTBOX_UNSENT_BYTES);
+  ++stats.lanes;
+  added.thread = std::thread(&Outbox::_runLane, this, std::ref(added));
+  return true;
+}
+
+void Outbox::send(const OutboxFrame_t &frame) {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (failed) {
+      return;
+    }
+    messages.push_back({frame, steadyClockUs()});
+  }
+  cond.notify_one();
+}
+
+void Outbox::sendSong(const std::vector<OutboxFrame_t> &lead, uint8_t queuePosition, EntryHandle_t entry, std::shared_ptr<Music> audio) {
+  const std::vector<std::byte> &bytes = audio->getVector();
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (failed) {
+      return;
+    }
+    const int64_t now = steadyClockUs();
+    for (const OutboxFrame_t &frame : lead) {
+      messages.push_back({frame, now});
+    }
+    // the position is only right in the order the messages were queued in, so it goes with them
+    const uint32_t begin[2] = {nextStreamId, static_cast<uint32_t>(bytes.size())};
+    std::vector<std::byte> body{};
+    body.resize(sizeof begin);
+    std::copy(
+      reinterpret_cast<const std::byte*>(begin),
+      reinterpret_cast<const std::byte*>(begin) + sizeof begin,
+      body.data()
+    );
+    Message message;
+    message.setCommand(Commands::Command::SONG_BEGIN);
+    message.setOptions(static_cast<std::byte>(queuePosition));
+    message.setBodySize(sizeof begin);
+    message.setBody(body);
+    messages.push_back({frame(message), now});
+    streams.push_back({nextStreamId, entry, std::move(audio), 0, 0, 0, {}});
+    ++nextStreamId;
+  }
+  cond.notify_one();
+}
+
+void Outbox::_notify(EntryHandle_t entry, bool sent) {
+  PipeData_t t{client.getSocket().getSocketFD(), &client, entry, false};
+  if (!sent) {
+    t.socketFD *= -1;
+  } else if (auto p_entry = queue.get(entry); p_entry != nullptr) {
+    p_entry->sent++;
+  }
+  ::write(notifyFd, reinterpret_cast<const void *>(&t), sizeof t);
+}
+
+std::list<OutboxStream_t>::iterator Outbox::_nextStream() {
+  auto next = streams.end();
+  int nextPosition = INT_MAX;
+  auto stream = streams.begin();
+  while (stream != streams.end()) {
+    const std::size_t size = stream->audio->getVector().size();
+    if (stream->inFlight > 0 && stream->offset == size && stream->resend.empty()) {
+      // the rest of it is being written, nothing to hand out
+      ++stream;
+      continue;
+    }
+    if (stream->inFlight == 0 && stream->written == size) {
+      // only an empty song gets here, the others are done with once their last chunk is written
+      _notify(stream->entry, true);
+      stream = streams.erase(stream);
+      continue;
+    }
+    const int position = queue.getPositionInQueue(stream->entry);
+    if (position == -1) {
+      if (stream->inFlight > 0) {
+        // dropped once the chunks being written are done with
+        stream->offset = size;
+        stream->resend.clear();
+        ++stream;
+        continue;
+      }
+      // the client was sent REMOVE_QUEUE_ENTRY for it, no point sending the rest
+      DEBUG_P(std::cout << "song removed while sending, dropping it\n");
+      _notify(stream->entry, true);
+      stream = streams.erase(stream);
+      continue;
+    }
+    if (position < nextPosition) {
+      next = stream;
+      nextPosition = position;
+    }
+    ++stream;
+  }
+  return next;
+}
+
+bool Outbox::_takeChunk(OutboxChunk_t &chunk) {
+  auto stream = _nextStream();
+  if (stream == streams.end()) {
+    return false;
+  }
+  chunk.stream = stream;
+  if (!stream->resend.empty()) {
+    chunk.offset = stream->resend.back().first;
+    chunk.length = stream->resend.back().second;
+    stream->resend.pop_back();
+  } else {
+    chunk.offset = stream->offset;
+    chunk.length = std::min<std::size_t>(stream->audio->getVector().size() - stream->offset, SONG_CHUNK_BYTES);
+    stream->offset += chunk.length;
+  }
+  // the stream stays in the list while any of its chunks are being written
+  ++stream->inFlight;
+  return true;
+}
+
+bool Outbox::_writeChunk(ThreadSafeSocket &socket, const OutboxChunk_t &chunk, std::vector<std::byte> &body) {
+  const std::vector<std::byte> &audio = chunk.stream->audio->getVector();
+  const uint32_t prefix[2] = {chunk.stream->id, static_cast<uint32_t>(chunk.offset)};
+  body.resize(sizeof prefix + chunk.length);
+  std::copy(
+    reinterpret_cast<const std::byte*>(prefix),
+    reinterpret_cast<const std::byte*>(prefix) + sizeof prefix,
+    body.data()
+  );
+  std::copy(audio.data() + chunk.offset, audio.data() + chunk.offset + chunk.length, body.data() + sizeof prefix);
+  Message header;
+  header.setCommand(Commands::Command::SONG_CHUNK);
+  header.setBodySize(static_cast<uint32_t>(body.size()));
+  // the header and the chunk go in one write, nothing else can get between them
+  return chunk.length == 0 || socket.writeHeaderAndData(header.data(), body.data(), body.size());
+}
+
+void Outbox::_finishChunk(const OutboxChunk_t &chunk, bool written) {
+  auto stream = chunk.stream;
+  --stream->inFlight;
+  if (failed) {
+    if (stream->inFlight == 0) {
+      streams.erase(stream);
+    }
+    return;
+  }
+  if (!written) {
+    stream->resend.emplace_back(chunk.offset, chunk.length);
+  } else {
+    stream->written += chunk.length;
+    if (stream->written == stream->audio->getVector().size()) {
+      _notify(stream->entry, true);
+      streams.erase(stream);
+    }
+  }
+  // another connection may be waiting on this stream
+  cond.notify_all();
+}
+
+void Outbox::_run() {
+  ThreadSafeSocket &socket = client.getSocket();
+  std::vector<std::byte> body{};
+  std::unique_lock<std::mutex> lock{mutex};
+  while (!stopping) {
+    bool written;
+    OutboxChunk_t chunk;
+    if (!messages.empty()) {
+      const OutboxMessage_t message = std::move(messages.front());
+      messages.pop_front();
+      lock.unlock();
+      written = socket.write(message.frame->data(), message.frame->size());
+      const auto waitUs = static_cast<uint64_t>(std::max<int64_t>(steadyClockUs() - message.queuedUs, 0));
+      ++stats.messages;
+      stats.lastWaitUs = waitUs;
+      uint64_t longest = stats.maxWaitUs;
+      while (waitUs > longest && !stats.maxWaitUs.compare_exchange_weak(longest, waitUs)) {}
+      lock.lock();
+    } else if (_takeChunk(chunk)) {
+      lock.unlock();
+      written = _writeChunk(socket, chunk, body);
+      ++stats.chunks;
+      lock.lock();
+      _finishChunk(chunk, written);
+    } else {
+      cond.wait(lock);
+      continue;
+    }
+
+    if (!written) {
+      // the client is gone, the room removes it. Streams with chunks on data connections go once those are done with
+      failed = true;
+      messages.clear();
+      streams.remove_if([](const OutboxStream_t &stream) { return stream.inFlight == 0; });
+      cond.notify_all();
+      _notify({}, false);
+      return;
+    }
+  }
+}
+
+void Outbox::_runLane(OutboxLane_t &lane) {
+  ThreadSafeSocket &socket = *lane.socket;
+  std::vector<std::byte> body{};
+  std::unique_lock<std::mutex> lock{mutex};
+  while (!stopping && !failed) {
+    OutboxChunk_t chunk;
+    if (!_takeChunk(chunk)) {
+      cond.wait(lock);
+      continue;
+    }
+    lock.unlock();
+    // the client shuts down its side of a connection it no longer wants, and reads what was already sent
+    const bool written = !socket.isClosedByPeer() && _writeChunk(socket, chunk, body);
+    ++stats.chunks;
+    ++stats.laneChunks;
+    lock.lock();
+    _finishChunk(chunk, written);
+    if (!written) {
+      // the chunk goes over another connection
+      break;
+    }
+  }
+  lock.unlock();
+#if defined(__APPLE__) || defined(__unix__)
+  shutdown(socket.getSocketFD(), SHUT_RDWR);
+#endif
+  --stats.lanes;
+  lane.finished = true;
+}
+
+const OutboxStats_t &Outbox::getStats() const {
+  return stats;
+}
+
+OutboxFrame_t Outbox::frame(Message &message) {
+  return std::make_shared<const std::vector<std::byte>>(message.data(), message.data() + message.size());
+}
@@ -0,0 +1,248 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Everything the room sends to one client, written in order of how soon the client needs it
+ */
+
+#pragma once
+
+#include <list>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+
+#include "Client.hpp"
+#include "IngestPipeline.hpp"
+#include "../music/Music.hpp"
+#include "../music/MusicStorage.hpp"
+#include "../messaging/Message.hpp"
+
+// bytes of a song in one SONG_CHUNK. Other messages wait behind at most one chunk
+#define SONG_CHUNK_BYTES 16384
+// bytes a client's connection holds that have been written but not sent, so a message written next goes out soon after
+#define OUTBOX_UNSENT_BYTES 16384
+
+namespace room {
+
+/**
+ * @brief A whole message, shared by the outboxes of every client it is sent to
+*/
+typedef std::shared_ptr<const std::vector<std::byte>> OutboxFrame_t;
+
+/**
+ * @brief A message waiting to be written
+*/
+typedef struct {
+  OutboxFrame_t frame;
+  /**
+   * steady clock time in us it was queued at
+  */
+  int64_t queuedUs;
+} OutboxMessage_t;
+
+/**
+ * @brief A song being sent to the client in SONG_CHUNKs
+*/
+typedef struct {
+  /**
+   * id the client was given for the song in its SONG_BEGIN
+  */
+  uint32_t id;
+  EntryHandle_t entry;
+  std::shared_ptr<Music> audio;
+  /**
+   * bytes of the song handed out to be sent so far, chunks are handed out in order
+  */
+  std::size_t offset;
+  /**
+   * bytes of the song written so far, the song has been sent once this is its size
+  */
+  std::size_t written;
+  /**
+   * chunks handed out that are being written
+  */
+  unsigned inFlight;
+  /**
+   * chunks whose data connection was lost before they were written, as offset and length. Sent again first
+  */
+  std::vector<std::pair<std::size_t, std::size_t>> resend;
+} OutboxStream_t;
+
+/**
+ * @brief A chunk of a song handed out to one connection to write
+*/
+typedef struct {
+  std::list<OutboxStream_t>::iterator stream;
+  std::size_t offset;
+  std::size_t length;
+} OutboxChunk_t;
+
+/**
+ * @brief An extra connection from the client that only song chunks are sent over
+*/
+typedef struct {
+  std::unique_ptr<ThreadSafeSocket> socket;
+  std::thread thread;
+  /**
+   * set once the connection is done with, it is then joined and dropped
+  */
+  std::atomic<bool> finished;
+} OutboxLane_t;
+
+typedef struct {
+  /**
+   * messages and song chunks written, and of those chunks the ones written over data connections
+  */
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> chunks;
+  std::atomic<uint64_t> laneChunks;
+  /**
+   * data connections open now
+  */
+  std::atomic<uint64_t> lanes;
+  /**
+   * microseconds from a message being queued to it being written, the last one and the longest so far
+  */
+  std::atomic<uint64_t> lastWaitUs;
+  std::atomic<uint64_t> maxWaitUs;
+} OutboxStats_t;
+
+/**
+ * @brief Sends a client its messages and songs from one thread, so no message waits behind a whole song.
+ * Songs go in chunks, and between any two chunks the messages queued so far are written first.
+ * Of the songs being sent, the one nearest the front of the queue gets the next chunk, so the song playing
+ * now arrives before the next one, and the next one before those after it.
+ * Every message the room sends the client goes through here, that keeps them in the order they were queued in.
+ * A client far from the room can open data connections as well, each gets its own thread that only sends chunks.
+ * Every connection takes the next chunk of the same song, so the song is striped across all of them
+*/
+class Outbox {
+private:
+
+  room::Client &client;
+
+  MusicStorage &queue;
+
+  /**
+   * write end of the pipe a PipeData_t is sent to once each song has been sent, or once the client is gone
+  */
+  int notifyFd;
+
+  std::mutex mutex;
+  std::condition_variable cond;
+
+  std::deque<OutboxMessage_t> messages;
+  std::list<OutboxStream_t> streams;
+
+  std::list<OutboxLane_t> lanes;
+
+  uint32_t nextStreamId;
+
+  /**
+   * set to stop the thread
+  */
+  bool stopping;
+
+  /**
+   * set once a write failed, nothing more is sent
+  */
+  bool failed;
+
+  OutboxStats_t stats;
+
+  std::thread thread;
+
+  /**
+   * @brief loop of the sending thread
+  */
+  void _run();
+
+  /**
+   * @brief loop of a data connection's thread
+  */
+  void _runLane(OutboxLane_t &lane);
+
+  /**
+   * @brief tell the room a song has been sent, or that the client is gone if entry is null
+  */
+  void _notify(EntryHandle_t entry, bool sent);
+
+  /**
+   * @brief the queued song nearest the front of the queue. Songs that have been removed are dropped
+  */
+  std::list<OutboxStream_t>::iterator _nextStream();
+
+  /**
+   * @brief hand out the next chunk to send, with the lock held
+   * @returns false if there is nothing to send now
+  */
+  bool _takeChunk(OutboxChunk_t &chunk);
+
+  /**
+   * @brief write a chunk handed out by Outbox::_takeChunk, with the lock let go
+  */
+  bool _writeChunk(ThreadSafeSocket &socket, const OutboxChunk_t &chunk, std::vector<std::byte> &body);
+
+  /**
+   * @brief account for a chunk once it was written, or hand it out again if it was not, with the lock held
+  */
+  void _finishChunk(const OutboxChunk_t &chunk, bool written);
+
+public:
+
+  /**
+   * @param client client to send to, must not move while the outbox exists
+   * @param queue queue the songs are in
+   * @param notifyFd write end of the pipe told about each song sent
+  */
+  Outbox(room::Client &client, MusicStorage &queue, int notifyFd);
+
+  Outbox(const Outbox &) = delete;
+
+  ~Outbox();
+
+  /**
+   * @brief start the sending thread
+  */
+  void start();
+
+  /**
+   * @brief stop the sending threads, anything still queued is dropped
+  */
+  void stop();
+
+  /**
+   * @brief send chunks over a data connection from the client as well as over its main connection
+   * @param socket the data connection, after it sent the client's token
+   * @returns false if the client has as many data connections as it can have, the connection is closed
+  */
+  bool addLane(ThreadSafeSocket &&socket);
+
+  /**
+   * @brief queue a message, it is written before any more of the songs being sent
+  */
+  void send(const OutboxFrame_t &frame);
+
+  /**
+   * @brief queue a song. The lead messages and the song's SONG_BEGIN are queued like any message,
+   * its chunks are sent as the song's place in the queue allows
+   * @param lead messages about the song that go before it, its frame index, metadata and gain
+   * @param queuePosition position of the song in the queue now
+   * @param entry handle of the song's entry
+   * @param audio the song
+  */
+  void sendSong(const std::vector<OutboxFrame_t> &lead, uint8_t queuePosition, EntryHandle_t entry, std::shared_ptr<Music> audio);
+
+  [[nodiscard]] const OutboxStats_t &getStats() const;
+
+  /**
+   * @brief copy a message into a frame that can be sent to any number of clients
+  */
+  static OutboxFrame_t frame(Message &message);
+};
+
+}
@@ -8,11 +8,27 @@
 using namespace Commands;
 using namespace room;
 
-Room::Room(): ip{}, fdMax{}, hostSocket{}, threadRecvPipe{},
-  threadSendPipe{}, threadWaitAudioPipe{}, startTime{},
-  name{}, clients{}, queue{}, audioPlayer{}, master{} {}
+Room::Room(): Room{RoomConfig_t{}} {}
+
+Room::Room(RoomConfig_t config): ip{}, fdMax{}, config{std::move(config)}, hostSocket{}, dataSocket{},
+  dataConnections{}, upstream{}, hopClock{},
+  relayPlaying{false}, upstreamLost{false}, upstreamSongs{}, controlSocket{}, controlConnections{}, threadRecvPipe{},
+  threadSendPipe{}, threadWaitAudioPipe{}, threadGainPipe{}, startTime{}, trackEndMs{0},
+  nextBeaconMs{}, preloadedEntry{}, playPending{false}, name{}, clients{}, queue{},
+  audioPlayer{this->config.audioDriver, this->config.audioDevice}, analyzer{queue}, ingest{queue}, journal{}, master{} {}
 
 Room::~Room() {
+  // the workers write to threadGainPipe and threadRecvPipe, stop them before they are closed
+  analyzer.stop();
+  ingest.stop();
+  // write out what is still queued for the journal
+  journal.stop();
+  if (threadGainPipe[0] != 0) {
+    close(threadGainPipe[0]);
+  }
+  if (threadGainPipe[1] != 0) {
+    close(threadGainPipe[1]);
+  }
   if (threadRecvPipe[0] != 0) {
     close(threadRecvPipe[0]);
   }
@@ -39,19 +55,35 @@ Room::~Room() {
   if (threadWaitAudioPipe[1] != 0) {
     close(threadWaitAudioPipe[1]);
   }
+  if (controlSocket.getSocketFD() > 0) {
+    unlink(config.controlPath.c_str());
+  }
 }
 
 bool Room::initializeRoom() {
-  const uint16_t port = getPort();
-  std::string host;
-  getHost(host);
+  if (!config.headless) {
+    config.port = getPort();
+    getHost(config.host);
+  }
 
-  if (!hostSocket.bind(host, port)) {
+  if (!hostSocket.bind(config.host, config.port)) {
     return false;
   }
   if (!hostSocket.listen()) {
     return false;
   }
+  if (!openDataSocket()) {
+    std::cerr << "Error: unable to open a data port, listeners get songs over one connection each\n";
+  }
+  if (config.headless && !openControlSocket()) {
+    return false;
+  }
+  if (isRelay() && !connectUpstream()) {
+    return false;
+  }
+  queue.setMemoryBudget(config.memoryBudget);
+  // before anything plays, the ring can only be resized while the player is stopped
+  audioPlayer.setRingSize(config.ringBytes);
 
   // create pipe for thread communication
   if (::pipe(threadRecvPipe) == -1) {
@@ -66,43 +98,152 @@ bool Room::initializeRoom() {
     fprintf(stderr, "pipe: %s (%d)\n", strerror(errno), errno);
     return false;
   }
+  if (::pipe(threadGainPipe) == -1) {
+    fprintf(stderr, "pipe: %s (%d)\n", strerror(errno), errno);
+    return false;
+  }
+  if (!isRelay()) {
+    // a relay is sent each song's gain by the upstream room
+    analyzer.start(threadGainPipe[1]);
+  }
+  ingest.start(threadRecvPipe[1]);
 
   // set initial max file descriptor for selector
   fdMax = hostSocket.getSocketFD();
   fdMax = fdMax > threadRecvPipe[0] ? fdMax : threadRecvPipe[0];
   fdMax = fdMax > threadSendPipe[0] ? fdMax : threadSendPipe[0];
   fdMax = fdMax > threadWaitAudioPipe[0] ? fdMax : threadWaitAudioPipe[0];
+  fdMax = fdMax > threadGainPipe[0] ? fdMax : threadGainPipe[0];
+  fdMax = fdMax > controlSocket.getSocketFD() ? fdMax : controlSocket.getSocketFD();
+  fdMax = fdMax > upstream.getSocketFD() ? fdMax : upstream.getSocketFD();
+  fdMax = fdMax > dataSocket.getSocketFD() ? fdMax : dataSocket.getSocketFD();
 
   // clear the master sets
   FD_ZERO(&master);
-  // add stdin, the hostSocket, and the pipe to selector list
-  FD_SET(0, &master);
+  // add stdin, or the control socket if headless, the hostSocket, and the pipe to selector list
+  if (config.headless) {
+    FD_SET(controlSocket.getSocketFD(), &master);
+  } else {
+    FD_SET(0, &master);
+  }
   FD_SET(hostSocket.getSocketFD(), &master);
+  if (dataSocket.getSocketFD() > 0) {
+    FD_SET(dataSocket.getSocketFD(), &master);
+  }
   FD_SET(threadRecvPipe[0], &master);
   FD_SET(threadSendPipe[0], &master);
   FD_SET(threadWaitAudioPipe[0], &master);
+  FD_SET(threadGainPipe[0], &master);
+  if (isRelay()) {
+    FD_SET(upstream.getSocketFD(), &master);
+    std::cout << "Successfully created a relay of " << config.upstreamHost << ':' << config.upstreamPort << '\n';
+    // the upstream room's queue is the one that counts, there is nothing of its own to restore
+    return true;
+  }
+  if (!restoreQueue()) {
+    return false;
+  }
   std::cout << "Successfully created a room\n";
   return true;
 }
 
+bool Room::openDataSocket() {
+  // port 0 lets the system pick a free one, clients are told which in SESSION_TOKEN
+  if (dataSocket.bind(config.host, 0) && dataSocket.listen()) {
+    return true;
+  }
+  if (dataSocket.getSocketFD() > 0) {
+    close(dataSocket.getSocketFD());
+  }
+  dataSocket.setSocketFD(0);
+  return false;
+}
+
+bool Room::connectUpstream() {
+  if (!upstream.connect(config.upstreamHost, config.upstreamPort)) {
+    std::cerr << "Error: unable to connect to the upstream room at " << config.upstreamHost << ':' << config.upstreamPort << '\n';
+    return false;
+  }
+  return true;
+}
+
+bool Room::openControlSocket() {
+  if (!controlSocket.bindLocal(config.controlPath)) {
+    return false;
+  }
+  // only the user running the room can control it
+  chmod(config.controlPath.c_str(), 0600);
+  return controlSocket.listen();
+}
+
 bool Room::launchRoom() {
-  std::cout << " >> ";
-  std::cout.flush();
+  if (!config.headless) {
+    std::cout << " >> ";
+    std::cout.flush();
+  }
   while (true) {
     fd_set read_fds = master;  // temp file descriptor list for select()
-    if (::select(fdMax + 1, &read_fds, nullptr, nullptr, nullptr /* <- time out in microseconds*/) == -1){
+    // while audio plays, wake up in time to send the next position beacon,
+    // and in time to drop the oldest data connection that has not sent its token
+    struct timeval timeout{};
+    struct timeval *p_timeout = nullptr;
+    int64_t untilWake = -1;
+    if (audioPlayer.isPlaying()) {
+      untilWake = std::max<int64_t>(nextBeaconMs - wallClockMs(), 0);
+    }
+    if (!dataConnections.empty()) {
+      const int64_t untilDrop = std::max<int64_t>(
+        dataConnections.front().acceptedMs + DATA_CONNECTION_TIMEOUT_MS - wallClockMs(), 0
+      );
+      untilWake = untilWake < 0 ? untilDrop : std::min(untilWake, untilDrop);
+    }
+    if (untilWake >= 0) {
+      timeout.tv_sec = static_cast<decltype(timeout.tv_sec)>(untilWake / 1000);
+      timeout.tv_usec = static_cast<decltype(timeout.tv_usec)>((untilWake % 1000) * 1000);
+      p_timeout = &timeout;
+    }
+    if (::select(fdMax + 1, &read_fds, nullptr, nullptr, p_timeout) == -1){
       fprintf(stderr, "select: %s (%d)\n", strerror(errno), errno);
       return false;
     }
 
+    if (audioPlayer.isPlaying() && wallClockMs() >= nextBeaconMs) {
+      const int64_t now = wallClockMs();
+      nextBeaconMs = now + BEACON_INTERVAL_MS;
+      sendPositionBeacon(now, audioPlayer.getPositionMs());
+    }
+
+    // the room being relayed sent something, mirror it
+    if (isRelay() && FD_ISSET(upstream.getSocketFD(), &read_fds) && !handleUpstreamMessage()) {
+      upstreamLost = true;
+    }
+
     // connection request, add them to the room
     if (FD_ISSET(hostSocket.getSocketFD(), &read_fds)) {
       DEBUG_P(std::cout << "connection request\n");
       handleConnectionRequests();
     }
 
+    // a client opening another connection to get songs over
+    if (dataSocket.getSocketFD() > 0 && FD_ISSET(dataSocket.getSocketFD(), &read_fds)) {
+      handleDataConnectionRequests();
+    }
+
+    // the token of a data connection
+    dropSilentDataConnections();
+    auto dataConnection = dataConnections.begin();
+    while (dataConnection != dataConnections.end()) {
+      const int socketFD = dataConnection->socket.getSocketFD();
+      if (FD_ISSET(socketFD, &read_fds) && handleDataConnection(*dataConnection)) {
+        FD_CLR(socketFD, &master);
+        dataConnection = dataConnections.erase(dataConnection);
+      } else {
+        ++dataConnection;
+      }
+    }
+
     // input from stdin, local user entered a command
-    if (FD_ISSET(0, &read_fds)) { 
+    if (!config.headless && FD_ISSET(0, &read_fds)) { 
       DEBUG_P(std::cout << "stdin command entered\n");
       const int result = handleStdinCommands();
       if (result == 0) {
@@ -113,23 +254,68 @@ bool Room::launchRoom() {
       }
     }
 
+    // a program wants to control the room
+    if (config.headless && FD_ISSET(controlSocket.getSocketFD(), &read_fds)) {
+      handleControlConnection();
+    }
+
+    // commands on the control socket
+    auto connection = controlConnections.begin();
+    while (connection != controlConnections.end()) {
+      if (!FD_ISSET(connection->socket.getSocketFD(), &read_fds)) {
+        ++connection;
+        continue;
+      }
+      const int result = handleControlCommands(*connection);
+      if (result == 0) {
+        return true;
+      }
+      if (result == -1) {
+        return false;
+      }
+      if (connection->closed) {
+        FD_CLR(connection->socket.getSocketFD(), &master);
+        connection = controlConnections.erase(connection);
+      } else {
+        ++connection;
+      }
+    }
+
     // data from pipe, a thread has finished receiving an audio file
     if (FD_ISSET(threadRecvPipe[0], &read_fds)) {
       processThreadFinishedReceiving();
     }
 
+    if (upstreamLost) {
+      std::cerr << "Error: lost the upstream room, the relay is shutting down\n";
+      return false;
+    }
+
     // data from pipe, a thread as finished sending an audio file
     if (FD_ISSET(threadSendPipe[0], &read_fds)) {
       DEBUG_P(std::cout << "data from send pipe\n");
       processThreadFinishedSending();
     }
 
+    // data from pipe, the loudness analyzer has measured a song
+    if (FD_ISSET(threadGainPipe[0], &read_fds)) {
+      processEntryGain();
+    }
+
     if (FD_ISSET(threadWaitAudioPipe[0], &read_fds)) {
       DEBUG_P(std::cout << "data from song wait pipe\n");
-      int x;
-      ::read(threadWaitAudioPipe[0], reinterpret_cast<void *>(&x), sizeof (int));
+      int advanced;
+      ::read(threadWaitAudioPipe[0], reinterpret_cast<void *>(&advanced), sizeof (int));
+      if (auto p_front = queue.getFront(); p_front != nullptr) {
+        journal.removed(p_front->handle);
+      }
       queue.removeFront();
-      attemptPlayNext();
+      preloadedEntry = {};
+      if (advanced) {
+        handleGaplessAdvance();
+      } else {
+        attemptPlayNext();
+      }
     }
 
     // loop through all clients to see if they sent something
@@ -161,21 +347,55 @@ void Room::processThreadFinishedReceiving() {
   PipeData_t t;
   ::read(threadRecvPipe[0], reinterpret_cast<void *>(&t), sizeof t);
 
+  if (isRelay() && std::abs(t.socketFD) == upstream.getSocketFD()) {
+    processUpstreamSongReceived(t);
+    return;
+  }
   if (t.socketFD < 0) { // when true, means that we need to remove that client and their entry
     DEBUG_P(std::cout << "client disconnected\n");
     t.socketFD *= -1;
+    for (room::Client &client : clients) {
+      if (client.getSocket().getSocketFD() == t.socketFD) {
+        // the entry the song was going to is removed below
+        client.entry = {};
+        handleRemoveClientEntries(client);
+      }
+    }
     // remove it
     clients.remove_if([&t](room::Client &client){
       return client.getSocket().getSocketFD() == t.socketFD;
     });
-    handleRemoveQueueEntry(t.p_entry);
+    handleRemoveQueueEntry(t.entry);
+    return;
+  }
+  if (t.rejected) {
+    // nothing was sent, take the entry out and listen to the client again
+    std::cerr << "Rejected a song that is not a valid MP3 file\n";
+    sendBasicResponse(*t.p_client, Command::BAD_VALUES);
+    t.p_client->entry = {};
+    handleRemoveQueueEntry(t.entry);
+    FD_SET(t.socketFD, &master);
     return;
   }
-  if (t.p_entry != nullptr) {
+  if (!t.entry.isNull()) {
+    if (auto p_entry = queue.get(t.entry); p_entry != nullptr) {
+      const EntryState state = p_entry->getState();
+      if (state == EntryState::READY || state == EntryState::PLAYING) {
+        journal.added(*p_entry);
+      }
+    }
+    analyzer.submit(t.entry);
     sendSongToAllClients(t);
     if (t.p_client != nullptr) {
-      t.p_client->p_entry = nullptr;
+      t.p_client->entry = {};
+      // also when the entry was removed while it arrived, more songs of a batch may be waiting behind it
+      FD_SET(t.socketFD, &master);
     }
+    if (playPending) {
+      // an earlier attempt found the song not ready, start it now instead of waiting for the next event
+      attemptPlayNext();
+    }
+    preloadNext();
   } else {
     // this should only be reached when room host cancels adding a song to the queue
     DEBUG_P(std::cout << "adding was cancelled, now adding client " << t.socketFD << " back to master\n");
@@ -187,115 +407,152 @@ void Room::processThreadFinishedReceiving() {
 void Room::processThreadFinishedSending() {
   PipeData_t t;
   ::read(threadSendPipe[0], reinterpret_cast<void *>(&t), sizeof t);
+  // the client may have been removed since, only its address is looked at
+  auto client = std::find_if(clients.begin(), clients.end(), [&t](room::Client &c) {
+    return &c == t.p_client && c.getSocket().getSocketFD() == std::abs(t.socketFD);
+  });
+  if (client == clients.end()) {
+    return;
+  }
   if (t.socketFD < 0) { // when true, means that we need to remove that client
-    t.socketFD  *= -1;
-    // remove it
-    clients.remove_if([&t](room::Client &client){
-      return &client == t.p_client;
-    });
-  } else { // other wise its all good, continue
-    // add the client's socket FD back to select
-    
-    if (t.p_client->entriesTillSynced == 0) {
-      FD_SET(t.socketFD , &master);
-      return;
-    }
+    FD_CLR(client->getSocket().getSocketFD(), &master);
+    clients.erase(client);
+    return;
+  }
+  if (client->entriesTillSynced == 0) {
+    // a song sent to everyone
+    return;
+  }
+  --client->entriesTillSynced;
+  if (client->entriesTillSynced == 0 && songInProgress()) {
+    // synced while a song plays, tell it when the song started. Otherwise the next PLAY_NEXT reaches it with everyone else's
+    std::vector<std::byte> bytes{};
+    bytes.resize(sizeof startTime);
+    std::copy(
+      reinterpret_cast<const std::byte*>(&startTime),
+      reinterpret_cast<const std::byte*>(&startTime) + sizeof startTime,
+      bytes.data()
+    );
+    Message message;
+    message.setCommand(Command::PLAY_NEXT);
+    message.setBodySize(sizeof startTime);
+    message.setBody(bytes);
+    client->outbox->send(Outbox::frame(message));
+  }
+}
 
-    --t.p_client->entriesTillSynced;
-    if (t.p_client->entriesTillSynced == 0 && audioPlayer.isPlaying()) {
-      std::vector<std::byte> bytes{0};
-      bytes.resize(sizeof startTime);
-      std::copy(
-        reinterpret_cast<const std::byte*>(&startTime),
-        reinterpret_cast<const std::byte*>(&startTime) + sizeof startTime,
-        bytes.data()
-      );
-      Message message;
-      message.setCommand(Command::PLAY_NEXT);
-      message.setBodySize(sizeof startTime);
-      message.setBody(bytes);
-      t.p_client->getSocket().write(message.data(), message.size());
-      FD_SET(t.socketFD , &master);
-    }
-  }
-}
-
-void Room::sendSongDataToClient_threaded(
-  std::shared_ptr<Music> audio,
-  const MusicStorageEntry *p_queue,
-  uint8_t queuePosition,
-  room::Client *p_client
-) {
-  auto &clientSocket = p_client->getSocket();
-  PipeData_t t {
-    clientSocket.getSocketFD(),
-    p_client,
-    const_cast<MusicStorageEntry *>(p_queue)
-  };
+void Room::processEntryGain() {
+  EntryHandle_t handle;
+  ::read(threadGainPipe[0], reinterpret_cast<void *>(&handle), sizeof handle);
+  shareEntryGain(handle);
+}
+
+void Room::shareEntryGain(EntryHandle_t handle) {
+  const int position = queue.getPositionInQueue(handle);
+  auto p_entry = queue.get(handle);
+  if (position == -1 || p_entry == nullptr) {
+    return;
+  }
+  const float gainDb = p_entry->gainDb;
+  journal.gain(handle, gainDb);
+  const float linear = std::pow(10.0f, gainDb / 20.0f);
+  // a song the player already has was opened without its gain
+  if (position == 0 && p_entry->getState() == EntryState::PLAYING) {
+    audioPlayer.setTrackGain(linear);
+  } else if (handle == preloadedEntry) {
+    audioPlayer.setNextTrackGain(linear);
+  }
+  sendToAllClients(entryGainFrame(static_cast<uint8_t>(position), gainDb));
+}
 
-  // send file to client
-  const auto &audioData = audio->getVector();
+OutboxFrame_t Room::entryGainFrame(uint8_t queuePosition, float gainDb) {
+  std::vector<std::byte> bytes{};
+  bytes.resize(sizeof gainDb);
+  std::copy(
+    reinterpret_cast<const std::byte*>(&gainDb),
+    reinterpret_cast<const std::byte*>(&gainDb) + sizeof gainDb,
+    bytes.data()
+  );
   Message message;
-  message.setCommand(static_cast<std::byte>(Command::SONG_DATA));
+  message.setCommand(Command::ENTRY_GAIN);
   message.setOptions(static_cast<std::byte>(queuePosition));
-  message.setBodySize(static_cast<uint32_t>(audioData.size()));
-  DEBUG_P(std::cout << "sending file to client\n");
-  if (!clientSocket.writeHeaderAndData(message.data(), audioData.data(), audioData.size())) {
-    t.socketFD *= -1;
-  } else {
-    t.p_entry->sent++;
+  message.setBodySize(sizeof gainDb);
+  message.setBody(bytes);
+  return Outbox::frame(message);
+}
+
+std::vector<OutboxFrame_t> Room::leadFrames(const MusicStorageEntry &entry, uint8_t queuePosition) {
+  std::vector<OutboxFrame_t> frames{};
+  if (entry.frameIndex != nullptr) {
+    // sent first so the client has the index by the time the song is stored
+    Message indexMessage;
+    const std::vector<std::byte> bytes = entry.frameIndex->serialize();
+    indexMessage.setCommand(Command::FRAME_INDEX);
+    indexMessage.setOptions(static_cast<std::byte>(queuePosition));
+    indexMessage.setBodySize(static_cast<uint32_t>(bytes.size()));
+    indexMessage.setBody(bytes);
+    frames.push_back(Outbox::frame(indexMessage));
+  }
+  if (entry.metadata != nullptr) {
+    Message metadataMessage;
+    const std::vector<std::byte> bytes = entry.metadata->serialize();
+    metadataMessage.setCommand(Command::QUEUE_METADATA);
+    metadataMessage.setOptions(static_cast<std::byte>(queuePosition));
+    metadataMessage.setBodySize(static_cast<uint32_t>(bytes.size()));
+    metadataMessage.setBody(bytes);
+    frames.push_back(Outbox::frame(metadataMessage));
+  }
+  if (!std::isnan(entry.gainDb.load())) {
+    // if the song has not been measured yet the gain follows once it has
+    frames.push_back(entryGainFrame(queuePosition, entry.gainDb));
   }
+  return frames;
+}
 
-  ::write(threadSendPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+void Room::sendToAllClients(const OutboxFrame_t &frame) {
+  for (room::Client &client : clients) {
+    client.outbox->send(frame);
+  }
 }
 
 void Room::sendSongToAllClients(const PipeData_t &next) {
   DEBUG_P(std::cout << "sending song to all clients\n");
-  if (next.p_entry == nullptr) {
-    DEBUG_P(std::cout << "song is nullptr\n");
-    return;
-  }
-  if (next.p_entry->sent != 0) {
-    DEBUG_P(std::cout << "song has already been sent, no need to send again\n");
+  auto p_entry = queue.get(next.entry);
+  if (p_entry == nullptr) {
+    DEBUG_P(std::cout << "song is not in the queue\n");
     return;
   }
-  if (!next.p_entry->entryMutex.try_lock()) {
-    DEBUG_P(std::cout << "could not get mutex for song\n");
+  const EntryState state = p_entry->getState();
+  if (state != EntryState::READY && state != EntryState::PLAYING) {
+    // this is called again when the entry becomes READY
+    DEBUG_P(std::cout << "song is not ready to send yet\n");
     return;
   }
-  DEBUG_P(std::cout << "got mutex for song\n");
   // 0 means we haven't started sending yet
   // 1 means that we have started sending, sent - 1 is the number of clients that it has been sent to
-  next.p_entry->sent = 1;
+  int notSent = 0;
+  if (!p_entry->sent.compare_exchange_strong(notSent, 1)) {
+    DEBUG_P(std::cout << "song has already been sent, no need to send again\n");
+    return;
+  }
   if (clients.empty() || (clients.size() == 1 && next.socketFD == clients.front().getSocket().getSocketFD())) {
     DEBUG_P(std::cout << "no one to send to\n");
-    next.p_entry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked mutex for song\n");
     attemptPlayNext();
   } else {
     Music m;
-    m.setPath(next.p_entry->path);
+    m.setPath(p_entry->path);
     auto data = m.getMemShared();
-    next.p_entry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked mutex for song\n");
-    int position = queue.getPositionInQueue(next.p_entry);
+    int position = queue.getPositionInQueue(next.entry);
     if (position == -1) {
       std::cerr << "Error: entry not found\n";
       return;
     }
+    // made once, every client's outbox shares them
+    const std::vector<OutboxFrame_t> lead = leadFrames(*p_entry, static_cast<uint8_t>(position));
     for (room::Client &client : clients) {
-      FD_CLR(client.getSocket().getSocketFD(), &master);
       // no need to send it back to the client that sent it
       if (client.getSocket().getSocketFD() != next.socketFD) {
-        std::thread thread = std::thread(
-          &Room::sendSongDataToClient_threaded,
-          this,
-          data,
-          next.p_entry,
-          static_cast<uint8_t>(position),
-          &client
-        );
-        thread.detach();
+        client.outbox->sendSong(lead, static_cast<uint8_t>(position), next.entry, data);
       }
     }
   }
@@ -305,141 +562,551 @@ void Room::sendSongToAllClients(const PipeData_t &next) {
 
 void Room::waitOnAudio_threaded() {
   DEBUG_P(std::cout << "waiting for audio to finish\n");
-  audioPlayer.wait();
+  // 1 if the player went straight into the preloaded song, 0 if it stopped
+  const int advanced = audioPlayer.waitTrackEnd() ? 1 : 0;
+  if (!advanced) {
+    audioPlayer.wait();
+  }
   DEBUG_P(std::cout << "audio finished\n");
-  int nothing = 0;
   DEBUG_P(std::cout << "write to waitAudioPipe\n");
-  write(threadWaitAudioPipe[1], &nothing, sizeof nothing);
+  write(threadWaitAudioPipe[1], &advanced, sizeof advanced);
   DEBUG_P(std::cout << "done writing to waitAudioPipe\n");
 }
 
+void Room::sendPlayNext() {
+  DEBUG_P(std::cout << "sending play next message to all clients\n");
+  std::vector<std::byte> bytes{};
+  bytes.resize(sizeof startTime);
+  std::copy(
+    reinterpret_cast<const std::byte*>(&startTime),
+    reinterpret_cast<const std::byte*>(&startTime) + sizeof startTime,
+    bytes.data()
+  );
+  Message message;
+  message.setCommand(Command::PLAY_NEXT);
+  message.setBodySize(sizeof startTime);
+  message.setBody(bytes);
+  sendToAllClients(Outbox::frame(message));
+}
+
 void Room::attemptPlayNext() {
   DEBUG_P(std::cout << "attempt play next\n");
+  if (isRelay()) {
+    // the upstream room decides when songs start, see Room::handleUpstreamPlayNext
+    return;
+  }
   if (audioPlayer.isPlaying()) {
     DEBUG_P(std::cout << "audio still playing, cancel\n");
     return;
   }
   auto musicEntry = queue.getFront();
-  bool gotLock = false;
+  bool ready = false;
   if (musicEntry != nullptr){
-    if (!(gotLock = musicEntry->entryMutex.try_lock())) {
-      DEBUG_P(std::cout << "could not get queue entry mutex, cancelling\n");
+    ready = musicEntry->transition(EntryState::READY, EntryState::PLAYING) || musicEntry->getState() == EntryState::PLAYING;
+    if (!ready) {
+      DEBUG_P(std::cout << "front of the queue is not ready, playing once it is\n");
+      playPending = true;
     } else {
-      DEBUG_P(std::cout << "got queue entry mutex\n");
-      startTime = (int64_t)std::time(nullptr);
+      startTime = wallClockMs();
+      trackEndMs = scheduledEnd(*musicEntry);
+      journal.played(musicEntry->handle, startTime);
     }
   }
 
-  DEBUG_P(std::cout << "sending play next message to all clients\n");
+  sendPlayNext();
+  if (musicEntry != nullptr && ready) {
+    playPending = false;
+    DEBUG_P(std::cout << "feeding next in queue to audioPlayer\n");
+    audioPlayer.feed(musicEntry->openSource());
+    preloadedEntry = {};
+    audioPlayer.play();
+    nextBeaconMs = wallClockMs() + BEACON_INTERVAL_MS;
+    std::thread threadAudioWait = std::thread(&Room::waitOnAudio_threaded, this);
+    threadAudioWait.detach();
+    preloadNext();
+  }
+}
+
+int64_t Room::scheduledEnd(const MusicStorageEntry &entry) const {
+  if (entry.metadata == nullptr || entry.metadata->durationMs == 0) {
+    return 0;
+  }
+  return startTime + entry.metadata->durationMs;
+}
+
+void Room::handleGaplessAdvance() {
+  DEBUG_P(std::cout << "player moved on to the preloaded song\n");
+  // the preloaded song is now the front of the queue and already playing
+  const int64_t now = wallClockMs();
+  // the previous song's length says when this one started, the wait thread only notices a little after.
+  // With a crossfade it started that long before the previous one ended
+  const int64_t scheduled = trackEndMs - audioPlayer.getCrossfadeMs();
+  startTime = trackEndMs != 0 && std::llabs(now - scheduled) < SCHEDULE_TOLERANCE_MS ? scheduled : now;
+  trackEndMs = 0;
+  if (auto p_front = queue.getFront(); p_front != nullptr) {
+    p_front->transition(EntryState::READY, EntryState::PLAYING);
+    trackEndMs = scheduledEnd(*p_front);
+    journal.played(p_front->handle, startTime);
+  }
+  sendPlayNext();
+  nextBeaconMs = wallClockMs() + BEACON_INTERVAL_MS;
+  std::thread threadAudioWait = std::thread(&Room::waitOnAudio_threaded, this);
+  threadAudioWait.detach();
+  preloadNext();
+}
+
+bool Room::restoreQueue() {
+  const int64_t begin = steadyClockUs();
+  std::vector<JournalSong_t> songs;
+  uint64_t startedId = 0;
+  int64_t startedMs = 0;
+  // rooms on different ports keep their queues apart unless told otherwise
+  const std::string stateDir = !config.stateDir.empty() ? config.stateDir :
+    std::string{ROOM_STATE_DIR} + '-' + std::to_string(config.port);
+  const JournalLoad loaded = journal.load(stateDir, songs, startedId, startedMs);
+  if (loaded == JournalLoad::IN_USE) {
+    std::cerr << "Error: another room is keeping its queue in " << stateDir << ", give this one its own with --state-dir\n";
+    return false;
+  }
+  if (loaded == JournalLoad::UNAVAILABLE) {
+    std::cerr << "Unable to keep the queue on disk, it will not survive a restart\n";
+    return true;
+  }
+  std::size_t restored = 0;
+  uint64_t frontId = 0;
+  for (const JournalSong_t &song : songs) {
+    MusicStorageEntry *p_entry = queue.addLocalAndPinEntry();
+    if (p_entry == nullptr) {
+      std::cerr << "Unable to restore every song, the queue is full\n";
+      break;
+    }
+    p_entry->path = journal.blobPath(song.hash, song.size);
+    p_entry->size = song.size;
+    p_entry->hash = song.hash;
+    p_entry->gainDb = song.gainDb;
+    // the index and metadata kept with the song save reading it again
+    p_entry->frameIndex = journal.loadIndex(song.hash, song.size);
+    if (p_entry->frameIndex == nullptr) {
+      p_entry->frameIndex = FrameIndex::fromFile(p_entry->path);
+    }
+    p_entry->metadata = journal.loadMetadata(song.hash, song.size);
+    if (p_entry->metadata == nullptr) {
+      p_entry->metadata = std::make_shared<const SongMetadata>(SongMetadata::fromFile(p_entry->path, p_entry->frameIndex.get()));
+    }
+    // there are no clients yet, each one that connects is sent the song
+    p_entry->sent = 1;
+    p_entry->transition(EntryState::RESERVED, EntryState::READY);
+    journal.bind(p_entry->handle, song.id);
+    queue.unpin(p_entry);
+    if (restored == 0) {
+      frontId = song.id;
+    }
+    ++restored;
+  }
+  // started after the songs are bound so that playing or skipping them below is recorded
+  journal.start();
+  if (restored == 0) {
+    return true;
+  }
+  std::cout << "Restored " << restored << " songs in " << static_cast<double>(steadyClockUs() - begin) / 1000 << " ms\n";
+  if (startedId != 0 && startedId == frontId) {
+    resumePlayback(startedMs);
+  } else {
+    attemptPlayNext();
+  }
+  return true;
+}
+
+void Room::resumePlayback(int64_t startedMs) {
+  MusicStorageEntry *p_front = queue.getFront();
+  if (p_front == nullptr) {
+    return;
+  }
+  const int64_t elapsed = wallClockMs() - startedMs;
+  const int64_t durationMs = p_front->metadata != nullptr ? p_front->metadata->durationMs : 0;
+  if (elapsed < 0 || (durationMs != 0 && elapsed >= durationMs)) {
+    // the song ended while the room was down, carry on with the next one
+    handleRemoveQueueEntry(p_front->handle);
+    return;
+  }
+  if (!p_front->transition(EntryState::READY, EntryState::PLAYING)) {
+    return;
+  }
+  // keep the original start time so the listeners' schedule lines up with where the song is
+  startTime = startedMs;
+  trackEndMs = scheduledEnd(*p_front);
+  audioPlayer.feed(p_front->openSource());
+  audioPlayer.seek(static_cast<double>(elapsed) / 1000);
+  preloadedEntry = {};
+  audioPlayer.play();
+  nextBeaconMs = wallClockMs() + BEACON_INTERVAL_MS;
+  std::thread threadAudioWait = std::thread(&Room::waitOnAudio_threaded, this);
+  threadAudioWait.detach();
+  preloadNext();
+  std::cout << "Resumed playing " << static_cast<double>(elapsed) / 1000 << " s into the current song\n";
+}
+
+void Room::preloadNext() {
+  if (!preloadedEntry.isNull() || !audioPlayer.isPlaying()) {
+    return;
+  }
+  auto p_entry = queue.getByPosition(1);
+  if (p_entry == nullptr) {
+    return;
+  }
+  if (p_entry->getState() != EntryState::READY) {
+    // still being received, this is tried again once it has been
+    DEBUG_P(std::cout << "next song is not ready, not preloading\n");
+    return;
+  }
+  if (audioPlayer.preload(p_entry->openSource())) {
+    DEBUG_P(std::cout << "preloaded next song\n");
+    preloadedEntry = p_entry->handle;
+  }
+}
+
+void Room::sendPositionBeacon(int64_t sentMs, int64_t positionMs) {
+  const int64_t beacon[2] = {sentMs, positionMs};
   std::vector<std::byte> bytes{};
-  bytes.resize(sizeof startTime);
+  bytes.resize(sizeof beacon);
   std::copy(
-    reinterpret_cast<const std::byte*>(&startTime),
-    reinterpret_cast<const std::byte*>(&startTime) + sizeof startTime,
+    reinterpret_cast<const std::byte*>(beacon),
+    reinterpret_cast<const std::byte*>(beacon) + sizeof beacon,
     bytes.data()
   );
+  Message message;
+  message.setCommand(Command::POSITION_BEACON);
+  message.setBodySize(sizeof beacon);
+  message.setBody(bytes);
+  const OutboxFrame_t frame = Outbox::frame(message);
   for (room::Client &client : clients) {
-    Message message;
-    message.setCommand(Command::PLAY_NEXT);
-    message.setBodySize(sizeof startTime);
-    message.setBody(bytes);
-    client.getSocket().write(message.data(), message.size());
+    // clients still receiving the queue will get PLAY_NEXT once synced, no need for beacons yet
+    if (client.entriesTillSynced != 0) {
+      continue;
+    }
+    client.outbox->send(frame);
   }
-  if (musicEntry != nullptr && gotLock) {
-    DEBUG_P(std::cout << "feeding next in queue to audioPlayer\n");
-    audioPlayer.feed(musicEntry->path.c_str());
-    audioPlayer.play();
-    std::thread threadAudioWait = std::thread(&Room::waitOnAudio_threaded, this);
-    threadAudioWait.detach();
-    musicEntry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked queue entry mutex\n");
+}
+
+bool Room::isRelay() const {
+  return config.upstreamPort != 0;
+}
+
+bool Room::songInProgress() {
+  return isRelay() ? relayPlaying : audioPlayer.isPlaying();
+}
+
+bool Room::handleUpstreamMessage() {
+  std::byte header[SIZE_OF_HEADER];
+  if (upstream.readAll(header, SIZE_OF_HEADER) == 0) {
+    return false;
   }
+  Message message(header);
+  const Command command = message.getCommand();
+  const auto position = static_cast<uint8_t>(message.getOptions());
+  if (command == Command::SONG_CHUNK) {
+    return handleUpstreamSongChunk(message.getBodySize());
+  }
+  std::vector<std::byte> body{message.getBodySize()};
+  if (!body.empty() && upstream.readAll(body.data(), body.size()) == 0) {
+    return false;
+  }
+  // the same messages a listener gets, kept so that the relay's own listeners can be sent them
+  switch (command) {
+    case Command::SONG_BEGIN:
+      return handleUpstreamSongBegin(position, body);
+
+    case Command::FRAME_INDEX: {
+      auto index = FrameIndex::deserialize(body.data(), body.size());
+      // SONG_BEGIN for the same position comes next, without an index the song is indexed when it arrives
+      MusicStorageEntry *p_entry = index != nullptr ? queue.addAtIndexAndPin(position) : nullptr;
+      if (p_entry != nullptr) {
+        p_entry->frameIndex = std::move(index);
+        queue.unpin(p_entry);
+      }
+      break;
+    }
+
+    case Command::QUEUE_METADATA: {
+      auto metadata = std::make_shared<SongMetadata>();
+      if (!SongMetadata::deserialize(body.data(), body.size(), *metadata)) {
+        break;
+      }
+      if (MusicStorageEntry *p_entry = queue.addAtIndexAndPin(position); p_entry != nullptr) {
+        p_entry->metadata = std::move(metadata);
+        queue.unpin(p_entry);
+      }
+      break;
+    }
+
+    case Command::ENTRY_GAIN: {
+      float gainDb;
+      if (body.size() != sizeof gainDb) {
+        break;
+      }
+      std::copy(body.data(), body.data() + sizeof gainDb, reinterpret_cast<std::byte *>(&gainDb));
+      MusicStorageEntry *p_entry = queue.getByPosition(position);
+      if (p_entry == nullptr) {
+        // measured before the song was sent, it goes to the clients along with the song
+        p_entry = queue.addAtIndexAndPin(position);
+        if (p_entry != nullptr) {
+          p_entry->gainDb = gainDb;
+          queue.unpin(p_entry);
+        }
+        break;
+      }
+      p_entry->gainDb = gainDb;
+      if (p_entry->sent != 0) {
+        shareEntryGain(p_entry->handle);
+      }
+      break;
+    }
+
+    case Command::REMOVE_QUEUE_ENTRY: {
+      MusicStorageEntry *p_entry = queue.getByPosition(position);
+      if (p_entry == nullptr) {
+        break;
+      }
+      // the rest of a song still arriving will not be sent
+      for (auto song = upstreamSongs.begin(); song != upstreamSongs.end(); ++song) {
+        if (song->second->p_entry == p_entry) {
+          ingest.cancel(song->second);
+          upstreamSongs.erase(song);
+          break;
+        }
+      }
+      handleRemoveQueueEntry(p_entry->handle);
+      break;
+    }
+
+    case Command::PLAY_NEXT: {
+      int64_t roomTime{};
+      if (body.size() < sizeof roomTime) {
+        return false;
+      }
+      std::copy(body.data(), body.data() + sizeof roomTime, reinterpret_cast<std::byte *>(&roomTime));
+      handleUpstreamPlayNext(roomTime);
+      break;
+    }
+
+    case Command::POSITION_BEACON: {
+      int64_t beacon[2]{};
+      if (body.size() < sizeof beacon) {
+        break;
+      }
+      std::copy(body.data(), body.data() + sizeof beacon, reinterpret_cast<std::byte *>(beacon));
+      hopClock.sample(beacon[0], wallClockMs(), upstream.getRoundTripUs());
+      sendPositionBeacon(hopClock.toLocal(beacon[0]), beacon[1]);
+      break;
+    }
+
+    default:
+      // answers to uploads, which a relay does not make
+      DEBUG_P(std::cout << "ignoring upstream message " << static_cast<int>(command) << '\n');
+      break;
+  }
+  return true;
 }
 
-void Room::handleRemoveQueueEntry(MusicStorageEntry *p_entry) {
+bool Room::handleUpstreamSongBegin(uint8_t queuePosition, const std::vector<std::byte> &body) {
+  uint32_t begin[2]{};
+  if (body.size() < sizeof begin) {
+    return false;
+  }
+  std::copy(body.data(), body.data() + sizeof begin, reinterpret_cast<std::byte *>(begin));
+  MusicStorageEntry *p_entry = queue.addAtIndexAndPin(queuePosition);
   if (p_entry == nullptr) {
+    std::cerr << "Error: the relay's queue no longer matches the upstream room's\n";
+    return false;
+  }
+  if (!MusicStorage::makeTemp(p_entry)) {
+    std::cerr << "Error: makeTemp\n";
+    queue.unpin(p_entry);
+    return false;
+  }
+  // the pipeline pins it again
+  queue.unpin(p_entry);
+  PipeData_t t{upstream.getSocketFD(), nullptr, p_entry->handle, false};
+  auto job = ingest.begin(t, begin[1]);
+  if (job == nullptr) {
+    return false;
+  }
+  if (begin[1] == 0) {
+    // no chunks are coming, the pipeline turns it down
+    return ingest.push(job, 0);
+  }
+  upstreamSongs[begin[0]] = std::move(job);
+  return true;
+}
+
+bool Room::handleUpstreamSongChunk(uint32_t bodySize) {
+  uint32_t prefix[2]{};
+  if (bodySize < sizeof prefix || upstream.readAll(reinterpret_cast<std::byte *>(prefix), sizeof prefix) == 0) {
+    return false;
+  }
+  const std::size_t length = bodySize - sizeof prefix;
+  auto song = upstreamSongs.find(prefix[0]);
+  if (
+    song == upstreamSongs.end() || prefix[1] != song->second->received ||
+    length > song->second->size - song->second->received
+  ) {
+    // a song that was removed, the rest of it is still on its way
+    DEBUG_P(std::cout << "dropping a chunk of stream " << prefix[0] << '\n');
+    std::vector<std::byte> discard{length};
+    return length == 0 || upstream.readAll(discard.data(), length) != 0;
+  }
+  const std::shared_ptr<IngestJob_t> job = song->second;
+  if (length > 0 && upstream.readAll(job->data + job->received, length) == 0) {
+    job->disconnected = true;
+    ingest.push(job, 0);
+    upstreamSongs.erase(song);
+    return false;
+  }
+  if (job->received + length == job->size) {
+    upstreamSongs.erase(song);
+  }
+  return ingest.push(job, length);
+}
+
+void Room::processUpstreamSongReceived(const PipeData_t &t) {
+  if (t.entry.isNull()) {
+    // the song was removed while it arrived
+    return;
+  }
+  if (t.socketFD < 0 || t.rejected) {
+    // a song missing from the queue would put every position after it out of step with the upstream room
+    upstreamLost = true;
     return;
   }
-  const int position = queue.getPositionInQueue(p_entry);
+  // like any listener, let the upstream room know the song is in
+  sendBasicResponse(upstream, Command::RECV_OK);
+  sendSongToAllClients(t);
+}
+
+void Room::handleUpstreamPlayNext(int64_t roomTime) {
+  // the same steps a listener takes, so the relay's queue stays in step with its listeners' queues
+  if (relayPlaying) {
+    queue.removeFront();
+  }
+  // the listeners go by this room's clock
+  startTime = hopClock.toLocal(roomTime);
+  trackEndMs = 0;
+  auto p_front = queue.getFront();
+  relayPlaying = p_front != nullptr;
+  if (p_front != nullptr) {
+    // still being received if it is not READY, the listeners start it once it reaches them
+    p_front->transition(EntryState::READY, EntryState::PLAYING);
+    trackEndMs = scheduledEnd(*p_front);
+  }
+  sendPlayNext();
+}
+
+void Room::handleRemoveQueueEntry(EntryHandle_t entry) {
+  const int position = queue.getPositionInQueue(entry);
   if (position < 0) {
     return;
   }
-  queue.removeByAddress(p_entry);
+  if (position <= 1) {
+    // the song after the current one is changing, forget what was preloaded
+    audioPlayer.cancelPreload();
+    preloadedEntry = {};
+  }
+  journal.removed(entry);
+  queue.removeByHandle(entry);
   Message message;
   message.setCommand(Command::REMOVE_QUEUE_ENTRY);
   message.setOptions(static_cast<std::byte>(position));
-  for (room::Client &client : clients) {
-    client.getSocket().write(message.data(), message.size());
-  }
+  sendToAllClients(Outbox::frame(message));
   attemptPlayNext();
+  preloadNext();
+}
+
+void Room::handleRemoveClientEntries(room::Client &client) {
+  handleRemoveQueueEntry(client.entry);
+  client.entry = {};
+  for (EntryHandle_t entry : client.reserved) {
+    handleRemoveQueueEntry(entry);
+  }
+  client.reserved.clear();
 }
 
 void Room::handleClientReqSongData_threaded(room::Client *p_client, uint32_t sizeOfFile) {
-  ThreadSafeSocket &socket = p_client->getSocket();
   PipeData_t t{};
-  t.socketFD = socket.getSocketFD();
+  t.socketFD = p_client->getSocket().getSocketFD();
   t.p_client = p_client;
-  t.p_entry = p_client->p_entry;
-
-  auto process = [&socket, &t, sizeOfFile]() {
-    DEBUG_P(std::cout << "reading in file of size " << sizeOfFile << " bytes\n");
-    Music music;
-    music.getVector().resize(sizeOfFile);
-
-    std::byte *dataPointer = music.getVector().data();
-    const size_t numBytesRead = socket.readAll(dataPointer, sizeOfFile);
-    if (numBytesRead == 0) {
-      // either client disconnected half way through, or some other error. Scrap it
-      DEBUG_P(std::cout << "error reading song from socket, removing entry from queue\n");
-      // make FD negative to tell parent thread we need to remove the client
-      t.socketFD *= -1;
-      return;
-    }
-    music.setPath(t.p_entry->path);
-    music.writeToPath();
-    t.p_entry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked queueEntry mutex\n");
-  };
-
-  process();
-
-  // notify parent thread that this thread is done
-  DEBUG_P(std::cout << "recv process done, writing to recv pipe: socketFD " << t.socketFD << "\n");
-  ::write(threadRecvPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
+  t.entry = p_client->entry;
+  // the pipeline writes to threadRecvPipe once the song is READY, or once it has given up on it
+  ingest.receive(t, p_client->getSocket(), sizeOfFile);
 }
 
 void Room::handleClientReqAddQueue(room::Client &client) {
   DEBUG_P(std::cout << "req add to queue request\n");
 
-  auto p_entry = this->queue.addTempAndLockEntry();
+  if (isRelay()) {
+    // songs are added to the upstream room, a relay only passes its queue on
+    sendBasicResponse(client, Command::RES_ADD_TO_QUEUE_NOT_OK);
+    return;
+  }
+
+  auto p_entry = this->queue.addTempAndPinEntry();
 
   if (p_entry == nullptr) {
     // adding to queue was unsuccessful
     // send a message back to client to deny their request to add a song
-    sendBasicResponse(client.getSocket(), Command::RES_ADD_TO_QUEUE_NOT_OK);
+    sendBasicResponse(client, Command::RES_ADD_TO_QUEUE_NOT_OK);
     DEBUG_P(std::cout << "res not ok, no room in queue\n");
     return;
   }
 
+  // the receiving thread pins it again once the song data arrives
+  queue.unpin(p_entry);
+
   // adding to the queue was successful
   // send a message back to client to confirm that they can continue to send the song
-  int position = queue.getPositionInQueue(p_entry);
+  int position = queue.getPositionInQueue(p_entry->handle);
   if (position == -1) {
     // this should never happen since we just checked for nullptr before, but just incase...
     DEBUG_P(std::cout << "couldn't find the entry\n");
-    sendBasicResponse(client.getSocket(), Command::RES_ADD_TO_QUEUE_NOT_OK);
+    sendBasicResponse(client, Command::RES_ADD_TO_QUEUE_NOT_OK);
     return;
   }
-  client.p_entry = p_entry;
-  sendBasicResponse(client.getSocket(), Command::RES_ADD_TO_QUEUE_OK, static_cast<std::byte>(position));
+  client.entry = p_entry->handle;
+  sendBasicResponse(client, Command::RES_ADD_TO_QUEUE_OK, static_cast<std::byte>(position));
   DEBUG_P(std::cout << "res ok\n");
 }
 
+void Room::handleClientReqAddBatch(room::Client &client, uint8_t count) {
+  DEBUG_P(std::cout << "req add batch of " << (int)count << " to queue\n");
+  std::vector<std::byte> positions{};
+  // songs are added to the upstream room, a relay answers with no slots
+  while (!isRelay() && positions.size() < count) {
+    auto p_entry = queue.addTempAndPinEntry();
+    if (p_entry == nullptr) {
+      // the queue is full, the client gets the slots reserved so far
+      break;
+    }
+    // the receiving thread pins it again once its song data arrives
+    queue.unpin(p_entry);
+    const int position = queue.getPositionInQueue(p_entry->handle);
+    if (position == -1) {
+      break;
+    }
+    client.reserved.push_back(p_entry->handle);
+    positions.push_back(static_cast<std::byte>(position));
+  }
+  Message message;
+  message.setCommand(Command::RES_ADD_BATCH_TO_QUEUE);
+  message.setBodySize(static_cast<uint32_t>(positions.size()));
+  message.setBody(positions);
+  client.outbox->send(Outbox::frame(message));
+  DEBUG_P(std::cout << "reserved " << positions.size() << " slots\n");
+}
+
 bool Room::handleClientRequests(room::Client &client) {
   std::byte requestHeader[SIZE_OF_HEADER];
   const size_t numBytesRead = client.getSocket().readAll(requestHeader, SIZE_OF_HEADER);
   if (numBytesRead == 0) {
-    handleRemoveQueueEntry(client.p_entry);
+    handleRemoveClientEntries(client);
     return false;
   }
   DEBUG_P(std::cout << "read client request\n");
@@ -452,28 +1119,62 @@ bool Room::handleClientRequests(room::Client &client) {
       handleClientReqAddQueue(client);
       break;
 
+    case Command::REQ_ADD_BATCH_TO_QUEUE:
+      handleClientReqAddBatch(client, static_cast<uint8_t>(message.getOptions()));
+      break;
+
     case Command::RECV_OK:
       DEBUG_P(std::cout << "got recv ok from client\n");
       attemptPlayNext();
       break;
 
+    case Command::PLAYBACK_LATE: {
+      int64_t lateMs{};
+      if (message.getBodySize() != sizeof lateMs || client.getSocket().readAll(reinterpret_cast<std::byte *>(&lateMs), sizeof lateMs) == 0) {
+        return false;
+      }
+      ++client.lateStarts;
+      client.lastLateMs = lateMs;
+      client.maxLateMs = std::max(client.maxLateMs, lateMs);
+      DEBUG_P(std::cout << "client " << client.getSocket().getSocketFD() << " started " << lateMs << " ms late\n");
+      break;
+    }
+
     case Command::CANCEL_REQ_ADD_TO_QUEUE:
-      handleRemoveQueueEntry(client.p_entry);
-      client.p_entry = nullptr;
+      if (client.entry.isNull() && !client.reserved.empty()) {
+        // gives up the next slot of a batch
+        client.entry = client.reserved.front();
+        client.reserved.pop_front();
+      }
+      handleRemoveQueueEntry(client.entry);
+      client.entry = {};
       break;
 
     case Command::SONG_DATA: {
-      if (client.p_entry == nullptr) {
+      if (client.entry.isNull() && !client.reserved.empty()) {
+        // the songs of a batch fill its slots in order
+        client.entry = client.reserved.front();
+        client.reserved.pop_front();
+      }
+      if (client.entry.isNull()) {
         // client tried to add a song when they did not have a spot in the queue, remove them for being naughty
         // should not be able to reach here as long as the client side waits for a confirmation before sending audio
         return false;
       }
+      const uint32_t sizeOfFile = message.getBodySize();
+      if (sizeOfFile == 0 || sizeOfFile > MAX_FILE_SIZE_BYTES) {
+        // checked before room is made for the song. Its body is not read, so the client cannot stay
+        std::cerr << "Rejected a song of " << sizeOfFile << " bytes, songs are at most " << MAX_FILE_SIZE_BYTES << " bytes\n";
+        sendBasicResponse(client.getSocket(), Command::BAD_VALUES);
+        handleRemoveClientEntries(client);
+        return false;
+      }
       FD_CLR(client.getSocket().getSocketFD(), &master);
       std::thread clientThread = std::thread(
         &Room::handleClientReqSongData_threaded,
         this,
         &client,
-        message.getBodySize()
+        sizeOfFile
       );
       clientThread.detach();
       break;
@@ -481,6 +1182,7 @@ bool Room::handleClientRequests(room::Client &client) {
 
     default:
       DEBUG_P(std::cout << "bad request\n");
+      // written straight away, the client's outbox is stopped when it is removed
       sendBasicResponse(client.getSocket(), Command::BAD_VALUES);
       // remove the client, we are just receiving garbage from them
       return false;
@@ -494,6 +1196,11 @@ void Room::handleConnectionRequests() {
     // error accepting connection, skip
     return;
   }
+  if (config.maxListeners != 0 && clients.size() >= config.maxListeners) {
+    // closed as clientSocket goes out of scope
+    std::cout << "Turned away a listener, the room is full\n";
+    return;
+  }
   if (clientSocket.getSocketFD() >= fdMax) {
     // new fileDescriptor is greater than previous greatest, update it
     fdMax = clientSocket.getSocketFD();
@@ -501,72 +1208,160 @@ void Room::handleConnectionRequests() {
 
   auto &client = addClient({"user", std::move(clientSocket)});
 
+  if (dataSocket.getSocketFD() > 0) {
+    // a client far away gets songs faster over more than one connection, the token lets it open them
+    std::random_device random;
+    client.sessionToken = (static_cast<uint64_t>(random()) << 32) | random();
+    const uint16_t dataPort = dataSocket.getPort();
+    std::vector<std::byte> body{};
+    body.resize(sizeof client.sessionToken + sizeof dataPort);
+    std::copy(
+      reinterpret_cast<const std::byte*>(&client.sessionToken),
+      reinterpret_cast<const std::byte*>(&client.sessionToken) + sizeof client.sessionToken,
+      body.data()
+    );
+    std::copy(
+      reinterpret_cast<const std::byte*>(&dataPort),
+      reinterpret_cast<const std::byte*>(&dataPort) + sizeof dataPort,
+      body.data() + sizeof client.sessionToken
+    );
+    Message message;
+    message.setCommand(Command::SESSION_TOKEN);
+    message.setBodySize(static_cast<uint32_t>(body.size()));
+    message.setBody(body);
+    client.outbox->send(Outbox::frame(message));
+  }
+
+  // the songs go out front first, the one playing before the rest
   int position = -1;
   Music m;
-  for (const MusicStorageEntry &entry : queue.getSongs()) {
+  for (EntryHandle_t handle : queue.getHandles()) {
     ++position;
-    if (entry.sent == 0) {
+    auto p_entry = queue.get(handle);
+    if (p_entry == nullptr || p_entry->sent == 0) {
       continue;
     }
-    m.setPath(entry.path);
+    m.setPath(p_entry->path);
     auto data = m.getMemShared();
     if (data == nullptr) {
       continue;
     }
     ++client.entriesTillSynced;
-    std::thread thread = std::thread(
-      &Room::sendSongDataToClient_threaded,
-      this, data, &entry, static_cast<uint8_t>(position), &client
-    );
-    thread.detach();
+    client.outbox->sendSong(leadFrames(*p_entry, static_cast<uint8_t>(position)), static_cast<uint8_t>(position), handle, data);
   }
 
-  if (client.entriesTillSynced == 0) {
-    // add the client to the selector list
-    FD_SET(client.getSocket().getSocketFD(), &master);
+  // everything the room sends goes through the outbox, so the client can be listened to while it syncs
+  FD_SET(client.getSocket().getSocketFD(), &master);
+}
+
+void Room::handleDataConnectionRequests() {
+  ThreadSafeSocket socket{dataSocket.accept()};
+  if (socket.getSocketFD() == -1) {
+    return;
   }
+  fdMax = fdMax > socket.getSocketFD() ? fdMax : socket.getSocketFD();
+  FD_SET(socket.getSocketFD(), &master);
+  // kept in the order they were accepted, the front is the first to time out
+  dataConnections.push_back({std::move(socket), wallClockMs(), {}, 0});
 }
 
-void Room::handleStdinAddSongHelper_threaded(MusicStorageEntry *queueEntry) {
+void Room::dropSilentDataConnections() {
+  // a connection that never says whose it is would be kept forever
+  const int64_t now = wallClockMs();
+  while (!dataConnections.empty() && now - dataConnections.front().acceptedMs >= DATA_CONNECTION_TIMEOUT_MS) {
+    DEBUG_P(std::cout << "data connection sent no token in time, closing it\n");
+    FD_CLR(dataConnections.front().socket.getSocketFD(), &master);
+    dataConnections.pop_front();
+  }
+}
 
-  auto process = [this](PipeData_t &t) {
-    Music m;
-    getMP3FilePath(m);
-    if (m.getPath() == "-1") {
-      handleRemoveQueueEntry(t.p_entry);
+bool Room::handleDataConnection(DataConnection_t &connection) {
+  // anyone can connect here, so nothing waits on what has not arrived yet
+  size_t bytesRead = 0;
+  if (!connection.socket.readAvailable(
+    connection.hello.data() + connection.received, connection.hello.size() - connection.received, bytesRead
+  )) {
+    return true;
+  }
+  connection.received += bytesRead;
+  if (connection.received < SIZE_OF_HEADER) {
+    return false;
+  }
+  Message message(connection.hello.data());
+  uint64_t token{};
+  if (message.getCommand() != Command::DATA_CONNECTION || message.getBodySize() != sizeof token) {
+    DEBUG_P(std::cout << "not a data connection, closing it\n");
+    return true;
+  }
+  if (connection.received < connection.hello.size()) {
+    return false;
+  }
+  std::copy(
+    connection.hello.data() + SIZE_OF_HEADER, connection.hello.data() + connection.hello.size(),
+    reinterpret_cast<std::byte *>(&token)
+  );
+  for (room::Client &client : clients) {
+    if (client.sessionToken != 0 && client.sessionToken == token) {
+      // nothing is read from it from now on, the outbox only writes chunks to it
+      if (!client.outbox->addLane(std::move(connection.socket))) {
+        DEBUG_P(std::cout << "client has all the data connections it can have\n");
+      }
+      return true;
+    }
+  }
+  DEBUG_P(std::cout << "data connection with an unknown token, closing it\n");
+  return true;
+}
+
+void Room::handleStdinAddSongHelper_threaded(MusicStorageEntry *p_entry, std::string path) {
+  // a path that came with a control command was checked before the entry was added
+  const bool fromStdin = path.empty();
+
+  auto process = [this, fromStdin](PipeData_t &t, MusicStorageEntry *p_entry, std::string &path) {
+    if (fromStdin) {
+      Music m;
+      getMP3FilePath(m);
+      path = m.getPath();
+    }
+    if (path == "-1") {
+      handleRemoveQueueEntry(t.entry);
       std::cout << "Cancelled\n";
       return false;
     }
-    t.p_entry->path = m.getPath();
+    p_entry->path = path;
+    p_entry->frameIndex = FrameIndex::fromFile(p_entry->path);
+    p_entry->metadata = std::make_shared<const SongMetadata>(SongMetadata::fromFile(p_entry->path, p_entry->frameIndex.get()));
+    p_entry->transition(EntryState::RESERVED, EntryState::READY);
     std::cout << "Added song to queue\n";
     return true;
   };
 
-  PipeData_t t{0, nullptr, queueEntry};
-  if (t.p_entry != nullptr) {
-    bool res = process(t);
-    t.p_entry->entryMutex.unlock();
-    DEBUG_P(std::cout << "unlocked entry mutex\n");
-    if (!res) {
-      t.p_entry = nullptr;
-    }
+  // the entry was pinned when it was added, so its slot is not reused even if it is removed.
+  // The socket given back is listened to again once the song is in, stdin, or the control socket which always is
+  PipeData_t t{fromStdin ? 0 : controlSocket.getSocketFD(), nullptr, p_entry->handle, false};
+  bool res = process(t, p_entry, path);
+  queue.unpin(p_entry);
+  if (!res) {
+    t.entry = {};
   }
 
   DEBUG_P(std::cout << "add local song to queue process done, writing to recv pipe: socketFD " << t.socketFD << "\n");
-  std::cout << " >> ";
-  std::cout.flush();
+  if (fromStdin) {
+    std::cout << " >> ";
+    std::cout.flush();
+  }
   ::write(threadRecvPipe[1], reinterpret_cast<const void *>(&t), sizeof t);
 }
 
 void Room::handleStdinAddSong() {
-  MusicStorageEntry *queueEntry = queue.addLocalAndLockEntry();
+  MusicStorageEntry *queueEntry = queue.addLocalAndPinEntry();
   if (queueEntry == nullptr) {
     std::cerr << "Unable to add a song to the queue\n";
     return;
   }
   // clear stdin from master
   FD_CLR(0, &master);
-  std::thread addSongThread = std::thread(&Room::handleStdinAddSongHelper_threaded, this, queueEntry);
+  std::thread addSongThread = std::thread(&Room::handleStdinAddSongHelper_threaded, this, queueEntry, std::string{});
   addSongThread.detach();
 }
 
@@ -577,7 +1372,13 @@ enum class RoomCommand {
   QUIT,
   ADD_SONG,
   MUTE,
-  UNMUTE
+  UNMUTE,
+  VOLUME_UP,
+  VOLUME_DOWN,
+  CROSSFADE_ON,
+  CROSSFADE_OFF,
+  STATS,
+  QUEUE
 };
 
 const std::unordered_map<std::string, RoomCommand> roomCommandMap = {
@@ -588,48 +1389,75 @@ const std::unordered_map<std::string, RoomCommand> roomCommandMap = {
   {"add song", RoomCommand::ADD_SONG},
   {"mute", RoomCommand::MUTE},
   {"unmute", RoomCommand::UNMUTE},
+  {"volume up", RoomCommand::VOLUME_UP},
+  {"volume down", RoomCommand::VOLUME_DOWN},
+  {"crossfade on", RoomCommand::CROSSFADE_ON},
+  {"crossfade off", RoomCommand::CROSSFADE_OFF},
+  {"stats", RoomCommand::STATS},
+  {"queue", RoomCommand::QUEUE},
 
 };
 
 // TODO:
-void roomShowHelp() {
-  std::cout <<
+void roomShowHelp(std::ostream &out) {
+  out <<
   "List of commands as room host:\n\n"
   "'faq'       | Answers to frequently asked questions\n\n"
   "'help'      | List commands and what they do.\n\n"
   "'exit'      | Exit the room.\n\n"
   "'quit'      | Quit the program.\n\n"
-  "'add song'  | Add a song to the queue.\n\n"
+  "'add song'  | Add a song to the queue. On the control socket the path goes with it, 'add song PATH'.\n\n"
   "'mute'      | Mute the audio player.\n\n"
-  "'unmute'    | Unmute the audio player.\n\n";
+  "'unmute'    | Unmute the audio player.\n\n"
+  "'volume up' / 'volume down'\n"
+  "            | Change the volume of the audio player by 10%.\n\n"
+  "'crossfade on' / 'crossfade off'\n"
+  "            | Fade between songs rather than going straight from one to the next.\n\n"
+  "'stats'     | Show how late each listener has started songs that reached them after they should have started.\n\n"
+  "'queue'     | List the songs in the queue with their lengths and when they start.\n\n";
   ;
 }
 
 // TODO:
-void roomShowFAQ() {
-  std::cout <<
+void roomShowFAQ(std::ostream &out) {
+  out <<
   "Question 1:\n\n";
 }
 
 int Room::handleStdinCommands() {
   std::string input;
   std::getline(std::cin, input);
+  if (input == "add song") {
+    handleStdinAddSong();
+    return 1;
+  }
+  const int result = runCommand(input, std::cout);
+  if (result == 0 || result == -1) {
+    return result;
+  }
+  if (result == 2) {
+    std::cout << "Invalid command. Try 'help' for information\n";
+  }
+  std::cout << " >> ";
+  std::cout.flush();
+  return 1;
+}
+
+int Room::runCommand(const std::string &input, std::ostream &out) {
   RoomCommand command;
   try {
     command = roomCommandMap.at(input);
   } catch (const std::out_of_range &err){
-    std::cout << "Invalid command. Try 'help' for information\n >> ";
-    std::cout.flush();
-    return 1;
+    return 2;
   }
 
   switch (command) {
     case RoomCommand::FAQ:
-      roomShowFAQ();
+      roomShowFAQ(out);
       break;
 
     case RoomCommand::HELP:
-      roomShowHelp();
+      roomShowHelp(out);
       break;
 
     case RoomCommand::EXIT:
@@ -638,10 +1466,10 @@ int Room::handleStdinCommands() {
     case RoomCommand::QUIT:
       return -1;
 
-    case RoomCommand::ADD_SONG: {
-      handleStdinAddSong();
-      return 1;
-    }
+    case RoomCommand::ADD_SONG:
+      // reached from the control socket without a path, there is no one to ask for it
+      out << "Give the path with the command: add song /path/to/song.mp3\n";
+      break;
 
     case RoomCommand::MUTE:
       audioPlayer.mute();
@@ -651,16 +1479,159 @@ int Room::handleStdinCommands() {
       audioPlayer.unmute();
       break;
 
+    case RoomCommand::VOLUME_UP:
+      audioPlayer.setVolume(std::min(audioPlayer.getVolume() + 0.1f, 1.0f));
+      out << "Volume: " << static_cast<int>(audioPlayer.getVolume() * 100 + 0.5f) << "%\n";
+      break;
+
+    case RoomCommand::VOLUME_DOWN:
+      audioPlayer.setVolume(std::max(audioPlayer.getVolume() - 0.1f, 0.0f));
+      out << "Volume: " << static_cast<int>(audioPlayer.getVolume() * 100 + 0.5f) << "%\n";
+      break;
+
+    case RoomCommand::CROSSFADE_ON:
+      audioPlayer.setCrossfadeMs(DEFAULT_CROSSFADE_MS);
+      break;
+
+    case RoomCommand::CROSSFADE_OFF:
+      audioPlayer.setCrossfadeMs(0);
+      break;
+
+    case RoomCommand::STATS:
+      printStats(out);
+      break;
+
+    case RoomCommand::QUEUE:
+      // the end of the current song is known from its length, no need to ask the player
+      queue.printQueue(songInProgress() && trackEndMs != 0 ? trackEndMs - wallClockMs() : 0, out);
+      break;
+
     default:
       // this section of code should never be reached
-      std::cerr << "Error: Reached default case in Room::handleStdinCommands\nCommand " << input << " not handled but is in clientMapCommand\n";
+      std::cerr << "Error: Reached default case in Room::runCommand\nCommand " << input << " not handled but is in clientMapCommand\n";
       return -1;
   }
-  std::cout << " >> ";
-  std::cout.flush();
   return 1;
 }
 
+void Room::handleControlConnection() {
+  BaseSocket socket{controlSocket.accept()};
+  if (socket.getSocketFD() == -1) {
+    return;
+  }
+  fdMax = fdMax > socket.getSocketFD() ? fdMax : socket.getSocketFD();
+  FD_SET(socket.getSocketFD(), &master);
+  controlConnections.push_back({std::move(socket), {}, false});
+}
+
+int Room::handleControlCommands(ControlConnection_t &connection) {
+  char buffer[1024];
+  const size_t numBytesRead = connection.socket.read(reinterpret_cast<std::byte *>(buffer), sizeof buffer);
+  if (numBytesRead == 0) {
+    connection.closed = true;
+    return 1;
+  }
+  connection.input.append(buffer, numBytesRead);
+  std::size_t newline;
+  while ((newline = connection.input.find('\n')) != std::string::npos) {
+    std::string input = connection.input.substr(0, newline);
+    connection.input.erase(0, newline + 1);
+    if (!input.empty() && input.back() == '\r') {
+      input.pop_back();
+    }
+    std::ostringstream out;
+    int result = 1;
+    if (input.rfind("add song ", 0) == 0) {
+      const std::string path = input.substr(9);
+      std::string extension = path.size() < 5 ? "" : path.substr(path.size() - 4);
+      std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+        return std::tolower(c);
+      });
+      Music m;
+      m.setPath(path);
+      if (isRelay()) {
+        out << "err: a relay plays the upstream room's queue, add songs there\n";
+      } else if (extension != ".mp3" || !m.validateFileAtPath()) {
+        out << "err: not a readable mp3 file: " << path << '\n';
+      } else if (MusicStorageEntry *queueEntry = queue.addLocalAndPinEntry(); queueEntry == nullptr) {
+        out << "err: unable to add a song to the queue\n";
+      } else {
+        std::thread addSongThread = std::thread(&Room::handleStdinAddSongHelper_threaded, this, queueEntry, path);
+        addSongThread.detach();
+        out << "ok\n";
+      }
+    } else {
+      result = runCommand(input, out);
+      out << (result == 2 ? "err: invalid command, try 'help'\n" : "ok\n");
+    }
+    const std::string reply = out.str();
+    // the other end may be gone already, that is found out on the next read
+    connection.socket.write(reinterpret_cast<const std::byte *>(reply.data()), reply.size());
+    if (result == 0 || result == -1) {
+      return result;
+    }
+  }
+  if (connection.input.size() > sizeof buffer) {
+    // not a command, no one types a line this long
+    connection.closed = true;
+  }
+  return 1;
+}
+
+void Room::printStats(std::ostream &out) {
+  if (isRelay()) {
+    out <<
+      "upstream: " << config.upstreamHost << ':' << config.upstreamPort << ", clock offset " << hopClock.getOffsetMs() <<
+      " ms from " << hopClock.getSamples() << " beacons, round trip " << upstream.getRoundTripUs() << " us\n";
+  }
+  const PlayerStats stats = audioPlayer.getStats();
+  out << "seek time: " << stats.lastSeekUs << " us (max " << stats.maxSeekUs << " us, " << FrameIndex::kernelName() << " sync scan)\n";
+  out << "output: " << stats.output;
+  if (stats.hasTimestamp) {
+    out << ", " << stats.timestamp.frames << " frames played by " << stats.timestamp.wallMs << " ms";
+  }
+  out << '\n';
+  const LoudnessStats_t &loudness = analyzer.getStats();
+  const double busySeconds = static_cast<double>(loudness.busyUs) / 1e6;
+  const double audioSeconds = static_cast<double>(loudness.audioMs) / 1e3;
+  out <<
+    "loudness: " << loudness.songs << " songs (" << loudness.failed << " failed), " <<
+    audioSeconds << " s of audio in " << busySeconds << " s on " << analyzer.getWorkers() << " workers, " <<
+    (busySeconds > 0 ? audioSeconds / busySeconds : 0) << "x realtime per worker, " << LoudnessMeter::kernelName() << " filters\n";
+  const IngestStats_t &ingestStats = ingest.getStats();
+  const uint64_t uploads = ingestStats.uploads;
+  out << "ingest: " << uploads << " uploads, " << ingestStats.bytes << " bytes";
+  if (uploads > 0) {
+    // the pipeline can take uploads no faster than its slowest stage gets through one
+    uint64_t slowestUs = 0;
+    for (int stage = VALIDATE; stage < INGEST_STAGES; ++stage) {
+      slowestUs = std::max<uint64_t>(slowestUs, ingestStats.stages[static_cast<std::size_t>(stage)].busyUs / uploads);
+    }
+    out <<
+      ", " << ingestStats.totalUs / uploads / 1000 << " ms each, " << ingestStats.tailUs / uploads << " us after the last byte, " <<
+      "up to " << (slowestUs > 0 ? 1000000 / slowestUs : 0) << " uploads/s";
+  }
+  out << '\n';
+  for (int stage = RECEIVE; stage < INGEST_STAGES; ++stage) {
+    const IngestStageStats_t &stageStats = ingestStats.stages[static_cast<std::size_t>(stage)];
+    const uint64_t chunks = stageStats.chunks;
+    out <<
+      "  " << IngestPipeline::stageName(static_cast<IngestStage>(stage)) << ": " << chunks << " pieces, " <<
+      (chunks > 0 ? stageStats.waitUs / chunks : 0) << " us waiting, " <<
+      (chunks > 0 ? stageStats.busyUs / chunks : 0) << " us working (max " << stageStats.maxUs << " us)\n";
+  }
+  out << "listeners: " << clients.size() << '\n';
+  for (room::Client &client : clients) {
+    const OutboxStats_t &outboxStats = client.outbox->getStats();
+    out <<
+      "  " << client.getName() << " (" << client.getSocket().getSocketFD() << "): " <<
+      client.lateStarts << " late starts, last " << client.lastLateMs << " ms, max " << client.maxLateMs << " ms, " <<
+      outboxStats.messages << " messages waited " << outboxStats.lastWaitUs << " us (max " << outboxStats.maxWaitUs << " us) behind " <<
+      outboxStats.chunks << " song chunks, " << outboxStats.laneChunks << " of them over " <<
+      outboxStats.lanes << " data connections\n";
+  }
+}
+
 void Room::sendBasicResponse(ThreadSafeSocket& socket, Command response, std::byte option) {
   Message message;
   message.setCommand(static_cast<std::byte>(response));
@@ -668,6 +1639,13 @@ void Room::sendBasicResponse(ThreadSafeSocket& socket, Command response, std::by
   socket.write(message.getMessage().data(), message.getMessage().size());
 }
 
+void Room::sendBasicResponse(room::Client &client, Command response, std::byte option) {
+  Message message;
+  message.setCommand(static_cast<std::byte>(response));
+  message.setOptions(option);
+  client.outbox->send(Outbox::frame(message));
+}
+
 void Room::setIp(int newIp) {
   ip = newIp;
 }
@@ -681,6 +1659,9 @@ void Room::printClients() {
 
 room::Client &Room::addClient(room::Client &&newClient) {
   room::Client &client = clients.emplace_back(std::move(newClient));
+  // made here rather than before, the outbox keeps a reference to the client
+  client.outbox = std::make_unique<Outbox>(client, queue, threadSendPipe[1]);
+  client.outbox->start();
   return client;
 }
 
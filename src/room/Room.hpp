@@ -5,15 +5,19 @@
 
 #pragma once
 
+#include <array>
 #include <string>
 #include <list>
 #include <mutex>
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <vector>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <thread>
+#include <random>
 #include <unordered_map>
 
 #if _WIN32
@@ -24,11 +28,18 @@
 #endif
 
 #include "Client.hpp"
+#include "Outbox.hpp"
+#include "IngestPipeline.hpp"
+#include "RoomConfig.hpp"
+#include "HopClock.hpp"
+#include "RoomJournal.hpp"
 #include "../socket/BaseSocket.hpp"
 #include "../music/MusicStorage.hpp"
 #include "../music/Player.hpp"
+#include "../music/LoudnessAnalyzer.hpp"
 #include "../CLInput.hpp"
 #include "../debug.hpp"
+#include "../Clock.hpp"
 #include "../messaging/Message.hpp"
 #include "../messaging/Commands.hpp"
 #include "../socket/ThreadSafeSocket.hpp"
@@ -39,11 +50,43 @@
 */
 namespace room {
 
+// how often the room tells clients where it is in the current song
+#define BEACON_INTERVAL_MS 2000
+// how far the player can be from when the songs' lengths say the next song starts before the clock is used instead
+#define SCHEDULE_TOLERANCE_MS 1000
+// how long a data connection has to send its token before it is dropped
+#define DATA_CONNECTION_TIMEOUT_MS 5000
+
+/**
+ * @brief A connection to the room's control socket
+*/
 typedef struct {
-  int socketFD;
-  room::Client *p_client;
-  MusicStorageEntry *p_entry;
-} PipeData_t;
+  BaseSocket socket;
+  /**
+   * text received that does not make a whole line yet
+  */
+  std::string input;
+  /**
+   * set once the other end has hung up, the connection is then dropped
+  */
+  bool closed;
+} ControlConnection_t;
+
+/**
+ * @brief A connection to the room's data port that has not sent its client's token yet
+*/
+typedef struct {
+  ThreadSafeSocket socket;
+  /**
+   * wall clock time in ms it was accepted at
+  */
+  int64_t acceptedMs;
+  /**
+   * the DATA_CONNECTION header and token, filled in as they arrive. Nothing waits for the rest
+  */
+  std::array<std::byte, SIZE_OF_HEADER + sizeof(uint64_t)> hello;
+  size_t received;
+} DataConnection_t;
 
 class Room {
 private:
@@ -58,11 +101,62 @@ private:
   */
   int fdMax;
 
+  /**
+   * how the room was set up, from prompts or from arguments and a config file
+  */
+  RoomConfig_t config;
+
   /**
    * Socket in which connections are established
   */
   BaseSocket hostSocket;
 
+  /**
+   * Socket clients open data connections to, on a port of its own so they are never taken for new listeners.
+   * Not open if it could not be bound, clients then get songs over their main connection only
+  */
+  BaseSocket dataSocket;
+
+  /**
+   * data connections waiting for their client's token
+  */
+  std::list<DataConnection_t> dataConnections;
+
+  /**
+   * Connection to the room a relay mirrors, unused unless Room::isRelay
+  */
+  ThreadSafeSocket upstream;
+
+  /**
+   * converts the upstream room's times to this room's clock
+  */
+  HopClock hopClock;
+
+  /**
+   * true while the upstream room is playing the front of the queue, so its next PLAY_NEXT removes it
+  */
+  bool relayPlaying;
+
+  /**
+   * set when the relay can no longer mirror the upstream room, the room then shuts down
+  */
+  bool upstreamLost;
+
+  /**
+   * songs the upstream room is sending, by the stream id from their SONG_BEGIN
+  */
+  std::unordered_map<uint32_t, std::shared_ptr<IngestJob_t>> upstreamSongs;
+
+  /**
+   * Unix socket a headless room takes commands from instead of stdin
+  */
+  BaseSocket controlSocket;
+
+  /**
+   * connections to the control socket
+  */
+  std::list<ControlConnection_t> controlConnections;
+
   /**
    * Pipe to communicate from child threads to parent thread
   */
@@ -79,10 +173,35 @@ private:
   int threadWaitAudioPipe[2];
 
   /**
-   * When the current song started playing to the nearest second
+   * Pipe the loudness analyzer writes the handle of each measured entry to
+  */
+  int threadGainPipe[2];
+
+  /**
+   * Wall clock time in milliseconds at which the current song started playing
   */
   int64_t startTime;
 
+  /**
+   * Wall clock time in milliseconds at which the current song ends, from its length. 0 if the length is unknown
+  */
+  int64_t trackEndMs;
+
+  /**
+   * Wall clock time in milliseconds at which the next position beacon should be sent
+  */
+  int64_t nextBeaconMs;
+
+  /**
+   * entry the audio player has preloaded to play right after the current one, null if none
+  */
+  EntryHandle_t preloadedEntry;
+
+  /**
+   * true when Room::attemptPlayNext found the front of the queue not READY, it is tried again as soon as an entry becomes READY
+  */
+  bool playPending;
+
   /**
    * name of the room, also not being used
   */
@@ -103,6 +222,21 @@ private:
   */
   Player audioPlayer;
 
+  /**
+   * measures the loudness of each song once it has been received
+  */
+  LoudnessAnalyzer analyzer;
+
+  /**
+   * stages uploaded songs go through before they are READY
+  */
+  IngestPipeline ingest;
+
+  /**
+   * keeps the queue on disk so a restarted room carries on with it
+  */
+  RoomJournal journal;
+
   /**
    * master file descriptor list
   */
@@ -111,16 +245,44 @@ private:
   /**
    * @brief Removes an entry from the queue, sends all clients a Command::REMOVE_QUEUE_ENTRY, calls Room::attemptPlayNext
   */
-  void handleRemoveQueueEntry(MusicStorageEntry *);
+  void handleRemoveQueueEntry(EntryHandle_t);
+
+  /**
+   * @brief Removes the entry a client is uploading to and the slots it has reserved, for a client that left
+  */
+  void handleRemoveClientEntries(room::Client &client);
 
   /**
    * @brief Handles connection requests
   */
   void handleConnectionRequests();
 
+  /**
+   * @brief Opens the data socket on any free port of the room's host
+   * @returns false on error, the room carries on without it
+  */
+  bool openDataSocket();
+
+  /**
+   * @brief Accepts a connection to the data socket
+  */
+  void handleDataConnectionRequests();
+
+  /**
+   * @brief Drops data connections that have not sent their token within DATA_CONNECTION_TIMEOUT_MS
+  */
+  void dropSilentDataConnections();
+
+  /**
+   * @brief Reads what has arrived of a data connection's token, without waiting for the rest. Once all of it
+   * is here, gives the connection to its client's outbox
+   * @returns true once the connection is done with here, whether or not a client took it
+  */
+  bool handleDataConnection(DataConnection_t &connection);
+
   /**
    * @brief Handles external client's request of SONG_DATA
-   * @details Threaded function which reads sizeOfFile bytes from p_client
+   * @details Threaded function which reads sizeOfFile bytes from p_client into Room::ingest
    * @param p_client a pointer to the client in which to read data from
    * @param sizeOfFile the size of the aud
    */
@@ -131,6 +293,11 @@ private:
   */
   void handleClientReqAddQueue(room::Client &client);
 
+  /**
+   * @brief Handles external client's request of REQ_ADD_BATCH_TO_QUEUE, reserves up to count slots at once
+  */
+  void handleClientReqAddBatch(room::Client &client, uint8_t count);
+
   /**
    * @brief Handles incoming messages from the client.
    * @param client reference to client object
@@ -142,9 +309,10 @@ private:
    * @brief Helper to Room::handleStdinAddSong
    * @details Threaded function, allows the room to continue managing requests from other clients,
    * while still getting the correct input from the room host
-   * @param p_entry a pointer to an entry in the queue
+   * @param p_entry an entry in the queue, pinned, unpinned when done
+   * @param path path of the song if it came with a control command, empty to ask for it on stdin
   */
-  void handleStdinAddSongHelper_threaded(MusicStorageEntry *p_entry);
+  void handleStdinAddSongHelper_threaded(MusicStorageEntry *p_entry, std::string path);
 
   /**
    * @brief Handles the stdin 'add song' command
@@ -158,6 +326,38 @@ private:
   */
   int handleStdinCommands();
 
+  /**
+   * @brief Runs one command, from stdin or the control socket. 'add song' is handled by the callers, who know where the path comes from
+   * @param input the command
+   * @param out where the command prints to
+   * @returns 0 to exit the room, -1 to quit the program, 1 once done, 2 if it is not a command
+  */
+  int runCommand(const std::string &input, std::ostream &out);
+
+  /**
+   * @brief Opens the control socket of a headless room
+   * @returns false on error
+  */
+  bool openControlSocket();
+
+  /**
+   * @brief Accepts a connection to the control socket
+  */
+  void handleControlConnection();
+
+  /**
+   * @brief Runs each whole line received on a control connection as a command, answering each with its output
+   * followed by "ok", or "err: ..." if it could not be run. Sets ControlConnection_t::closed when the other end hangs up
+   * @returns like Room::runCommand, 0 to exit, -1 to quit, 1 otherwise
+  */
+  int handleControlCommands(ControlConnection_t &connection);
+
+  /**
+   * @brief Prints how late each listener has been starting songs
+   * @param out where to print them
+  */
+  void printStats(std::ostream &out);
+
   /**
    * @brief Handles when a thread finishes receiving song data
    * @details More specifically, this is called in the main thread when there is data to be read from the threadRecvPipe
@@ -171,19 +371,32 @@ private:
   void processThreadFinishedSending();
 
   /**
-   * @brief Sends song data to a specific client
-   * 
-   * @param audio a shared Music object in which the data to be sent is stored
-   * @param p_queue a pointer to the MusicStorageEntry object which corresponds to the song being sent
-   * @param queuePosition the MusicStorageEntry's position in the queue
-   * @param p_client a pointer to the room::Client object to send the data to
+   * @brief Handles when the loudness analyzer has set an entry's gain
+   * @details Sends the gain to all clients as Command::ENTRY_GAIN, and gives it to the audio player if it has the song
+  */
+  void processEntryGain();
+
+  /**
+   * @brief Sends an entry's gain to all clients, and gives it to the audio player if it has the song
+  */
+  void shareEntryGain(EntryHandle_t handle);
+
+  /**
+   * @brief Makes an entry's gain into a Command::ENTRY_GAIN message
   */
-  void sendSongDataToClient_threaded(
-    std::shared_ptr<Music> audio,
-    const MusicStorageEntry *p_queue,
-    uint8_t queuePosition,
-    room::Client *p_client
-  );
+  static OutboxFrame_t entryGainFrame(uint8_t queuePosition, float gainDb);
+
+  /**
+   * @brief Makes the messages that go before a song, its frame index, metadata and gain if it has them
+   * @param entry the song's entry
+   * @param queuePosition the entry's position in the queue
+  */
+  static std::vector<OutboxFrame_t> leadFrames(const MusicStorageEntry &entry, uint8_t queuePosition);
+
+  /**
+   * @brief Queues a message for every client
+  */
+  void sendToAllClients(const OutboxFrame_t &frame);
 
   /**
    * @brief Attempts to send the next song to all clients client
@@ -191,7 +404,8 @@ private:
   void sendSongToAllClients(const PipeData_t &);
 
   /**
-   * @brief waits for audio to stop playing, then notifies the main thread via Room::threadWaitAudioPipe
+   * @brief waits for the current song to end, then notifies the main thread via Room::threadWaitAudioPipe
+   * whether the player went straight into the preloaded song or stopped
   */
   void waitOnAudio_threaded();
 
@@ -200,6 +414,93 @@ private:
   */
   void attemptPlayNext();
 
+  /**
+   * @return when a song started at Room::startTime ends, from its length. 0 if the length is unknown
+  */
+  [[nodiscard]] int64_t scheduledEnd(const MusicStorageEntry &entry) const;
+
+  /**
+   * @brief Sends PLAY_NEXT with Room::startTime to all clients
+  */
+  void sendPlayNext();
+
+  /**
+   * @brief Called when the player went from one song straight into the preloaded next one
+  */
+  void handleGaplessAdvance();
+
+  /**
+   * @brief Preloads the song after the current one into the player, if it has been received
+  */
+  void preloadNext();
+
+  /**
+   * @brief Puts the songs the journal kept back in the queue, and carries on with the song that was playing
+   * @returns false if another room is keeping its queue in the same state directory
+  */
+  bool restoreQueue();
+
+  /**
+   * @brief Plays the front of the queue from where a song started at startedMs would be now
+   * @param startedMs wall clock time in milliseconds the song started at before the restart
+  */
+  void resumePlayback(int64_t startedMs);
+
+  /**
+   * @brief Sends a playback position to all clients so they can correct drift
+   * @param sentMs wall clock time in milliseconds the position is for
+   * @param positionMs position in the current song at that time
+  */
+  void sendPositionBeacon(int64_t sentMs, int64_t positionMs);
+
+  /**
+   * @return true if the room mirrors an upstream room rather than running its own queue
+  */
+  [[nodiscard]] bool isRelay() const;
+
+  /**
+   * @return true if a song is playing, in the audio player or, for a relay, in the upstream room
+  */
+  [[nodiscard]] bool songInProgress();
+
+  /**
+   * @brief Connects a relay to its upstream room, which then sends it the queue like any listener
+   * @returns false on error
+  */
+  bool connectUpstream();
+
+  /**
+   * @brief Handles a message from the upstream room, passing it on to this room's clients
+   * @returns false if the upstream room is gone
+  */
+  bool handleUpstreamMessage();
+
+  /**
+   * @brief Starts receiving a song from the upstream room into the entry at its position, through Room::ingest
+   * @param queuePosition the song's position in the queue
+   * @param body the SONG_BEGIN body, the stream id and the size of the song
+   * @returns false if the queue no longer matches the upstream room's
+  */
+  bool handleUpstreamSongBegin(uint8_t queuePosition, const std::vector<std::byte> &body);
+
+  /**
+   * @brief Reads a piece of a song from the upstream room and passes it on to Room::ingest
+   * @param bodySize size of the SONG_CHUNK body, the stream id and offset followed by the data
+   * @returns false if the upstream room is gone
+  */
+  bool handleUpstreamSongChunk(uint32_t bodySize);
+
+  /**
+   * @brief Moves on to the next song when the upstream room does, and tells the clients when it started
+   * @param roomTime when the upstream room started the song, in its clock
+  */
+  void handleUpstreamPlayNext(int64_t roomTime);
+
+  /**
+   * @brief Handles when a song from the upstream room has been received, passes it on to the clients
+  */
+  void processUpstreamSongReceived(const PipeData_t &t);
+
   /**
    * @brief Sends a header only response to the client
    * @param socket socket to send to
@@ -207,13 +508,26 @@ private:
   */
   static void sendBasicResponse(ThreadSafeSocket& socket, Commands::Command responseCommand, std::byte option = (std::byte)0);
 
+  /**
+   * @brief Queues a header only response for a client, after anything already queued for it
+   * @param client client to send to
+   * @param responseCommand one of the responses define in Commands.hpp
+  */
+  static void sendBasicResponse(room::Client &client, Commands::Command responseCommand, std::byte option = (std::byte)0);
+
 public:
 
   /**
-   * @brief Default Constructor
+   * @brief Default Constructor, an interactive room
   */
   Room();
 
+  /**
+   * @brief Constructs a room set up by a config
+   * @param config the room's settings, a headless config takes commands from its control socket rather than stdin
+  */
+  explicit Room(RoomConfig_t config);
+
   ~Room();
 
   /**
@@ -239,7 +553,7 @@ public:
   void printClients();
 
   /**
-   * @brief add a client
+   * @brief add a client, and start its outbox
    * @param client client object to add
    * @returns reference to client which was added
   */
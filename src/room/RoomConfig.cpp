@@ -0,0 +1,188 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for room settings
+*/
+
+#include <fstream>
+#include <iostream>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+#include "RoomConfig.hpp"
+#include "RoomJournal.hpp"
+
+/**
+ * @brief parse a whole string as an unsigned number
+ * @return false if it is not one, or is bigger than max
+*/
+static bool parseNumber(const std::string &value, unsigned long long max, unsigned long long &number) {
+  if (value.empty()) {
+    return false;
+  }
+  char *endPtr;
+  errno = 0;
+  number = strtoull(value.c_str(), &endPtr, 10);
+  return *endPtr == '\0' && errno == 0 && value[0] != '-' && number <= max;
+}
+
+/**
+ * @brief set one setting
+ * @param key name of the setting, as in the config file
+ * @param value its value
+ * @param from where it came from, for the error message
+ * @return false if the key is unknown or the value is not valid for it
+*/
+static bool setOption(RoomConfig_t &config, const std::string &key, const std::string &value, const std::string &from) {
+  unsigned long long number = 0;
+  if (key == "host") {
+    config.host = value;
+  } else if (key == "port") {
+    if (!parseNumber(value, UINT16_MAX, number)) {
+      std::cerr << from << ": not a valid port number: " << value << '\n';
+      return false;
+    }
+    config.port = static_cast<uint16_t>(number);
+  } else if (key == "control") {
+    config.controlPath = value;
+  } else if (key == "memory-budget") {
+    if (!parseNumber(value, SIZE_MAX, number)) {
+      std::cerr << from << ": not a valid number of bytes: " << value << '\n';
+      return false;
+    }
+    config.memoryBudget = static_cast<std::size_t>(number);
+  } else if (key == "storage") {
+    // songs always start in memory, the budget decides how many stay there
+    if (value == "disk") {
+      config.memoryBudget = 0;
+    } else if (value != "memory") {
+      std::cerr << from << ": storage is either memory or disk, not " << value << '\n';
+      return false;
+    }
+  } else if (key == "max-listeners") {
+    if (!parseNumber(value, SIZE_MAX, number)) {
+      std::cerr << from << ": not a valid number of listeners: " << value << '\n';
+      return false;
+    }
+    config.maxListeners = static_cast<std::size_t>(number);
+  } else if (key == "audio") {
+    config.audioDriver = value == "default" ? "" : value;
+  } else if (key == "audio-device") {
+    config.audioDevice = value;
+  } else if (key == "ring-bytes") {
+    if (!parseNumber(value, PCM_RING_MAX_BYTES, number) || number == 0) {
+      std::cerr << from << ": ring size is 1 to " << PCM_RING_MAX_BYTES << " bytes, not " << value << '\n';
+      return false;
+    }
+    config.ringBytes = static_cast<std::size_t>(number);
+  } else if (key == "upstream") {
+    // the last colon, so the host can be a name or an address
+    const std::size_t colon = value.rfind(':');
+    if (colon == std::string::npos || colon == 0 || !parseNumber(value.substr(colon + 1), UINT16_MAX, number) || number == 0) {
+      std::cerr << from << ": upstream is HOST:PORT, not " << value << '\n';
+      return false;
+    }
+    config.upstreamHost = value.substr(0, colon);
+    config.upstreamPort = static_cast<uint16_t>(number);
+  } else if (key == "state-dir") {
+    config.stateDir = value;
+  } else {
+    std::cerr << from << ": unknown setting " << key << '\n';
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief read a config file of `key = value` lines. Blank lines and lines starting with # are skipped
+*/
+static bool readConfigFile(RoomConfig_t &config, const std::string &path) {
+  std::ifstream file{path};
+  if (!file) {
+    std::cerr << "Error: unable to open config file " << path << '\n';
+    return false;
+  }
+  const char *const space = " \t\r";
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(file, line)) {
+    ++lineNumber;
+    const std::size_t start = line.find_first_not_of(space);
+    if (start == std::string::npos || line[start] == '#') {
+      continue;
+    }
+    const std::string from = path + ':' + std::to_string(lineNumber);
+    const std::size_t equals = line.find('=');
+    if (equals == std::string::npos) {
+      std::cerr << from << ": expected key = value\n";
+      return false;
+    }
+    std::string key = line.substr(start, equals - start);
+    std::string value = line.substr(equals + 1);
+    key.erase(key.find_last_not_of(space) + 1);
+    value.erase(0, value.find_first_not_of(space));
+    value.erase(value.find_last_not_of(space) + 1);
+    if (!setOption(config, key, value, from)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool parseRoomConfig(int argc, char **argv, RoomConfig_t &config) {
+  config = RoomConfig_t{};
+  config.headless = true;
+  config.host = "0.0.0.0";
+  // the file goes first wherever --config is, so that the other arguments win over it
+  for (int i = 0; i + 1 < argc; ++i) {
+    if (std::string{argv[i]} == "--config" && !readConfigFile(config, argv[i + 1])) {
+      return false;
+    }
+  }
+  for (int i = 0; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0 || i + 1 >= argc) {
+      std::cerr << "Error: expected --setting value, got " << arg << '\n';
+      return false;
+    }
+    const std::string value = argv[++i];
+    if (arg != "--config" && !setOption(config, arg.substr(2), value, "argument " + arg)) {
+      return false;
+    }
+  }
+  if (config.audioDriver == "wav" && config.audioDevice.empty()) {
+    std::cerr << "Error: give the file to write with --audio-device\n";
+    return false;
+  }
+  if (config.port == 0) {
+    std::cerr << "Error: a room needs a port, give one with --port or in the config file\n";
+    return false;
+  }
+  return true;
+}
+
+void showRoomConfigHelp() {
+  std::cout <<
+  "Usage: main room [--setting value]...\n"
+  "Starts a room without prompts. Settings can also be given in a file of 'setting = value' lines.\n\n"
+  "--config FILE         | Read settings from FILE, settings given as arguments win.\n"
+  "--host HOST           | Host or IP to listen on, 0.0.0.0 by default.\n"
+  "--port PORT           | Port to listen on, required.\n"
+  "--control PATH        | Unix socket to read commands from, " ROOM_CONTROL_PATH " by default.\n"
+  "--memory-budget BYTES | Bytes of songs kept in memory before songs are kept on disk.\n"
+  "--storage memory|disk | Where songs are kept, disk is the same as a memory budget of 0.\n"
+  "--max-listeners N     | Listeners allowed at once, 0 for no limit.\n"
+  "--audio DRIVER        | out123 driver to play through, 'default', 'none' to play nothing, or 'wav' to write a file.\n"
+  "--audio-device DEVICE | Device for the audio driver, or the file for 'wav'.\n"
+  "--ring-bytes BYTES    | Decoded audio buffered ahead of the audio device, rounded up to a power of two.\n"
+  "--upstream HOST:PORT  | Relay another room, or another relay, to this room's listeners instead of running a queue.\n"
+  "--state-dir DIR       | Where the queue is kept across restarts, " ROOM_STATE_DIR "-PORT by default.\n"
+  "                      | Each room needs its own, a room will not start on one another room is using.\n\n"
+  "Commands are the same as a room's, one per line on the control socket, for example:\n"
+  "  echo stats | nc -U " ROOM_CONTROL_PATH "\n"
+  "  echo 'add song /path/to/song.mp3' | nc -U " ROOM_CONTROL_PATH "\n\n"
+  "Relays can feed other relays, so one room can reach more listeners than it could serve itself:\n"
+  "  main room --port 9000\n"
+  "  main room --port 9001 --upstream 127.0.0.1:9000 --control /tmp/relay-1.sock\n"
+  "  main room --port 9002 --upstream 127.0.0.1:9001 --control /tmp/relay-2.sock\n";
+}
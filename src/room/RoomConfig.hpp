@@ -0,0 +1,74 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Settings of a room started without prompts, read from arguments and a config file
+ */
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "../music/PcmRing.hpp"
+#include "../music/MusicStorage.hpp"
+
+// where a headless room listens for control commands unless told otherwise
+#define ROOM_CONTROL_PATH "/tmp/musicbroadcaster-room.sock"
+
+/**
+ * @brief How a room is set up. A default constructed config is an interactive room that asks for its host and port
+*/
+typedef struct {
+  /**
+   * true if the room takes its settings from here and its commands from the control socket rather than stdin
+  */
+  bool headless = false;
+  std::string host;
+  uint16_t port = 0;
+  /**
+   * path of the unix socket control commands are read from
+  */
+  std::string controlPath = ROOM_CONTROL_PATH;
+  /**
+   * bytes of songs kept in memory before songs are moved to disk, 0 to keep every song on disk
+  */
+  std::size_t memoryBudget = MEMORY_BUDGET_BYTES;
+  /**
+   * listeners allowed at once, 0 for no limit
+  */
+  std::size_t maxListeners = 0;
+  /**
+   * driver and device to play through, see AudioSink::create. Empty strings for out123's default
+  */
+  std::string audioDriver;
+  std::string audioDevice;
+  /**
+   * bytes of decoded audio buffered ahead of the audio device, more rides out longer stalls of a busy host
+  */
+  std::size_t ringBytes = PCM_RING_BYTES;
+  /**
+   * room to relay, the room then mirrors that room's queue for its own listeners rather than playing its own.
+   * A port of 0 for a room that is not a relay
+  */
+  std::string upstreamHost;
+  uint16_t upstreamPort = 0;
+  /**
+   * directory the queue is kept in across restarts, empty for ROOM_STATE_DIR-PORT
+  */
+  std::string stateDir;
+} RoomConfig_t;
+
+/**
+ * @brief fill in a config from the arguments of `main room ...`, and from the file given with --config.
+ * Arguments given on the command line win over the file
+ * @param argc number of arguments, starting from the one after "room"
+ * @param argv the arguments
+ * @param config set to the room's settings, starting from its defaults
+ * @return false, after printing why, if an argument or a line of the file is not valid
+*/
+bool parseRoomConfig(int argc, char **argv, RoomConfig_t &config);
+
+/**
+ * @brief print the arguments and config file keys parseRoomConfig understands
+*/
+void showRoomConfigHelp();
@@ -0,0 +1,493 @@
+/**
+ * @author Justin Nicolas Allard
+ * Implementation file for the room journal
+*/
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <iostream>
+#include <algorithm>
+#if _WIN32
+// windows includes
+#elif defined(__APPLE__) || defined(__unix__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#endif
+
+#include "RoomJournal.hpp"
+#include "../debug.hpp"
+#include "../Fnv1a.hpp"
+
+// bytes copied at a time into a blob
+#define BLOB_COPY_BYTES 65536
+
+RoomJournal::RoomJournal():
+  ids{}, nextId{1}, songs{}, playingId{0}, playingStartMs{0}, dir{}, journalFd{-1}, journal{nullptr}, sinceSnapshot{0},
+  records{JOURNAL_QUEUE_RECORDS}, thread{} {}
+
+RoomJournal::~RoomJournal() {
+  stop();
+}
+
+uint64_t RoomJournal::key(EntryHandle_t handle) {
+  return static_cast<uint64_t>(handle.slot) << 32 | handle.generation;
+}
+
+std::string RoomJournal::journalPath() const {
+  return dir + "/journal";
+}
+
+std::string RoomJournal::snapshotPath() const {
+  return dir + "/snapshot";
+}
+
+std::string RoomJournal::blobPath(uint64_t hash, uint64_t size) const {
+  char name[64];
+  snprintf(name, sizeof name, "/%016llx-%llu.mp3", static_cast<unsigned long long>(hash), static_cast<unsigned long long>(size));
+  return dir + "/blobs" + std::string{name};
+}
+
+JournalLoad RoomJournal::load(const std::string &stateDir, std::vector<JournalSong_t> &restored, uint64_t &startedId, int64_t &startedMs) {
+  dir = stateDir;
+  if (
+    (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) ||
+    (mkdir((dir + "/blobs").c_str(), 0700) == -1 && errno != EEXIST)
+  ) {
+    fprintf(stderr, "mkdir: %s (%d)\n", strerror(errno), errno);
+    return JournalLoad::UNAVAILABLE;
+  }
+  journalFd = ::open(journalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (journalFd == -1) {
+    fprintf(stderr, "open: %s (%d)\n", strerror(errno), errno);
+    return JournalLoad::UNAVAILABLE;
+  }
+  // two rooms appending to one journal would corrupt it, and each would restore the other's queue
+  if (flock(journalFd, LOCK_EX | LOCK_NB) == -1) {
+    const bool inUse = errno == EWOULDBLOCK;
+    if (!inUse) {
+      fprintf(stderr, "flock: %s (%d)\n", strerror(errno), errno);
+    }
+    close(journalFd);
+    journalFd = -1;
+    return inUse ? JournalLoad::IN_USE : JournalLoad::UNAVAILABLE;
+  }
+  _replay(snapshotPath());
+  _replay(journalPath());
+  // a song whose blob is gone cannot be played, forget it
+  songs.erase(std::remove_if(songs.begin(), songs.end(), [this](const JournalSong_t &song) {
+    return access(blobPath(song.hash, song.size).c_str(), R_OK) != 0;
+  }), songs.end());
+  _sweepBlobs();
+  for (const JournalSong_t &song : songs) {
+    nextId = std::max(nextId, song.id + 1);
+  }
+  restored = songs;
+  startedId = playingId;
+  startedMs = playingStartMs;
+  return JournalLoad::LOADED;
+}
+
+void RoomJournal::_replay(const std::string &path) {
+  std::ifstream file{path};
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields{line};
+    std::string op;
+    JournalRecord_t record{};
+    fields >> op >> record.id;
+    if (op == "add") {
+      record.op = JournalOp::ADD;
+      fields >> std::hex >> record.hash >> std::dec >> record.size;
+    } else if (op == "remove") {
+      record.op = JournalOp::REMOVE;
+    } else if (op == "play") {
+      record.op = JournalOp::PLAY;
+      fields >> record.startMs;
+    } else if (op == "gain") {
+      record.op = JournalOp::GAIN;
+      fields >> record.gainDb;
+    } else {
+      continue;
+    }
+    // the last line can be cut short by a crash
+    if (!fields.fail()) {
+      _apply(record);
+      nextId = std::max(nextId, record.id + 1);
+    }
+  }
+}
+
+bool RoomJournal::_apply(const JournalRecord_t &record) {
+  auto song = std::find_if(songs.begin(), songs.end(), [&record](const JournalSong_t &s) {
+    return s.id == record.id;
+  });
+  switch (record.op) {
+    case JournalOp::ADD:
+      if (song != songs.end()) {
+        return false;
+      }
+      songs.push_back({record.id, record.hash, record.size, NAN});
+      return true;
+    case JournalOp::REMOVE:
+      if (song == songs.end()) {
+        return false;
+      }
+      songs.erase(song);
+      if (playingId == record.id) {
+        playingId = 0;
+        playingStartMs = 0;
+      }
+      return true;
+    case JournalOp::PLAY:
+      playingId = record.id;
+      playingStartMs = record.startMs;
+      return true;
+    case JournalOp::GAIN:
+      if (song == songs.end()) {
+        return false;
+      }
+      song->gainDb = record.gainDb;
+      return true;
+  }
+  return false;
+}
+
+void RoomJournal::bind(EntryHandle_t handle, uint64_t id) {
+  ids[key(handle)] = id;
+}
+
+void RoomJournal::start() {
+  if (thread.joinable() || journalFd == -1) {
+    return;
+  }
+  // the locked descriptor, the lock is held until it is closed
+  journal = fdopen(journalFd, "a");
+  if (journal == nullptr) {
+    fprintf(stderr, "fdopen: %s (%d)\n", strerror(errno), errno);
+    return;
+  }
+  thread = std::thread(&RoomJournal::_run, this);
+}
+
+void RoomJournal::stop() {
+  records.close();
+  if (thread.joinable()) {
+    thread.join();
+  }
+  if (journal != nullptr) {
+    fclose(journal);
+    journal = nullptr;
+  } else if (journalFd != -1) {
+    close(journalFd);
+  }
+  journalFd = -1;
+}
+
+void RoomJournal::post(const JournalRecord_t &record) {
+  if (!thread.joinable() || !records.push(record)) {
+    if (record.op == JournalOp::ADD && record.fd > 0) {
+      close(record.fd);
+    }
+  }
+}
+
+void RoomJournal::added(const MusicStorageEntry &entry) {
+  JournalRecord_t record{};
+  record.op = JournalOp::ADD;
+  record.id = nextId++;
+  record.hash = entry.hash;
+  // the entry's own descriptor is closed when the entry is removed, which can happen before the song is copied
+  record.fd = entry.fd > 0 ? dup(entry.fd) : ::open(entry.path.c_str(), O_RDONLY);
+  if (record.fd < 0) {
+    fprintf(stderr, "open: %s (%d)\n", strerror(errno), errno);
+    return;
+  }
+  record.frameIndex = entry.frameIndex;
+  record.metadata = entry.metadata;
+  ids[key(entry.handle)] = record.id;
+  post(record);
+  const float db = entry.gainDb;
+  if (!std::isnan(db)) {
+    gain(entry.handle, db);
+  }
+}
+
+void RoomJournal::removed(EntryHandle_t handle) {
+  auto id = ids.find(key(handle));
+  if (id == ids.end()) {
+    return;
+  }
+  JournalRecord_t record{};
+  record.op = JournalOp::REMOVE;
+  record.id = id->second;
+  ids.erase(id);
+  post(record);
+}
+
+void RoomJournal::played(EntryHandle_t handle, int64_t startMs) {
+  auto id = ids.find(key(handle));
+  if (id == ids.end()) {
+    return;
+  }
+  JournalRecord_t record{};
+  record.op = JournalOp::PLAY;
+  record.id = id->second;
+  record.startMs = startMs;
+  post(record);
+}
+
+void RoomJournal::gain(EntryHandle_t handle, float gainDb) {
+  auto id = ids.find(key(handle));
+  if (id == ids.end()) {
+    return;
+  }
+  JournalRecord_t record{};
+  record.op = JournalOp::GAIN;
+  record.id = id->second;
+  record.gainDb = gainDb;
+  post(record);
+}
+
+void RoomJournal::_run() {
+  JournalRecord_t record{};
+  while (records.pop(record)) {
+    if (record.op == JournalOp::ADD) {
+      const bool stored = _storeBlob(record);
+      close(record.fd);
+      if (!stored) {
+        std::cerr << "Error: could not keep a copy of a song, it will not survive a restart\n";
+        continue;
+      }
+      _storeSidecars(record);
+    }
+    JournalSong_t removedSong{};
+    if (record.op == JournalOp::REMOVE) {
+      for (const JournalSong_t &song : songs) {
+        if (song.id == record.id) {
+          removedSong = song;
+        }
+      }
+    }
+    if (!_apply(record)) {
+      continue;
+    }
+    if (record.op == JournalOp::REMOVE) {
+      _dropBlob(removedSong.hash, removedSong.size);
+    }
+    const std::string line = _format(record);
+    fputs(line.c_str(), journal);
+    ++sinceSnapshot;
+    if (records.size() == 0) {
+      // nothing else is waiting, make what was written so far survive a crash
+      fflush(journal);
+      fsync(fileno(journal));
+    }
+    if (sinceSnapshot >= JOURNAL_COMPACT_RECORDS) {
+      _compact();
+    }
+  }
+  fflush(journal);
+  fsync(fileno(journal));
+}
+
+bool RoomJournal::_storeBlob(JournalRecord_t &record) const {
+  struct stat info{};
+  if (fstat(record.fd, &info) == -1 || info.st_size <= 0) {
+    return false;
+  }
+  record.size = static_cast<uint64_t>(info.st_size);
+  if (record.hash != 0 && access(blobPath(record.hash, record.size).c_str(), F_OK) == 0) {
+    // the same song is already kept
+    return true;
+  }
+  const std::string temp = dir + "/blobs/incoming";
+  const int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out < 0) {
+    return false;
+  }
+  std::vector<unsigned char> buffer(BLOB_COPY_BYTES);
+  uint64_t hash = FNV_OFFSET_BASIS;
+  uint64_t copied = 0;
+  bool ok = true;
+  while (ok && copied < record.size) {
+    // pread, a dup of a memfd shares its offset with the entry's descriptor
+    const ssize_t n = pread(record.fd, buffer.data(), buffer.size(), static_cast<off_t>(copied));
+    if (n <= 0) {
+      ok = false;
+      break;
+    }
+    hash = fnv1a(hash, buffer.data(), static_cast<std::size_t>(n));
+    ssize_t written = 0;
+    while (written < n) {
+      const ssize_t res = ::write(out, buffer.data() + written, static_cast<std::size_t>(n - written));
+      if (res <= 0) {
+        ok = false;
+        break;
+      }
+      written += res;
+    }
+    copied += static_cast<uint64_t>(n);
+  }
+  ok = ok && fsync(out) == 0;
+  close(out);
+  if (record.hash == 0) {
+    record.hash = hash;
+  }
+  if (!ok || rename(temp.c_str(), blobPath(record.hash, record.size).c_str()) == -1) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool readWhole(const std::string &path, std::vector<std::byte> &bytes) {
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return false;
+  }
+  std::vector<char> chars{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  bytes.resize(chars.size());
+  std::copy(chars.begin(), chars.end(), reinterpret_cast<char *>(bytes.data()));
+  return true;
+}
+
+static void writeWhole(const std::string &path, const std::vector<std::byte> &bytes) {
+  // written aside and renamed, a reader never sees half a file
+  const std::string temp = path + ".new";
+  std::ofstream file{temp, std::ios::binary | std::ios::trunc};
+  file.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+  file.close();
+  if (!file || rename(temp.c_str(), path.c_str()) == -1) {
+    remove(temp.c_str());
+  }
+}
+
+void RoomJournal::_storeSidecars(const JournalRecord_t &record) const {
+  const std::string blob = blobPath(record.hash, record.size);
+  if (record.frameIndex != nullptr && access((blob + ".index").c_str(), F_OK) != 0) {
+    writeWhole(blob + ".index", record.frameIndex->serialize());
+  }
+  if (record.metadata != nullptr && access((blob + ".meta").c_str(), F_OK) != 0) {
+    writeWhole(blob + ".meta", record.metadata->serialize());
+  }
+}
+
+std::shared_ptr<const FrameIndex> RoomJournal::loadIndex(uint64_t hash, uint64_t size) const {
+  std::vector<std::byte> bytes;
+  if (!readWhole(blobPath(hash, size) + ".index", bytes)) {
+    return nullptr;
+  }
+  return FrameIndex::deserialize(bytes.data(), bytes.size());
+}
+
+std::shared_ptr<const SongMetadata> RoomJournal::loadMetadata(uint64_t hash, uint64_t size) const {
+  std::vector<std::byte> bytes;
+  auto metadata = std::make_shared<SongMetadata>();
+  if (!readWhole(blobPath(hash, size) + ".meta", bytes) || !SongMetadata::deserialize(bytes.data(), bytes.size(), *metadata)) {
+    return nullptr;
+  }
+  return metadata;
+}
+
+void RoomJournal::_dropBlob(uint64_t hash, uint64_t size) const {
+  for (const JournalSong_t &song : songs) {
+    if (song.hash == hash && song.size == size) {
+      return;
+    }
+  }
+  const std::string blob = blobPath(hash, size);
+  remove(blob.c_str());
+  remove((blob + ".index").c_str());
+  remove((blob + ".meta").c_str());
+}
+
+void RoomJournal::_sweepBlobs() const {
+  DIR *blobs = opendir((dir + "/blobs").c_str());
+  if (blobs == nullptr) {
+    return;
+  }
+  while (dirent *file = readdir(blobs)) {
+    const std::string name = file->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    const std::string path = dir + "/blobs/" + name;
+    // a blob's frame index and metadata go with it
+    const bool used = std::any_of(songs.begin(), songs.end(), [this, &path](const JournalSong_t &song) {
+      const std::string blob = blobPath(song.hash, song.size);
+      return path == blob || path == blob + ".index" || path == blob + ".meta";
+    });
+    if (!used) {
+      DEBUG_P(std::cout << "removing unused blob " << path << '\n');
+      remove(path.c_str());
+    }
+  }
+  closedir(blobs);
+}
+
+void RoomJournal::_compact() {
+  const std::string temp = snapshotPath() + ".new";
+  FILE *snapshot = fopen(temp.c_str(), "w");
+  if (snapshot == nullptr) {
+    return;
+  }
+  for (const JournalSong_t &song : songs) {
+    JournalRecord_t record{};
+    record.op = JournalOp::ADD;
+    record.id = song.id;
+    record.hash = song.hash;
+    record.size = song.size;
+    fputs(_format(record).c_str(), snapshot);
+    if (!std::isnan(song.gainDb)) {
+      record.op = JournalOp::GAIN;
+      record.gainDb = song.gainDb;
+      fputs(_format(record).c_str(), snapshot);
+    }
+  }
+  if (playingId != 0) {
+    JournalRecord_t record{};
+    record.op = JournalOp::PLAY;
+    record.id = playingId;
+    record.startMs = playingStartMs;
+    fputs(_format(record).c_str(), snapshot);
+  }
+  fflush(snapshot);
+  const bool ok = fsync(fileno(snapshot)) == 0;
+  fclose(snapshot);
+  // once the snapshot is in place the journal only repeats it, so it can be emptied
+  if (!ok || rename(temp.c_str(), snapshotPath().c_str()) == -1) {
+    remove(temp.c_str());
+    return;
+  }
+  fflush(journal);
+  if (ftruncate(fileno(journal), 0) == 0) {
+    sinceSnapshot = 0;
+  }
+}
+
+std::string RoomJournal::_format(const JournalRecord_t &record) {
+  std::ostringstream line;
+  switch (record.op) {
+    case JournalOp::ADD:
+      line << "add " << record.id << ' ' << std::hex << record.hash << std::dec << ' ' << record.size;
+      break;
+    case JournalOp::REMOVE:
+      line << "remove " << record.id;
+      break;
+    case JournalOp::PLAY:
+      line << "play " << record.id << ' ' << record.startMs;
+      break;
+    case JournalOp::GAIN:
+      line << "gain " << record.id << ' ' << record.gainDb;
+      break;
+  }
+  line << '\n';
+  return line.str();
+}
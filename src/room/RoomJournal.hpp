@@ -0,0 +1,273 @@
+/**
+ * @author Justin Nicolas Allard
+ * @brief Keeps the room's queue on disk so that a restarted room picks up where it left off
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "../BoundedQueue.hpp"
+#include "../music/MusicStorage.hpp"
+
+// where the journal, the snapshot and the songs are kept, followed by -PORT unless a room is given its own directory
+#define ROOM_STATE_DIR "/tmp/musicbroadcaster-room"
+// journal records written before the state is compacted into a new snapshot
+#define JOURNAL_COMPACT_RECORDS 64
+// records that can wait for the journal thread before the room blocks on it
+#define JOURNAL_QUEUE_RECORDS 256
+
+/**
+ * @brief A song as the journal knows it
+*/
+typedef struct {
+  /**
+   * journal id of the queue entry, the same across restarts
+  */
+  uint64_t id;
+  /**
+   * FNV-1a hash and size of the song, which name its blob
+  */
+  uint64_t hash;
+  uint64_t size;
+  /**
+   * loudness gain in dB, NAN if not measured
+  */
+  float gainDb;
+} JournalSong_t;
+
+/**
+ * @brief How RoomJournal::load went
+*/
+enum class JournalLoad : uint8_t {
+  LOADED,
+  /** the state directory could not be made, the queue is not kept */
+  UNAVAILABLE,
+  /** another room holds the journal */
+  IN_USE
+};
+
+enum class JournalOp : uint8_t {
+  ADD,
+  REMOVE,
+  PLAY,
+  GAIN
+};
+
+/**
+ * @brief A change to the queue on its way to the journal thread
+*/
+typedef struct {
+  JournalOp op;
+  uint64_t id;
+  /**
+   * ADD: open descriptor of the song's file, closed by the journal thread
+  */
+  int fd;
+  /**
+   * ADD: hash of the song if the room already has it, 0 to have it worked out while copying
+  */
+  uint64_t hash;
+  /**
+   * ADD: size of the song, filled in once it has been copied
+  */
+  uint64_t size;
+  /**
+   * ADD: the song's frame index and metadata, kept next to the blob so a restart does not have to read the song
+  */
+  std::shared_ptr<const FrameIndex> frameIndex;
+  std::shared_ptr<const SongMetadata> metadata;
+  /**
+   * PLAY: wall clock time in ms the song started at
+  */
+  int64_t startMs;
+  /**
+   * GAIN: gain in dB
+  */
+  float gainDb;
+} JournalRecord_t;
+
+/**
+ * @brief An append-only journal of queue changes, compacted into a snapshot every JOURNAL_COMPACT_RECORDS records.
+ * Songs are kept once each in the state directory's blobs, named by their hash and size, and deleted once no entry uses
+ * them. The room posts changes from its main thread and a journal thread copies songs and writes records, so the
+ * room never waits on the disk. Replaying a journal over a snapshot it was already folded into changes nothing,
+ * so a crash while compacting loses nothing. The journal is locked while a room has it, so two rooms never share one
+*/
+class RoomJournal {
+private:
+
+  /**
+   * ids of the room's entries, only used by the room's main thread
+  */
+  std::unordered_map<uint64_t, uint64_t> ids;
+
+  /**
+   * id given to the next entry added
+  */
+  uint64_t nextId;
+
+  /**
+   * the queue as it is on disk, only used by the journal thread once started
+  */
+  std::vector<JournalSong_t> songs;
+  uint64_t playingId;
+  int64_t playingStartMs;
+
+  /**
+   * directory the journal, the snapshot and the blobs are in, set by RoomJournal::load
+  */
+  std::string dir;
+
+  /**
+   * the journal file, locked and open for appending from RoomJournal::load, -1 until then
+  */
+  int journalFd;
+
+  /**
+   * journal file open for appending, nullptr until started
+  */
+  FILE *journal;
+
+  /**
+   * records written since the last snapshot
+  */
+  int sinceSnapshot;
+
+  BoundedQueue<JournalRecord_t> records;
+
+  std::thread thread;
+
+  static uint64_t key(EntryHandle_t handle);
+
+  [[nodiscard]] std::string journalPath() const;
+  [[nodiscard]] std::string snapshotPath() const;
+
+  /**
+   * @brief loop of the journal thread
+  */
+  void _run();
+
+  /**
+   * @brief change songs, playingId and playingStartMs by a record
+   * @return true if the record changed anything
+  */
+  bool _apply(const JournalRecord_t &record);
+
+  /**
+   * @brief read a file of records written by RoomJournal::_format and apply them
+  */
+  void _replay(const std::string &path);
+
+  /**
+   * @brief copy a song into its blob, working out its hash if it is not known
+   * @return false if the song could not be copied
+  */
+  bool _storeBlob(JournalRecord_t &record) const;
+
+  /**
+   * @brief write the frame index and metadata of a stored song next to its blob, unless they are there already
+  */
+  void _storeSidecars(const JournalRecord_t &record) const;
+
+  /**
+   * @brief delete a song's blob if no song in the queue uses it anymore
+  */
+  void _dropBlob(uint64_t hash, uint64_t size) const;
+
+  /**
+   * @brief delete blobs that no song in the queue uses, left behind by a crash
+  */
+  void _sweepBlobs() const;
+
+  /**
+   * @brief write the queue to a new snapshot and empty the journal
+  */
+  void _compact();
+
+  /**
+   * @return a record as one line of text
+  */
+  static std::string _format(const JournalRecord_t &record);
+
+  /**
+   * @brief queue a record for the journal thread, dropped if the journal is not running
+  */
+  void post(const JournalRecord_t &record);
+
+public:
+
+  RoomJournal();
+
+  RoomJournal(const RoomJournal &) = delete;
+
+  ~RoomJournal();
+
+  /**
+   * @brief lock the journal in a state directory and read the snapshot and the journal, call before RoomJournal::start
+   * @param stateDir directory to keep the queue in, made if it does not exist
+   * @param restored set to the songs in the queue, in order
+   * @param startedId set to the id of the song that was playing, 0 if none
+   * @param startedMs set to the wall clock time in ms that song started at
+   * @return UNAVAILABLE if the directory or the journal could not be made, IN_USE if another room has the journal
+  */
+  JournalLoad load(const std::string &stateDir, std::vector<JournalSong_t> &restored, uint64_t &startedId, int64_t &startedMs);
+
+  /**
+   * @return path of a song's blob
+  */
+  [[nodiscard]] std::string blobPath(uint64_t hash, uint64_t size) const;
+
+  /**
+   * @brief read the frame index kept next to a song's blob
+   * @return nullptr if there is none
+  */
+  [[nodiscard]] std::shared_ptr<const FrameIndex> loadIndex(uint64_t hash, uint64_t size) const;
+
+  /**
+   * @brief read the metadata kept next to a song's blob
+   * @return nullptr if there is none
+  */
+  [[nodiscard]] std::shared_ptr<const SongMetadata> loadMetadata(uint64_t hash, uint64_t size) const;
+
+  /**
+   * @brief tie an entry made from a restored song to its id
+  */
+  void bind(EntryHandle_t handle, uint64_t id);
+
+  /**
+   * @brief start the journal thread
+  */
+  void start();
+
+  /**
+   * @brief write out every record posted so far and stop the journal thread
+  */
+  void stop();
+
+  /**
+   * @brief an entry is READY and has to be kept
+  */
+  void added(const MusicStorageEntry &entry);
+
+  /**
+   * @brief an entry was taken out of the queue
+  */
+  void removed(EntryHandle_t handle);
+
+  /**
+   * @brief the entry at the front started playing
+  */
+  void played(EntryHandle_t handle, int64_t startMs);
+
+  /**
+   * @brief an entry's loudness gain was measured
+  */
+  void gain(EntryHandle_t handle, float gainDb);
+};
@@ -134,6 +134,44 @@ bool BaseSocket::bind(const std::string &host, const uint16_t port) {
   return true;
 }
 
+bool BaseSocket::bindLocal(const std::string &path) {
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) {
+    fprintf(stderr, "socket path too long: \"%s\"\n", path.c_str());
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socketFD == -1) {
+    fprintf(stderr, "socket: %s (%d)\n", strerror(errno), errno);
+    return false;
+  }
+  // a socket left behind by a room that did not shut down cleanly, anything else at the path is left alone
+  struct stat info{};
+  if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path.c_str());
+  }
+  if (::bind(socketFD, reinterpret_cast<struct sockaddr *>(&addr), sizeof addr) == -1) {
+    fprintf(stderr, "bind: %s (%d)\n", strerror(errno), errno);
+    return false;
+  }
+  return true;
+}
+
+uint16_t BaseSocket::getPort() const {
+  struct sockaddr_storage address{};
+  socklen_t length = sizeof address;
+  if (getsockname(socketFD, reinterpret_cast<struct sockaddr *>(&address), &length) == -1) {
+    fprintf(stderr, "getsockname: %s (%d)\n", strerror(errno), errno);
+    return 0;
+  }
+  if (address.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<struct sockaddr_in6 *>(&address)->sin6_port);
+  }
+  return ntohs(reinterpret_cast<struct sockaddr_in *>(&address)->sin_port);
+}
+
 bool BaseSocket::listen(int backlog) const {
   /* Set a default value if the backlog is negative */
   if (backlog < 0)
@@ -23,6 +23,8 @@ typedef SSIZE_T ssize_t;
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #endif
 
 /**
@@ -86,6 +88,18 @@ public:
   */
   bool bind(const std::string &, uint16_t);
 
+  /**
+   * Attempts to bind a unix domain socket to a path, replacing a socket left at the path
+   * @param path path of the socket, at most sizeof sockaddr_un::sun_path - 1 characters
+  */
+  bool bindLocal(const std::string &path);
+
+  /**
+   * Port the socket is bound to, useful after binding to port 0
+   * @returns the port, 0 on error
+  */
+  [[nodiscard]] uint16_t getPort() const;
+
   /**
    * Call after BaseSocket::bind() to allow incoming requests to connect
   */
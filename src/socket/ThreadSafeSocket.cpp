@@ -3,6 +3,8 @@
  * Implementation file for socket class
 */
 
+#include <algorithm>
+
 #include "ThreadSafeSocket.hpp"
 
 ThreadSafeSocket::ThreadSafeSocket(const int socketFD):
@@ -29,6 +31,37 @@ ThreadSafeSocket::~ThreadSafeSocket() {
   socketFD = 0;
 }
 
+int64_t ThreadSafeSocket::getRoundTripUs() const {
+#if defined(__linux__)
+  struct tcp_info info{};
+  socklen_t length = sizeof info;
+  if (getsockopt(socketFD, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+    return info.tcpi_rtt;
+  }
+#endif
+  return -1;
+}
+
+bool ThreadSafeSocket::limitUnsentBytes(int bytes) {
+#if defined(TCP_NOTSENT_LOWAT)
+  return setsockopt(socketFD, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof bytes) == 0;
+#else
+  (void)bytes;
+  return false;
+#endif
+}
+
+bool ThreadSafeSocket::isClosedByPeer() {
+#if defined(__APPLE__) || defined(__unix__)
+  std::unique_lock<std::mutex> lock{readLock};
+  std::byte peek{};
+  const ssize_t peeked = recv(socketFD, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked == 0 || (peeked == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+#else
+  return false;
+#endif
+}
+
 bool ThreadSafeSocket::connect(const std::string &ip, const uint16_t port) {
   std::unique_lock<std::mutex> w_lock{writeLock};
   std::unique_lock<std::mutex> r_lock{readLock};
@@ -83,6 +116,66 @@ bool ThreadSafeSocket::writeHeaderAndData(const std::byte header[SIZE_OF_HEADER]
   return true;
 }
 
+bool ThreadSafeSocket::writeHeaderAndFile(
+  const std::byte header[SIZE_OF_HEADER],
+  const int fd,
+  const size_t fileSize,
+  const std::function<void(size_t)> &progress
+) {
+  std::unique_lock<std::mutex> lock(writeLock);
+  if (send(socketFD, reinterpret_cast<const char *>(header), 6, 0) == -1) {
+    fprintf(stderr, "send: %s (%d)\n", strerror(errno), errno);
+    return false;
+  }
+  size_t sent = 0;
+#if defined(__linux__)
+  off_t offset = 0;
+  while (sent < fileSize) {
+    const ssize_t sentNow = sendfile(socketFD, fd, &offset, std::min<size_t>(fileSize - sent, SEND_FILE_PIECE_BYTES));
+    if (sentNow == -1) {
+      fprintf(stderr, "sendfile: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    if (sentNow == 0) {
+      // the file got shorter since it was opened
+      std::cerr << "Error: file ended before it was all sent\n";
+      return false;
+    }
+    sent += static_cast<size_t>(sentNow);
+    if (progress) {
+      progress(sent);
+    }
+  }
+#elif defined(__APPLE__) || defined(__unix__)
+  // one piece at a time, never the whole file
+  std::vector<std::byte> buffer{};
+  buffer.resize(SEND_FILE_PIECE_BYTES);
+  while (sent < fileSize) {
+    const ssize_t readNow = pread(fd, buffer.data(), std::min<size_t>(fileSize - sent, buffer.size()), static_cast<off_t>(sent));
+    if (readNow == -1) {
+      fprintf(stderr, "pread: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    if (readNow == 0) {
+      std::cerr << "Error: file ended before it was all sent\n";
+      return false;
+    }
+    if (send(socketFD, reinterpret_cast<const char *>(buffer.data()), static_cast<size_t>(readNow), 0) == -1) {
+      fprintf(stderr, "send: %s (%d)\n", strerror(errno), errno);
+      return false;
+    }
+    sent += static_cast<size_t>(readNow);
+    if (progress) {
+      progress(sent);
+    }
+  }
+#else
+  (void)fd;
+  (void)progress;
+  return fileSize == 0;
+#endif
+  return true;
+}
 
 size_t ThreadSafeSocket::read(std::byte *buffer, const size_t bufferSize) {
   std::unique_lock<std::mutex> lock{readLock};
@@ -94,6 +187,24 @@ size_t ThreadSafeSocket::read(std::byte *buffer, const size_t bufferSize) {
   return static_cast<size_t>(numReadBytes);
 }
 
+bool ThreadSafeSocket::readAvailable(std::byte *buffer, const size_t bufferSize, size_t &bytesRead) {
+  std::unique_lock<std::mutex> lock{readLock};
+  bytesRead = 0;
+#if defined(__APPLE__) || defined(__unix__)
+  const ssize_t numReadBytes = recv(socketFD, reinterpret_cast<char *>(buffer), bufferSize, MSG_DONTWAIT);
+  if (numReadBytes == -1) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+#else
+  const ssize_t numReadBytes = recv(socketFD, reinterpret_cast<char *>(buffer), bufferSize, 0);
+  if (numReadBytes == -1) {
+    return false;
+  }
+#endif
+  bytesRead = static_cast<size_t>(numReadBytes);
+  return numReadBytes > 0 || bufferSize == 0;
+}
+
 size_t ThreadSafeSocket::readAll(std::byte *buffer, const size_t bufferSize) {
   std::unique_lock<std::mutex> lock{readLock};
   size_t totalBytesRead = 0;
@@ -12,6 +12,7 @@
 #include <cstdint>
 #include <vector>
 #include <mutex>
+#include <functional>
 #if _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -23,11 +24,19 @@ typedef SSIZE_T ssize_t;
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
 #endif
 
 #include "BaseSocket.hpp"
 #include "../messaging/Message.hpp"
 
+// bytes of a file sent between progress reports
+#define SEND_FILE_PIECE_BYTES 262144
+
 /**
  * Used to communicate over a network. Same as BaseSocket class, but adds a mutex lock to reading and writing
 */
@@ -83,6 +92,26 @@ public:
   */
   [[nodiscard]] int getSocketFD() const;
 
+  /**
+   * Asks the kernel how long a round trip over the connection takes
+   * @returns smoothed round trip time in microseconds, -1 if it is not known
+  */
+  [[nodiscard]] int64_t getRoundTripUs() const;
+
+  /**
+   * Keeps at most about this many bytes written to the connection but not yet sent, where the system allows it.
+   * Writes then wait for the network rather than filling a large buffer, so what is written next goes out sooner
+   * @param bytes unsent bytes to allow
+   * @returns false if the limit could not be set
+  */
+  bool limitUnsentBytes(int bytes);
+
+  /**
+   * Checks, without waiting, whether the other end has finished sending, it may still be reading
+   * @returns true if the other end shut down its side of the connection or it was lost
+  */
+  [[nodiscard]] bool isClosedByPeer();
+
   /**
    * Attempts to connect via IP and port to another TCP socket
    * @param ip ip address, can be numerical or domain name.
@@ -109,6 +138,22 @@ public:
   */
   bool writeHeaderAndData(const std::byte header[SIZE_OF_HEADER], const std::byte *data, size_t dataSize);
 
+  /**
+   * Write a header followed by the contents of a file, sent from the file as it is read rather than from memory.
+   * Uses sendfile where the system has it, so the file is never copied into the process
+   * @param header an array of size SIZE_OF_HEADER that contains header information
+   * @param fd file descriptor of the file, read from its start
+   * @param fileSize bytes of the file to send
+   * @param progress called with the bytes of the file sent so far after each piece, may be empty
+   * @returns true if the whole file was sent, false on error
+  */
+  bool writeHeaderAndFile(
+    const std::byte header[SIZE_OF_HEADER],
+    int fd,
+    size_t fileSize,
+    const std::function<void(size_t)> &progress
+  );
+
   /**
    * Read raw data from socketFD, might not read all bytes
    * @param buffer pointer to buffer to write to
@@ -117,6 +162,15 @@ public:
   */
   size_t read(std::byte *buffer, size_t bufferSize);
 
+  /**
+   * Reads whatever has arrived, without waiting for more
+   * @param buffer pointer to buffer to write to
+   * @param bufferSize size of buffer
+   * @param bytesRead set to the number of bytes read, 0 if nothing has arrived
+   * @returns false if the socket was closed by peer or lost
+  */
+  bool readAvailable(std::byte *buffer, size_t bufferSize, size_t &bytesRead);
+
   /**
    * Reads raw data from socketFD. Will ensure all bytes are read.
    * Should use this rather than ThreadSafeSocket::read in most cases.